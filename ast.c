@@ -2,158 +2,211 @@
 #include "platform.h"
 #endif
 
-struct Expression *MakeSyntaxError(struct Arena *arena, uint32_t position)
+struct Ast *AstCreate()
 {
-    struct Expression *result = ArenaAllocate(arena, sizeof(struct Expression));
-    result->type = EXP_ERROR;
-    result->start_token = position;
-    result->end_token = position;
+    struct Ast *result = calloc(1, sizeof(struct Ast));
+    result->nodes = ArrayListCreate(sizeof(struct Expression), 256);
+    result->tuple_members = ArrayListCreate(sizeof(ExpressionId), 16);
+    result->tuple_types = ArrayListCreate(sizeof(TypeId), 4);
     return result;
 }
 
-struct Expression *MakeLambda(struct Arena *arena, uint32_t start_token,
-                              Symbol variable, struct Expression *body)
+void AstFree(struct Ast **ast_ptr)
 {
-    struct Expression *result = ArenaAllocate(arena, sizeof(struct Expression));
-    result->type = EXP_LAMBDA;
-    result->start_token = start_token;
-    result->end_token = body->end_token;
-    result->lambda_id = variable;
-    result->lambda_body = body;
-    return result;
+    struct Ast *ast = *ast_ptr;
+    *ast_ptr = NULL;
+
+    if (!ast) { return; }
+    ArrayListFree(&ast->nodes);
+    ArrayListFree(&ast->tuple_members);
+    ArrayListFree(&ast->tuple_types);
+    free(ast);
 }
 
-struct Expression *MakeIdentifier(struct Arena *arena, uint32_t token_pos,
-                                  Symbol id)
+// AstAllocated is how many bytes the AST is using, for --verbose.
+size_t AstAllocated(struct Ast *ast)
 {
-    struct Expression *result = ArenaAllocate(arena, sizeof(struct Expression));
-    result->type = EXP_IDENTIFIER;
-    result->start_token = result->end_token = token_pos;
-    result->identifier_id = id;
-    return result;
+    return ast->nodes->item_count * ast->nodes->item_size +
+        ast->tuple_members->item_count * ast->tuple_members->item_size +
+        ast->tuple_types->item_count * ast->tuple_types->item_size;
 }
 
-struct Expression *MakeApply(struct Arena *arena, struct Expression *func_expr,
-                             struct Expression *arg_expr)
+// (AstNode doesn't check the index, since it's in every step of every walk
+// of the tree.)
+struct Expression *AstNode(struct Ast *ast, ExpressionId id)
 {
-    struct Expression *result = ArenaAllocate(arena, sizeof(struct Expression));
-    result->type = EXP_APPLY;
-    result->start_token = func_expr->start_token;
-    result->end_token = arg_expr->end_token;
-    result->apply_function = func_expr;
-    result->apply_argument = arg_expr;
-    return result;
+    return ((struct Expression *)ast->nodes->buffer) + id;
 }
 
-struct Expression *MakeLet(struct Arena *arena, uint32_t let_pos,
-                           Symbol variable, struct Expression *value,
-                           struct Expression *body)
+ExpressionId AstTupleMember(struct Ast *ast, struct Expression *tuple, int i)
 {
-    struct Expression *result = ArenaAllocate(arena, sizeof(struct Expression));
-    result->type = EXP_LET;
-    result->start_token = let_pos;
-    result->end_token = body->end_token;
-    result->let_id = variable;
-    result->let_value = value;
-    result->let_body = body;
-    return result;
+    return ((ExpressionId *)ast->tuple_members->buffer)[
+        tuple->tuple_first + (uint32_t)i
+    ];
 }
 
-struct Expression *MakeLetRec(struct Arena *arena, uint32_t let_pos,
-                              Symbol variable, struct Expression *value,
-                              struct Expression *body)
+TypeId AstTupleType(struct Ast *ast, struct Expression *tuple)
 {
-    struct Expression *result = ArenaAllocate(arena, sizeof(struct Expression));
-    result->type = EXP_LETREC;
-    result->start_token = let_pos;
-    result->end_token = body->end_token;
-    result->let_id = variable;
-    result->let_value = value;
-    result->let_body = body;
-    return result;
+    return *(TypeId *)ArrayListIndex(
+        ast->tuple_types,
+        tuple->tuple_index
+    );
 }
 
-struct Expression *MakeIf(struct Arena *arena, uint32_t if_pos,
-                          struct Expression *test,
-                          struct Expression *then_branch,
-                          struct Expression *else_branch)
+void AstSetTupleType(struct Ast *ast, struct Expression *tuple, TypeId type)
 {
-    struct Expression *result = ArenaAllocate(arena, sizeof(struct Expression));
-    result->type = EXP_IF;
-    result->start_token = if_pos;
-    result->end_token = else_branch->end_token;
-    result->if_test = test;
-    result->if_then = then_branch;
-    result->if_else = else_branch;
-    return result;
+    *(TypeId *)ArrayListIndex(ast->tuple_types, tuple->tuple_index) = type;
 }
 
-struct Expression *MakeBinary(struct Arena *arena, MILLIE_TOKEN op,
-                              struct Expression *left,
-                              struct Expression *right)
+uint64_t ExpressionLiteral(struct Expression *expression)
 {
-    struct Expression *result = ArenaAllocate(arena, sizeof(struct Expression));
-    result->type = EXP_BINARY;
-    result->start_token = left->start_token;
-    result->end_token = right->end_token;
-    result->binary_operator = op;
-    result->binary_left = left;
-    result->binary_right = right;
-    return result;
+    return ((uint64_t)expression->literal_high << 32) |
+        expression->literal_low;
 }
 
-struct Expression *MakeUnary(struct Arena *arena, uint32_t operator_pos,
-                             MILLIE_TOKEN op, struct Expression *arg)
+static ExpressionId _AddNode(struct Ast *ast, struct Expression *node)
 {
-    struct Expression *result = ArenaAllocate(arena, sizeof(struct Expression));
-    result->type = EXP_UNARY;
-    result->start_token = operator_pos;
-    result->end_token = arg->end_token;
-    result->unary_operator = op;
-    result->unary_arg = arg;
-    return result;
+    return ArrayListAdd(ast->nodes, node);
 }
 
-struct Expression *MakeBooleanLiteral(struct Arena *arena, uint32_t pos,
-                                      bool value)
+ExpressionId MakeSyntaxError(struct Ast *ast, uint32_t position)
 {
-    struct Expression *result = ArenaAllocate(arena, sizeof(struct Expression));
-    result->type = value ? EXP_TRUE : EXP_FALSE;
-    result->start_token = result->end_token = pos;
-    return result;
+    struct Expression result = { .type = EXP_ERROR };
+    result.start_token = position;
+    result.end_token = position;
+    return _AddNode(ast, &result);
 }
 
-struct Expression *MakeIntegerLiteral(struct Arena *arena, uint32_t pos,
-                                      uint64_t value)
+ExpressionId MakeLambda(struct Ast *ast, uint32_t start_token,
+                        Symbol variable, ExpressionId body)
 {
-    struct Expression *result = ArenaAllocate(arena, sizeof(struct Expression));
-    result->type = EXP_INTEGER_CONSTANT;
-    result->literal_value = value;
-    result->start_token = result->end_token = pos;
-    return result;
+    struct Expression result = { .type = EXP_LAMBDA };
+    result.start_token = start_token;
+    result.end_token = AstNode(ast, body)->end_token;
+    result.lambda_id = variable;
+    result.lambda_body = body;
+    return _AddNode(ast, &result);
 }
 
-struct Expression *MakeTuple(struct Arena *arena, struct Expression *first,
-                             struct Expression *rest, int length)
+ExpressionId MakeIdentifier(struct Ast *ast, uint32_t token_pos, Symbol id)
 {
-    struct Expression *result = ArenaAllocate(arena, sizeof(struct Expression));
-    result->type = EXP_TUPLE;
-    result->tuple_first = first;
-    result->tuple_rest = rest;
-    result->tuple_length = length;
-    result->start_token = first->start_token;
-    result->end_token = rest->end_token;
-    return result;
+    struct Expression result = { .type = EXP_IDENTIFIER };
+    result.start_token = result.end_token = token_pos;
+    result.identifier_id = id;
+    return _AddNode(ast, &result);
 }
 
-struct Expression *MakeTupleFinal(struct Arena *arena, struct Expression *expr)
+ExpressionId MakeApply(struct Ast *ast, ExpressionId func_expr,
+                       ExpressionId arg_expr)
 {
-   struct Expression *result = ArenaAllocate(arena, sizeof(struct Expression));
-    result->type = EXP_TUPLE_FINAL;
-    result->tuple_first = expr;
-    result->start_token = expr->start_token;
-    result->end_token = expr->end_token;
-    return result;
+    struct Expression result = { .type = EXP_APPLY };
+    result.start_token = AstNode(ast, func_expr)->start_token;
+    result.end_token = AstNode(ast, arg_expr)->end_token;
+    result.apply_function = func_expr;
+    result.apply_argument = arg_expr;
+    return _AddNode(ast, &result);
+}
+
+// MakeTailCall turns the application into a tail call. (It's always the last
+// thing the parser made, so it can just be changed where it is.)
+ExpressionId MakeTailCall(struct Ast *ast, uint32_t tail_pos,
+                          ExpressionId apply_expr)
+{
+    struct Expression *result = AstNode(ast, apply_expr);
+    result->type = EXP_TAILCALL;
+    result->start_token = tail_pos;
+    return apply_expr;
+}
+
+ExpressionId MakeLet(struct Ast *ast, uint32_t let_pos, Symbol variable,
+                     ExpressionId value, ExpressionId body)
+{
+    struct Expression result = { .type = EXP_LET };
+    result.start_token = let_pos;
+    result.end_token = AstNode(ast, body)->end_token;
+    result.let_id = variable;
+    result.let_value = value;
+    result.let_body = body;
+    return _AddNode(ast, &result);
+}
+
+ExpressionId MakeLetRec(struct Ast *ast, uint32_t let_pos, Symbol variable,
+                        ExpressionId value, ExpressionId body)
+{
+    struct Expression result = { .type = EXP_LETREC };
+    result.start_token = let_pos;
+    result.end_token = AstNode(ast, body)->end_token;
+    result.let_id = variable;
+    result.let_value = value;
+    result.let_body = body;
+    return _AddNode(ast, &result);
+}
+
+ExpressionId MakeIf(struct Ast *ast, uint32_t if_pos, ExpressionId test,
+                    ExpressionId then_branch, ExpressionId else_branch)
+{
+    struct Expression result = { .type = EXP_IF };
+    result.start_token = if_pos;
+    result.end_token = AstNode(ast, else_branch)->end_token;
+    result.if_test = test;
+    result.if_then = then_branch;
+    result.if_else = else_branch;
+    return _AddNode(ast, &result);
+}
+
+ExpressionId MakeBinary(struct Ast *ast, MILLIE_TOKEN op, ExpressionId left,
+                        ExpressionId right)
+{
+    struct Expression result = { .type = EXP_BINARY };
+    result.start_token = AstNode(ast, left)->start_token;
+    result.end_token = AstNode(ast, right)->end_token;
+    result.binary_operator = op;
+    result.binary_left = left;
+    result.binary_right = right;
+    return _AddNode(ast, &result);
+}
+
+ExpressionId MakeUnary(struct Ast *ast, uint32_t operator_pos,
+                       MILLIE_TOKEN op, ExpressionId arg)
+{
+    struct Expression result = { .type = EXP_UNARY };
+    result.start_token = operator_pos;
+    result.end_token = AstNode(ast, arg)->end_token;
+    result.unary_operator = op;
+    result.unary_arg = arg;
+    return _AddNode(ast, &result);
+}
+
+ExpressionId MakeBooleanLiteral(struct Ast *ast, uint32_t pos, bool value)
+{
+    struct Expression result = { .type = value ? EXP_TRUE : EXP_FALSE };
+    result.start_token = result.end_token = pos;
+    return _AddNode(ast, &result);
+}
+
+ExpressionId MakeIntegerLiteral(struct Ast *ast, uint32_t pos,
+                                uint64_t value)
+{
+    struct Expression result = { .type = EXP_INTEGER_CONSTANT };
+    result.literal_low = (uint32_t)value;
+    result.literal_high = (uint32_t)(value >> 32);
+    result.start_token = result.end_token = pos;
+    return _AddNode(ast, &result);
+}
+
+ExpressionId MakeTuple(struct Ast *ast, ExpressionId *members, int length)
+{
+    struct Expression result = { .type = EXP_TUPLE };
+    result.tuple_first = ast->tuple_members->item_count;
+    result.tuple_length = (uint32_t)length;
+    for (int i = 0; i < length; i++) {
+        ArrayListAdd(ast->tuple_members, &members[i]);
+    }
+    TypeId no_type = 0;
+    result.tuple_index = ArrayListAdd(ast->tuple_types, &no_type);
+    result.start_token = AstNode(ast, members[0])->start_token;
+    result.end_token = AstNode(ast, members[length - 1])->end_token;
+    return _AddNode(ast, &result);
 }
 
 static void _PrintIndent(int indent)
@@ -166,16 +219,20 @@ static void _PrintIndent(int indent)
 static void _DumpExprImpl(
     struct SymbolTable *table,
     struct MillieTokens *tokens,
-    struct Expression *expression,
+    struct Ast *ast,
+    ExpressionId id,
     int indent
 )
 {
+    struct Expression *expression = AstNode(ast, id);
     switch(expression->type) {
     case EXP_LAMBDA:
         {
             struct MString *id = FindSymbolKey(table, expression->lambda_id);
             _PrintIndent(indent); printf("lambda %s =>\n", MStringData(id));
-            _DumpExprImpl(table, tokens, expression->lambda_body, indent+1);
+            _DumpExprImpl(
+                table, tokens, ast, expression->lambda_body, indent+1
+            );
             MStringFree(&id);
         }
         break;
@@ -191,8 +248,24 @@ static void _DumpExprImpl(
     case EXP_APPLY:
         {
             _PrintIndent(indent); printf("apply\n");
-            _DumpExprImpl(table, tokens, expression->apply_function, indent+1);
-            _DumpExprImpl(table, tokens, expression->apply_argument, indent+1);
+            _DumpExprImpl(
+                table, tokens, ast, expression->apply_function, indent+1
+            );
+            _DumpExprImpl(
+                table, tokens, ast, expression->apply_argument, indent+1
+            );
+        }
+        break;
+
+    case EXP_TAILCALL:
+        {
+            _PrintIndent(indent); printf("tail apply\n");
+            _DumpExprImpl(
+                table, tokens, ast, expression->apply_function, indent+1
+            );
+            _DumpExprImpl(
+                table, tokens, ast, expression->apply_argument, indent+1
+            );
         }
         break;
 
@@ -200,9 +273,9 @@ static void _DumpExprImpl(
         {
             struct MString *id = FindSymbolKey(table, expression->let_id);
             _PrintIndent(indent); printf("let %s = \n", MStringData(id));
-            _DumpExprImpl(table, tokens, expression->let_value, indent+1);
+            _DumpExprImpl(table, tokens, ast, expression->let_value, indent+1);
             _PrintIndent(indent); printf("in\n");
-            _DumpExprImpl(table, tokens, expression->let_body, indent+1);
+            _DumpExprImpl(table, tokens, ast, expression->let_body, indent+1);
             MStringFree(&id);
         }
         break;
@@ -210,9 +283,9 @@ static void _DumpExprImpl(
         {
             struct MString *id = FindSymbolKey(table, expression->let_id);
             _PrintIndent(indent); printf("let rec %s = \n", MStringData(id));
-            _DumpExprImpl(table, tokens, expression->let_value, indent+1);
+            _DumpExprImpl(table, tokens, ast, expression->let_value, indent+1);
             _PrintIndent(indent); printf("in\n");
-            _DumpExprImpl(table, tokens, expression->let_body, indent+1);
+            _DumpExprImpl(table, tokens, ast, expression->let_body, indent+1);
             MStringFree(&id);
         }
         break;
@@ -220,7 +293,7 @@ static void _DumpExprImpl(
     case EXP_INTEGER_CONSTANT:
         {
             _PrintIndent(indent);
-            printf("literal %llu\n", expression->literal_value);
+            printf("literal %llu\n", ExpressionLiteral(expression));
         }
         break;
 
@@ -239,21 +312,26 @@ static void _DumpExprImpl(
     case EXP_IF:
         {
             _PrintIndent(indent); printf("if\n");
-            _DumpExprImpl(table, tokens, expression->if_test, indent+1);
+            _DumpExprImpl(table, tokens, ast, expression->if_test, indent+1);
             _PrintIndent(indent); printf("then\n");
-            _DumpExprImpl(table, tokens, expression->if_then, indent+1);
+            _DumpExprImpl(table, tokens, ast, expression->if_then, indent+1);
             _PrintIndent(indent); printf("else\n");
-            _DumpExprImpl(table, tokens, expression->if_else, indent+1);
+            _DumpExprImpl(table, tokens, ast, expression->if_else, indent+1);
         }
         break;
 
     case EXP_BINARY:
         {
-            uint32_t bin_tok = expression->binary_left->end_token + 1;
+            struct Expression *left = AstNode(ast, expression->binary_left);
+            uint32_t bin_tok = left->end_token + 1;
             struct MString *operator = ExtractToken(tokens, bin_tok);
             _PrintIndent(indent); printf("binary %s\n", MStringData(operator));
-            _DumpExprImpl(table, tokens, expression->binary_left, indent+1);
-            _DumpExprImpl(table, tokens, expression->binary_right, indent+1);
+            _DumpExprImpl(
+                table, tokens, ast, expression->binary_left, indent+1
+            );
+            _DumpExprImpl(
+                table, tokens, ast, expression->binary_right, indent+1
+            );
             MStringFree(&operator);
         }
         break;
@@ -263,19 +341,18 @@ static void _DumpExprImpl(
             struct MString *operator;
             operator = ExtractToken(tokens, expression->start_token);
             _PrintIndent(indent); printf("unary %s\n", MStringData(operator));
-            _DumpExprImpl(table, tokens, expression->unary_arg, indent+1);
+            _DumpExprImpl(table, tokens, ast, expression->unary_arg, indent+1);
             MStringFree(&operator);
         }
         break;
 
     case EXP_TUPLE:
-    case EXP_TUPLE_FINAL:
         {
-            _PrintIndent(indent); printf("tuple (%d)\n", expression->tuple_length);
-            _DumpExprImpl(table, tokens, expression->tuple_first, indent+1);
-            while(expression->type != EXP_TUPLE_FINAL) {
-                expression = expression->tuple_rest;
-                _DumpExprImpl(table, tokens, expression->tuple_first, indent+1);
+            _PrintIndent(indent);
+            printf("tuple (%u)\n", expression->tuple_length);
+            for (uint32_t i = 0; i < expression->tuple_length; i++) {
+                ExpressionId member = AstTupleMember(ast, expression, (int)i);
+                _DumpExprImpl(table, tokens, ast, member, indent+1);
             }
         }
         break;
@@ -291,7 +368,7 @@ static void _DumpExprImpl(
 }
 
 void DumpExpression(struct SymbolTable *table, struct MillieTokens *tokens,
-                    struct Expression *expression)
+                    struct Ast *ast, ExpressionId expression)
 {
-    _DumpExprImpl(table, tokens, expression, 0);
+    _DumpExprImpl(table, tokens, ast, expression, 0);
 }
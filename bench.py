@@ -0,0 +1,323 @@
+#!/usr/local/bin/python3
+import locale
+import os
+import re
+import sys
+
+from pathlib import Path
+from subprocess import run, PIPE
+from tempfile import TemporaryDirectory
+from time import perf_counter
+
+# How many times to run each benchmark; we report the fastest run.
+RUNS = 5
+
+DISPATCH_MODES = ['SWITCH', 'GOTO', 'TAILCALL']
+
+
+def read_bench_spec(path):
+    spec = {}
+    with open(path) as file:
+        for line in file:
+            if (not line) or line[0] != '#':
+                break
+            spec_part = line[1:].strip().split(':')
+            if len(spec_part) > 1:
+                spec[spec_part[0].strip()] = spec_part[1].strip()
+    return spec
+
+
+def build_millie(out_dir, mode):
+    cc = os.environ.get('CC', 'cc')
+    output = Path(out_dir) / 'millie_{}'.format(mode.lower())
+    run(
+        [cc, '-O2', '-DVM_DISPATCH_' + mode, 'millie.c', '-o', str(output)],
+        check=True,
+    )
+    return output
+
+
+def count_dispatches(millie, path, level):
+    """Run the benchmark under the interpreter at the given -O level, and
+    return how many instructions it dispatched."""
+    cp = run(
+        [str(millie), '-v', '--jit', 'never', '-O{}'.format(level), str(path)],
+        stdout=PIPE,
+        stderr=PIPE,
+        encoding=locale.getpreferredencoding()
+    )
+    if cp.returncode:
+        return None
+    match = re.search(r'^Dispatches: (\d+)$', cp.stderr, re.MULTILINE)
+    return int(match.group(1)) if match else None
+
+
+def print_dispatch_counts(out_dir):
+    """How many dispatches the superinstructions (-O2) save over -O1."""
+    cc = os.environ.get('CC', 'cc')
+    millie = Path(out_dir) / 'millie_stats'
+    run([cc, '-O2', '-DVM_STATS', 'millie.c', '-o', str(millie)], check=True)
+
+    print('{0:<32}{1:>14}{2:>14}{3:>10}'.format(
+        'benchmark', '-O1', '-O2', 'saved'
+    ))
+    for path in sorted(Path('./bench').glob('**/*.millie')):
+        before = count_dispatches(millie, path, 1)
+        after = count_dispatches(millie, path, 2)
+        if before is None or after is None:
+            print('{0:<32}{1:>14}'.format(str(path), 'FAIL'))
+            continue
+        print('{0:<32}{1:>14}{2:>14}{3:>9.1f}%'.format(
+            str(path),
+            before,
+            after,
+            100.0 * (before - after) / before
+        ))
+
+
+# The sizes of the generated programs for --typecheck; each is twice the last.
+TYPECHECK_SIZES = [1000, 2000, 4000, 8000, 16000]
+
+
+def nested_lets(count):
+    """Lets inside functions inside lets, `count` deep, each generalizing a
+    function that captures the argument of the one outside it."""
+    return 'let g =\n' + ''.join(
+        'fn a{0} => let f{0} = fn y => (y, a{0}) in\n'.format(i)
+        for i in range(count)
+    ) + '0\nin 0\n'
+
+
+def let_chain(count):
+    """A chain of `count` lets, each a generic function that calls the one
+    before it."""
+    return 'let f0 = fn y => y in\n' + ''.join(
+        'let f{0} = fn y => f{1} y in\n'.format(i, i - 1)
+        for i in range(1, count)
+    ) + 'f{0} 0\n'.format(count - 1)
+
+
+def binding_chain(count):
+    """A chain of `count` lets, each adding up the one before it and the first,
+    so that every lookup sees every binding in scope."""
+    return 'let x0 = 0 in\n' + ''.join(
+        'let x{0} = x{1} + x0 in\n'.format(i, i - 1)
+        for i in range(1, count)
+    ) + 'x{0}\n'.format(count - 1)
+
+
+def time_typecheck(millie, path):
+    best = None
+    for _ in range(RUNS):
+        start = perf_counter()
+        cp = run([str(millie), '--print-type', str(path)], stdout=PIPE,
+                 stderr=PIPE)
+        elapsed = perf_counter() - start
+        if cp.returncode:
+            return None
+        if best is None or elapsed < best:
+            best = elapsed
+    return best
+
+
+def print_typecheck_scaling(out_dir):
+    """How the time to type check generated programs grows with their size.
+    Each program is twice the size of the last, so time that grows linearly
+    shows up as a growth of about 2x."""
+    millie = build_millie(out_dir, 'GOTO')
+
+    print('{0:<16}{1:>10}{2:>14}{3:>10}'.format(
+        'program', 'lets', 'time', 'growth'
+    ))
+    for generate in (nested_lets, let_chain, binding_chain):
+        previous = None
+        for count in TYPECHECK_SIZES:
+            path = Path(out_dir) / '{}_{}.millie'.format(
+                generate.__name__, count
+            )
+            path.write_text(generate(count))
+            elapsed = time_typecheck(millie, path)
+            line = '{0:<16}{1:>10}'.format(generate.__name__, count)
+            if elapsed is None:
+                print(line + '{0:>14}'.format('FAIL'))
+                previous = None
+                continue
+            line += '{0:>12.1f}ms'.format(elapsed * 1000)
+            if previous:
+                line += '{0:>9.2f}x'.format(elapsed / previous)
+            print(line)
+            previous = elapsed
+
+
+# The sizes of the generated sources for --lexer, in megabytes.
+LEXER_SIZES = [4, 16, 64]
+
+# The fewest threads --lexer-threads goes up to, even with fewer cores.
+LEXER_THREADS = 8
+
+# The ways the lexer can be built to scan, and the switches that build them.
+LEXER_BUILDS = [
+    ('scalar', ['-DLEXER_SCALAR']),
+    ('sse2', []),
+    ('avx2', ['-mavx2']),
+]
+
+
+def lexer_source(megabytes):
+    """Something like real code, with long and short identifiers, keywords,
+    literals, indentation and comments, repeated to about `megabytes`."""
+    chunk = ''.join(
+        '# Step {0} of the computation, which adds things up.\n'
+        'let accumulated_value_{0} = fn x =>\n'
+        '    if x = {0} then (x, tail helper_{0} (x + 1))\n'
+        '    else accumulated_value_{1} x * 17 - y / 3\n'
+        'in\n'.format(i, i - 1)
+        for i in range(1, 1001)
+    )
+    return chunk * max(1, (megabytes * 1024 * 1024) // len(chunk)) + '0\n'
+
+
+def time_lexer(millie, path, threads=1):
+    """The best MB/s that --lex reports over RUNS runs, on `threads`
+    threads."""
+    best = None
+    for _ in range(RUNS):
+        cp = run([str(millie), '--lex', '--lex-threads', str(threads),
+                  str(path)], stdout=PIPE, stderr=PIPE,
+                 encoding=locale.getpreferredencoding())
+        match = re.search(r'\(([0-9.]+) MB/s', cp.stdout)
+        if cp.returncode or not match:
+            return None
+        speed = float(match.group(1))
+        if best is None or speed > best:
+            best = speed
+    return best
+
+
+def print_lexer_throughput(out_dir):
+    """How fast the lexer goes, in MB/s, built to scan each way it can."""
+    cc = os.environ.get('CC', 'cc')
+    binaries = []
+    for name, flags in LEXER_BUILDS:
+        output = Path(out_dir) / 'millie_lex_{}'.format(name)
+        cp = run([cc, '-O2'] + flags + ['millie.c', '-o', str(output)])
+        if cp.returncode == 0:
+            binaries.append((name, output))
+
+    print('{0:<16}'.format('source') + ''.join(
+        '{0:>16}'.format(name) for name, _ in binaries
+    ))
+    for megabytes in LEXER_SIZES:
+        path = Path(out_dir) / 'lexer_{}.millie'.format(megabytes)
+        path.write_text(lexer_source(megabytes))
+        line = '{0:<16}'.format('{} MB'.format(megabytes))
+        for _, millie in binaries:
+            speed = time_lexer(millie, path)
+            if speed is None:
+                line += '{0:>16}'.format('FAIL')
+            else:
+                line += '{0:>11.1f} MB/s'.format(speed)
+        print(line)
+
+
+def print_lexer_scaling(out_dir):
+    """How fast the lexer goes, in MB/s, on more and more threads, to see
+    how it scales with cores."""
+    output = Path(out_dir) / 'millie_lex'
+    cc = os.environ.get('CC', 'cc')
+    if run([cc, '-O2', 'millie.c', '-o', str(output)]).returncode != 0:
+        print('FAIL')
+        return
+
+    threads = [1]
+    while threads[-1] * 2 <= max(LEXER_THREADS, os.cpu_count() or 1):
+        threads.append(threads[-1] * 2)
+    print('{0:<16}'.format('source') + ''.join(
+        '{0:>16}'.format('{} threads'.format(count)) for count in threads
+    ))
+    for megabytes in LEXER_SIZES:
+        path = Path(out_dir) / 'lexer_{}.millie'.format(megabytes)
+        path.write_text(lexer_source(megabytes))
+        line = '{0:<16}'.format('{} MB'.format(megabytes))
+        for count in threads:
+            speed = time_lexer(output, path, count)
+            if speed is None:
+                line += '{0:>16}'.format('FAIL')
+            else:
+                line += '{0:>11.1f} MB/s'.format(speed)
+        print(line)
+
+
+def time_bench(millie, path, spec):
+    best = None
+    for _ in range(RUNS):
+        start = perf_counter()
+        cp = run(
+            [str(millie), str(path)],
+            stdout=PIPE,
+            stderr=PIPE,
+            encoding=locale.getpreferredencoding()
+        )
+        elapsed = perf_counter() - start
+
+        if cp.returncode:
+            return None, 'millie returned exit code {}'.format(cp.returncode)
+        actual = cp.stdout.strip()
+        if 'Expected' in spec and actual != spec['Expected']:
+            return None, 'Expected "{}" got "{}"'.format(
+                spec['Expected'],
+                actual
+            )
+
+        if best is None or elapsed < best:
+            best = elapsed
+    return best, None
+
+
+locale.setlocale(locale.LC_ALL, '')
+with TemporaryDirectory() as out_dir:
+    # `./bench.py --dispatches` counts instructions instead of timing them.
+    if '--dispatches' in sys.argv[1:]:
+        print_dispatch_counts(out_dir)
+        sys.exit(0)
+
+    # `./bench.py --typecheck` times the type checker on generated programs
+    # of growing size instead.
+    if '--typecheck' in sys.argv[1:]:
+        print_typecheck_scaling(out_dir)
+        sys.exit(0)
+
+    # `./bench.py --lexer` measures the lexer's throughput on generated
+    # sources of a few megabytes and up.
+    if '--lexer' in sys.argv[1:]:
+        print_lexer_throughput(out_dir)
+        sys.exit(0)
+
+    # `./bench.py --lexer-threads` measures how the lexer's throughput on
+    # the same sources goes up with the number of threads it lexes on.
+    if '--lexer-threads' in sys.argv[1:]:
+        print_lexer_scaling(out_dir)
+        sys.exit(0)
+
+    binaries = [(mode, build_millie(out_dir, mode)) for mode in DISPATCH_MODES]
+
+    print('{0:<32}'.format('benchmark') + ''.join(
+        '{0:>18}'.format(mode.lower()) for mode in DISPATCH_MODES
+    ))
+    for path in sorted(Path('./bench').glob('**/*.millie')):
+        spec = read_bench_spec(path)
+        line = '{0:<32}'.format(str(path))
+        baseline = None
+        for mode, millie in binaries:
+            elapsed, error = time_bench(millie, path, spec)
+            if error:
+                line += '{0:>18}'.format('FAIL')
+                print('  {}: {}'.format(mode.lower(), error))
+                continue
+            if baseline is None:
+                baseline = elapsed
+            line += '{0:>10.1f}ms {1:>4.2f}x'.format(
+                elapsed * 1000,
+                baseline / elapsed
+            )
+        print(line)
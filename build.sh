@@ -1,2 +1,8 @@
 #!/bin/bash
-clang -Wextra -Wall -g ./millie.c -o millie
+# Set CC to pick a compiler, and CFLAGS for extra switches; for example
+#
+#   CFLAGS="-O2 -DVM_DISPATCH_SWITCH" ./build.sh
+#
+# to build an optimized interpreter with the switch-based dispatch loop. (See
+# the dispatch notes in runtime.c.)
+${CC:-clang} -Wextra -Wall -g $CFLAGS ./millie.c -o millie
@@ -0,0 +1,466 @@
+#ifndef PLATFORM_INCLUDED
+#include "platform.h"
+#endif
+
+/*
+ * The bytecode cache.
+ *
+ * With --cache-dir, the driver first looks in that directory for the module
+ * it would compile the input to, in a file named for a hash of the source.
+ * If it's there, the file is mapped and run as it is, and the lexer, parser,
+ * type checker, compiler and optimizer never see the program. If not, they
+ * all run as usual and the result is written out for next time.
+ *
+ * A cache file is, end to end:
+ *
+ *   - A _CacheHeader.
+ *   - A _CacheFunction for each function in the module.
+ *   - The code of every function, one after the other.
+ *   - The type of the program's result (see _WriteCacheType).
+ *   - The source the module was compiled from.
+ *
+ * The code is used in place, from the mapping: a CompiledExpression loaded
+ * from the cache points its code at the file, and the mapping stays around
+ * as long as the process does. (Nothing writes to code after the optimizer
+ * is done with it, so the mapping is read-only.)
+ *
+ * An entry is only good for the source, optimizer level and build of millie
+ * that wrote it. The file name is a hash of all three; the header records
+ * them again, along with the whole source, so that anything that doesn't
+ * match, including a hash collision, a file from another build or a file cut
+ * short, is a miss and gets written over. --clear-cache removes every entry.
+ */
+
+// Any change to the compiler can change the code it writes, so an entry is
+// only trusted by the build that wrote it.
+#define _CACHE_MAGIC 0x31434c4d // "MLC1"
+#define _CACHE_VERSION "millie bytecode cache 3, built " __DATE__ " " __TIME__
+#define _CACHE_EXTENSION ".mlc"
+#define _CACHE_TEMP_EXTENSION ".tmp"
+
+struct _CacheHeader {
+    uint32_t magic;
+    uint32_t version_hash;
+    uint32_t optimize_level;
+    uint32_t function_count;
+    int32_t func_id;
+    int32_t closure_loads;
+    int32_t closure_loads_saved;
+    uint32_t type_length;
+    uint64_t code_length;
+    uint64_t source_length;
+    uint64_t file_length;
+};
+
+struct _CacheFunction {
+    uint64_t code_offset;   // From the start of the code.
+    uint64_t code_length;
+    uint64_t register_count;
+    uint64_t closure_length;
+    uint64_t stack_words;
+    int32_t uncurried_id;
+    uint16_t result_register;
+    uint8_t arity;
+    uint8_t _reserved[1];
+};
+
+static uint32_t _CacheVersionHash(void)
+{
+    return CityHash32(_CACHE_VERSION, sizeof(_CACHE_VERSION) - 1);
+}
+
+static struct MString *_CachePath(const char *cache_dir,
+                                  struct MString *source,
+                                  int optimize_level)
+{
+    uint32_t key[3] = {
+        MStringHash32(source),
+        _CacheVersionHash(),
+        (uint32_t)optimize_level,
+    };
+    return MStringPrintF(
+        "%s/%08x" _CACHE_EXTENSION,
+        cache_dir,
+        CityHash32((const char *)key, sizeof(key))
+    );
+}
+
+// ----------------------------------------------------------------------------
+// Types
+// ----------------------------------------------------------------------------
+//
+// A type is written out prefix-first: a byte with its TypeExpType, and then
+// whatever it's made of. It's a DAG, though, and written out as a tree it can
+// be exponentially bigger, so each node other than int and bool is numbered
+// (in temp) once it's been written, and after that it's only written as
+// _CACHE_TYPE_BACK_REFERENCE and its 32-bit number. The numbers go up in the
+// order the nodes are finished, which is also the order they're read back.
+//
+#define _CACHE_TYPE_BACK_REFERENCE 0xFF
+
+struct _CacheTypeWriter {
+    FILE *output;
+    uint32_t length;
+    struct TypeStore *store;
+    uint32_t node_count;
+};
+
+// (Nothing is added to the store while it's written out, so the nodes stay
+// put. The caller clears the temps after.)
+static bool _WriteCacheType(struct _CacheTypeWriter *writer, TypeId type_id)
+{
+    struct TypeExp *type = ResolveType(writer->store, type_id);
+
+    if (type->temp) {
+        uint32_t index = type->temp - 1;
+        fputc(_CACHE_TYPE_BACK_REFERENCE, writer->output);
+        fwrite(&index, sizeof(index), 1, writer->output);
+        writer->length += 1 + sizeof(index);
+        return true;
+    }
+
+    uint8_t tag = (uint8_t)type->type;
+    fputc(tag, writer->output);
+    writer->length += 1;
+
+    bool ok;
+    switch(type->type) {
+    case TYPEEXP_INT:
+    case TYPEEXP_BOOL:
+        return true;
+
+    case TYPEEXP_FUNC:
+    case TYPEEXP_TUPLE:
+        ok = _WriteCacheType(writer, type->arg_first) &&
+            _WriteCacheType(writer, type->arg_second);
+        break;
+
+    case TYPEEXP_TUPLE_FINAL:
+        ok = _WriteCacheType(writer, type->tuple_first);
+        break;
+
+    case TYPEEXP_VARIABLE:
+    case TYPEEXP_GENERIC_VARIABLE:
+        ok = true;
+        break;
+
+    case TYPEEXP_ERROR:
+    case TYPEEXP_INVALID:
+    default:
+        return false;
+    }
+
+    type->temp = ++writer->node_count;
+    return ok;
+}
+
+struct _CacheTypeReader {
+    struct TypeStore *store;
+    const uint8_t *next;
+    const uint8_t *end;
+    struct ArrayList *nodes;    // of TypeId, by the number it was written with
+};
+
+// (0 is no type, so it's what _ReadCacheType returns for a bad entry.)
+static TypeId _ReadCacheType(struct _CacheTypeReader *reader)
+{
+    if (reader->next == reader->end) { return 0; }
+    uint8_t tag = *(reader->next++);
+
+    TypeId result;
+    switch(tag) {
+    case TYPEEXP_INT:
+    case TYPEEXP_BOOL:
+        return TypeStoreAdd(reader->store, tag, 0, 0);
+
+    case TYPEEXP_FUNC:
+    case TYPEEXP_TUPLE:
+    case TYPEEXP_TUPLE_FINAL:
+        {
+            TypeId first = _ReadCacheType(reader);
+            if (!first) { return 0; }
+            TypeId second = 0;
+            if (tag != TYPEEXP_TUPLE_FINAL) {
+                second = _ReadCacheType(reader);
+                if (!second) { return 0; }
+            }
+            result = TypeStoreAdd(reader->store, tag, first, second);
+            break;
+        }
+
+    case TYPEEXP_VARIABLE:
+    case TYPEEXP_GENERIC_VARIABLE:
+        result = TypeStoreAdd(reader->store, tag, 0, 0);
+        break;
+
+    case _CACHE_TYPE_BACK_REFERENCE:
+        {
+            uint32_t index;
+            if ((size_t)(reader->end - reader->next) < sizeof(index)) {
+                return 0;
+            }
+            memcpy(&index, reader->next, sizeof(index));
+            reader->next += sizeof(index);
+            if (index >= reader->nodes->item_count) { return 0; }
+            return *(TypeId *)ArrayListIndex(reader->nodes, index);
+        }
+
+    default:
+        return 0;
+    }
+
+    ArrayListAdd(reader->nodes, &result);
+    return result;
+}
+
+// ----------------------------------------------------------------------------
+// Loading
+// ----------------------------------------------------------------------------
+
+bool LoadCachedModule(const char *cache_dir, struct MString *source,
+                      int optimize_level, struct TypeStore *store,
+                      struct Module *module, int *func_id, TypeId *type)
+{
+    struct MString *path = _CachePath(cache_dir, source, optimize_level);
+    int fd = open(MStringData(path), O_RDONLY);
+    MStringFree(&path);
+    if (fd < 0) { return false; }
+
+    struct stat filestat;
+    if (fstat(fd, &filestat) != 0 ||
+        (size_t)filestat.st_size < sizeof(struct _CacheHeader)) {
+        close(fd);
+        return false;
+    }
+
+    size_t file_length = filestat.st_size;
+    const uint8_t *base = mmap(
+        NULL,
+        file_length,
+        PROT_READ,
+        MAP_PRIVATE,
+        fd,
+        0
+    );
+    close(fd);
+    if (base == MAP_FAILED) { return false; }
+
+    const struct _CacheHeader *header = (const struct _CacheHeader *)base;
+    if (header->magic != _CACHE_MAGIC ||
+        header->version_hash != _CacheVersionHash() ||
+        header->optimize_level != (uint32_t)optimize_level ||
+        header->file_length != file_length ||
+        header->func_id < 0 ||
+        (uint32_t)header->func_id >= header->function_count ||
+        header->source_length != MStringLength(source)) {
+        munmap((void *)base, file_length);
+        return false;
+    }
+
+    // Take each part's length off what's left one at a time, so that a file
+    // with lengths that don't add up can't make anything wrap around.
+    size_t remaining = file_length - sizeof(*header);
+    size_t functions_length =
+        (size_t)header->function_count * sizeof(struct _CacheFunction);
+    bool ok = functions_length <= remaining;
+    if (ok) { remaining -= functions_length; }
+    ok = ok && header->code_length <= remaining;
+    if (ok) { remaining -= header->code_length; }
+    ok = ok && header->type_length <= remaining;
+    if (ok) { remaining -= header->type_length; }
+    ok = ok && header->source_length == remaining;
+    if (!ok) {
+        munmap((void *)base, file_length);
+        return false;
+    }
+
+    const uint8_t *code = base + sizeof(*header) + functions_length;
+    const uint8_t *type_start = code + header->code_length;
+    const uint8_t *source_start = type_start + header->type_length;
+    if (memcmp(source_start, MStringData(source), header->source_length)) {
+        munmap((void *)base, file_length);
+        return false;
+    }
+
+    struct _CacheTypeReader reader = {
+        .store = store,
+        .next = type_start,
+        .end = source_start,
+        .nodes = ArrayListCreate(sizeof(TypeId), 64),
+    };
+    TypeId result_type = _ReadCacheType(&reader);
+    ArrayListFree(&reader.nodes);
+    if (!result_type || reader.next != reader.end) {
+        munmap((void *)base, file_length);
+        return false;
+    }
+
+    const struct _CacheFunction *entries =
+        (const struct _CacheFunction *)(base + sizeof(*header));
+    for (uint32_t i = 0; i < header->function_count; i++) {
+        if (entries[i].code_offset > header->code_length ||
+            entries[i].code_length >
+                header->code_length - entries[i].code_offset ||
+            entries[i].uncurried_id < 0 ||
+            (uint32_t)entries[i].uncurried_id >= header->function_count) {
+            munmap((void *)base, file_length);
+            return false;
+        }
+    }
+
+    ModuleInit(module);
+    module->function_count = header->function_count;
+    module->function_capacity = header->function_count;
+    module->functions = calloc(
+        header->function_count,
+        sizeof(struct CompiledExpression)
+    );
+    module->closure_loads = header->closure_loads;
+    module->closure_loads_saved = header->closure_loads_saved;
+    for (uint32_t i = 0; i < header->function_count; i++) {
+        struct CompiledExpression *function = &(module->functions[i]);
+        function->code = (uint8_t *)(code + entries[i].code_offset);
+        function->code_length = entries[i].code_length;
+        function->register_count = entries[i].register_count;
+        function->closure_length = entries[i].closure_length;
+        function->result_register = entries[i].result_register;
+        function->stack_words = entries[i].stack_words;
+        function->arity = entries[i].arity;
+        function->uncurried_id = entries[i].uncurried_id;
+
+        // The symbols a closure captures only matter to the compiler.
+        if (function->closure_length == 0) {
+            function->static_closure.function_id = i;
+        }
+    }
+
+    *func_id = header->func_id;
+    *type = result_type;
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+// Writing
+// ----------------------------------------------------------------------------
+//
+// The file is written under a temporary name and then renamed into place, so
+// that another millie looking for the same entry never maps half of it.
+//
+bool WriteCachedModule(const char *cache_dir, struct MString *source,
+                       int optimize_level, struct Module *module,
+                       int func_id, struct TypeStore *store, TypeId type)
+{
+    if (mkdir(cache_dir, 0777) != 0 && errno != EEXIST) { return false; }
+
+    struct MString *path = _CachePath(cache_dir, source, optimize_level);
+    struct MString *temp_path = MStringPrintF(
+        "%s.%ld" _CACHE_TEMP_EXTENSION,
+        MStringData(path),
+        (long)getpid()
+    );
+
+    bool ok = false;
+    FILE *output = fopen(MStringData(temp_path), "wb");
+    if (output) {
+        struct _CacheHeader header = {
+            .magic = _CACHE_MAGIC,
+            .version_hash = _CacheVersionHash(),
+            .optimize_level = optimize_level,
+            .function_count = module->function_count,
+            .func_id = func_id,
+            .closure_loads = module->closure_loads,
+            .closure_loads_saved = module->closure_loads_saved,
+            .source_length = MStringLength(source),
+        };
+        fwrite(&header, sizeof(header), 1, output);
+
+        for (int i = 0; i < module->function_count; i++) {
+            struct CompiledExpression *function = &(module->functions[i]);
+            struct _CacheFunction entry = {
+                .code_offset = header.code_length,
+                .code_length = function->code_length,
+                .register_count = function->register_count,
+                .closure_length = function->closure_length,
+                .stack_words = function->stack_words,
+                .uncurried_id = function->uncurried_id,
+                .result_register = function->result_register,
+                .arity = function->arity,
+            };
+            fwrite(&entry, sizeof(entry), 1, output);
+            header.code_length += function->code_length;
+        }
+
+        for (int i = 0; i < module->function_count; i++) {
+            struct CompiledExpression *function = &(module->functions[i]);
+            fwrite(function->code, 1, function->code_length, output);
+        }
+
+        struct _CacheTypeWriter writer = {
+            .output = output,
+            .store = store,
+        };
+        ok = _WriteCacheType(&writer, type);
+        _ClearTypeTemps(store, type);
+        header.type_length = writer.length;
+
+        fwrite(MStringData(source), 1, header.source_length, output);
+
+        // Now that everything's been counted, go back and fix up the header.
+        header.file_length = sizeof(header) +
+            module->function_count * sizeof(struct _CacheFunction) +
+            header.code_length + header.type_length + header.source_length;
+        fseek(output, 0, SEEK_SET);
+        fwrite(&header, sizeof(header), 1, output);
+
+        ok = !ferror(output) && ok;
+        ok = (fclose(output) == 0) && ok;
+    }
+
+    if (ok) {
+        ok = rename(MStringData(temp_path), MStringData(path)) == 0;
+    }
+    if (!ok) {
+        unlink(MStringData(temp_path));
+    }
+
+    MStringFree(&temp_path);
+    MStringFree(&path);
+    return ok;
+}
+
+// ----------------------------------------------------------------------------
+// Clearing
+// ----------------------------------------------------------------------------
+
+static bool _EndsWith(const char *name, const char *suffix)
+{
+    size_t length = strlen(name);
+    size_t suffix_length = strlen(suffix);
+    return length > suffix_length &&
+        strcmp(name + length - suffix_length, suffix) == 0;
+}
+
+// Entries are <hash>.mlc, and a write that was interrupted can leave behind
+// its <hash>.mlc.<pid>.tmp, so those go too.
+bool ClearCache(const char *cache_dir)
+{
+    DIR *dir = opendir(cache_dir);
+    if (!dir) { return errno == ENOENT; }
+
+    bool ok = true;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (!_EndsWith(entry->d_name, _CACHE_EXTENSION) &&
+            !(_EndsWith(entry->d_name, _CACHE_TEMP_EXTENSION) &&
+              strstr(entry->d_name, _CACHE_EXTENSION "."))) {
+            continue;
+        }
+
+        struct MString *path = MStringPrintF("%s/%s", cache_dir,
+                                             entry->d_name);
+        if (unlink(MStringData(path)) != 0) { ok = false; }
+        MStringFree(&path);
+    }
+    closedir(dir);
+    return ok;
+}
@@ -27,7 +27,11 @@ static struct CompiledExpression *_AddFunction(
 
     *expression_id = global->function_count;
     global->function_count += 1;
-    return global->functions + global->function_count - 1;
+
+    struct CompiledExpression *function =
+        global->functions + global->function_count - 1;
+    memset(function, 0, sizeof(*function));
+    return function;
 }
 
 // ----------------------------------------------------------------------------
@@ -36,7 +40,18 @@ static struct CompiledExpression *_AddFunction(
 
 struct CompileBinding {
     Symbol symbol;
-    uint8_t reg;
+    uint16_t reg;
+
+    // If the symbol is bound to a lambda that we compiled, the ID of its
+    // function, so that calls to it can go straight to its uncurried entry;
+    // otherwise -1.
+    int function_id;
+
+    // A function that closes over nothing doesn't need a register at all:
+    // its closure is always its static closure, which calls go straight
+    // past with CALL_DIRECT, and which is only loaded (into a new register)
+    // when it's used as a value. Then reg isn't used.
+    bool is_static;
 };
 
 struct CompileContext {
@@ -44,8 +59,14 @@ struct CompileContext {
     uint8_t *code_write;
     int code_capacity;
 
-    uint8_t integer_registers;
+    // How many things are holding on to each register: the expression whose
+    // value is in it, and any bindings of that value. A register with no
+    // references is free to be reused. (This grows as registers are handed
+    // out, up to MAX_REGISTERS.)
+    int *register_refs;
+    int register_capacity;
     size_t max_registers;
+    bool out_of_registers;
 
     struct CompileBinding *bindings;
     int binding_top;
@@ -55,15 +76,41 @@ struct CompileContext {
     int closure_top;
     int closure_capacity;
 
+    // For each captured value, the register it has already been loaded into
+    // on every path to the code being written, or -1. (See
+    // _CompileIdentifierImpl.)
+    int *closure_cache;
+
+    // The words of the frame that stack objects (see NEW_CLOSURE_S) are using
+    // at the moment, and the most they ever use at once. Objects are given
+    // out and given back in nested order, the way the scopes they live in
+    // nest, so that two that are never live together can share.
+    size_t stack_words;
+    size_t max_stack_words;
+
     struct CompileContext *parent_context;
 
+    // How many arguments the function takes, in r1 and up. (See
+    // CompiledExpression.)
+    int arity;
+
     struct Module *module;
+    struct Ast *ast;
+    struct TypeStore *types;
     struct MillieTokens *tokens;
     struct Errors **errors;
 };
 
 #define INITIAL_BINDING_CAPACITY (64)
 #define INITIAL_CODE_CAPACITY (64)
+#define INITIAL_REGISTER_CAPACITY (64)
+
+// Registers are numbered with a U16 (after a WIDE prefix).
+#define MAX_REGISTERS (UINT16_MAX + 1)
+
+// Past this, objects go in the heap even if they needn't, so that a deep
+// recursion doesn't run out of VM stack any sooner than it used to.
+#define MAX_STACK_WORDS (256)
 
 static void _InitCompileContext(struct CompileContext *context,
                                 struct CompileContext *parent)
@@ -73,21 +120,28 @@ static void _InitCompileContext(struct CompileContext *context,
     context->code_write = context->code;
     context->code_capacity = INITIAL_CODE_CAPACITY;
 
-    context->integer_registers = 0;
+    context->register_refs = calloc(INITIAL_REGISTER_CAPACITY, sizeof(int));
+    context->register_capacity = INITIAL_REGISTER_CAPACITY;
     context->max_registers = 0;
 
-    context->bindings = malloc(INITIAL_BINDING_CAPACITY);
+    context->bindings = malloc(
+        INITIAL_BINDING_CAPACITY * sizeof(struct CompileBinding)
+    );
     context->binding_top = 0;
     context->binding_capacity = INITIAL_BINDING_CAPACITY;
 
-    context->closure_symbols = malloc(INITIAL_BINDING_CAPACITY);
+    context->closure_symbols = malloc(INITIAL_BINDING_CAPACITY * sizeof(Symbol));
     context->closure_top = 0;
     context->closure_capacity = INITIAL_BINDING_CAPACITY;
+    context->closure_cache = malloc(INITIAL_BINDING_CAPACITY * sizeof(int));
 
     context->parent_context = parent;
+    context->arity = 1;
 
     if (parent != NULL) {
         context->module = parent->module;
+        context->ast = parent->ast;
+        context->types = parent->types;
         context->tokens = parent->tokens;
         context->errors = parent->errors;
     }
@@ -132,6 +186,16 @@ static void _WriteCodeU8(struct CompileContext *context, uint8_t value)
     *(context->code_write++) = value;
 }
 
+// The compiler writes every instruction with a WIDE prefix, so that it never
+// has to know how many registers a function will end up with or how far its
+// jumps will go; _FinishCompile then has CompactFunction take the prefix off
+// everywhere it isn't needed.
+static void _WriteCodeOp(struct CompileContext *context, MILLIE_OPCODE op)
+{
+    _WriteCodeU8(context, OP_WIDE);
+    _WriteCodeU8(context, op);
+}
+
 static void _WriteCodeU16(struct CompileContext *context, uint16_t value)
 {
     _EnsureCodeCapacity(context, 4);
@@ -148,6 +212,11 @@ static void _WriteCodeU32(struct CompileContext *context, uint32_t value)
     *(context->code_write++) = (value & 0xFF000000) >> 24;
 }
 
+static void _WriteCodeReg(struct CompileContext *context, uint16_t reg)
+{
+    _WriteCodeU16(context, reg);
+}
+
 static void _WriteCodeU64(struct CompileContext *context, uint64_t value)
 {
     _EnsureCodeCapacity(context, 8);
@@ -161,58 +230,239 @@ static void _WriteCodeU64(struct CompileContext *context, uint64_t value)
     *(context->code_write++) = (value & 0xFF00000000000000) >> 56;
 }
 
-static uint8_t _GetFreeIntRegister(struct CompileContext *context)
+// ----------------------------------------------------------------------------
+// Registers
+// ----------------------------------------------------------------------------
+//
+// Registers are reference counted. _CompileExpression returns a register
+// holding one reference for the caller, who must free it once it has used the
+// value; a binding holds another reference for as long as it is in scope. As
+// soon as nothing refers to a register it goes back into the pool, and the
+// next temporary gets the lowest free register, so that a function's frame is
+// only as big as the most values it has live at once.
+//
+static void _EnsureRegisterCapacity(struct CompileContext *context, int count)
+{
+    if (count <= context->register_capacity) { return; }
+
+    int new_capacity = context->register_capacity * 2;
+    if (new_capacity < count) { new_capacity = count; }
+    context->register_refs = realloc(
+        context->register_refs,
+        new_capacity * sizeof(int)
+    );
+    memset(
+        context->register_refs + context->register_capacity,
+        0,
+        (new_capacity - context->register_capacity) * sizeof(int)
+    );
+    context->register_capacity = new_capacity;
+}
+
+static uint16_t _GetFreeIntRegister(struct CompileContext *context)
+{
+    for (int reg = 0; reg < MAX_REGISTERS; reg++) {
+        _EnsureRegisterCapacity(context, reg + 1);
+        if (context->register_refs[reg] == 0) {
+            context->register_refs[reg] = 1;
+            if ((size_t)reg + 1 > context->max_registers) {
+                context->max_registers = reg + 1;
+            }
+            return reg;
+        }
+    }
+
+    // Whoever finishes compiling the function reports this.
+    context->out_of_registers = true;
+    return UINT16_MAX;
+}
+
+// _GetFreeIntRegisters allocates `count` registers in a row, for the arguments
+// of a CALLN, and returns the first.
+static uint16_t _GetFreeIntRegisters(struct CompileContext *context, int count)
 {
-    context->integer_registers++;
-    context->max_registers++;
-    return context->integer_registers - 1;
+    for (int first = 0; first + count <= MAX_REGISTERS; first++) {
+        _EnsureRegisterCapacity(context, first + count);
+        int i;
+        for (i = 0; i < count; i++) {
+            if (context->register_refs[first + i] != 0) { break; }
+        }
+        if (i < count) { continue; }
+
+        for (i = 0; i < count; i++) {
+            context->register_refs[first + i] = 1;
+        }
+        if ((size_t)(first + count) > context->max_registers) {
+            context->max_registers = first + count;
+        }
+        return first;
+    }
+
+    context->out_of_registers = true;
+    return 0;
 }
 
-static void _RetainRegister(struct CompileContext *context, uint8_t reg)
+static void _RetainRegister(struct CompileContext *context, uint16_t reg)
 {
-    (void)(context);
-    (void)(reg);
+    context->register_refs[reg]++;
 }
 
-static void _FreeRegister(struct CompileContext *context, uint8_t reg)
+static void _FreeRegister(struct CompileContext *context, uint16_t reg)
 {
-    (void)(context);
-    (void)(reg);
+    if (context->register_refs[reg] > 0) {
+        context->register_refs[reg]--;
+    }
 }
 
-static void _PushBinding(struct CompileContext *context,
-                         Symbol symbol,
-                         uint8_t reg)
+// _IsSharedRegister returns true if anything other than the caller's own
+// reference is holding on to the register, so that it can't be written.
+static bool _IsSharedRegister(struct CompileContext *context, uint16_t reg)
+{
+    return context->register_refs[reg] > 1;
+}
+
+static void _PushKnownBinding(struct CompileContext *context,
+                              Symbol symbol,
+                              uint16_t reg,
+                              int function_id)
 {
     if (context->binding_top == context->binding_capacity) {
         context->binding_capacity *= 2;
-        context->bindings = realloc(context->code, context->binding_capacity);
+        context->bindings = realloc(
+            context->bindings,
+            context->binding_capacity * sizeof(struct CompileBinding)
+        );
     }
 
     context->bindings[context->binding_top].symbol = symbol;
     context->bindings[context->binding_top].reg = reg;
+    context->bindings[context->binding_top].function_id = function_id;
+    context->bindings[context->binding_top].is_static = false;
     _RetainRegister(context, reg);
     context->binding_top++;
 }
 
+// _MakeBindingStatic turns the binding into a static one (see
+// CompileBinding), letting go of its register.
+static void _MakeBindingStatic(struct CompileContext *context, int binding)
+{
+    _FreeRegister(context, context->bindings[binding].reg);
+    context->bindings[binding].reg = UINT16_MAX;
+    context->bindings[binding].is_static = true;
+}
+
+static void _PushBinding(struct CompileContext *context,
+                         Symbol symbol,
+                         uint16_t reg)
+{
+    _PushKnownBinding(context, symbol, reg, -1);
+}
+
 static void _PopBinding(struct CompileContext *context)
 {
     context->binding_top--;
-    _FreeRegister(context, context->bindings[context->binding_top].reg);
+    if (!context->bindings[context->binding_top].is_static) {
+        _FreeRegister(context, context->bindings[context->binding_top].reg);
+    }
+}
+
+// _FindBinding returns the index of the innermost binding of `id` in this
+// function, or -1 if it is not bound here.
+static int _FindBinding(struct CompileContext *context, Symbol id)
+{
+    for(int i = context->binding_top - 1; i >= 0; i--) {
+        if (context->bindings[i].symbol == id) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// _AddClosureSymbol adds `id` to the values that the function captures, and
+// returns its index.
+static int _AddClosureSymbol(struct CompileContext *context, Symbol id)
+{
+    if (context->closure_capacity == context->closure_top) {
+        uint32_t new_capacity = context->closure_capacity * 2;
+        context->closure_symbols = realloc(
+            context->closure_symbols,
+            new_capacity * sizeof(Symbol)
+        );
+        context->closure_cache = realloc(
+            context->closure_cache,
+            new_capacity * sizeof(int)
+        );
+        context->closure_capacity = new_capacity;
+    }
+    int index = context->closure_top;
+    context->closure_symbols[index] = id;
+    context->closure_cache[index] = -1;
+    context->closure_top++;
+    return index;
+}
+
+// Captured values are only loaded once on any path through a function (see
+// _CompileIdentifierImpl), but a load in one branch of an `if` doesn't help
+// the other branch, or whatever comes after. _MarkClosureCache remembers what
+// was loaded before a branch, and _ResetClosureCache forgets whatever was
+// loaded since.
+struct _ClosureCacheMark {
+    int *registers;
+    int top;
+};
+
+static struct _ClosureCacheMark _MarkClosureCache(
+    struct CompileContext *context)
+{
+    struct _ClosureCacheMark mark;
+    mark.top = context->closure_top;
+    mark.registers = malloc((mark.top + 1) * sizeof(int));
+    memcpy(mark.registers, context->closure_cache, mark.top * sizeof(int));
+    return mark;
+}
+
+static void _ResetClosureCache(struct CompileContext *context,
+                               struct _ClosureCacheMark *mark)
+{
+    for (int i = 0; i < context->closure_top; i++) {
+        int before = (i < mark->top) ? mark->registers[i] : -1;
+        if (context->closure_cache[i] != before) {
+            _FreeRegister(context, context->closure_cache[i]);
+            context->closure_cache[i] = before;
+        }
+    }
+}
+
+// _LookupBinding returns the innermost binding of `id`, looking through the
+// enclosing functions too, or NULL. (A binding from an enclosing function
+// can't be used directly, except to know what it's bound to.)
+static struct CompileBinding *_LookupBinding(struct CompileContext *context,
+                                             Symbol id)
+{
+    for (; context != NULL; context = context->parent_context) {
+        int binding = _FindBinding(context, id);
+        if (binding >= 0) {
+            return &(context->bindings[binding]);
+        }
+    }
+    return NULL;
 }
 
 static void _FinishCompile(struct CompileContext *context,
-                           uint8_t result_register,
+                           uint16_t result_register,
                            int func_id,
                            struct CompiledExpression *result)
 {
     result->result_register = result_register;
-    _WriteCodeU8(context, OP_RET);
+    _WriteCodeOp(context, OP_RET);
 
     result->code = context->code;
     result->code_length = context->code_write - context->code;
     context->code = NULL;
 
+    // (If this fails, the code is still fine the way it is, just bigger.)
+    CompactFunction(result);
+
     result->closure_length = context->closure_top;
     if (result->closure_length > 0) {
         result->closure = context->closure_symbols;
@@ -222,7 +472,11 @@ static void _FinishCompile(struct CompileContext *context,
     }
 
     result->register_count = context->max_registers;
+    result->stack_words = context->max_stack_words;
+    result->arity = context->arity;
 
+    free(context->register_refs);
+    free(context->closure_cache);
     free(context->bindings);
     memset(context, 0, sizeof(struct CompileContext));
 }
@@ -232,50 +486,96 @@ static void _FinishCompile(struct CompileContext *context,
 // Expressions
 // ----------------------------------------------------------------------------
 
-static uint8_t _CompileExpression(struct CompileContext *context,
-                                   struct Expression *expression);
+static uint16_t _CompileExpression(struct CompileContext *context,
+                                   ExpressionId id);
+
+static struct Expression *_Node(struct CompileContext *context,
+                                ExpressionId id)
+{
+    return AstNode(context->ast, id);
+}
 
-static uint8_t _WriteLoadLiteral(struct CompileContext *context, uint64_t value)
+static uint16_t _WriteLoadLiteral(struct CompileContext *context, uint64_t value)
 {
-    uint8_t reg = _GetFreeIntRegister(context);
+    uint16_t reg = _GetFreeIntRegister(context);
     if (value <= UINT8_MAX) {
-        _WriteCodeU8(context, OP_LOADI_8);
+        _WriteCodeOp(context, OP_LOADI_8);
         _WriteCodeU8(context, value);
     } else if (value <= UINT16_MAX) {
-        _WriteCodeU8(context, OP_LOADI_16);
+        _WriteCodeOp(context, OP_LOADI_16);
         _WriteCodeU16(context, value);
     } else if (value <= UINT32_MAX) {
-        _WriteCodeU8(context, OP_LOADI_32);
+        _WriteCodeOp(context, OP_LOADI_32);
         _WriteCodeU32(context, value);
     } else {
-        _WriteCodeU8(context, OP_LOADI_64);
+        _WriteCodeOp(context, OP_LOADI_64);
         _WriteCodeU64(context, value);
     }
-    _WriteCodeU8(context, reg);
+    _WriteCodeReg(context, reg);
     return reg;
 }
 
-static uint8_t _CompileIntegerLiteral(struct CompileContext *context,
+static void _WriteNewClosure(struct CompileContext *context,
+                             int func_id,
+                             uint16_t closure_register)
+{
+    uint16_t id_reg = _WriteLoadLiteral(context, func_id);
+    _WriteCodeOp(context, OP_NEW_CLOSURE);
+    _WriteCodeReg(context, id_reg);
+    _WriteCodeReg(context, closure_register);
+    _FreeRegister(context, id_reg);
+}
+
+// _ReserveStackWords finds room in the frame for a stack object of `words`
+// words, and returns its offset, or -1 if it ought to go in the heap after
+// all. Give it back with _ReleaseStackWords, once nothing can use it.
+static int _ReserveStackWords(struct CompileContext *context, size_t words)
+{
+    if (context->stack_words + words > MAX_STACK_WORDS) {
+        return -1;
+    }
+    int offset = (int)context->stack_words;
+    context->stack_words += words;
+    if (context->stack_words > context->max_stack_words) {
+        context->max_stack_words = context->stack_words;
+    }
+    return offset;
+}
+
+static void _ReleaseStackWords(struct CompileContext *context,
+                               size_t stack_words)
+{
+    context->stack_words = stack_words;
+}
+
+static uint16_t _CompileIntegerLiteral(struct CompileContext *context,
                                       struct Expression *expression)
 {
-    return _WriteLoadLiteral(context, expression->literal_value);
+    return _WriteLoadLiteral(context, ExpressionLiteral(expression));
 }
 
-static uint8_t _CompileIdentifierImpl(struct CompileContext *context, Symbol id)
+static uint16_t _CompileIdentifierImpl(struct CompileContext *context, Symbol id)
 {
+    // A function with a static closure is in no register, and it needn't be
+    // captured either, since we can load it from right here.
+    //
+    struct CompileBinding *known = _LookupBinding(context, id);
+    if (known != NULL && known->is_static) {
+        uint16_t closure_register = _GetFreeIntRegister(context);
+        _WriteNewClosure(context, known->function_id, closure_register);
+        return closure_register;
+    }
+
     // Look to see if it's a local or an argument that's already bound in a
     // register.
     //
-    for(int i = context->binding_top; i >= 0; i--) {
-        if (context->bindings[i].symbol == id) {
-            _RetainRegister(context, context->bindings[i].reg);
-            return context->bindings[i].reg;
-        }
+    int binding = _FindBinding(context, id);
+    if (binding >= 0) {
+        _RetainRegister(context, context->bindings[binding].reg);
+        return context->bindings[binding].reg;
     }
 
     // The variable must be in our closure, the type checker said it was.
-    // TODO: It would be great if we could save the result of this load and not
-    //       do it all the time but I'm not entirely sure how.
     //
     // First, look for the offset within our closure. We might already be
     // tracking this variable.
@@ -293,17 +593,18 @@ static uint8_t _CompileIdentifierImpl(struct CompileContext *context, Symbol id)
     // variables that we've found in our expression.)
     //
     if (closure_offset < 0) {
-        if (context->closure_capacity == context->closure_top) {
-            uint32_t new_capacity = context->closure_capacity * 2;
-            context->closure_symbols = realloc(
-                context->closure_symbols,
-                new_capacity * sizeof(Symbol)
-            );
-            context->closure_capacity = new_capacity;
-        }
-        closure_offset = context->closure_top;
-        context->closure_symbols[closure_offset] = id;
-        context->closure_top++;
+        closure_offset = _AddClosureSymbol(context, id);
+    }
+
+    // If it's already been loaded on the way here, it's still there: the
+    // register stays held for as long as the cache says so, and closures
+    // never change.
+    //
+    int cached = context->closure_cache[closure_offset];
+    if (cached >= 0) {
+        context->module->closure_loads_saved++;
+        _RetainRegister(context, cached);
+        return cached;
     }
 
     // Now that we know the offset into the closure to read from, load from our
@@ -312,30 +613,229 @@ static uint8_t _CompileIdentifierImpl(struct CompileContext *context, Symbol id)
     // Note that closure_offset is (index + 1) because closure[0] is always the
     // current function pointer. (See the definition of `struct RuntimeClosure`.
     //
-    uint8_t load_target = _GetFreeIntRegister(context);
-    _WriteCodeU8(context, OP_LOADA_64);
-    _WriteCodeU8(context, 0);
+    uint16_t load_target = _GetFreeIntRegister(context);
+    _WriteCodeOp(context, OP_LOADA_64);
+    _WriteCodeReg(context, 0);
     _WriteCodeU16(context, (int16_t)closure_offset + 1);
-    _WriteCodeU8(context, load_target);
+    _WriteCodeReg(context, load_target);
+    context->module->closure_loads++;
+
+    context->closure_cache[closure_offset] = load_target;
+    _RetainRegister(context, load_target);
     return load_target;
 }
 
 
-static uint8_t _CompileIdentifier(struct CompileContext *context,
+static uint16_t _CompileIdentifier(struct CompileContext *context,
                                      struct Expression *expression)
 {
     return _CompileIdentifierImpl(context, expression->identifier_id);
 }
 
-static uint8_t _CompileLambdaImpl(struct CompileContext *context,
-                                  struct Expression *expression,
-                                  Symbol self_id,
-                                  uint8_t closure_register)
+// ----------------------------------------------------------------------------
+// Functions
+// ----------------------------------------------------------------------------
+//
+// Every function takes one argument, so `fn x => fn y => x + y` is a function
+// that returns a function, and calling it as `add 1 2` makes a closure for
+// `add 1` just to call it once. Since most calls pass all the arguments, the
+// compiler writes a lambda like that (up to MAX_UNCURRIED_ARITY deep) as one
+// uncurried entry that takes them all at once, in r1 and up, and calls to a
+// lambda it knows about go straight there with CALLN.
+//
+// The lambda itself, the one that takes just x, is then a stub: it collects
+// its argument in a closure for the next stub, and so on, and the last one
+// calls the uncurried entry with everything. So a partial application still
+// gets a closure, but nothing else does.
+//
+// The uncurried entry gets the lambda's own closure in r0, which means it
+// must have the same layout. It does, because the lambda's closure is the
+// entry's, copied.
+//
+// A lambda that `let` binds and that closes over nothing doesn't get a
+// closure made for it at all, unless it's used as a value; calls to it are
+// direct (see _CallKind).
+//
+
+#define MAX_UNCURRIED_ARITY (16)
+
+// _LambdaArity returns how many lambdas are nested directly in this one,
+// counting itself.
+static int _LambdaArity(struct Ast *ast, struct Expression *expression)
+{
+    int arity = 0;
+    while (expression->type == EXP_LAMBDA && arity < MAX_UNCURRIED_ARITY) {
+        arity++;
+        expression = AstNode(ast, expression->lambda_body);
+    }
+    return arity;
+}
+
+// _CompileCurriedStubs writes the lambda with the given func_id, and the
+// functions it returns, as stubs that collect arguments for the uncurried
+// entry. Stage k (counting from 0) gets a closure of the lambda's closure
+// followed by the first k arguments, and argument k + 1 in r1.
+static void _CompileCurriedStubs(struct CompileContext *context,
+                                 int func_id,
+                                 int arity)
+{
+    int *stages = malloc(arity * sizeof(int));
+    stages[0] = func_id;
+    for (int k = 1; k < arity; k++) {
+        _AddFunction(context->module, &(stages[k]));
+    }
+
+    for (int k = 0; k < arity; k++) {
+        struct CompileContext stub;
+        _InitCompileContext(&stub, context);
+        uint16_t closure_reg = _GetFreeIntRegister(&stub);
+        uint16_t arg_reg = _GetFreeIntRegister(&stub);
+        uint16_t result_reg;
+
+        if (k < arity - 1) {
+            // Collect the argument into the next stage's closure.
+            result_reg = _GetFreeIntRegister(&stub);
+            _WriteNewClosure(&stub, stages[k + 1], result_reg);
+            for (int slot = 1; slot <= k + 1; slot++) {
+                uint16_t value_reg = closure_reg;
+                if (k > 0) {
+                    value_reg = _GetFreeIntRegister(&stub);
+                    _WriteCodeOp(&stub, OP_LOADA_64);
+                    _WriteCodeReg(&stub, closure_reg);
+                    _WriteCodeU16(&stub, slot);
+                    _WriteCodeReg(&stub, value_reg);
+                }
+                _WriteCodeOp(&stub, OP_STOREA_64);
+                _WriteCodeReg(&stub, result_reg);
+                _WriteCodeU16(&stub, slot);
+                _WriteCodeReg(&stub, value_reg);
+                if (k > 0) { _FreeRegister(&stub, value_reg); }
+            }
+            _WriteCodeOp(&stub, OP_STOREA_64);
+            _WriteCodeReg(&stub, result_reg);
+            _WriteCodeU16(&stub, k + 2);
+            _WriteCodeReg(&stub, arg_reg);
+        } else {
+            // That's all of them.
+            uint16_t function_reg = _GetFreeIntRegister(&stub);
+            _WriteCodeOp(&stub, OP_LOADA_64);
+            _WriteCodeReg(&stub, closure_reg);
+            _WriteCodeU16(&stub, 1);
+            _WriteCodeReg(&stub, function_reg);
+
+            uint16_t first_reg = _GetFreeIntRegisters(&stub, arity);
+            for (int i = 0; i < arity - 1; i++) {
+                _WriteCodeOp(&stub, OP_LOADA_64);
+                _WriteCodeReg(&stub, closure_reg);
+                _WriteCodeU16(&stub, i + 2);
+                _WriteCodeReg(&stub, first_reg + i);
+            }
+            _WriteCodeOp(&stub, OP_MOV);
+            _WriteCodeReg(&stub, arg_reg);
+            _WriteCodeReg(&stub, first_reg + arity - 1);
+
+            _WriteCodeOp(&stub, OP_TAILCALLN);
+            _WriteCodeReg(&stub, function_reg);
+            _WriteCodeReg(&stub, first_reg);
+            _WriteCodeU8(&stub, arity);
+            result_reg = first_reg;
+        }
+
+        if (k == 0) {
+            // The lambda itself closes over what the uncurried entry does.
+            struct CompiledExpression *entry = &(context->module->functions[
+                context->module->functions[func_id].uncurried_id
+            ]);
+            for (size_t i = 0; i < entry->closure_length; i++) {
+                _AddClosureSymbol(&stub, entry->closure[i]);
+            }
+        }
+
+        struct CompiledExpression *result =
+            &(context->module->functions[stages[k]]);
+        _FinishCompile(&stub, result_reg, stages[k], result);
+        if (k > 0) {
+            // (This closure is built by the stage before, not by
+            // _WriteClosure, so there are no symbols to go with it.)
+            result->closure_length = k + 1;
+            result->closure = NULL;
+        }
+    }
+    free(stages);
+}
+
+// _CompileUncurried writes the uncurried entry for the lambda with the given
+// func_id, and then the lambda itself, as stubs.
+static void _CompileUncurried(struct CompileContext *context,
+                              struct Expression *expression,
+                              Symbol self_id,
+                              int func_id,
+                              int arity)
+{
+    int entry_id;
+    _AddFunction(context->module, &entry_id);
+    context->module->functions[func_id].uncurried_id = entry_id;
+
+    // Calls to the function from its own body (by the name `let rec` gave it)
+    // look at the entry's arity to decide whether they can use it, so it has
+    // to be right before the body is compiled, not just after.
+    context->module->functions[entry_id].arity = arity;
+
+    struct CompileContext child_context;
+    _InitCompileContext(&child_context, context);
+    child_context.arity = arity;
+
+    uint16_t self_register = _GetFreeIntRegister(&child_context);
+    if (self_id != INVALID_SYMBOL) {
+        _PushKnownBinding(&child_context, self_id, self_register, func_id);
+    }
+
+    struct Expression *lambda = expression;
+    ExpressionId body = 0;
+    for (int i = 0; i < arity; i++) {
+        uint16_t arg_register = _GetFreeIntRegister(&child_context);
+        _PushBinding(&child_context, lambda->lambda_id, arg_register);
+        body = lambda->lambda_body;
+        lambda = _Node(context, body);
+    }
+
+    uint16_t ret_register = _CompileExpression(&child_context, body);
+    for (int i = 0; i < arity; i++) {
+        _PopBinding(&child_context);
+    }
+    if (self_id != INVALID_SYMBOL) {
+        _PopBinding(&child_context);
+    }
+
+    if (child_context.out_of_registers) {
+        _ReportCompileError(
+            context,
+            expression,
+            "this function needs more than 65536 registers"
+        );
+    }
+    _FinishCompile(
+        &child_context,
+        ret_register,
+        entry_id,
+        &(context->module->functions[entry_id])
+    );
+
+    _CompileCurriedStubs(context, func_id, arity);
+}
+
+// _CompileFunction compiles the lambda, and returns its function ID.
+static int _CompileFunction(struct CompileContext *context,
+                            struct Expression *expression,
+                            Symbol self_id)
 {
     // First, compile the actual function.
     int func_id;
-    struct CompiledExpression *result = _AddFunction(context->module, &func_id);
-    {
+    _AddFunction(context->module, &func_id);
+    int arity = _LambdaArity(context->ast, expression);
+    if (arity > 1) {
+        _CompileUncurried(context, expression, self_id, func_id, arity);
+    } else {
         struct CompileContext child_context;
         _InitCompileContext(&child_context, context);
 
@@ -344,15 +844,15 @@ static uint8_t _CompileLambdaImpl(struct CompileContext *context,
         // in r0. (This prevents us from allocating a closure just to contain a
         // pointer to the closure that we know is already in r0.)
         //
-        uint8_t self_register = _GetFreeIntRegister(&child_context);
+        uint16_t self_register = _GetFreeIntRegister(&child_context);
         if (self_id != INVALID_SYMBOL) {
-            _PushBinding(&child_context, self_id, self_register);
+            _PushKnownBinding(&child_context, self_id, self_register, func_id);
         }
 
         // And the next one for the arg...
-        uint8_t arg_register = _GetFreeIntRegister(&child_context);
+        uint16_t arg_register = _GetFreeIntRegister(&child_context);
         _PushBinding(&child_context, expression->lambda_id, arg_register);
-        uint8_t ret_register = _CompileExpression(
+        uint16_t ret_register = _CompileExpression(
             &child_context,
             expression->lambda_body
         );
@@ -362,55 +862,281 @@ static uint8_t _CompileLambdaImpl(struct CompileContext *context,
             _PopBinding(&child_context);
         }
 
-        _FinishCompile(&child_context, ret_register, func_id, result);
+        if (child_context.out_of_registers) {
+            _ReportCompileError(
+                context,
+                expression,
+                "this function needs more than 65536 registers"
+            );
+        }
+
+        // (Compiling the body may have added functions to the module, which
+        // moves them all around, so we can only find ours now.)
+        _FinishCompile(
+            &child_context,
+            ret_register,
+            func_id,
+            &(context->module->functions[func_id])
+        );
     }
+    return func_id;
+}
+
+// _IsStaticFunction is true if the function closes over nothing, so that a
+// binding of it can be static (see CompileBinding).
+static bool _IsStaticFunction(struct CompileContext *context, int func_id)
+{
+    return context->module->functions[func_id].closure_length == 0 &&
+        func_id <= UINT16_MAX;
+}
+
+// _WriteClosure writes code to put the closure of the function, with the
+// values it closes over, in closure_register. If on_stack, the closure can't
+// escape (see _Escapes), and so it goes in the frame if there's room.
+static void _WriteClosure(struct CompileContext *context,
+                          int func_id,
+                          uint16_t closure_register,
+                          bool on_stack)
+{
+    struct CompiledExpression *result = &(context->module->functions[func_id]);
 
     // Now generate the closure object into `closure_register`.
-    uint8_t id_reg = _WriteLoadLiteral(context, func_id);
-    _WriteCodeU8(context, OP_NEW_CLOSURE);
-    _WriteCodeU8(context, id_reg);
-    _WriteCodeU8(context, closure_register);
-    _FreeRegister(context, id_reg);
+    int offset = -1;
+    if (on_stack && result->closure_length > 0 && func_id <= UINT16_MAX) {
+        offset = _ReserveStackWords(context, result->closure_length + 1);
+    }
+    if (offset >= 0) {
+        _WriteCodeOp(context, OP_NEW_CLOSURE_S);
+        _WriteCodeU16(context, func_id);
+        _WriteCodeU16(context, offset);
+        _WriteCodeReg(context, closure_register);
+    } else {
+        _WriteNewClosure(context, func_id, closure_register);
+    }
 
     // Load in the closed values.
     for(size_t i = 0; i < result->closure_length; i++) {
-        id_reg = _CompileIdentifierImpl(context, result->closure[i]);
+        uint16_t id_reg = _CompileIdentifierImpl(context, result->closure[i]);
 
-        _WriteCodeU8(context, OP_STOREA_64);
-        _WriteCodeU8(context, closure_register);
+        _WriteCodeOp(context, OP_STOREA_64);
+        _WriteCodeReg(context, closure_register);
         _WriteCodeU16(context, i + 1);
-        _WriteCodeU8(context, id_reg);
+        _WriteCodeReg(context, id_reg);
 
         _FreeRegister(context, id_reg);
     }
+}
 
-    return closure_register;
+
+// ----------------------------------------------------------------------------
+// Escape Analysis
+// ----------------------------------------------------------------------------
+//
+// An object that can't outlive the frame that makes it needn't be in the heap
+// at all: it can go in the frame (see NEW_CLOSURE_S), and it's gone when the
+// frame is. We only look for the easy ones, by name: the closure of a lambda
+// bound by `let` or `let rec`, or applied right where it's written, and a
+// tuple bound by `let`.
+//
+// (There's nothing to do with a tuple but pass it around, yet, so the only
+// tuples that qualify are the ones that are never used.)
+//
+
+// _Escapes is true if the value bound to `symbol` might still be wanted after
+// the frame evaluating expression `id` has returned, or by a frame that takes
+// its place. The only safe use is a call with at least `arity` arguments; any
+// other use might keep it, or give it to something that might. A tail call
+// gives away the frame the closure is in, and so it doesn't count-- except a
+// call by the function to itself with exactly `arity` arguments, when
+// `is_self`, which is a jump. And since we don't know when a lambda will be
+// called, any use at all from inside one is an escape.
+static bool _Escapes(struct Ast *ast,
+                     ExpressionId id,
+                     Symbol symbol,
+                     int arity,
+                     bool is_self)
+{
+    struct Expression *expression = AstNode(ast, id);
+    switch(expression->type) {
+    case EXP_IDENTIFIER:
+        return expression->identifier_id == symbol;
+
+    case EXP_APPLY:
+    case EXP_TAILCALL:
+        {
+            int arg_count = 0;
+            ExpressionId head_id = id;
+            struct Expression *head = expression;
+            do {
+                if (_Escapes(ast, head->apply_argument, symbol, arity,
+                             is_self)) {
+                    return true;
+                }
+                arg_count++;
+                head_id = head->apply_function;
+                head = AstNode(ast, head_id);
+            } while (head->type == EXP_APPLY);
+
+            if (head->type != EXP_IDENTIFIER ||
+                head->identifier_id != symbol) {
+                return _Escapes(ast, head_id, symbol, arity, is_self);
+            }
+            if (expression->type == EXP_TAILCALL && !is_self) {
+                return arg_count <= arity;
+            }
+            return arg_count < arity;
+        }
+
+    case EXP_LAMBDA:
+        if (expression->lambda_id == symbol) { return false; }
+        return _Escapes(ast, expression->lambda_body, symbol, INT_MAX, false);
+
+    case EXP_LET:
+        if (_Escapes(ast, expression->let_value, symbol, arity, is_self)) {
+            return true;
+        }
+        return expression->let_id != symbol &&
+            _Escapes(ast, expression->let_body, symbol, arity, is_self);
+
+    case EXP_LETREC:
+        if (expression->let_id == symbol) { return false; }
+        return _Escapes(ast, expression->let_value, symbol, arity, is_self) ||
+            _Escapes(ast, expression->let_body, symbol, arity, is_self);
+
+    case EXP_IF:
+        return _Escapes(ast, expression->if_test, symbol, arity, is_self) ||
+            _Escapes(ast, expression->if_then, symbol, arity, is_self) ||
+            _Escapes(ast, expression->if_else, symbol, arity, is_self);
+
+    case EXP_BINARY:
+        return _Escapes(ast, expression->binary_left, symbol, arity, is_self) ||
+            _Escapes(ast, expression->binary_right, symbol, arity, is_self);
+
+    case EXP_UNARY:
+        return _Escapes(ast, expression->unary_arg, symbol, arity, is_self);
+
+    case EXP_TUPLE:
+        for (uint32_t i = 0; i < expression->tuple_length; i++) {
+            ExpressionId member = AstTupleMember(ast, expression, (int)i);
+            if (_Escapes(ast, member, symbol, arity, is_self)) {
+                return true;
+            }
+        }
+        break;
+
+    case EXP_INTEGER_CONSTANT:
+    case EXP_TRUE:
+    case EXP_FALSE:
+    case EXP_ERROR:
+    case EXP_INVALID:
+        break;
+    }
+    return false;
 }
 
+// _LetEscapes is true if the value that the `let` binds escapes its body.
+static bool _LetEscapes(struct Ast *ast, struct Expression *expression)
+{
+    int arity = INT_MAX;
+    struct Expression *value = AstNode(ast, expression->let_value);
+    if (value->type == EXP_LAMBDA) {
+        arity = _LambdaArity(ast, value);
+    }
+    return _Escapes(ast, expression->let_body, expression->let_id, arity,
+                    false);
+}
+
+// _LetRecEscapes is _LetEscapes for `let rec`, where the function can also
+// use its own name.
+static bool _LetRecEscapes(struct Ast *ast, struct Expression *expression)
+{
+    Symbol id = expression->let_id;
+    ExpressionId body = expression->let_value;
+    struct Expression *lambda = AstNode(ast, body);
+    int arity = _LambdaArity(ast, lambda);
+    bool shadowed = false;
+    for (int i = 0; i < arity; i++) {
+        shadowed = shadowed || (lambda->lambda_id == id);
+        body = lambda->lambda_body;
+        lambda = AstNode(ast, body);
+    }
+    if (!shadowed && _Escapes(ast, body, id, arity, true)) {
+        return true;
+    }
+    return _Escapes(ast, expression->let_body, id, arity, false);
+}
+
+// ----------------------------------------------------------------------------
+// Bindings
+// ----------------------------------------------------------------------------
 
-static uint8_t _CompileLambda(struct CompileContext *context,
+// _WriteLambda compiles the lambda and writes its closure, on the stack if
+// on_stack (see _WriteClosure).
+static uint16_t _WriteLambda(struct CompileContext *context,
+                            struct Expression *expression,
+                            bool on_stack)
+{
+    int func_id = _CompileFunction(context, expression, INVALID_SYMBOL);
+    uint16_t closure_register = _GetFreeIntRegister(context);
+    _WriteClosure(context, func_id, closure_register, on_stack);
+    return closure_register;
+}
+
+static uint16_t _CompileLambda(struct CompileContext *context,
                               struct Expression *expression)
 {
-    uint8_t closure_register = _GetFreeIntRegister(context);
-    return _CompileLambdaImpl(
-        context,
-        expression,
-        INVALID_SYMBOL,
-        closure_register
-    );
+    return _WriteLambda(context, expression, false);
 }
 
-static uint8_t _CompileLet(struct CompileContext *context,
+static uint16_t _WriteTuple(struct CompileContext *context,
+                           struct Expression *expression,
+                           bool on_stack);
+
+static uint16_t _CompileLet(struct CompileContext *context,
                            struct Expression *expression)
 {
-    uint8_t dest_reg = _CompileExpression(context, expression->let_value);
-    _PushBinding(context, expression->let_id, dest_reg);
-    uint8_t result = _CompileExpression(context, expression->let_body);
+    size_t stack_words = context->stack_words;
+    struct Expression *value = _Node(context, expression->let_value);
+
+    // Remember which function a lambda is, so that calls to it can be direct.
+    if (value->type == EXP_LAMBDA) {
+        int function_id = _CompileFunction(context, value, INVALID_SYMBOL);
+        bool is_static = _IsStaticFunction(context, function_id);
+        uint16_t dest_reg = _GetFreeIntRegister(context);
+        if (!is_static) {
+            _WriteClosure(
+                context,
+                function_id,
+                dest_reg,
+                !_LetEscapes(context->ast, expression)
+            );
+        }
+        _PushKnownBinding(context, expression->let_id, dest_reg, function_id);
+        _FreeRegister(context, dest_reg);
+        if (is_static) {
+            _MakeBindingStatic(context, context->binding_top - 1);
+        }
+    } else {
+        uint16_t dest_reg;
+        if (value->type == EXP_TUPLE) {
+            dest_reg = _WriteTuple(
+                context,
+                value,
+                !_LetEscapes(context->ast, expression)
+            );
+        } else {
+            dest_reg = _CompileExpression(context, expression->let_value);
+        }
+        _PushBinding(context, expression->let_id, dest_reg);
+        _FreeRegister(context, dest_reg);
+    }
+    uint16_t result = _CompileExpression(context, expression->let_body);
     _PopBinding(context);
+    _ReleaseStackWords(context, stack_words);
     return result;
 }
 
-static uint8_t _CompileLetRec(struct CompileContext *context,
+static uint16_t _CompileLetRec(struct CompileContext *context,
                               struct Expression *expression)
 {
     // `let rec` requires special handling, and so right now we require that
@@ -420,11 +1146,13 @@ static uint8_t _CompileLetRec(struct CompileContext *context,
     // but for now we stick with this, which is a fine time-honored tradition
     // dating back to Standard ML.
     //
-    uint8_t dest_reg = _GetFreeIntRegister(context);
-    if (expression->let_value->type != EXP_LAMBDA) {
+    size_t stack_words = context->stack_words;
+    uint16_t dest_reg = _GetFreeIntRegister(context);
+    struct Expression *value = _Node(context, expression->let_value);
+    if (value->type != EXP_LAMBDA) {
         _ReportCompileError(
             context,
-            expression->let_value,
+            value,
             "the expression in a let rec must be a function definition"
         );
         return dest_reg;
@@ -439,135 +1167,505 @@ static uint8_t _CompileLetRec(struct CompileContext *context,
     // longer be the case.)
     //
     _PushBinding(context, expression->let_id, dest_reg);
-    _CompileLambdaImpl(
-        context,
-        expression->let_value,
-        expression->let_id,
-        dest_reg
-    );
+    _FreeRegister(context, dest_reg);
+    int binding = context->binding_top - 1;
+    int function_id = _CompileFunction(context, value, expression->let_id);
+    context->bindings[binding].function_id = function_id;
+    if (_IsStaticFunction(context, function_id)) {
+        _MakeBindingStatic(context, binding);
+    } else {
+        _WriteClosure(
+            context,
+            function_id,
+            dest_reg,
+            !_LetRecEscapes(context->ast, expression)
+        );
+    }
 
     // Now we can compile the body.
-    uint8_t body_reg = _CompileExpression(context, expression->let_body);
+    uint16_t body_reg = _CompileExpression(context, expression->let_body);
     _PopBinding(context);
+    _ReleaseStackWords(context, stack_words);
     return body_reg;
 }
 
-static uint8_t _CompileApply(struct CompileContext *context,
-                             struct Expression *expression)
+// ----------------------------------------------------------------------------
+// Calls
+// ----------------------------------------------------------------------------
+
+// A call to a function we know something about can skip some of the work of
+// CALL, taking its arguments in a row of registers:
+//
+//   CALL_SELF:   A call to the function we're compiling, by the name `let rec`
+//                gave it, which is already running with the right closure.
+//   CALL_DIRECT: A call to a function with a static closure, which needn't be
+//                loaded, and whose ID is known without looking at it.
+//   CALLN:       A call to the uncurried entry of a lambda that has a closure.
+//
+// Each of those takes as many arguments as it can, and the rest are applied
+// to the result one at a time, with CALL.
+//
+enum _CallKind {
+    CALL_KIND_INDIRECT,
+    CALL_KIND_SELF,
+    CALL_KIND_DIRECT,
+    CALL_KIND_UNCURRIED,
+};
+
+// _CallShape describes `f a b c`, which parses as ((f a) b) c: the function
+// at the head, and the arguments in order.
+struct _CallShape {
+    ExpressionId head;
+    ExpressionId *args;
+    int arg_count;
+
+    // How the first call goes, and how many of the arguments it takes. (For
+    // CALL_KIND_DIRECT, function_id is the function it calls.)
+    enum _CallKind kind;
+    int function_id;
+    int first_count;
+};
+
+static void _GetCallShape(struct CompileContext *context,
+                          struct Expression *expression,
+                          struct _CallShape *shape)
 {
-    uint8_t lambda_register = _CompileExpression(
+    shape->arg_count = 1;
+    shape->head = expression->apply_function;
+    struct Expression *head = _Node(context, shape->head);
+    while (head->type == EXP_APPLY) {
+        shape->arg_count++;
+        shape->head = head->apply_function;
+        head = _Node(context, shape->head);
+    }
+
+    shape->args = malloc(shape->arg_count * sizeof(ExpressionId));
+    struct Expression *cursor = expression;
+    for (int i = shape->arg_count - 1; i >= 0; i--) {
+        shape->args[i] = cursor->apply_argument;
+        cursor = _Node(context, cursor->apply_function);
+    }
+
+    shape->kind = CALL_KIND_INDIRECT;
+    shape->function_id = -1;
+    shape->first_count = 1;
+    if (head->type != EXP_IDENTIFIER) {
+        return;
+    }
+
+    // (In a function, r0 holds the closure, and so the name `let rec` gave
+    // the function is the only thing that is ever bound to it. At the top
+    // level, r0 is just another register.)
+    int self = _FindBinding(context, head->identifier_id);
+    if (context->parent_context != NULL &&
+        self >= 0 && context->bindings[self].reg == 0 &&
+        context->arity <= shape->arg_count) {
+        shape->kind = CALL_KIND_SELF;
+        shape->first_count = context->arity;
+        return;
+    }
+
+    struct CompileBinding *known = _LookupBinding(
         context,
-        expression->apply_function
+        head->identifier_id
     );
-    uint8_t arg_register = _CompileExpression(
+    if (known == NULL || known->function_id < 0) {
+        return;
+    }
+
+    struct Module *module = context->module;
+    int entry_id = module->functions[known->function_id].uncurried_id;
+    int arity = module->functions[entry_id].arity;
+    bool can_uncurry = (entry_id != 0 && arity >= 1 &&
+                        arity <= shape->arg_count);
+    if (known->is_static) {
+        shape->kind = CALL_KIND_DIRECT;
+        shape->function_id = known->function_id;
+        shape->first_count = can_uncurry ? arity : 1;
+    } else if (can_uncurry) {
+        shape->kind = CALL_KIND_UNCURRIED;
+        shape->first_count = arity;
+    }
+}
+
+// _WriteCallArguments compiles the first `count` arguments of the call into
+// registers in a row, as CALLN wants them, and returns the first.
+static uint16_t _WriteCallArguments(struct CompileContext *context,
+                                   struct _CallShape *shape,
+                                   int count)
+{
+    if (count == 1) {
+        // A row of one is wherever the argument already is, as long as the
+        // result can go there too.
+        uint16_t arg_reg = _CompileExpression(context, shape->args[0]);
+        if (!_IsSharedRegister(context, arg_reg)) {
+            return arg_reg;
+        }
+        uint16_t first_reg = _GetFreeIntRegister(context);
+        _WriteCodeOp(context, OP_MOV);
+        _WriteCodeReg(context, arg_reg);
+        _WriteCodeReg(context, first_reg);
+        _FreeRegister(context, arg_reg);
+        return first_reg;
+    }
+
+    uint16_t first_reg = _GetFreeIntRegisters(context, count);
+    for (int i = 0; i < count; i++) {
+        uint16_t arg_reg = _CompileExpression(context, shape->args[i]);
+        _WriteCodeOp(context, OP_MOV);
+        _WriteCodeReg(context, arg_reg);
+        _WriteCodeReg(context, first_reg + i);
+        _FreeRegister(context, arg_reg);
+    }
+    return first_reg;
+}
+
+// _WriteCall calls the closure in lambda_register with one argument, and
+// returns the register with the result.
+static uint16_t _WriteCall(struct CompileContext *context,
+                          uint16_t lambda_register,
+                          ExpressionId argument)
+{
+    uint16_t arg_register = _CompileExpression(context, argument);
+
+    // CALL reads the closure and the argument before the result comes back,
+    // so the result can go in either of their registers.
+    _FreeRegister(context, lambda_register);
+    _FreeRegister(context, arg_register);
+    uint16_t ret_register = _GetFreeIntRegister(context);
+
+    _WriteCodeOp(context, OP_CALL);
+    _WriteCodeReg(context, lambda_register);
+    _WriteCodeReg(context, arg_register);
+    _WriteCodeReg(context, ret_register);
+
+    return ret_register;
+}
+
+// _WriteKnownCall writes the first call of a call that isn't
+// CALL_KIND_INDIRECT, and then applies the arguments after that, up to
+// last_arg, to the result one at a time. Returns the register with the
+// result.
+static uint16_t _WriteKnownCall(struct CompileContext *context,
+                               struct _CallShape *shape,
+                               int last_arg)
+{
+    uint16_t lambda_register = 0;
+    if (shape->kind == CALL_KIND_UNCURRIED) {
+        lambda_register = _CompileExpression(context, shape->head);
+    }
+    uint16_t first_reg = _WriteCallArguments(
         context,
-        expression->apply_argument
+        shape,
+        shape->first_count
     );
-    uint8_t ret_register = _GetFreeIntRegister(context);
 
-    _WriteCodeU8(context, OP_CALL);
-    _WriteCodeU8(context, lambda_register);
-    _WriteCodeU8(context, arg_register);
-    _WriteCodeU8(context, ret_register);
+    switch (shape->kind) {
+    case CALL_KIND_SELF:
+        _WriteCodeOp(context, OP_CALL_SELF);
+        _WriteCodeReg(context, first_reg);
+        _WriteCodeU8(context, shape->first_count);
+        break;
+
+    case CALL_KIND_DIRECT:
+        _WriteCodeOp(context, OP_CALL_DIRECT);
+        _WriteCodeU16(context, shape->function_id);
+        _WriteCodeReg(context, first_reg);
+        _WriteCodeU8(context, shape->first_count);
+        break;
+
+    default:
+        _WriteCodeOp(context, OP_CALLN);
+        _WriteCodeReg(context, lambda_register);
+        _WriteCodeReg(context, first_reg);
+        _WriteCodeU8(context, shape->first_count);
+        _FreeRegister(context, lambda_register);
+        break;
+    }
+
+    // The result comes back in the first argument's register.
+    for (int i = 1; i < shape->first_count; i++) {
+        _FreeRegister(context, first_reg + i);
+    }
+
+    uint16_t result_reg = first_reg;
+    for (int i = shape->first_count; i < last_arg; i++) {
+        result_reg = _WriteCall(context, result_reg, shape->args[i]);
+    }
+    return result_reg;
+}
+
+static uint16_t _CompileApply(struct CompileContext *context,
+                             struct Expression *expression)
+{
+    struct _CallShape shape;
+    _GetCallShape(context, expression, &shape);
+
+    uint16_t ret_register;
+    if (shape.kind != CALL_KIND_INDIRECT) {
+        ret_register = _WriteKnownCall(context, &shape, shape.arg_count);
+    } else {
+        // A lambda that's called right where it's written is only ever used
+        // by this CALL, and so its closure can go on the stack. (Not if it
+        // takes more arguments, though, since then the CALL is to a stub
+        // that keeps it.)
+        size_t stack_words = context->stack_words;
+        struct Expression *head = _Node(context, expression->apply_function);
+        uint16_t lambda_register;
+        if (head->type == EXP_LAMBDA && _LambdaArity(context->ast, head) == 1) {
+            lambda_register = _WriteLambda(context, head, true);
+        } else {
+            lambda_register = _CompileExpression(
+                context,
+                expression->apply_function
+            );
+        }
+        ret_register = _WriteCall(
+            context,
+            lambda_register,
+            expression->apply_argument
+        );
+        _ReleaseStackWords(context, stack_words);
+    }
+    free(shape.args);
+    return ret_register;
+}
+
+// _WriteSelfTailCall writes a tail call to the very function we're compiling
+// (by way of the name `let rec` gave it, which is always bound to r0), which
+// doesn't need to go through the VM's call machinery at all: put the new
+// arguments where the arguments go, and jump back to the top.
+static uint16_t _WriteSelfTailCall(struct CompileContext *context,
+                                  struct _CallShape *shape)
+{
+    uint16_t *arg_regs = malloc(shape->arg_count * sizeof(uint16_t));
+    for (int i = 0; i < shape->arg_count; i++) {
+        arg_regs[i] = _CompileExpression(context, shape->args[i]);
+    }
+
+    // An argument that's already in one of the argument registers, but not
+    // its own, could be overwritten before it gets moved; so move it out of
+    // the way first. (As in `tail loop acc n`, from inside `loop n acc`.)
+    for (int i = 0; i < shape->arg_count; i++) {
+        if (arg_regs[i] != i + 1 &&
+            arg_regs[i] >= 1 && arg_regs[i] <= shape->arg_count) {
+            uint16_t copy_reg = _GetFreeIntRegister(context);
+            _WriteCodeOp(context, OP_MOV);
+            _WriteCodeReg(context, arg_regs[i]);
+            _WriteCodeReg(context, copy_reg);
+            _FreeRegister(context, arg_regs[i]);
+            arg_regs[i] = copy_reg;
+        }
+    }
+    for (int i = 0; i < shape->arg_count; i++) {
+        if (arg_regs[i] != i + 1) {
+            _WriteCodeOp(context, OP_MOV);
+            _WriteCodeReg(context, arg_regs[i]);
+            _WriteCodeReg(context, i + 1);
+        }
+        _FreeRegister(context, arg_regs[i]);
+    }
+    free(arg_regs);
+
+    // (+6 because jumps are relative to the end of the jump instruction,
+    // which is 6 bytes long with its WIDE prefix.)
+    ptrdiff_t jump_loc = context->code_write - context->code;
+    _WriteCodeOp(context, OP_JMP);
+    _WriteCodeU32(context, (uint32_t)(int32_t)(-(jump_loc + 6)));
+
+    // Nothing ever gets written here, but our caller needs somewhere to
+    // think the result went.
+    return _GetFreeIntRegister(context);
+}
+
+static uint16_t _CompileTailCall(struct CompileContext *context,
+                                struct Expression *expression)
+{
+    struct _CallShape shape;
+    _GetCallShape(context, expression, &shape);
+
+    uint16_t ret_register;
+    if (shape.kind == CALL_KIND_SELF && shape.arg_count == context->arity) {
+        ret_register = _WriteSelfTailCall(context, &shape);
+
+    } else if (shape.kind == CALL_KIND_DIRECT &&
+               shape.first_count == shape.arg_count) {
+        uint16_t first_reg = _WriteCallArguments(
+            context,
+            &shape,
+            shape.first_count
+        );
+
+        _WriteCodeOp(context, OP_TAILCALL_DIRECT);
+        _WriteCodeU16(context, shape.function_id);
+        _WriteCodeReg(context, first_reg);
+        _WriteCodeU8(context, shape.first_count);
+
+        for (int i = 0; i < shape.first_count; i++) {
+            _FreeRegister(context, first_reg + i);
+        }
+        ret_register = _GetFreeIntRegister(context);
+
+    } else if (shape.kind == CALL_KIND_UNCURRIED &&
+               shape.first_count == shape.arg_count) {
+        uint16_t lambda_register = _CompileExpression(context, shape.head);
+        uint16_t first_reg = _WriteCallArguments(
+            context,
+            &shape,
+            shape.first_count
+        );
+
+        _WriteCodeOp(context, OP_TAILCALLN);
+        _WriteCodeReg(context, lambda_register);
+        _WriteCodeReg(context, first_reg);
+        _WriteCodeU8(context, shape.first_count);
+
+        _FreeRegister(context, lambda_register);
+        for (int i = 0; i < shape.first_count; i++) {
+            _FreeRegister(context, first_reg + i);
+        }
+        ret_register = _GetFreeIntRegister(context);
 
+    } else {
+        uint16_t lambda_register;
+        if (shape.kind != CALL_KIND_INDIRECT) {
+            lambda_register = _WriteKnownCall(
+                context,
+                &shape,
+                shape.arg_count - 1
+            );
+        } else {
+            lambda_register = _CompileExpression(
+                context,
+                expression->apply_function
+            );
+        }
+        uint16_t arg_register = _CompileExpression(
+            context,
+            expression->apply_argument
+        );
+
+        _WriteCodeOp(context, OP_TAILCALL);
+        _WriteCodeReg(context, lambda_register);
+        _WriteCodeReg(context, arg_register);
+
+        _FreeRegister(context, lambda_register);
+        _FreeRegister(context, arg_register);
+        ret_register = _GetFreeIntRegister(context);
+    }
+    free(shape.args);
     return ret_register;
 }
 
-static uint8_t _CompileBinary(struct CompileContext *context,
+static uint16_t _CompileBinary(struct CompileContext *context,
                               struct Expression *expression)
 {
     // opcodes we use are guaranteed to read their input before writing their
     // output, so we can free the input registers before allocating the output
     // register to save space.
-    uint8_t left_register = _CompileExpression(
+    uint16_t left_register = _CompileExpression(
         context,
         expression->binary_left
     );
-    uint8_t right_register = _CompileExpression(
+    uint16_t right_register = _CompileExpression(
         context,
         expression->binary_right
     );
     _FreeRegister(context, left_register);
     _FreeRegister(context, right_register);
 
-    uint8_t out_register = _GetFreeIntRegister(context);
+    uint16_t out_register = _GetFreeIntRegister(context);
 
     switch(expression->binary_operator) {
-    case TOK_PLUS: _WriteCodeU8(context, OP_ADD); break;
-    case TOK_MINUS: _WriteCodeU8(context, OP_SUB); break;
-    case TOK_EQUALS: _WriteCodeU8(context, OP_EQ); break;
-    case TOK_STAR: _WriteCodeU8(context, OP_MUL); break;
+    case TOK_PLUS: _WriteCodeOp(context, OP_ADD); break;
+    case TOK_MINUS: _WriteCodeOp(context, OP_SUB); break;
+    case TOK_EQUALS: _WriteCodeOp(context, OP_EQ); break;
+    case TOK_STAR: _WriteCodeOp(context, OP_MUL); break;
     default:
         _ReportCompileError(context, expression, "Unsupported binary operator");
         break;
     }
 
-    _WriteCodeU8(context, left_register);
-    _WriteCodeU8(context, right_register);
-    _WriteCodeU8(context, out_register);
+    _WriteCodeReg(context, left_register);
+    _WriteCodeReg(context, right_register);
+    _WriteCodeReg(context, out_register);
 
     return out_register;
 }
 
-static uint8_t _CompileUnary(struct CompileContext *context,
+static uint16_t _CompileUnary(struct CompileContext *context,
                              struct Expression *expression)
 {
     // opcodes we use are guaranteed to read their input before writing their
     // output, so we can free the input registers before allocating the output
     // register to save space.
-    uint8_t arg_register = _CompileExpression(
+    uint16_t arg_register = _CompileExpression(
         context,
         expression->unary_arg
     );
     _FreeRegister(context, arg_register);
 
-    uint8_t out_register = _GetFreeIntRegister(context);
+    uint16_t out_register = _GetFreeIntRegister(context);
 
     switch(expression->binary_operator) {
-    case TOK_MINUS: _WriteCodeU8(context, OP_NEG); break;
+    case TOK_MINUS: _WriteCodeOp(context, OP_NEG); break;
     default:
         _ReportCompileError(context, expression, "Unsupported unary operator");
         break;
     }
 
-    _WriteCodeU8(context, arg_register);
-    _WriteCodeU8(context, out_register);
+    _WriteCodeReg(context, arg_register);
+    _WriteCodeReg(context, out_register);
 
     return out_register;
 }
 
-static uint8_t _CompileIf(struct CompileContext *context,
+static uint16_t _CompileIf(struct CompileContext *context,
                           struct Expression *expression)
 {
     ptrdiff_t false_target_loc;
     {
         // Compile the test part and jump-to-false.
-        uint8_t result_reg = _CompileExpression(context, expression->if_test);
+        uint16_t result_reg = _CompileExpression(context, expression->if_test);
 
-        _WriteCodeU8(context, OP_JZ);
-        _WriteCodeU8(context, result_reg);
+        _WriteCodeOp(context, OP_JZ);
+        _WriteCodeReg(context, result_reg);
 
         // Reserve space for, but do not write, the location of the false
         // branch. (We'll know it once we're done compiling the true branch.)
         false_target_loc = context->code_write - context->code;
-        _EnsureCodeCapacity(context, 2);
-        context->code_write += 2;
+        _EnsureCodeCapacity(context, 4);
+        context->code_write += 4;
 
         _FreeRegister(context, result_reg);
     }
 
-    uint8_t true_reg;
+    uint16_t out_reg;
     ptrdiff_t end_target_loc;
+    struct _ClosureCacheMark mark = _MarkClosureCache(context);
     {
-        true_reg = _CompileExpression(context, expression->if_then);
+        out_reg = _CompileExpression(context, expression->if_then);
+
+        // The false branch is going to put its value in the same register,
+        // so it can't be one that a binding is using (as in `if c then x
+        // else y`); copy the value out if it is.
+        if (_IsSharedRegister(context, out_reg)) {
+            uint16_t copy_reg = _GetFreeIntRegister(context);
+            _WriteCodeOp(context, OP_MOV);
+            _WriteCodeReg(context, out_reg);
+            _WriteCodeReg(context, copy_reg);
+            _FreeRegister(context, out_reg);
+            out_reg = copy_reg;
+        }
+        _ResetClosureCache(context, &mark);
 
-        _WriteCodeU8(context, OP_JMP);
+        _WriteCodeOp(context, OP_JMP);
 
         // Reserve space for, but do not write, the location of the end of
         // the expression, as we did for the FALSE spot.
         end_target_loc= context->code_write - context->code;
-        _EnsureCodeCapacity(context, 2);
-        context->code_write += 2;
+        _EnsureCodeCapacity(context, 4);
+        context->code_write += 4;
     }
 
     {
@@ -575,30 +1673,33 @@ static uint8_t _CompileIf(struct CompileContext *context,
         // jump.
         ptrdiff_t false_loc = context->code_write - context->code;
 
-        // (-2 because jumps are relative to the end of the jump instruction,
-        // and the offset is 2 bytes wide.)
-        int16_t false_offset = false_loc - false_target_loc - 2;
+        // (-4 because jumps are relative to the end of the jump instruction,
+        // and the offset is 4 bytes wide.)
+        int32_t false_offset = false_loc - false_target_loc - 4;
         context->code_write = context->code + false_target_loc;
-        _WriteCodeU16(context, false_offset);
+        _WriteCodeU32(context, (uint32_t)false_offset);
 
         context->code_write = context->code + false_loc;
     }
 
     {
-        // Now compile the false branch.
-        // TODO: Temporarily free the true register before coming in here so
-        //       that we have a chance of using it... this whole thing is a
-        //       mess.
-        uint8_t false_reg = _CompileExpression(context, expression->if_else);
+        // Now compile the false branch. Nothing in the true branch happens
+        // on this path, so the result register is free for the false branch
+        // to use; with luck it computes its value right into it.
+        _FreeRegister(context, out_reg);
+        uint16_t false_reg = _CompileExpression(context, expression->if_else);
+        _ResetClosureCache(context, &mark);
+        free(mark.registers);
 
         // If false put the data somewhere different than true, then we need to
         // make it so the output is in the same register. Issue a MOV and then
         // we can free the false register.
-        if (false_reg != true_reg) {
-            _WriteCodeU8(context, OP_MOV);
-            _WriteCodeU8(context, false_reg);
-            _WriteCodeU8(context, true_reg);
+        if (false_reg != out_reg) {
+            _WriteCodeOp(context, OP_MOV);
+            _WriteCodeReg(context, false_reg);
+            _WriteCodeReg(context, out_reg);
             _FreeRegister(context, false_reg);
+            _RetainRegister(context, out_reg);
         }
     }
 
@@ -606,59 +1707,136 @@ static uint8_t _CompileIf(struct CompileContext *context,
         // This is the end of the whole expression, go back and patch up the jump.
         const ptrdiff_t end_loc = context->code_write - context->code;
 
-        // (-2 because jumps are relative to the end of the jump instruction, and
-        // the offset is 2 bytes wide.)
-        int16_t end_offset = end_loc - end_target_loc - 2;
+        // (-4 because jumps are relative to the end of the jump instruction, and
+        // the offset is 4 bytes wide.)
+        int32_t end_offset = end_loc - end_target_loc - 4;
         context->code_write = context->code + end_target_loc;
-        _WriteCodeU16(context, end_offset);
+        _WriteCodeU32(context, (uint32_t)end_offset);
 
         context->code_write = context->code + end_loc;
     }
 
-    return true_reg;
+    return out_reg;
 }
 
-static uint8_t _CompileTrue(struct CompileContext *context)
+static uint16_t _CompileTrue(struct CompileContext *context)
 {
     return _WriteLoadLiteral(context, 1);
 }
 
-static uint8_t _CompileFalse(struct CompileContext *context)
+static uint16_t _CompileFalse(struct CompileContext *context)
 {
     return _WriteLoadLiteral(context, 0);
 }
 
-static uint8_t _CompileTuple(struct CompileContext *context,
-                             struct Expression *expression)
+// _GetTupleLayout works out the byte offset of each member of the tuple, and
+// returns the length to allocate it with (see TUPLE_PACKED). The tuple is
+// packed if its type says how big each member is, and if that makes it any
+// smaller, which it does if there's more than one bool in it.
+static uint64_t _GetTupleLayout(struct TypeStore *types,
+                                TypeId type,
+                                struct Expression *expression,
+                                size_t *offsets)
 {
-    uint8_t len_reg = _WriteLoadLiteral(context, expression->tuple_length);
+    if (type) {
+        size_t bytes = PackedTupleLayout(types, type, offsets);
+        size_t words = (bytes + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+        if (bytes > 0 && words < (size_t)expression->tuple_length &&
+            bytes <= INT16_MAX) {
+            return words | TUPLE_PACKED;
+        }
+    }
 
-    uint8_t out_reg = _GetFreeIntRegister(context);
-    _WriteCodeU8(context, OP_NEW_TUPLE);
-    _WriteCodeU8(context, len_reg);
-    _WriteCodeU8(context, out_reg);
+    for (uint32_t i = 0; i < expression->tuple_length; i++) {
+        offsets[i] = i * sizeof(uint64_t);
+    }
+    return expression->tuple_length;
+}
 
-    _FreeRegister(context, len_reg);
+// _WriteTuple compiles the tuple, which goes on the stack if on_stack and
+// there's room. (See _Escapes.)
+static uint16_t _WriteTuple(struct CompileContext *context,
+                           struct Expression *expression,
+                           bool on_stack)
+{
+    // Compute all of the members before allocating the tuple, so that nothing
+    // can allocate between NEW_TUPLE and the stores that fill it in. (The
+    // garbage collector relies on this; see gc.c.)
+    int member_count = (int)expression->tuple_length;
+    uint16_t *member_regs = malloc(member_count * sizeof(uint16_t));
+    for (int i = 0; i < member_count; i++) {
+        member_regs[i] = _CompileExpression(
+            context,
+            AstTupleMember(context->ast, expression, i)
+        );
+    }
 
-    struct Expression *cursor = expression;
-    for (int i = 0; i < expression->tuple_length; i++) {
-        uint8_t member_reg;
-        member_reg = _CompileExpression(context, expression->tuple_first);
-        _WriteCodeU8(context, OP_STOREA_64);
-        _WriteCodeU8(context, out_reg);
-        _WriteCodeU16(context, i);
-        _WriteCodeU8(context, member_reg);
-        _FreeRegister(context, member_reg);
+    TypeId tuple_type = AstTupleType(context->ast, expression);
+    size_t *offsets = malloc(member_count * sizeof(size_t));
+    uint64_t length = _GetTupleLayout(
+        context->types,
+        tuple_type,
+        expression,
+        offsets
+    );
+    size_t words = length & UINT32_MAX;
+
+    int offset = -1;
+    if (on_stack) {
+        offset = _ReserveStackWords(context, words);
+    }
+
+    uint16_t out_reg;
+    if (offset >= 0) {
+        out_reg = _GetFreeIntRegister(context);
+        _WriteCodeOp(context, OP_NEW_TUPLE_S);
+        _WriteCodeU16(context, words);
+        _WriteCodeU16(context, offset);
+        _WriteCodeReg(context, out_reg);
+    } else {
+        uint16_t len_reg = _WriteLoadLiteral(context, length);
+
+        out_reg = _GetFreeIntRegister(context);
+        _WriteCodeOp(context, OP_NEW_TUPLE);
+        _WriteCodeReg(context, len_reg);
+        _WriteCodeReg(context, out_reg);
+
+        _FreeRegister(context, len_reg);
+    }
 
-        cursor = cursor->tuple_rest;
+    bool packed = (length & TUPLE_PACKED) != 0;
+    struct TypeExp *type = packed ? TypeAt(context->types, tuple_type) : NULL;
+    for (int i = 0; i < member_count; i++) {
+        if (packed &&
+            PackedMemberSize(context->types, type->tuple_first) == 1) {
+            _WriteCodeOp(context, OP_STOREA_8);
+            _WriteCodeReg(context, out_reg);
+            _WriteCodeU16(context, offsets[i]);
+        } else {
+            _WriteCodeOp(context, OP_STOREA_64);
+            _WriteCodeReg(context, out_reg);
+            _WriteCodeU16(context, offsets[i] / sizeof(uint64_t));
+        }
+        _WriteCodeReg(context, member_regs[i]);
+        _FreeRegister(context, member_regs[i]);
+        if (packed) { type = TypeAt(context->types, type->tuple_rest); }
     }
+    free(member_regs);
+    free(offsets);
 
     return out_reg;
 }
 
-static uint8_t _CompileExpression(struct CompileContext *context,
-                                  struct Expression *expression)
+static uint16_t _CompileTuple(struct CompileContext *context,
+                             struct Expression *expression)
+{
+    return _WriteTuple(context, expression, false);
+}
+
+static uint16_t _CompileExpression(struct CompileContext *context,
+                                  ExpressionId id)
 {
+    struct Expression *expression = _Node(context, id);
     switch(expression->type) {
     case EXP_INTEGER_CONSTANT: return _CompileIntegerLiteral(context, expression);
     case EXP_LET: return _CompileLet(context, expression);
@@ -666,6 +1844,7 @@ static uint8_t _CompileExpression(struct CompileContext *context,
     case EXP_IDENTIFIER: return _CompileIdentifier(context, expression);
     case EXP_LAMBDA: return _CompileLambda(context, expression);
     case EXP_APPLY: return _CompileApply(context, expression);
+    case EXP_TAILCALL: return _CompileTailCall(context, expression);
     case EXP_BINARY: return _CompileBinary(context, expression);
     case EXP_UNARY: return _CompileUnary(context, expression);
     case EXP_IF: return _CompileIf(context, expression);
@@ -676,7 +1855,6 @@ static uint8_t _CompileExpression(struct CompileContext *context,
     case EXP_ERROR:
         break;
 
-    case EXP_TUPLE_FINAL:
     case EXP_INVALID:
         _ReportCompileError(
             context,
@@ -688,7 +1866,86 @@ static uint8_t _CompileExpression(struct CompileContext *context,
     return 0;
 }
 
-int CompileExpression(struct Expression *expression,
+// ----------------------------------------------------------------------------
+// Tail Position
+// ----------------------------------------------------------------------------
+
+// _CheckTailCalls reports an error for each `tail` call under expression `id`
+// that isn't in tail position, which is to say for each one that would need
+// to come back to the current frame after the call. `in_tail` is true if
+// the expression is itself in tail position.
+//
+static void _CheckTailCalls(struct CompileContext *context,
+                            ExpressionId id,
+                            bool in_tail)
+{
+    struct Expression *expression = _Node(context, id);
+    switch(expression->type) {
+    case EXP_TAILCALL:
+        if (!in_tail) {
+            _ReportCompileError(
+                context,
+                expression,
+                "a tail call must be the last thing its function does"
+            );
+        }
+        _CheckTailCalls(context, expression->apply_function, false);
+        _CheckTailCalls(context, expression->apply_argument, false);
+        break;
+
+    case EXP_APPLY:
+        _CheckTailCalls(context, expression->apply_function, false);
+        _CheckTailCalls(context, expression->apply_argument, false);
+        break;
+
+    case EXP_LAMBDA:
+        _CheckTailCalls(context, expression->lambda_body, true);
+        break;
+
+    case EXP_LET:
+    case EXP_LETREC:
+        _CheckTailCalls(context, expression->let_value, false);
+        _CheckTailCalls(context, expression->let_body, in_tail);
+        break;
+
+    case EXP_IF:
+        _CheckTailCalls(context, expression->if_test, false);
+        _CheckTailCalls(context, expression->if_then, in_tail);
+        _CheckTailCalls(context, expression->if_else, in_tail);
+        break;
+
+    case EXP_BINARY:
+        _CheckTailCalls(context, expression->binary_left, false);
+        _CheckTailCalls(context, expression->binary_right, false);
+        break;
+
+    case EXP_UNARY:
+        _CheckTailCalls(context, expression->unary_arg, false);
+        break;
+
+    case EXP_TUPLE:
+        for (uint32_t i = 0; i < expression->tuple_length; i++) {
+            _CheckTailCalls(
+                context,
+                AstTupleMember(context->ast, expression, (int)i),
+                false
+            );
+        }
+        break;
+
+    case EXP_IDENTIFIER:
+    case EXP_INTEGER_CONSTANT:
+    case EXP_TRUE:
+    case EXP_FALSE:
+    case EXP_ERROR:
+    case EXP_INVALID:
+        break;
+    }
+}
+
+int CompileExpression(struct Ast *ast,
+                      struct TypeStore *types,
+                      ExpressionId expression,
                       struct MillieTokens *tokens,
                       struct Errors **errors,
                       struct Module *module)
@@ -698,14 +1955,33 @@ int CompileExpression(struct Expression *expression,
     struct CompileContext context;
 
     int func_id;
-    struct CompiledExpression *result = _AddFunction(module, &func_id);
+    _AddFunction(module, &func_id);
 
     _InitCompileContext(&context, NULL);
     context.module = module;
+    context.ast = ast;
+    context.types = types;
     context.errors = errors;
     context.tokens = tokens;
 
-    uint8_t result_register = _CompileExpression(&context, expression);
-    _FinishCompile(&context, result_register, func_id, result);
+    _CheckTailCalls(&context, expression, true);
+    if (*errors) {
+        return func_id;
+    }
+
+    uint16_t result_register = _CompileExpression(&context, expression);
+    if (context.out_of_registers) {
+        _ReportCompileError(
+            &context,
+            _Node(&context, expression),
+            "this expression needs more than 65536 registers"
+        );
+    }
+    _FinishCompile(
+        &context,
+        result_register,
+        func_id,
+        &(module->functions[func_id])
+    );
     return func_id;
 }
@@ -0,0 +1,670 @@
+#ifndef PLATFORM_INCLUDED
+#include "platform.h"
+#endif
+
+/*
+ * The C backend.
+ *
+ * EmitC translates the bytecode of a module into a standalone C program,
+ * which can then be built with the system C compiler and linked against the
+ * runtime in rt.c and gc.c. Every function in the module becomes a C
+ * function with the same (closure, argument) signature-- except for the
+ * uncurried entries, which take all their arguments-- every register becomes
+ * a local, and every jump becomes a goto. The C compiler gets to do the rest.
+ *
+ * Since the translation is instruction by instruction, the generated code
+ * does exactly what the VM would do, in the same order; in particular it
+ * never allocates between an allocation and the stores that initialize it,
+ * which the collector depends on.
+ */
+
+static const char _emit_prologue[] =
+    "#include \"platform.h\"\n"
+    "\n"
+    "#define CHECK_STACK() do {                                          \\\n"
+    "        if ((char *)__builtin_frame_address(0) < CompiledStackLimit) { \\\n"
+    "            CompiledStackOverflow();                                \\\n"
+    "        }                                                           \\\n"
+    "    } while(0)\n"
+    "\n";
+
+// _FindJumpTargets marks the offset of every instruction that is the target
+// of a jump, so that we know where to put labels.
+static bool _FindJumpTargets(struct CompiledExpression *code, bool *targets)
+{
+    const uint8_t *ip = code->code;
+    const uint8_t *end = code->code + code->code_length;
+    while (ip < end) {
+        size_t length = _InstructionLength(ip);
+        if (length == 0) {
+            fprintf(stderr, "ERROR: cannot emit C for instruction %d\n", *ip);
+            return false;
+        }
+
+        const uint8_t *next = ip + length;
+        const uint8_t *args = ip + 1;
+        bool wide = (*ip == OP_WIDE);
+        MILLIE_OPCODE op = wide ? *(args++) : *ip;
+        const uint8_t *target = NULL;
+        if (op == OP_JMP) {
+            target = next + _ReadOff(&args, wide);
+        } else if (op == OP_JZ) {
+            _ReadReg(&args, wide);
+            target = next + _ReadOff(&args, wide);
+        } else if (op == OP_JNE) {
+            _ReadReg(&args, wide);
+            _ReadReg(&args, wide);
+            target = next + _ReadOff(&args, wide);
+        } else if (op == OP_JNEI) {
+            _ReadReg(&args, wide);
+            _ReadU8(&args);
+            target = next + _ReadOff(&args, wide);
+        }
+
+        if (target) {
+            if (target < code->code || target > end) {
+                fprintf(stderr, "ERROR: jump out of range at %td\n",
+                        ip - code->code);
+                return false;
+            }
+            targets[target - code->code] = true;
+        }
+        ip = next;
+    }
+    return true;
+}
+
+// _HasTailCall is true if the function gives its frame away with a tail call
+// anywhere. (The C compiler can't turn a call into a jump if the frame has
+// things in it that the callee might see, and it can't tell that the objects
+// that the VM would put on the stack are done with by then; so in such a
+// function they go in the heap after all.)
+static bool _HasTailCall(struct CompiledExpression *code)
+{
+    const uint8_t *ip = code->code;
+    const uint8_t *end = code->code + code->code_length;
+    while (ip < end) {
+        MILLIE_OPCODE op = (*ip == OP_WIDE) ? ip[1] : *ip;
+        if (op == OP_TAILCALL || op == OP_TAILCALLN ||
+            op == OP_TAILCALL_DIRECT) {
+            return true;
+        }
+        ip += _InstructionLength(ip);
+    }
+    return false;
+}
+
+// _AccessBits is how wide the memory is that a LOADA or STOREA works on.
+static int _AccessBits(MILLIE_OPCODE op)
+{
+    switch(op) {
+    case OP_LOADA_8:  case OP_STOREA_8:  return 8;
+    case OP_LOADA_16: case OP_STOREA_16: return 16;
+    case OP_LOADA_32: case OP_STOREA_32: return 32;
+    default:                             return 64;
+    }
+}
+
+static void _EmitSignature(FILE *output,
+                           struct CompiledExpression *code,
+                           int func_id)
+{
+    fprintf(output, "static uint64_t _f%d(uint64_t r0", func_id);
+    for (int i = 1; i <= code->arity; i++) {
+        fprintf(output, ", uint64_t r%d", i);
+    }
+    fprintf(output, ")");
+}
+
+// _EmitUncurriedCall writes a call to the uncurried entry of the closure in
+// func_reg, for CALLN and TAILCALLN.
+static void _EmitUncurriedCall(FILE *output, uint16_t func_reg,
+                               uint16_t first_reg, uint8_t count)
+{
+    fprintf(output, "((uint64_t (*)(uint64_t");
+    for (int i = 0; i < count; i++) {
+        fprintf(output, ", uint64_t");
+    }
+    fprintf(output,
+            "))(void (*)(void))_functions[_uncurried_ids[((uint64_t *)r%d)[0]]])"
+            "(r%d",
+            func_reg, func_reg);
+    for (int i = 0; i < count; i++) {
+        fprintf(output, ", r%d", first_reg + i);
+    }
+    fprintf(output, ")");
+}
+
+// _EmitDirectCall writes a call straight to the C function for callee_id,
+// for CALL_DIRECT and CALL_SELF, with the static closure of closure_id, or
+// with our own closure if closure_id is -1.
+static void _EmitDirectCall(FILE *output, int callee_id, int closure_id,
+                            uint16_t first_reg, uint8_t count)
+{
+    if (closure_id >= 0) {
+        fprintf(output, "_f%d((uint64_t)&(_static_closures[%d])",
+                callee_id, closure_id);
+    } else {
+        fprintf(output, "_f%d(r0", callee_id);
+    }
+    for (int i = 0; i < count; i++) {
+        fprintf(output, ", r%d", first_reg + i);
+    }
+    fprintf(output, ")");
+}
+
+static bool _EmitFunction(FILE *output,
+                          struct Module *module,
+                          int func_id)
+{
+    struct CompiledExpression *code = &(module->functions[func_id]);
+
+    bool *targets = calloc(code->code_length + 1, sizeof(bool));
+    if (!_FindJumpTargets(code, targets)) {
+        free(targets);
+        return false;
+    }
+
+    _EmitSignature(output, code, func_id);
+    fprintf(output, "\n{\n");
+    fprintf(output, "    (void)r0;");
+    for (int i = 1; i <= code->arity; i++) {
+        fprintf(output, " (void)r%d;", i);
+    }
+    fprintf(output, "\n");
+    for (size_t i = code->arity + 1; i < code->register_count; i++) {
+        fprintf(output, "    uint64_t r%zu = 0;\n", i);
+    }
+    bool stack_objects = code->stack_words > 0 && !_HasTailCall(code);
+    if (stack_objects) {
+        fprintf(output, "    uint64_t _stack[%zu];\n", code->stack_words);
+    }
+    fprintf(output, "    CHECK_STACK();\n");
+    fprintf(output, "\n");
+
+    bool ok = true;
+    const uint8_t *ip = code->code;
+    const uint8_t *end = code->code + code->code_length;
+    while (ok && ip < end) {
+        ptrdiff_t offset = ip - code->code;
+        if (targets[offset]) {
+            fprintf(output, "L%td:\n", offset);
+        }
+
+        MILLIE_OPCODE op = *(ip++);
+        bool wide = (op == OP_WIDE);
+        if (wide) { op = *(ip++); }
+        switch(op) {
+        case OP_RET:
+            fprintf(output, "    return r%d;\n", code->result_register);
+            break;
+
+        case OP_LOADI_8:
+            {
+                uint8_t val = _ReadU8(&ip);
+                uint16_t reg = _ReadReg(&ip, wide);
+                fprintf(output, "    r%d = %u;\n", reg, val);
+            }
+            break;
+
+        case OP_LOADI_16:
+            {
+                uint16_t val = _ReadU16(&ip);
+                uint16_t reg = _ReadReg(&ip, wide);
+                fprintf(output, "    r%d = %u;\n", reg, val);
+            }
+            break;
+
+        case OP_LOADI_32:
+            {
+                uint32_t val = _ReadU32(&ip);
+                uint16_t reg = _ReadReg(&ip, wide);
+                fprintf(output, "    r%d = %uU;\n", reg, val);
+            }
+            break;
+
+        case OP_LOADI_64:
+            {
+                uint64_t val = _ReadU64(&ip);
+                uint16_t reg = _ReadReg(&ip, wide);
+                fprintf(output, "    r%d = UINT64_C(%llu);\n", reg,
+                        (unsigned long long)val);
+            }
+            break;
+
+        case OP_LOADA_8:
+        case OP_LOADA_16:
+        case OP_LOADA_32:
+        case OP_LOADA_64:
+            {
+                uint16_t src_reg = _ReadReg(&ip, wide);
+                int16_t index = (int16_t)_ReadU16(&ip);
+                uint16_t dst_reg = _ReadReg(&ip, wide);
+                fprintf(output, "    r%d = ((uint%d_t *)r%d)[%d];\n",
+                        dst_reg, _AccessBits(op), src_reg, index);
+            }
+            break;
+
+        case OP_STOREA_8:
+        case OP_STOREA_16:
+        case OP_STOREA_32:
+        case OP_STOREA_64:
+            {
+                uint16_t src_reg = _ReadReg(&ip, wide);
+                int16_t index = (int16_t)_ReadU16(&ip);
+                uint16_t val_reg = _ReadReg(&ip, wide);
+                int bits = _AccessBits(op);
+                fprintf(output, "    ((uint%d_t *)r%d)[%d] = (uint%d_t)r%d;\n",
+                        bits, src_reg, index, bits, val_reg);
+            }
+            break;
+
+        case OP_NEW_CLOSURE:
+            {
+                uint16_t funcid_reg = _ReadReg(&ip, wide);
+                uint16_t dst_reg = _ReadReg(&ip, wide);
+                fprintf(output, "    r%d = _NewClosure(r%d);\n",
+                        dst_reg, funcid_reg);
+            }
+            break;
+
+        case OP_NEW_TUPLE:
+            {
+                uint16_t len_reg = _ReadReg(&ip, wide);
+                uint16_t dst_reg = _ReadReg(&ip, wide);
+                fprintf(output, "    r%d = CompiledNewTuple(r%d);\n",
+                        dst_reg, len_reg);
+            }
+            break;
+
+        case OP_NEW_CLOSURE_S:
+            {
+                uint16_t target_id = _ReadU16(&ip);
+                uint16_t offset = _ReadU16(&ip);
+                uint16_t dst_reg = _ReadReg(&ip, wide);
+                if (stack_objects) {
+                    fprintf(output, "    _stack[%u] = %u;\n",
+                            offset, target_id);
+                    fprintf(output, "    r%d = (uint64_t)&(_stack[%u]);\n",
+                            dst_reg, offset);
+                } else {
+                    fprintf(output, "    r%d = _NewClosure(%u);\n",
+                            dst_reg, target_id);
+                }
+            }
+            break;
+
+        case OP_NEW_TUPLE_S:
+            {
+                uint16_t length = _ReadU16(&ip);
+                uint16_t offset = _ReadU16(&ip);
+                uint16_t dst_reg = _ReadReg(&ip, wide);
+                if (stack_objects) {
+                    fprintf(output, "    r%d = (uint64_t)&(_stack[%u]);\n",
+                            dst_reg, offset);
+                } else {
+                    fprintf(output, "    r%d = CompiledNewTuple(%u);\n",
+                            dst_reg, length);
+                }
+            }
+            break;
+
+        case OP_CALL:
+            {
+                uint16_t func_reg = _ReadReg(&ip, wide);
+                uint16_t arg_reg = _ReadReg(&ip, wide);
+                uint16_t ret_reg = _ReadReg(&ip, wide);
+                fprintf(output,
+                        "    r%d = _functions[((uint64_t *)r%d)[0]](r%d, r%d);\n",
+                        ret_reg, func_reg, func_reg, arg_reg);
+            }
+            break;
+
+        case OP_TAILCALL:
+            {
+                // This relies on the C compiler turning it into a jump, which
+                // they all do when optimizing.
+                uint16_t func_reg = _ReadReg(&ip, wide);
+                uint16_t arg_reg = _ReadReg(&ip, wide);
+                fprintf(output,
+                        "    return _functions[((uint64_t *)r%d)[0]](r%d, r%d);\n",
+                        func_reg, func_reg, arg_reg);
+            }
+            break;
+
+        case OP_CALLN:
+            {
+                uint16_t func_reg = _ReadReg(&ip, wide);
+                uint16_t first_reg = _ReadReg(&ip, wide);
+                uint8_t count = _ReadU8(&ip);
+                fprintf(output, "    r%d = ", first_reg);
+                _EmitUncurriedCall(output, func_reg, first_reg, count);
+                fprintf(output, ";\n");
+            }
+            break;
+
+        case OP_TAILCALLN:
+            {
+                uint16_t func_reg = _ReadReg(&ip, wide);
+                uint16_t first_reg = _ReadReg(&ip, wide);
+                uint8_t count = _ReadU8(&ip);
+                fprintf(output, "    return ");
+                _EmitUncurriedCall(output, func_reg, first_reg, count);
+                fprintf(output, ";\n");
+            }
+            break;
+
+        case OP_CALL_DIRECT:
+        case OP_TAILCALL_DIRECT:
+            {
+                uint16_t target_id = _ReadU16(&ip);
+                uint16_t first_reg = _ReadReg(&ip, wide);
+                uint8_t count = _ReadU8(&ip);
+                int callee_id = target_id;
+                if (count > 1) {
+                    callee_id = module->functions[target_id].uncurried_id;
+                }
+                if (op == OP_CALL_DIRECT) {
+                    fprintf(output, "    r%d = ", first_reg);
+                } else {
+                    fprintf(output, "    return ");
+                }
+                _EmitDirectCall(output, callee_id, target_id, first_reg, count);
+                fprintf(output, ";\n");
+            }
+            break;
+
+        case OP_CALL_SELF:
+            {
+                uint16_t first_reg = _ReadReg(&ip, wide);
+                uint8_t count = _ReadU8(&ip);
+                fprintf(output, "    r%d = ", first_reg);
+                _EmitDirectCall(output, func_id, -1, first_reg, count);
+                fprintf(output, ";\n");
+            }
+            break;
+
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_EQ:
+            {
+                uint16_t left_reg = _ReadReg(&ip, wide);
+                uint16_t right_reg = _ReadReg(&ip, wide);
+                uint16_t ret_reg = _ReadReg(&ip, wide);
+                const char *c_op =
+                    (op == OP_ADD) ? "+" :
+                    (op == OP_SUB) ? "-" :
+                    (op == OP_MUL) ? "*" : "==";
+                fprintf(output, "    r%d = (r%d %s r%d);\n",
+                        ret_reg, left_reg, c_op, right_reg);
+            }
+            break;
+
+        case OP_NEG:
+            {
+                uint16_t arg_reg = _ReadReg(&ip, wide);
+                uint16_t ret_reg = _ReadReg(&ip, wide);
+                fprintf(output, "    r%d = -r%d;\n", ret_reg, arg_reg);
+            }
+            break;
+
+        case OP_JMP:
+            {
+                int32_t jump = _ReadOff(&ip, wide);
+                fprintf(output, "    goto L%td;\n", (ip + jump) - code->code);
+            }
+            break;
+
+        case OP_JZ:
+            {
+                uint16_t test_reg = _ReadReg(&ip, wide);
+                int32_t jump = _ReadOff(&ip, wide);
+                fprintf(output, "    if (r%d == 0) { goto L%td; }\n",
+                        test_reg, (ip + jump) - code->code);
+            }
+            break;
+
+        case OP_MOV:
+            {
+                uint16_t src_reg = _ReadReg(&ip, wide);
+                uint16_t dst_reg = _ReadReg(&ip, wide);
+                fprintf(output, "    r%d = r%d;\n", dst_reg, src_reg);
+            }
+            break;
+
+        case OP_ADDI:
+        case OP_SUBI:
+        case OP_EQI:
+            {
+                uint16_t left_reg = _ReadReg(&ip, wide);
+                int8_t value = (int8_t)_ReadU8(&ip);
+                uint16_t ret_reg = _ReadReg(&ip, wide);
+                const char *c_op =
+                    (op == OP_ADDI) ? "+" :
+                    (op == OP_SUBI) ? "-" : "==";
+                fprintf(output, "    r%d = (r%d %s (uint64_t)%d);\n",
+                        ret_reg, left_reg, c_op, value);
+            }
+            break;
+
+        case OP_JNE:
+            {
+                uint16_t left_reg = _ReadReg(&ip, wide);
+                uint16_t right_reg = _ReadReg(&ip, wide);
+                int32_t jump = _ReadOff(&ip, wide);
+                fprintf(output, "    if (r%d != r%d) { goto L%td; }\n",
+                        left_reg, right_reg, (ip + jump) - code->code);
+            }
+            break;
+
+        case OP_JNEI:
+            {
+                uint16_t left_reg = _ReadReg(&ip, wide);
+                int8_t value = (int8_t)_ReadU8(&ip);
+                int32_t jump = _ReadOff(&ip, wide);
+                fprintf(output,
+                        "    if (r%d != (uint64_t)%d) { goto L%td; }\n",
+                        left_reg, value, (ip + jump) - code->code);
+            }
+            break;
+
+        case OP_NEW_CLOSURE_I:
+            {
+                uint16_t func_id = _ReadU16(&ip);
+                uint16_t dst_reg = _ReadReg(&ip, wide);
+                fprintf(output, "    r%d = _NewClosure(%u);\n",
+                        dst_reg, func_id);
+            }
+            break;
+
+        default:
+            fprintf(stderr, "ERROR: cannot emit C for instruction %d\n", op);
+            ok = false;
+            break;
+        }
+    }
+
+    if (ok && targets[code->code_length]) {
+        // A jump to the very end falls off the function, which the VM would
+        // do too; make it at least compile.
+        fprintf(output, "L%zu:\n", code->code_length);
+        fprintf(output, "    return r%d;\n", code->result_register);
+    }
+    fprintf(output, "}\n\n");
+
+    free(targets);
+    return ok;
+}
+
+// _EmitPrintValue writes C statements that print `value` (a C expression) as
+// FormatValue would print a value of this type. `depth` is how many tuples
+// this is inside of, to keep the names of their locals apart.
+static void _EmitPrintValue(FILE *output, struct MString *value,
+                            struct TypeStore *store, TypeId type_id,
+                            int depth)
+{
+    struct TypeExp *type = ResolveType(store, type_id);
+    switch(type->type) {
+    case TYPEEXP_BOOL:
+        fprintf(output, "    fputs((%s) ? \"true\" : \"false\", stdout);\n",
+                MStringData(value));
+        break;
+
+    case TYPEEXP_INT:
+        fprintf(output, "    printf(\"%%lld\", (long long)(%s));\n",
+                MStringData(value));
+        break;
+
+    case TYPEEXP_FUNC:
+        fprintf(output, "    fputs(\"A FUNCTION\", stdout);\n");
+        break;
+
+    case TYPEEXP_TUPLE:
+        {
+            // Whether the tuple is packed is up to whoever made it (see
+            // TUPLE_PACKED), so each member is read both ways.
+            fprintf(output, "    {\n");
+            fprintf(output, "    uint64_t *_t%d = (uint64_t *)(%s);\n",
+                    depth, MStringData(value));
+            fprintf(output, "    bool _p%d = TupleIsPacked(_t%d);\n",
+                    depth, depth);
+            fprintf(output, "    fputs(\"(\", stdout);\n");
+
+            // (If the layout is unknown, the tuple can't be packed, and so
+            // the first half of the ?: never happens.)
+            size_t *offsets = calloc(
+                TupleTypeLength(store, type_id),
+                sizeof(size_t)
+            );
+            PackedTupleLayout(store, type_id, offsets);
+            int i = 0;
+            while(true) {
+                struct MString *member;
+                if (PackedMemberSize(store, type->tuple_first) == 1) {
+                    member = MStringPrintF(
+                        "(_p%d ? ((uint8_t *)_t%d)[%zu] : _t%d[%d])",
+                        depth, depth, offsets[i], depth, i
+                    );
+                } else {
+                    member = MStringPrintF(
+                        "(_p%d ? _t%d[%zu] : _t%d[%d])",
+                        depth, depth, offsets[i] / sizeof(uint64_t), depth, i
+                    );
+                }
+                _EmitPrintValue(
+                    output,
+                    member,
+                    store,
+                    type->tuple_first,
+                    depth + 1
+                );
+                MStringFree(&member);
+
+                if (type->type == TYPEEXP_TUPLE_FINAL) { break; }
+                fprintf(output, "    fputs(\", \", stdout);\n");
+                type = TypeAt(store, type->tuple_rest);
+                i += 1;
+            }
+            fprintf(output, "    fputs(\")\", stdout);\n");
+            fprintf(output, "    }\n");
+            free(offsets);
+        }
+        break;
+
+    case TYPEEXP_TUPLE_FINAL:
+    case TYPEEXP_VARIABLE:
+    case TYPEEXP_GENERIC_VARIABLE:
+    case TYPEEXP_INVALID:
+    case TYPEEXP_ERROR:
+        fprintf(output, "    fputs(\"<<Invalid>>\", stdout);\n");
+        break;
+    }
+}
+
+bool EmitC(FILE *output, struct Module *module, int func_id,
+           struct TypeStore *store, TypeId type, size_t stack_size,
+           size_t heap_limit)
+{
+    fprintf(output, "// Generated by millie --emit-c; see rt.c for how to build it.\n");
+    fprintf(output, "%s", _emit_prologue);
+
+    for (int i = 0; i < module->function_count; i++) {
+        _EmitSignature(output, &(module->functions[i]), i);
+        fprintf(output, ";\n");
+    }
+    fprintf(output, "\n");
+
+    // (The uncurried entries are cast back to their own type to be called;
+    // see _EmitUncurriedCall. Going by way of void (*)(void) is how to say
+    // that's on purpose.)
+    fprintf(output, "__attribute__((unused))\n");
+    fprintf(output, "static const CompiledFunction _functions[] = {\n");
+    for (int i = 0; i < module->function_count; i++) {
+        if (module->functions[i].arity == 1) {
+            fprintf(output, "    _f%d,\n", i);
+        } else {
+            fprintf(output, "    (CompiledFunction)(void (*)(void))_f%d,\n", i);
+        }
+    }
+    fprintf(output, "};\n\n");
+
+    fprintf(output, "__attribute__((unused))\n");
+    fprintf(output, "static const int _uncurried_ids[] = {\n");
+    for (int i = 0; i < module->function_count; i++) {
+        fprintf(output, "    %d,\n", module->functions[i].uncurried_id);
+    }
+    fprintf(output, "};\n\n");
+
+    // Functions that don't close over anything share one closure object,
+    // which is just the function ID; see CompiledExpression.
+    fprintf(output, "static const size_t _closure_lengths[] = {\n");
+    for (int i = 0; i < module->function_count; i++) {
+        fprintf(output, "    %zu,\n", module->functions[i].closure_length);
+    }
+    fprintf(output, "};\n\n");
+
+    fprintf(output, "static uint64_t _static_closures[] = {\n");
+    for (int i = 0; i < module->function_count; i++) {
+        fprintf(output, "    %d,\n", i);
+    }
+    fprintf(output, "};\n\n");
+
+    fprintf(output,
+            "__attribute__((unused))\n"
+            "static uint64_t _NewClosure(uint64_t func_id)\n"
+            "{\n"
+            "    if (_closure_lengths[func_id] == 0) {\n"
+            "        return (uint64_t)&(_static_closures[func_id]);\n"
+            "    }\n"
+            "    return CompiledNewClosure(func_id, _closure_lengths[func_id]);\n"
+            "}\n\n");
+
+    for (int i = 0; i < module->function_count; i++) {
+        if (!_EmitFunction(output, module, i)) {
+            return false;
+        }
+    }
+
+    fprintf(output, "static void _PrintResult(uint64_t value)\n");
+    fprintf(output, "{\n");
+    struct MStringStatic st;
+    _EmitPrintValue(
+        output,
+        MStringCreateStatic("value", &st),
+        store,
+        type,
+        0
+    );
+    fprintf(output, "    fputs(\"\\n\", stdout);\n");
+    fprintf(output, "}\n\n");
+
+    fprintf(output, "int main(void)\n");
+    fprintf(output, "{\n");
+    fprintf(output,
+            "    bool ok = RunCompiledProgram(_f%d, %zu, %zu, _PrintResult);\n",
+            func_id, stack_size, heap_limit);
+    fprintf(output, "    return ok ? 0 : 1;\n");
+    fprintf(output, "}\n");
+    return true;
+}
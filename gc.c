@@ -0,0 +1,588 @@
+#ifndef PLATFORM_INCLUDED
+#include "platform.h"
+#endif
+
+/*
+ * The garbage collected heap.
+ *
+ * Every tuple and closure the program makes lives here. The heap is a set of
+ * HEAP_BLOCK_SIZE blocks, and new objects are bump-allocated out of runs of
+ * free space in those blocks. Everything allocated since the last collection
+ * is the nursery.
+ *
+ * The collector is generational, but it doesn't move anything. Instead it
+ * uses "sticky" mark bits: an object that survives a collection stays marked,
+ * and a marked object is old. A minor collection only marks and sweeps the
+ * nursery, never looking inside old objects, and a major collection clears
+ * every mark bit and does the whole heap.
+ *
+ * Skipping old objects is only safe because an old object can never point at
+ * a young one. That holds because millie objects are immutable: the compiler
+ * only ever writes into an object with the instructions that immediately
+ * follow its allocation, and nothing can allocate (and so nothing can
+ * collect) in between. So there's no write barrier and no remembered set.
+ *
+ * Objects don't move because millie values aren't tagged: a word in a
+ * register might be a pointer or might be an integer that looks like one,
+ * and we can't go changing integers. Instead, every candidate word is checked
+ * against the heap exactly, through a bitmap of where objects start, and
+ * anything that is an object is kept alive.
+ *
+ * In memory, an object is a header word holding the number of slots,
+ * followed by the slots. Pointers to objects point at the first slot, so the
+ * header is at ptr[-1]. The number of slots is only the low half of the
+ * header; the high half is for whoever made the object (see TUPLE_PACKED).
+ */
+
+#define _HEADER_SLOTS(header) ((size_t)((header) & UINT32_MAX))
+
+#define HEAP_BLOCK_SHIFT (18)
+#define HEAP_BLOCK_SIZE (1 << HEAP_BLOCK_SHIFT)
+#define HEAP_BLOCK_WORDS (HEAP_BLOCK_SIZE / sizeof(uint64_t))
+#define HEAP_BITMAP_WORDS (HEAP_BLOCK_WORDS / 64)
+
+// How much we allocate before doing a minor collection.
+#define NURSERY_SIZE (2 * 1024 * 1024)
+
+// The smallest the old generation can be before we do a major collection.
+#define MIN_MAJOR_THRESHOLD (16 * 1024 * 1024)
+
+// How many empty blocks we hold onto after a major collection.
+#define SPARE_BLOCKS (NURSERY_SIZE / HEAP_BLOCK_SIZE)
+
+// Free runs smaller than this many words aren't worth allocating out of;
+// they wait for a major collection to merge them with their neighbours.
+#define MIN_RUN_WORDS (4)
+
+struct HeapBlock {
+    uint64_t *memory;
+    uint64_t starts[HEAP_BITMAP_WORDS]; // Bit set for each object header.
+    uint64_t marks[HEAP_BITMAP_WORDS];  // Bit set for each live object header.
+};
+
+struct HeapRun {
+    struct HeapBlock *block;
+    uint64_t *start;
+    uint64_t *end;
+};
+
+struct Heap {
+    // Sorted by address, so that we can find the block for a pointer.
+    struct HeapBlock **blocks;
+    size_t block_count;
+    size_t block_capacity;
+
+    // The run we're currently bump-allocating out of, and where in it the
+    // nursery starts.
+    struct HeapBlock *alloc_block;
+    uint64_t *alloc_ptr;
+    uint64_t *alloc_limit;
+    uint64_t *nursery_start;
+
+    // Free runs that we haven't started allocating out of yet.
+    struct HeapRun *runs;
+    size_t run_cursor;
+    size_t run_count;
+    size_t run_capacity;
+
+    // Runs that we've allocated the nursery into since the last collection.
+    struct HeapRun *nursery;
+    size_t nursery_count;
+    size_t nursery_capacity;
+
+    uint64_t **mark_stack;
+    size_t mark_top;
+    size_t mark_capacity;
+
+    size_t nursery_bytes;
+    size_t old_bytes;
+    size_t major_threshold;
+    size_t heap_limit;
+
+    HeapRootScanner scan_roots;
+    void *root_context;
+
+    struct HeapStats stats;
+};
+
+static void _AddRun(struct HeapRun **runs, size_t *count, size_t *capacity,
+                    struct HeapBlock *block, uint64_t *start, uint64_t *end)
+{
+    if (*count == *capacity) {
+        *capacity = (*capacity == 0) ? 64 : *capacity * 2;
+        *runs = realloc(*runs, *capacity * sizeof(struct HeapRun));
+    }
+    (*runs)[*count].block = block;
+    (*runs)[*count].start = start;
+    (*runs)[*count].end = end;
+    *count += 1;
+}
+
+static bool _TestBit(uint64_t *bitmap, size_t index)
+{
+    return (bitmap[index / 64] >> (index % 64)) & 1;
+}
+
+static void _SetBit(uint64_t *bitmap, size_t index)
+{
+    bitmap[index / 64] |= ((uint64_t)1) << (index % 64);
+}
+
+static void _ClearBit(uint64_t *bitmap, size_t index)
+{
+    bitmap[index / 64] &= ~(((uint64_t)1) << (index % 64));
+}
+
+// _NextSetBit returns the index of the first set bit at or after `index`, or
+// HEAP_BLOCK_WORDS if there isn't one.
+static size_t _NextSetBit(uint64_t *bitmap, size_t index)
+{
+    size_t word = index / 64;
+    if (word >= HEAP_BITMAP_WORDS) { return HEAP_BLOCK_WORDS; }
+
+    uint64_t bits = bitmap[word] & (~((uint64_t)0) << (index % 64));
+    while (bits == 0) {
+        word++;
+        if (word == HEAP_BITMAP_WORDS) { return HEAP_BLOCK_WORDS; }
+        bits = bitmap[word];
+    }
+    return (word * 64) + (size_t)__builtin_ctzll(bits);
+}
+
+static size_t _WordIndex(struct HeapBlock *block, uint64_t *ptr)
+{
+    return (size_t)(ptr - block->memory);
+}
+
+// ----------------------------------------------------------------------------
+// Blocks
+// ----------------------------------------------------------------------------
+
+static size_t _FindBlockIndex(struct Heap *heap, uintptr_t base)
+{
+    size_t min = 0;
+    size_t max = heap->block_count;
+    while (min < max) {
+        size_t mid = (min + max) / 2;
+        uintptr_t mid_base = (uintptr_t)heap->blocks[mid]->memory;
+        if (mid_base < base) {
+            min = mid + 1;
+        } else {
+            max = mid;
+        }
+    }
+    return min;
+}
+
+static struct HeapBlock *_FindBlock(struct Heap *heap, uintptr_t address)
+{
+    uintptr_t base = address & ~((uintptr_t)HEAP_BLOCK_SIZE - 1);
+    size_t index = _FindBlockIndex(heap, base);
+    if (index < heap->block_count &&
+        (uintptr_t)heap->blocks[index]->memory == base) {
+        return heap->blocks[index];
+    }
+    return NULL;
+}
+
+static struct HeapBlock *_NewBlock(struct Heap *heap)
+{
+    if ((heap->block_count + 1) * HEAP_BLOCK_SIZE > heap->heap_limit) {
+        return NULL;
+    }
+
+    struct HeapBlock *block = calloc(1, sizeof(struct HeapBlock));
+    block->memory = aligned_alloc(HEAP_BLOCK_SIZE, HEAP_BLOCK_SIZE);
+    if (!block->memory) {
+        free(block);
+        return NULL;
+    }
+
+    if (heap->block_count == heap->block_capacity) {
+        heap->block_capacity = (heap->block_capacity == 0)
+            ? 16
+            : heap->block_capacity * 2;
+        heap->blocks = realloc(
+            heap->blocks,
+            heap->block_capacity * sizeof(struct HeapBlock *)
+        );
+    }
+
+    size_t index = _FindBlockIndex(heap, (uintptr_t)block->memory);
+    memmove(
+        heap->blocks + index + 1,
+        heap->blocks + index,
+        (heap->block_count - index) * sizeof(struct HeapBlock *)
+    );
+    heap->blocks[index] = block;
+    heap->block_count++;
+
+    size_t heap_bytes = heap->block_count * HEAP_BLOCK_SIZE;
+    heap->stats.heap_bytes = heap_bytes;
+    if (heap_bytes > heap->stats.peak_heap_bytes) {
+        heap->stats.peak_heap_bytes = heap_bytes;
+    }
+    return block;
+}
+
+static void _FreeBlock(struct HeapBlock *block)
+{
+    free(block->memory);
+    free(block);
+}
+
+// ----------------------------------------------------------------------------
+// Marking
+// ----------------------------------------------------------------------------
+
+// _FindObject returns the object that `value` points at, and the block it's
+// in, or NULL if `value` isn't a pointer to an object in the heap.
+static uint64_t *_FindObject(struct Heap *heap, uint64_t value,
+                             struct HeapBlock **block_ptr)
+{
+    if (value & 7) { return NULL; }
+
+    struct HeapBlock *block = _FindBlock(heap, (uintptr_t)value);
+    if (!block) { return NULL; }
+
+    uint64_t *object = (uint64_t *)(uintptr_t)value;
+    if (object == block->memory) { return NULL; } // Can't have a header.
+
+    if (!_TestBit(block->starts, _WordIndex(block, object - 1))) {
+        return NULL;
+    }
+    *block_ptr = block;
+    return object;
+}
+
+static void _MarkValue(struct Heap *heap, uint64_t value)
+{
+    struct HeapBlock *block;
+    uint64_t *object = _FindObject(heap, value, &block);
+    if (!object) { return; }
+
+    size_t index = _WordIndex(block, object - 1);
+    if (_TestBit(block->marks, index)) { return; }
+    _SetBit(block->marks, index);
+
+    if (heap->mark_top == heap->mark_capacity) {
+        heap->mark_capacity = (heap->mark_capacity == 0)
+            ? 256
+            : heap->mark_capacity * 2;
+        heap->mark_stack = realloc(
+            heap->mark_stack,
+            heap->mark_capacity * sizeof(uint64_t *)
+        );
+    }
+    heap->mark_stack[heap->mark_top++] = object;
+}
+
+void HeapMarkRange(struct Heap *heap, uint64_t *start, uint64_t *end)
+{
+    for (uint64_t *ptr = start; ptr < end; ptr++) {
+        _MarkValue(heap, *ptr);
+    }
+}
+
+static void _DrainMarkStack(struct Heap *heap)
+{
+    while (heap->mark_top > 0) {
+        uint64_t *object = heap->mark_stack[--heap->mark_top];
+        HeapMarkRange(heap, object, object + _HEADER_SLOTS(object[-1]));
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Sweeping
+// ----------------------------------------------------------------------------
+
+// _SweepBlock frees every unmarked object in the block, and adds the free
+// space to the list of runs. Returns the number of bytes still in use.
+static size_t _SweepBlock(struct Heap *heap, struct HeapBlock *block)
+{
+    size_t live_bytes = 0;
+    for (size_t i = 0; i < HEAP_BITMAP_WORDS; i++) {
+        block->starts[i] &= block->marks[i];
+    }
+
+    size_t index = 0;
+    while (index < HEAP_BLOCK_WORDS) {
+        size_t next = _NextSetBit(block->starts, index);
+        if (next - index >= MIN_RUN_WORDS) {
+            _AddRun(
+                &heap->runs, &heap->run_count, &heap->run_capacity,
+                block, block->memory + index, block->memory + next
+            );
+        }
+        if (next == HEAP_BLOCK_WORDS) { break; }
+
+        size_t words = _HEADER_SLOTS(block->memory[next]) + 1;
+        live_bytes += words * sizeof(uint64_t);
+        index = next + words;
+    }
+    return live_bytes;
+}
+
+// _SweepNurseryRun frees every unmarked object allocated into the given run,
+// which is packed solid with objects. Returns the number of bytes that
+// survived.
+static size_t _SweepNurseryRun(struct Heap *heap, struct HeapRun *run)
+{
+    struct HeapBlock *block = run->block;
+    size_t survivor_bytes = 0;
+    uint64_t *dead_start = NULL;
+
+    uint64_t *ptr = run->start;
+    while (ptr < run->end) {
+        size_t words = _HEADER_SLOTS(*ptr) + 1;
+        size_t index = _WordIndex(block, ptr);
+        if (_TestBit(block->marks, index)) {
+            survivor_bytes += words * sizeof(uint64_t);
+            if (dead_start && ptr - dead_start >= MIN_RUN_WORDS) {
+                _AddRun(
+                    &heap->runs, &heap->run_count, &heap->run_capacity,
+                    block, dead_start, ptr
+                );
+            }
+            dead_start = NULL;
+        } else {
+            _ClearBit(block->starts, index);
+            if (!dead_start) { dead_start = ptr; }
+        }
+        ptr += words;
+    }
+
+    if (dead_start) {
+        if (run->end == heap->alloc_ptr) {
+            // This dead space runs right up to where we're allocating, so
+            // just back up and allocate over it again.
+            heap->alloc_ptr = dead_start;
+        } else if (run->end - dead_start >= MIN_RUN_WORDS) {
+            _AddRun(
+                &heap->runs, &heap->run_count, &heap->run_capacity,
+                block, dead_start, run->end
+            );
+        }
+    }
+    return survivor_bytes;
+}
+
+// ----------------------------------------------------------------------------
+// Collection
+// ----------------------------------------------------------------------------
+
+static void _CloseNurseryRun(struct Heap *heap)
+{
+    if (heap->alloc_ptr > heap->nursery_start) {
+        _AddRun(
+            &heap->nursery, &heap->nursery_count, &heap->nursery_capacity,
+            heap->alloc_block, heap->nursery_start, heap->alloc_ptr
+        );
+    }
+    heap->nursery_start = heap->alloc_ptr;
+}
+
+static void _MarkRoots(struct Heap *heap)
+{
+    if (heap->scan_roots) {
+        heap->scan_roots(heap, heap->root_context);
+    }
+    _DrainMarkStack(heap);
+}
+
+static void _MinorCollection(struct Heap *heap)
+{
+    _CloseNurseryRun(heap);
+    _MarkRoots(heap);
+
+    // Keep the runs we haven't got to yet, and add the nursery's free space
+    // after them. (There may be no runs at all yet, and then no array.)
+    if (heap->run_count > heap->run_cursor) {
+        memmove(
+            heap->runs,
+            heap->runs + heap->run_cursor,
+            (heap->run_count - heap->run_cursor) * sizeof(struct HeapRun)
+        );
+    }
+    heap->run_count -= heap->run_cursor;
+    heap->run_cursor = 0;
+
+    size_t survivor_bytes = 0;
+    for (size_t i = 0; i < heap->nursery_count; i++) {
+        survivor_bytes += _SweepNurseryRun(heap, &(heap->nursery[i]));
+    }
+    heap->nursery_count = 0;
+    heap->nursery_start = heap->alloc_ptr;
+
+    heap->old_bytes += survivor_bytes;
+    heap->stats.promoted_bytes += survivor_bytes;
+    heap->stats.live_bytes = heap->old_bytes;
+    heap->stats.minor_collections++;
+}
+
+static void _MajorCollection(struct Heap *heap)
+{
+    _CloseNurseryRun(heap);
+    for (size_t i = 0; i < heap->block_count; i++) {
+        memset(heap->blocks[i]->marks, 0, sizeof(heap->blocks[i]->marks));
+    }
+    _MarkRoots(heap);
+
+    heap->run_count = 0;
+    heap->run_cursor = 0;
+    heap->nursery_count = 0;
+    heap->alloc_block = NULL;
+    heap->alloc_ptr = heap->alloc_limit = heap->nursery_start = NULL;
+
+    size_t live_bytes = 0;
+    size_t spare_blocks = 0;
+    size_t kept = 0;
+    for (size_t i = 0; i < heap->block_count; i++) {
+        struct HeapBlock *block = heap->blocks[i];
+        size_t first_run = heap->run_count;
+        size_t block_live = _SweepBlock(heap, block);
+        if (block_live == 0) {
+            if (spare_blocks == SPARE_BLOCKS) {
+                heap->run_count = first_run;
+                _FreeBlock(block);
+                continue;
+            }
+            spare_blocks++;
+        }
+        live_bytes += block_live;
+        heap->blocks[kept++] = block;
+    }
+    heap->block_count = kept;
+
+    heap->old_bytes = live_bytes;
+    heap->major_threshold = live_bytes * 2;
+    if (heap->major_threshold < MIN_MAJOR_THRESHOLD) {
+        heap->major_threshold = MIN_MAJOR_THRESHOLD;
+    }
+
+    heap->stats.heap_bytes = heap->block_count * HEAP_BLOCK_SIZE;
+    heap->stats.live_bytes = live_bytes;
+    heap->stats.major_collections++;
+}
+
+void HeapCollect(struct Heap *heap, bool major)
+{
+    if (major) {
+        _MajorCollection(heap);
+    } else {
+        _MinorCollection(heap);
+        if (heap->old_bytes > heap->major_threshold) {
+            _MajorCollection(heap);
+        }
+    }
+    heap->nursery_bytes = 0;
+}
+
+// ----------------------------------------------------------------------------
+// Allocation
+// ----------------------------------------------------------------------------
+
+// _NextRun moves allocation to a free run with room for at least `words`
+// words, collecting or growing the heap if it has to.
+static bool _NextRun(struct Heap *heap, size_t words)
+{
+    _CloseNurseryRun(heap);
+
+    bool collected = false;
+    for (;;) {
+        while (heap->run_cursor < heap->run_count) {
+            struct HeapRun *run = &(heap->runs[heap->run_cursor++]);
+            if ((size_t)(run->end - run->start) >= words) {
+                heap->alloc_block = run->block;
+                heap->alloc_ptr = heap->nursery_start = run->start;
+                heap->alloc_limit = run->end;
+                return true;
+            }
+        }
+
+        struct HeapBlock *block = _NewBlock(heap);
+        if (block) {
+            heap->alloc_block = block;
+            heap->alloc_ptr = heap->nursery_start = block->memory;
+            heap->alloc_limit = block->memory + HEAP_BLOCK_WORDS;
+            return true;
+        }
+
+        if (collected) {
+            fprintf(stderr, "ERROR: out of memory\n");
+            return false;
+        }
+        HeapCollect(heap, true);
+        collected = true;
+    }
+}
+
+uint64_t *HeapAllocate(struct Heap *heap, size_t slot_count)
+{
+    size_t words = slot_count + 1;
+    if (words > HEAP_BLOCK_WORDS) {
+        fprintf(stderr, "ERROR: object of %zu slots is too big\n", slot_count);
+        return NULL;
+    }
+
+    if (heap->nursery_bytes >= NURSERY_SIZE) {
+        HeapCollect(heap, false);
+    }
+
+    if ((size_t)(heap->alloc_limit - heap->alloc_ptr) < words) {
+        if (!_NextRun(heap, words)) {
+            return NULL;
+        }
+    }
+
+    uint64_t *header = heap->alloc_ptr;
+    heap->alloc_ptr += words;
+    *header = slot_count;
+    _SetBit(heap->alloc_block->starts, _WordIndex(heap->alloc_block, header));
+
+    size_t bytes = words * sizeof(uint64_t);
+    heap->nursery_bytes += bytes;
+    heap->stats.allocated_bytes += bytes;
+    heap->stats.allocated_objects++;
+    return header + 1;
+}
+
+// ----------------------------------------------------------------------------
+// The Heap
+// ----------------------------------------------------------------------------
+
+struct Heap *HeapCreate(size_t heap_limit)
+{
+    struct Heap *heap = calloc(1, sizeof(struct Heap));
+    heap->heap_limit = heap_limit;
+    heap->major_threshold = MIN_MAJOR_THRESHOLD;
+    return heap;
+}
+
+void HeapFree(struct Heap **heap_ptr)
+{
+    struct Heap *heap = *heap_ptr;
+    *heap_ptr = NULL;
+
+    if (!heap) { return; }
+    for (size_t i = 0; i < heap->block_count; i++) {
+        _FreeBlock(heap->blocks[i]);
+    }
+    free(heap->blocks);
+    free(heap->runs);
+    free(heap->nursery);
+    free(heap->mark_stack);
+    free(heap);
+}
+
+void HeapSetRootScanner(struct Heap *heap, HeapRootScanner scanner,
+                        void *context)
+{
+    heap->scan_roots = scanner;
+    heap->root_context = context;
+}
+
+struct HeapStats HeapGetStats(struct Heap *heap)
+{
+    return heap->stats;
+}
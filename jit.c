@@ -0,0 +1,512 @@
+#ifndef PLATFORM_INCLUDED
+#include "platform.h"
+#endif
+
+/*
+ * A template JIT for x86-64.
+ *
+ * JitCompile translates a function's bytecode into machine code, one fixed
+ * template per instruction, in memory that we mmap and then make executable.
+ * The machine code works directly on the function's register window in the
+ * VM stack (the address of which lives in rbx), so it never needs to move
+ * values in or out, and the collector finds them exactly where it always
+ * does.
+ *
+ * Only the simple instructions get templates: loads, stores, arithmetic,
+ * moves and jumps (including the superinstructions that combine them). Anything else-- calls, returns and allocations-- leaves the
+ * machine code and hands the instruction back to the interpreter, which runs
+ * it and then comes back in wherever it ends up. That's what lets the JIT and
+ * the interpreter call each other freely: calls always go through the VM's
+ * frame stack, and JitRun can start a function's machine code at any
+ * instruction, since there's a machine code address recorded for each one.
+ *
+ * JitRun returns the bytecode address of the instruction that the
+ * interpreter needs to run next.
+ */
+
+struct JitCode {
+    uint8_t *memory;
+    size_t memory_size;
+
+    // The machine code address for each instruction, by bytecode offset.
+    uint32_t *native_offsets;
+};
+
+#if defined(__x86_64__)
+
+const bool JitAvailable = true;
+
+typedef const uint8_t *(*JitEntry)(uint64_t *registers, const uint8_t *target);
+
+struct _JitPatch {
+    size_t site;          // Where the rel32 goes in the machine code.
+    size_t target_offset; // The bytecode offset it jumps to.
+};
+
+struct _JitBuffer {
+    uint8_t *code;
+    size_t length;
+    size_t capacity;
+
+    struct _JitPatch *patches;
+    size_t patch_count;
+    size_t patch_capacity;
+};
+
+static void _JitByte(struct _JitBuffer *buffer, uint8_t byte)
+{
+    if (buffer->length == buffer->capacity) {
+        buffer->capacity = (buffer->capacity == 0) ? 256 : buffer->capacity * 2;
+        buffer->code = realloc(buffer->code, buffer->capacity);
+    }
+    buffer->code[buffer->length++] = byte;
+}
+
+static void _JitBytes(struct _JitBuffer *buffer, int count, ...)
+{
+    va_list args;
+    va_start(args, count);
+    for (int i = 0; i < count; i++) {
+        _JitByte(buffer, (uint8_t)va_arg(args, int));
+    }
+    va_end(args);
+}
+
+static void _JitU32(struct _JitBuffer *buffer, uint32_t value)
+{
+    for (int i = 0; i < 4; i++) {
+        _JitByte(buffer, (uint8_t)(value >> (8 * i)));
+    }
+}
+
+static void _JitU64(struct _JitBuffer *buffer, uint64_t value)
+{
+    for (int i = 0; i < 8; i++) {
+        _JitByte(buffer, (uint8_t)(value >> (8 * i)));
+    }
+}
+
+// The registers we use. (The numbers are what goes in the ModRM byte.)
+#define RAX (0)
+#define RCX (1)
+#define RBX (3)
+
+// _JitMemOp writes `REX.W opcode ModRM disp32`, for an instruction between
+// `reg` and the memory at [base + disp].
+static void _JitMemOp(struct _JitBuffer *buffer, uint8_t opcode, int reg,
+                      int base, int32_t disp)
+{
+    _JitByte(buffer, 0x48);
+    _JitByte(buffer, opcode);
+    _JitByte(buffer, 0x80 | (reg << 3) | base);
+    _JitU32(buffer, (uint32_t)disp);
+}
+
+#define _REG(r) ((int32_t)(r) * 8)
+
+// mov reg, [rbx + 8 * vm_reg]
+static void _JitLoad(struct _JitBuffer *buffer, int reg, uint8_t vm_reg)
+{
+    _JitMemOp(buffer, 0x8B, reg, RBX, _REG(vm_reg));
+}
+
+// mov [rbx + 8 * vm_reg], reg
+static void _JitStore(struct _JitBuffer *buffer, int reg, uint8_t vm_reg)
+{
+    _JitMemOp(buffer, 0x89, reg, RBX, _REG(vm_reg));
+}
+
+// jmp/jcc rel32 to the given bytecode offset, patched once everything is
+// laid out.
+static void _JitJump(struct _JitBuffer *buffer, size_t target_offset)
+{
+    if (buffer->patch_count == buffer->patch_capacity) {
+        buffer->patch_capacity =
+            (buffer->patch_capacity == 0) ? 16 : buffer->patch_capacity * 2;
+        buffer->patches = realloc(
+            buffer->patches,
+            buffer->patch_capacity * sizeof(struct _JitPatch)
+        );
+    }
+    buffer->patches[buffer->patch_count].site = buffer->length;
+    buffer->patches[buffer->patch_count].target_offset = target_offset;
+    buffer->patch_count++;
+    _JitU32(buffer, 0);
+}
+
+// Leave the machine code, telling the interpreter to pick up at `ip`.
+static void _JitExit(struct _JitBuffer *buffer, const uint8_t *ip)
+{
+    _JitBytes(buffer, 2, 0x48, 0xB8);     // movabs rax, ip
+    _JitU64(buffer, (uint64_t)(uintptr_t)ip);
+    _JitBytes(buffer, 2, 0x5B, 0xC3);     // pop rbx; ret
+}
+
+// _JitInstruction writes the template for the instruction at ip, and returns
+// the address of the next one.
+static const uint8_t *_JitInstruction(struct _JitBuffer *buffer,
+                                      struct CompiledExpression *code,
+                                      const uint8_t *ip)
+{
+    const uint8_t *start = ip;
+    MILLIE_OPCODE op = *(ip++);
+    switch(op) {
+    case OP_LOADI_8:
+    case OP_LOADI_16:
+    case OP_LOADI_32:
+    case OP_LOADI_64:
+        {
+            uint64_t val =
+                (op == OP_LOADI_8)  ? _ReadU8(&ip) :
+                (op == OP_LOADI_16) ? _ReadU16(&ip) :
+                (op == OP_LOADI_32) ? _ReadU32(&ip) : _ReadU64(&ip);
+            uint8_t reg = _ReadU8(&ip);
+            _JitBytes(buffer, 2, 0x48, 0xB8);           // movabs rax, val
+            _JitU64(buffer, val);
+            _JitStore(buffer, RAX, reg);
+        }
+        break;
+
+    case OP_LOADA_64:
+        {
+            uint8_t src_reg = _ReadU8(&ip);
+            int16_t offset = (int16_t)_ReadU16(&ip);
+            uint8_t dst_reg = _ReadU8(&ip);
+            _JitLoad(buffer, RAX, src_reg);
+            _JitMemOp(buffer, 0x8B, RAX, RAX, offset * 8); // mov rax, [rax+d]
+            _JitStore(buffer, RAX, dst_reg);
+        }
+        break;
+
+    case OP_STOREA_64:
+        {
+            uint8_t src_reg = _ReadU8(&ip);
+            int16_t offset = (int16_t)_ReadU16(&ip);
+            uint8_t val_reg = _ReadU8(&ip);
+            _JitLoad(buffer, RAX, src_reg);
+            _JitLoad(buffer, RCX, val_reg);
+            _JitMemOp(buffer, 0x89, RCX, RAX, offset * 8); // mov [rax+d], rcx
+        }
+        break;
+
+    case OP_LOADA_8:
+    case OP_LOADA_16:
+    case OP_LOADA_32:
+        {
+            uint8_t src_reg = _ReadU8(&ip);
+            int16_t offset = (int16_t)_ReadU16(&ip);
+            uint8_t dst_reg = _ReadU8(&ip);
+            _JitLoad(buffer, RAX, src_reg);
+            // movzx eax, byte/word [rax+d], or mov eax, [rax+d]; either way
+            // the top of rax is cleared.
+            if (op == OP_LOADA_8) {
+                _JitBytes(buffer, 2, 0x0F, 0xB6);
+            } else if (op == OP_LOADA_16) {
+                _JitBytes(buffer, 2, 0x0F, 0xB7);
+                offset *= 2;
+            } else {
+                _JitByte(buffer, 0x8B);
+                offset *= 4;
+            }
+            _JitByte(buffer, 0x80 | (RAX << 3) | RAX);
+            _JitU32(buffer, (uint32_t)(int32_t)offset);
+            _JitStore(buffer, RAX, dst_reg);
+        }
+        break;
+
+    case OP_STOREA_8:
+    case OP_STOREA_16:
+    case OP_STOREA_32:
+        {
+            uint8_t src_reg = _ReadU8(&ip);
+            int16_t offset = (int16_t)_ReadU16(&ip);
+            uint8_t val_reg = _ReadU8(&ip);
+            _JitLoad(buffer, RAX, src_reg);
+            _JitLoad(buffer, RCX, val_reg);
+            // mov [rax+d], cl/cx/ecx
+            if (op == OP_STOREA_8) {
+                _JitByte(buffer, 0x88);
+            } else if (op == OP_STOREA_16) {
+                _JitBytes(buffer, 2, 0x66, 0x89);
+                offset *= 2;
+            } else {
+                _JitByte(buffer, 0x89);
+                offset *= 4;
+            }
+            _JitByte(buffer, 0x80 | (RCX << 3) | RAX);
+            _JitU32(buffer, (uint32_t)(int32_t)offset);
+        }
+        break;
+
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+        {
+            uint8_t left_reg = _ReadU8(&ip);
+            uint8_t right_reg = _ReadU8(&ip);
+            uint8_t ret_reg = _ReadU8(&ip);
+            _JitLoad(buffer, RAX, left_reg);
+            if (op == OP_ADD) {
+                _JitMemOp(buffer, 0x03, RAX, RBX, _REG(right_reg));
+            } else if (op == OP_SUB) {
+                _JitMemOp(buffer, 0x2B, RAX, RBX, _REG(right_reg));
+            } else {
+                // imul rax, [rbx + d] is two opcode bytes.
+                _JitBytes(buffer, 4, 0x48, 0x0F, 0xAF, 0x83);
+                _JitU32(buffer, (uint32_t)_REG(right_reg));
+            }
+            _JitStore(buffer, RAX, ret_reg);
+        }
+        break;
+
+    case OP_NEG:
+        {
+            uint8_t arg_reg = _ReadU8(&ip);
+            uint8_t ret_reg = _ReadU8(&ip);
+            _JitLoad(buffer, RAX, arg_reg);
+            _JitBytes(buffer, 3, 0x48, 0xF7, 0xD8);     // neg rax
+            _JitStore(buffer, RAX, ret_reg);
+        }
+        break;
+
+    case OP_EQ:
+        {
+            uint8_t left_reg = _ReadU8(&ip);
+            uint8_t right_reg = _ReadU8(&ip);
+            uint8_t ret_reg = _ReadU8(&ip);
+            _JitLoad(buffer, RAX, left_reg);
+            _JitBytes(buffer, 2, 0x31, 0xC9);           // xor ecx, ecx
+            _JitMemOp(buffer, 0x3B, RAX, RBX, _REG(right_reg)); // cmp
+            _JitBytes(buffer, 3, 0x0F, 0x94, 0xC1);     // sete cl
+            _JitStore(buffer, RCX, ret_reg);
+        }
+        break;
+
+    case OP_MOV:
+        {
+            uint8_t src_reg = _ReadU8(&ip);
+            uint8_t dst_reg = _ReadU8(&ip);
+            _JitLoad(buffer, RAX, src_reg);
+            _JitStore(buffer, RAX, dst_reg);
+        }
+        break;
+
+    case OP_JMP:
+        {
+            int16_t offset = (int16_t)_ReadU16(&ip);
+            _JitByte(buffer, 0xE9);                     // jmp rel32
+            _JitJump(buffer, (ip + offset) - code->code);
+        }
+        break;
+
+    case OP_JZ:
+        {
+            uint8_t test_reg = _ReadU8(&ip);
+            int16_t offset = (int16_t)_ReadU16(&ip);
+            // cmp qword [rbx + d], 0
+            _JitBytes(buffer, 3, 0x48, 0x83, 0xBB);
+            _JitU32(buffer, (uint32_t)_REG(test_reg));
+            _JitByte(buffer, 0x00);
+            _JitBytes(buffer, 2, 0x0F, 0x84);           // je rel32
+            _JitJump(buffer, (ip + offset) - code->code);
+        }
+        break;
+
+    case OP_ADDI:
+    case OP_SUBI:
+        {
+            uint8_t left_reg = _ReadU8(&ip);
+            int8_t value = (int8_t)_ReadU8(&ip);
+            uint8_t ret_reg = _ReadU8(&ip);
+            _JitLoad(buffer, RAX, left_reg);
+            // add/sub rax, imm8 (sign-extended, like the VM)
+            _JitBytes(buffer, 3, 0x48, 0x83, (op == OP_ADDI) ? 0xC0 : 0xE8);
+            _JitByte(buffer, (uint8_t)value);
+            _JitStore(buffer, RAX, ret_reg);
+        }
+        break;
+
+    case OP_EQI:
+        {
+            uint8_t left_reg = _ReadU8(&ip);
+            int8_t value = (int8_t)_ReadU8(&ip);
+            uint8_t ret_reg = _ReadU8(&ip);
+            _JitLoad(buffer, RAX, left_reg);
+            _JitBytes(buffer, 2, 0x31, 0xC9);           // xor ecx, ecx
+            _JitBytes(buffer, 3, 0x48, 0x83, 0xF8);     // cmp rax, imm8
+            _JitByte(buffer, (uint8_t)value);
+            _JitBytes(buffer, 3, 0x0F, 0x94, 0xC1);     // sete cl
+            _JitStore(buffer, RCX, ret_reg);
+        }
+        break;
+
+    case OP_JNE:
+        {
+            uint8_t left_reg = _ReadU8(&ip);
+            uint8_t right_reg = _ReadU8(&ip);
+            int16_t offset = (int16_t)_ReadU16(&ip);
+            _JitLoad(buffer, RAX, left_reg);
+            _JitMemOp(buffer, 0x3B, RAX, RBX, _REG(right_reg)); // cmp
+            _JitBytes(buffer, 2, 0x0F, 0x85);           // jne rel32
+            _JitJump(buffer, (ip + offset) - code->code);
+        }
+        break;
+
+    case OP_JNEI:
+        {
+            uint8_t left_reg = _ReadU8(&ip);
+            int8_t value = (int8_t)_ReadU8(&ip);
+            int16_t offset = (int16_t)_ReadU16(&ip);
+            // cmp qword [rbx + d], imm8
+            _JitBytes(buffer, 3, 0x48, 0x83, 0xBB);
+            _JitU32(buffer, (uint32_t)_REG(left_reg));
+            _JitByte(buffer, (uint8_t)value);
+            _JitBytes(buffer, 2, 0x0F, 0x85);           // jne rel32
+            _JitJump(buffer, (ip + offset) - code->code);
+        }
+        break;
+
+    default:
+        // Everything else is up to the interpreter, including anything
+        // after a WIDE prefix. We don't need to know how long the
+        // instruction is, since the interpreter will never come back in
+        // until it's done with it.
+        _JitExit(buffer, start);
+        return NULL;
+    }
+    return ip;
+}
+
+bool JitCompile(struct CompiledExpression *code)
+{
+    struct _JitBuffer buffer;
+    memset(&buffer, 0, sizeof(buffer));
+
+    uint32_t *native_offsets = calloc(code->code_length + 1, sizeof(uint32_t));
+
+    // The entry point, which every JitRun goes through:
+    //
+    //     push rbx
+    //     mov rbx, rdi   ; the registers
+    //     jmp rsi        ; the instruction to start at
+    //
+    _JitBytes(&buffer, 7, 0x53, 0x48, 0x89, 0xFB, 0xFF, 0xE6, 0xCC);
+
+    // Every instruction gets its own machine code address, so that we can
+    // come back in anywhere. Instructions the interpreter handles are just an
+    // exit, and then we carry on translating right after them.
+    bool ok = true;
+    const uint8_t *ip = code->code;
+    const uint8_t *end = code->code + code->code_length;
+    while (ip < end) {
+        native_offsets[ip - code->code] = buffer.length;
+        size_t length = _InstructionLength(ip);
+        if (length == 0) {
+            // We can't tell where the next instruction would be.
+            ok = false;
+            break;
+        }
+        const uint8_t *next = _JitInstruction(&buffer, code, ip);
+        if (next == NULL) {
+            next = ip + length;
+        }
+        ip = next;
+    }
+    native_offsets[code->code_length] = buffer.length;
+    _JitExit(&buffer, end);
+
+    for (size_t i = 0; ok && i < buffer.patch_count; i++) {
+        struct _JitPatch *patch = &(buffer.patches[i]);
+        if (patch->target_offset > code->code_length) {
+            ok = false;
+            break;
+        }
+        int32_t rel =
+            (int32_t)native_offsets[patch->target_offset] -
+            (int32_t)(patch->site + 4);
+        memcpy(buffer.code + patch->site, &rel, sizeof(rel));
+    }
+
+    uint8_t *memory = MAP_FAILED;
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t memory_size = (buffer.length + page_size - 1) & ~(page_size - 1);
+    if (ok) {
+        memory = mmap(
+            NULL,
+            memory_size,
+            PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS,
+            -1,
+            0
+        );
+    }
+    if (memory != MAP_FAILED) {
+        memcpy(memory, buffer.code, buffer.length);
+        if (mprotect(memory, memory_size, PROT_READ | PROT_EXEC) != 0) {
+            munmap(memory, memory_size);
+            memory = MAP_FAILED;
+        }
+    }
+
+    free(buffer.code);
+    free(buffer.patches);
+    if (memory == MAP_FAILED) {
+        free(native_offsets);
+        return false;
+    }
+
+    struct JitCode *jit = malloc(sizeof(struct JitCode));
+    jit->memory = memory;
+    jit->memory_size = memory_size;
+    jit->native_offsets = native_offsets;
+    code->jit = jit;
+    return true;
+}
+
+const uint8_t *JitRun(struct CompiledExpression *code,
+                      const uint8_t *ip,
+                      uint64_t *registers)
+{
+    struct JitCode *jit = code->jit;
+    JitEntry entry = (JitEntry)(void *)jit->memory;
+    return entry(registers, jit->memory + jit->native_offsets[ip - code->code]);
+}
+
+void JitFree(struct CompiledExpression *code)
+{
+    struct JitCode *jit = code->jit;
+    code->jit = NULL;
+    if (!jit) { return; }
+
+    munmap(jit->memory, jit->memory_size);
+    free(jit->native_offsets);
+    free(jit);
+}
+
+#else
+
+// There's no JIT for this machine; everything is interpreted.
+
+const bool JitAvailable = false;
+
+bool JitCompile(struct CompiledExpression *code)
+{
+    (void)code;
+    return false;
+}
+
+const uint8_t *JitRun(struct CompiledExpression *code,
+                      const uint8_t *ip,
+                      uint64_t *registers)
+{
+    (void)code;
+    (void)registers;
+    return ip;
+}
+
+void JitFree(struct CompiledExpression *code)
+{
+    code->jit = NULL;
+}
+
+#endif
@@ -2,142 +2,290 @@
 #include "platform.h"
 #endif
 
-struct KeywordToken {
-    const char *str;
-    MILLIE_TOKEN token;
+/*
+ * The lexer is table driven: every byte has a class, in _CharClasses, and the
+ * runs of identifier characters, digits, whitespace and comments are scanned
+ * a vector at a time where there's SSE2 or AVX2. (Build with -DLEXER_SCALAR
+ * to scan a byte at a time everywhere, which is what happens past the last
+ * full vector anyway.) Identifiers and keywords are scanned the same way, and
+ * then the identifier is looked up in a perfect hash of the keywords.
+ */
+#define CHAR_IDENTIFIER_START 0x01
+#define CHAR_IDENTIFIER       0x02
+#define CHAR_DIGIT            0x04
+#define CHAR_SPACE            0x08  // Including newlines.
+
+static const uint8_t _CharClasses[256] = {
+    [' '] = CHAR_SPACE,
+    ['\t'] = CHAR_SPACE,
+    ['\r'] = CHAR_SPACE,
+    ['\n'] = CHAR_SPACE,
+    ['0' ... '9'] = CHAR_IDENTIFIER | CHAR_DIGIT,
+    ['A' ... 'Z'] = CHAR_IDENTIFIER_START | CHAR_IDENTIFIER,
+    ['a' ... 'z'] = CHAR_IDENTIFIER_START | CHAR_IDENTIFIER,
+    ['_'] = CHAR_IDENTIFIER_START | CHAR_IDENTIFIER,
+    ['\''] = CHAR_IDENTIFIER,
+    ['\"'] = CHAR_IDENTIFIER,
 };
 
-static struct MillieTokens *_CreateTokens(struct MString *buffer)
+// The tokens that are always one character. ('=' is handled on its own,
+// since it might be the start of '=>'.)
+static const uint8_t _SingleCharTokens[256] = {
+    ['('] = TOK_LPAREN,
+    [')'] = TOK_RPAREN,
+    ['+'] = TOK_PLUS,
+    ['-'] = TOK_MINUS,
+    ['*'] = TOK_STAR,
+    ['/'] = TOK_SLASH,
+    [','] = TOK_COMMA,
+};
+
+static bool _HasCharClass(char c, uint8_t char_class)
 {
-    struct MillieTokens *result = calloc(1, sizeof(struct MillieTokens));
-    result->token_array = ArrayListCreate(sizeof(struct MillieToken), 200);
-    result->line_array = ArrayListCreate(sizeof(unsigned int), 100);
-    result->buffer = MStringCopy(buffer);
-    return result;
+    return (_CharClasses[(unsigned char)c] & char_class) != 0;
 }
 
-static void _AddToken(struct MillieTokens *tokens, MILLIE_TOKEN type,
-                      unsigned int start, unsigned int length)
-{
-    struct MillieToken token;
-    token.type = type;
-    token.start = start;
-    token.length = length;
+#if !defined(LEXER_SCALAR) && defined(__AVX2__)
+#include <immintrin.h>
+#define LEX_VECTOR_SIZE 32
+#define LEX_VECTOR_ALL  0xFFFFFFFFu
+typedef __m256i LexVector;
 
-    ArrayListAdd(tokens->token_array, &token);
+static inline LexVector _LexLoad(const char *ptr)
+{
+    return _mm256_loadu_si256((const __m256i *)ptr);
 }
-
-static int _IsDigit(char c)
+static inline LexVector _LexSplat(char c) { return _mm256_set1_epi8(c); }
+static inline LexVector _LexOr(LexVector a, LexVector b)
+{
+    return _mm256_or_si256(a, b);
+}
+static inline LexVector _LexSub(LexVector a, LexVector b)
+{
+    return _mm256_sub_epi8(a, b);
+}
+static inline LexVector _LexEq(LexVector a, LexVector b)
+{
+    return _mm256_cmpeq_epi8(a, b);
+}
+static inline LexVector _LexMin(LexVector a, LexVector b)
+{
+    return _mm256_min_epu8(a, b);
+}
+static inline uint32_t _LexMask(LexVector v)
 {
-    return (c >= '0') && (c <= '9');
+    return (uint32_t)_mm256_movemask_epi8(v);
 }
+const char *LexerScanName = "avx2";
 
-static int _IsIdentifierCharacter(char c)
+#elif !defined(LEXER_SCALAR) && defined(__SSE2__)
+#include <emmintrin.h>
+#define LEX_VECTOR_SIZE 16
+#define LEX_VECTOR_ALL  0xFFFFu
+typedef __m128i LexVector;
+
+static inline LexVector _LexLoad(const char *ptr)
+{
+    return _mm_loadu_si128((const __m128i *)ptr);
+}
+static inline LexVector _LexSplat(char c) { return _mm_set1_epi8(c); }
+static inline LexVector _LexOr(LexVector a, LexVector b)
+{
+    return _mm_or_si128(a, b);
+}
+static inline LexVector _LexSub(LexVector a, LexVector b)
+{
+    return _mm_sub_epi8(a, b);
+}
+static inline LexVector _LexEq(LexVector a, LexVector b)
+{
+    return _mm_cmpeq_epi8(a, b);
+}
+static inline LexVector _LexMin(LexVector a, LexVector b)
+{
+    return _mm_min_epu8(a, b);
+}
+static inline uint32_t _LexMask(LexVector v)
 {
-    return
-        ((c >= '0') && (c <= '9')) ||
-        ((c >= 'A') && (c <= 'Z')) ||
-        ((c >= 'a') && (c <= 'z')) ||
-        (c == '_') ||
-        (c == '\'') ||
-        (c == '\"');
+    return (uint32_t)_mm_movemask_epi8(v);
 }
+const char *LexerScanName = "sse2";
 
-static int _IsIdentifierStart(char c)
+#else
+const char *LexerScanName = "scalar";
+#endif
+
+#ifdef LEX_VECTOR_SIZE
+// _LexBetween is the bytes of the vector that are in [low, high]. (There's
+// only a signed compare, so the range is moved down to start at zero and
+// compared unsigned with a min.)
+static inline LexVector _LexBetween(LexVector v, char low, char high)
 {
-    return
-        ((c >= 'A') && (c <= 'Z')) ||
-        ((c >= 'a') && (c <= 'z')) ||
-        (c == '_');
+    LexVector offset = _LexSub(v, _LexSplat(low));
+    return _LexEq(_LexMin(offset, _LexSplat((char)(high - low))), offset);
 }
 
-static void _AddIntegerLiteral(struct MillieTokens *tokens, const char *start,
-                               unsigned int length, const char **ptr_ptr)
+// _LexClassMask is the bit mask of the bytes in the vector that have the
+// given class, which is the same as _CharClasses.
+static inline uint32_t _LexClassMask(LexVector v, uint8_t char_class)
 {
-    const char *limit = start + length;
-    const char *ptr = *ptr_ptr;
-    const char *token_start = ptr;
+    LexVector result;
+    switch(char_class) {
+    case CHAR_DIGIT:
+        result = _LexBetween(v, '0', '9');
+        break;
+
+    case CHAR_IDENTIFIER:
+        // (c | 0x20) folds upper case into lower case, and nothing else into
+        // the letters.
+        result = _LexOr(
+            _LexOr(
+                _LexBetween(v, '0', '9'),
+                _LexBetween(_LexOr(v, _LexSplat(0x20)), 'a', 'z')
+            ),
+            _LexOr(
+                _LexEq(v, _LexSplat('_')),
+                _LexOr(_LexEq(v, _LexSplat('\'')), _LexEq(v, _LexSplat('\"')))
+            )
+        );
+        break;
 
-    while (ptr < limit) {
-        if (!_IsDigit(*ptr)) {
-            break;
+    case CHAR_SPACE:
+        result = _LexOr(
+            _LexOr(_LexEq(v, _LexSplat(' ')), _LexEq(v, _LexSplat('\t'))),
+            _LexOr(_LexEq(v, _LexSplat('\r')), _LexEq(v, _LexSplat('\n')))
+        );
+        break;
+
+    default:
+        Fail("No vector mask for that character class");
+        return 0;
+    }
+    return _LexMask(result);
+}
+#endif
+
+// _ScanWhile returns the first character at or after ptr that doesn't have
+// the class, or limit.
+static inline const char *_ScanWhile(const char *ptr,
+                                     const char *limit,
+                                     uint8_t char_class)
+{
+#ifdef LEX_VECTOR_SIZE
+    while (limit - ptr >= LEX_VECTOR_SIZE) {
+        uint32_t run = _LexClassMask(_LexLoad(ptr), char_class);
+        if (run != LEX_VECTOR_ALL) {
+            return ptr + __builtin_ctz(~run);
         }
+        ptr += LEX_VECTOR_SIZE;
+    }
+#endif
+    while (ptr < limit && _HasCharClass(*ptr, char_class)) {
         ptr++;
     }
-
-    _AddToken(
-        tokens,
-        TOK_INT_LITERAL,
-        (unsigned int)(token_start - start),
-        (unsigned int)(ptr - token_start)
-    );
-    *ptr_ptr = ptr;
+    return ptr;
 }
 
-static int _TryAddKeyword(struct KeywordToken keyword,
-                          struct MillieTokens *tokens,
-                          const char *start,
-                          unsigned int length,
-                          const char **ptr_ptr)
+// _SkipComment returns the end of the line the comment is on (that is, the
+// newline, which is left to be skipped as whitespace) or limit.
+static const char *_SkipComment(const char *ptr, const char *limit)
 {
-    const char *ptr = *ptr_ptr;
-    const char *limit = start + length;
-    const char *keyword_str = keyword.str;
-    while(ptr < limit && *ptr == *keyword_str) {
+#ifdef LEX_VECTOR_SIZE
+    while (limit - ptr >= LEX_VECTOR_SIZE) {
+        uint32_t newlines = _LexMask(_LexEq(_LexLoad(ptr), _LexSplat('\n')));
+        if (newlines) {
+            return ptr + __builtin_ctz(newlines);
+        }
+        ptr += LEX_VECTOR_SIZE;
+    }
+#endif
+    while (ptr < limit && *ptr != '\n') {
         ptr++;
-        keyword_str++;
     }
+    return ptr;
+}
 
-    if (*keyword_str == '\0' && !_IsIdentifierCharacter(*ptr)) {
-        const char *token_start = *ptr_ptr;
-        unsigned int pos = (unsigned int)(token_start - start);
-        unsigned int len = (unsigned int)(ptr - token_start);
-        _AddToken(tokens, keyword.token, pos, len);
-        *ptr_ptr = ptr;
-        return 1;
-    }
+/*
+ * The keywords, by a perfect hash of their first two characters and length:
+ * (first * 7 + second + length) % 16 is different for each of them. Anything
+ * else that hashes to the same slot is told apart by comparing.
+ */
+struct KeywordToken {
+    const char *str;
+    unsigned int length;
+    MILLIE_TOKEN token;
+};
+
+#define KEYWORD_MIN_LENGTH 2
+#define KEYWORD_MAX_LENGTH 5
 
-    return 0;
+static unsigned int _KeywordHash(const char *str, unsigned int length)
+{
+    return ((unsigned int)(unsigned char)str[0] * 7 +
+            (unsigned int)(unsigned char)str[1] +
+            length) & 15;
 }
 
-// TODO: Parse as identifier and then classify keywords; use length &c.
-static int _TryAddKeywords(struct KeywordToken *keywords,
-                           struct MillieTokens *tokens,
-                           const char *start,
-                           unsigned int length,
-                           const char **ptr_ptr)
+static const struct KeywordToken _Keywords[16] = {
+    [0]  = { "false", 5, TOK_FALSE },
+    [1]  = { "tail",  4, TOK_TAIL },
+    [2]  = { "true",  4, TOK_TRUE },
+    [3]  = { "else",  4, TOK_ELSE },
+    [6]  = { "rec",   3, TOK_REC },
+    [7]  = { "if",    2, TOK_IF },
+    [8]  = { "then",  4, TOK_THEN },
+    [10] = { "fn",    2, TOK_FN },
+    [12] = { "let",   3, TOK_LET },
+    [15] = { "in",    2, TOK_IN },
+};
+
+// _ClassifyIdentifier returns the keyword token for the identifier, or TOK_ID
+// if it isn't one.
+static MILLIE_TOKEN _ClassifyIdentifier(const char *str, unsigned int length)
 {
-    while(keywords->str) {
-        if (_TryAddKeyword(*keywords, tokens, start, length, ptr_ptr)) {
-            return 1;
-        }
-        keywords++;
+    if (length < KEYWORD_MIN_LENGTH || length > KEYWORD_MAX_LENGTH) {
+        return TOK_ID;
     }
-
-    return 0;
+    const struct KeywordToken *keyword = &_Keywords[_KeywordHash(str, length)];
+    if (keyword->length == length && memcmp(keyword->str, str, length) == 0) {
+        return keyword->token;
+    }
+    return TOK_ID;
 }
 
-static void _AddIdentifierToken(struct MillieTokens *tokens, const char *start,
-                                unsigned int length, const char **ptr_ptr)
+// _CreateTokens makes room for as many tokens as there could possibly be: one
+// for each character, and the EOF. (That's more than there will be, but only
+// the pages that get written are touched, and LexBuffer gives the rest back.)
+static struct MillieTokens *_CreateTokens(struct MString *buffer)
 {
-    const char *limit = start + length;
-    const char *ptr = *ptr_ptr;
-    const char *token_start = ptr;
+    size_t capacity = (size_t)MStringLength(buffer) + 1;
+    struct MillieTokens *result = calloc(1, sizeof(struct MillieTokens));
+    result->types = malloc(capacity * sizeof(uint8_t));
+    result->starts = malloc(capacity * sizeof(uint32_t));
+    result->lengths = malloc(capacity * sizeof(uint32_t));
+    result->hashes = malloc(capacity * sizeof(uint32_t));
+    result->buffer = MStringCopy(buffer);
+    return result;
+}
 
-    while (ptr < limit) {
-        if (!_IsIdentifierCharacter(*ptr)) {
-            break;
-        }
-        ptr++;
-    }
+// _ShrinkTokens gives back the room _CreateTokens made that wasn't used.
+static void _ShrinkTokens(struct MillieTokens *tokens)
+{
+    size_t count = tokens->count;
+    tokens->types = realloc(tokens->types, count * sizeof(uint8_t));
+    tokens->starts = realloc(tokens->starts, count * sizeof(uint32_t));
+    tokens->lengths = realloc(tokens->lengths, count * sizeof(uint32_t));
+    tokens->hashes = realloc(tokens->hashes, count * sizeof(uint32_t));
+}
 
-    _AddToken(
-        tokens,
-        TOK_ID,
-        (unsigned int)(token_start - start),
-        (unsigned int)(ptr - token_start)
-    );
-    *ptr_ptr = ptr;
+static void _SetToken(struct MillieTokens *tokens, uint32_t index,
+                      MILLIE_TOKEN type, unsigned int start,
+                      unsigned int length, uint32_t hash)
+{
+    tokens->types[index] = (uint8_t)type;
+    tokens->starts[index] = start;
+    tokens->lengths[index] = length;
+    tokens->hashes[index] = hash;
 }
 
 void TokensFree(struct MillieTokens **tokens_ptr)
@@ -146,145 +294,105 @@ void TokensFree(struct MillieTokens **tokens_ptr)
     *tokens_ptr = NULL;
 
     if (!tokens) { return; }
-    ArrayListFree(&tokens->token_array);
+    free(tokens->types);
+    free(tokens->starts);
+    free(tokens->lengths);
+    free(tokens->hashes);
     ArrayListFree(&tokens->line_array);
+    MStringFree(&tokens->buffer);
     free(tokens);
 }
 
-struct MillieTokens *LexBuffer(struct MString *buffer, struct Errors **errors)
+/*
+ * A LexChunk is a piece of the buffer to lex, which starts at the start of a
+ * line and ends at the end of one. Since comments only run to the end of the
+ * line and no token has a newline in it, the pieces can be lexed on their own,
+ * and the tokens and errors put back together in order are the same as lexing
+ * the whole thing. (Positions are always from the start of the buffer, so
+ * there's nothing to fix up.)
+ *
+ * A chunk has no more tokens than characters, so each one writes its tokens
+ * into the result starting at the index of its first character, and they are
+ * moved down to follow on from the chunk before afterwards.
+ */
+struct LexChunk {
+    const char *start;      // The start of the whole buffer.
+    const char *begin;
+    const char *end;
+    struct MillieTokens *tokens;
+    uint32_t first;         // Where this chunk's tokens start in tokens.
+    uint32_t count;
+    struct Errors *errors;
+};
+
+static void _AddToken(struct LexChunk *chunk, MILLIE_TOKEN type,
+                      unsigned int start, unsigned int length)
 {
-    struct MillieTokens *tokens = _CreateTokens(buffer);
-    *errors = NULL;
+    _SetToken(chunk->tokens, chunk->first + chunk->count, type, start, length, 0);
+    chunk->count++;
+}
 
-    const unsigned int length = MStringLength(buffer);
-    const char *start = MStringData(buffer);
-    const char *ptr = start;
+// _AddIdentifier adds an identifier or keyword token; identifiers get the hash
+// of their characters, so that the parser can look them up in the symbol table
+// without copying them out of the buffer first.
+static void _AddIdentifier(struct LexChunk *chunk, const char *str,
+                           unsigned int start, unsigned int length)
+{
+    MILLIE_TOKEN type = _ClassifyIdentifier(str, length);
+    _SetToken(
+        chunk->tokens,
+        chunk->first + chunk->count,
+        type,
+        start,
+        length,
+        (type == TOK_ID) ? CityHash32(str, length) : 0
+    );
+    chunk->count++;
+}
+
+static void _LexChunk(struct LexChunk *chunk)
+{
+    const char *start = chunk->start;
+    const char *limit = chunk->end;
+    const char *ptr = chunk->begin;
     unsigned int error_start = UINT_MAX;
 
-    while(ptr - start < length) {
+    while(ptr < limit) {
         const char *token_start = ptr;
         unsigned int pos = (unsigned int)(token_start - start);
+        uint8_t char_class = _CharClasses[(unsigned char)*ptr];
 
         int error_now = 0;
-        switch(*ptr) {
-        case '(': _AddToken(tokens, TOK_LPAREN, pos, 1); ptr++; break;
-        case ')': _AddToken(tokens, TOK_RPAREN, pos, 1); ptr++; break;
-        case '+': _AddToken(tokens, TOK_PLUS, pos, 1); ptr++; break;
-        case '-': _AddToken(tokens, TOK_MINUS, pos, 1); ptr++; break;
-        case '*': _AddToken(tokens, TOK_STAR, pos, 1); ptr++; break;
-        case '/': _AddToken(tokens, TOK_SLASH, pos, 1); ptr++; break;
-        case ',': _AddToken(tokens, TOK_COMMA, pos, 1); ptr++; break;
-        case '=':
-            {
-                ptr++;
-                if (ptr - start < length && *ptr == '>') {
-                    _AddToken(tokens, TOK_ARROW, pos, 2);
-                    ptr++;
-                } else {
-                    _AddToken(tokens, TOK_EQUALS, pos, 1);
-                }
-            }
-            break;
-
-        case ' ':
-        case '\t':
-        case '\r':
+        if (char_class & CHAR_SPACE) {
+            ptr = _ScanWhile(ptr + 1, limit, CHAR_SPACE);
+        } else if (char_class & CHAR_IDENTIFIER_START) {
+            ptr = _ScanWhile(ptr + 1, limit, CHAR_IDENTIFIER);
+            unsigned int len = (unsigned int)(ptr - token_start);
+            _AddIdentifier(chunk, token_start, pos, len);
+        } else if (char_class & CHAR_DIGIT) {
+            ptr = _ScanWhile(ptr + 1, limit, CHAR_DIGIT);
+            _AddToken(
+                chunk,
+                TOK_INT_LITERAL,
+                pos,
+                (unsigned int)(ptr - token_start)
+            );
+        } else if (_SingleCharTokens[(unsigned char)*ptr]) {
+            _AddToken(chunk, _SingleCharTokens[(unsigned char)*ptr], pos, 1);
             ptr++;
-            break;
-
-        case '\n':
-            ArrayListAdd(tokens->line_array, &pos);
+        } else if (*ptr == '=') {
             ptr++;
-            break;
-
-        case '#':
-            while (*ptr != '\n') { ptr++; }
-            break;
-
-        case 'e':
-            {
-                struct KeywordToken kws[] = {
-                    { "else", TOK_ELSE },
-                    { NULL, 0 },
-                };
-                if (!_TryAddKeywords(kws, tokens, start, length, &ptr)) {
-                    _AddIdentifierToken(tokens, start, length, &ptr);
-                }
-            }
-            break;
-
-        case 'f':
-            {
-                struct KeywordToken kws[] = {
-                    { "false", TOK_FALSE },
-                    { "fn", TOK_FN },
-                    { NULL, 0 },
-                };
-                if (!_TryAddKeywords(kws, tokens, start, length, &ptr)) {
-                    _AddIdentifierToken(tokens, start, length, &ptr);
-                }
-            }
-            break;
-
-        case 'i':
-            {
-                struct KeywordToken kws[] = {
-                    { "if", TOK_IF },
-                    { "in", TOK_IN },
-                    { NULL, 0 },
-                };
-                if (!_TryAddKeywords(kws, tokens, start, length, &ptr)) {
-                    _AddIdentifierToken(tokens, start, length, &ptr);
-                }
-            }
-            break;
-
-        case 'l':
-            {
-                struct KeywordToken kws[] = {
-                    { "let", TOK_LET },
-                    { NULL, 0 },
-                };
-                if (!_TryAddKeywords(kws, tokens, start, length, &ptr)) {
-                    _AddIdentifierToken(tokens, start, length, &ptr);
-                }
-            }
-            break;
-
-        case 'r':
-            {
-                struct KeywordToken kws[] = {
-                    { "rec", TOK_REC },
-                    { NULL, 0 },
-                };
-                if (!_TryAddKeywords(kws, tokens, start, length, &ptr)) {
-                    _AddIdentifierToken(tokens, start, length, &ptr);
-                }
-            }
-            break;
-
-        case 't':
-            {
-                struct KeywordToken kws[] = {
-                    { "then", TOK_THEN },
-                    { "true", TOK_TRUE },
-                    { NULL, 0 },
-                };
-                if (!_TryAddKeywords(kws, tokens, start, length, &ptr)) {
-                    _AddIdentifierToken(tokens, start, length, &ptr);
-                }
-            }
-            break;
-
-        default:
-            if (_IsDigit(*ptr)) {
-                _AddIntegerLiteral(tokens, start, length, &ptr);
-            } else if (_IsIdentifierStart(*ptr)) {
-                _AddIdentifierToken(tokens, start, length, &ptr);
-            } else {
-                error_now = 1;
+            if (ptr < limit && *ptr == '>') {
+                _AddToken(chunk, TOK_ARROW, pos, 2);
                 ptr++;
+            } else {
+                _AddToken(chunk, TOK_EQUALS, pos, 1);
             }
+        } else if (*ptr == '#') {
+            ptr = _SkipComment(ptr, limit);
+        } else {
+            error_now = 1;
+            ptr++;
         }
 
         // Error state machine; collapse all errors until we scan
@@ -295,27 +403,181 @@ struct MillieTokens *LexBuffer(struct MString *buffer, struct Errors **errors)
             }
         } else if (error_start != UINT_MAX) {
             // We were in an error state, now we aren't; report the
-            // scanning error.
+            // scanning error. (A chunk ends with a newline, which is
+            // something, so errors never run from one chunk into the next.)
             struct MString *msg = MStringCreate("Unexpected characters");
-            AddError(errors, error_start, pos, msg);
+            AddError(&(chunk->errors), error_start, pos, msg);
             MStringFree(&msg);
 
             error_start = UINT_MAX;
         }
     }
+}
+
+// Buffers smaller than this are lexed on the calling thread, and bigger ones
+// are cut into chunks of at least this size.
+#define LEX_PARALLEL_CHUNK_SIZE (1024 * 1024)
+
+// There are this many chunks for each thread, so that a thread that gets
+// through its chunks quickly can take more.
+#define LEX_CHUNKS_PER_THREAD 4
+
+struct LexPool {
+    struct LexChunk *chunks;
+    int chunk_count;
+    int next_chunk;
+};
+
+static void *_LexWorker(void *context)
+{
+    struct LexPool *pool = (struct LexPool *)context;
+    for (;;) {
+        int index = __atomic_fetch_add(&pool->next_chunk, 1, __ATOMIC_RELAXED);
+        if (index >= pool->chunk_count) { break; }
+        _LexChunk(&(pool->chunks[index]));
+    }
+    return NULL;
+}
+
+// _LexChunks cuts the buffer into chunks at line ends, lexes them on `threads`
+// threads, and puts the results together into tokens and errors.
+static void _LexChunks(struct MillieTokens *tokens, struct Errors **errors,
+                       int threads)
+{
+    const unsigned int length = MStringLength(tokens->buffer);
+    const char *start = MStringData(tokens->buffer);
+    const char *limit = start + length;
+
+    int chunk_count = threads * LEX_CHUNKS_PER_THREAD;
+    if ((unsigned int)chunk_count > length / LEX_PARALLEL_CHUNK_SIZE) {
+        chunk_count = (int)(length / LEX_PARALLEL_CHUNK_SIZE);
+    }
+    unsigned int chunk_size = length / (unsigned int)chunk_count;
+
+    struct LexChunk *chunks = calloc(
+        (size_t)chunk_count,
+        sizeof(struct LexChunk)
+    );
+    const char *begin = start;
+    int used = 0;
+    while (begin < limit && used < chunk_count) {
+        // Each chunk but the last ends just after the first newline past
+        // chunk_size.
+        const char *end = limit;
+        size_t left = (size_t)(limit - begin);
+        if (used < chunk_count - 1 && left > chunk_size) {
+            end = memchr(begin + chunk_size, '\n', left - chunk_size);
+            end = end ? end + 1 : limit;
+        }
+
+        struct LexChunk *chunk = &chunks[used++];
+        chunk->start = start;
+        chunk->begin = begin;
+        chunk->end = end;
+        chunk->tokens = tokens;
+        chunk->first = (uint32_t)(begin - start);
+        begin = end;
+    }
 
-    _AddToken(tokens, TOK_EOF, length, 0);
+    struct LexPool pool = { chunks, used, 0 };
+    pthread_t *workers = calloc((size_t)threads, sizeof(pthread_t));
+    int started = 0;
+    for (int i = 1; i < threads && i < used; i++) {
+        if (pthread_create(&workers[started], NULL, _LexWorker, &pool) != 0) {
+            break;
+        }
+        started++;
+    }
+    _LexWorker(&pool);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+
+    for (int i = 0; i < used; i++) {
+        struct LexChunk *chunk = &chunks[i];
+        if (chunk->first != tokens->count) {
+            size_t count = chunk->count;
+            uint32_t from = chunk->first, to = tokens->count;
+            memmove(&tokens->types[to], &tokens->types[from], count);
+            memmove(&tokens->starts[to], &tokens->starts[from],
+                    count * sizeof(uint32_t));
+            memmove(&tokens->lengths[to], &tokens->lengths[from],
+                    count * sizeof(uint32_t));
+            memmove(&tokens->hashes[to], &tokens->hashes[from],
+                    count * sizeof(uint32_t));
+        }
+        tokens->count += chunk->count;
+        struct ErrorReport *error = FirstError(chunk->errors);
+        while (error) {
+            AddError(errors, error->start_pos, error->end_pos, error->message);
+            error = error->next;
+        }
+        FreeErrors(&chunk->errors);
+    }
+    free(chunks);
+}
+
+struct MillieTokens *LexBuffer(struct MString *buffer, int threads,
+                               struct Errors **errors)
+{
+    struct MillieTokens *tokens = _CreateTokens(buffer);
+    *errors = NULL;
+
+    const unsigned int length = MStringLength(buffer);
+    if (threads <= 0) {
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (threads > 1 && length >= 2 * LEX_PARALLEL_CHUNK_SIZE) {
+        _LexChunks(tokens, errors, threads);
+    } else {
+        struct LexChunk chunk = {
+            MStringData(buffer),
+            MStringData(buffer),
+            MStringData(buffer) + length,
+            tokens,
+            0,
+            0,
+            NULL,
+        };
+        _LexChunk(&chunk);
+        tokens->count = chunk.count;
+        *errors = chunk.errors;
+    }
+
+    _SetToken(tokens, tokens->count++, TOK_EOF, length, 0, 0);
+    _ShrinkTokens(tokens);
     return tokens;
 }
 
+// _GetLines returns where each line of the buffer ends, finding them the first
+// time it's asked. (Only error messages want lines, so most of the time
+// nobody asks.)
+static struct ArrayList *_GetLines(struct MillieTokens *tokens)
+{
+    if (tokens->line_array) { return tokens->line_array; }
+
+    const char *start = MStringData(tokens->buffer);
+    const char *limit = start + MStringLength(tokens->buffer);
+    tokens->line_array = ArrayListCreate(sizeof(unsigned int), 100);
+    const char *ptr = start;
+    while ((ptr = memchr(ptr, '\n', (size_t)(limit - ptr))) != NULL) {
+        unsigned int pos = (unsigned int)(ptr - start);
+        ArrayListAdd(tokens->line_array, &pos);
+        ptr++;
+    }
+    return tokens->line_array;
+}
+
 void GetLineColumnForPosition(struct MillieTokens *tokens,
                               unsigned int position,
                               unsigned int *line,
                               unsigned int *col)
 {
-    unsigned int *line_array = (unsigned int *)(tokens->line_array->buffer);
+    struct ArrayList *lines = _GetLines(tokens);
+    unsigned int *line_array = (unsigned int *)(lines->buffer);
     int min = 0;
-    int max = ((int)tokens->line_array->item_count) - 1;
+    int max = ((int)lines->item_count) - 1;
     while(min <= max) {
         int mid = (max + min) / 2;
         unsigned int line_position = line_array[mid];
@@ -343,7 +605,7 @@ struct MString *ExtractLine(struct MillieTokens *tokens, unsigned int line)
         Fail("Expect line > 0");
     }
 
-    struct ArrayList *line_array = tokens->line_array;
+    struct ArrayList *line_array = _GetLines(tokens);
     if (line_array->item_count == 0) {
         return MStringCopy(tokens->buffer);
     }
@@ -365,30 +627,27 @@ struct MString *ExtractLine(struct MillieTokens *tokens, unsigned int line)
 
 struct MString *ExtractToken(struct MillieTokens *tokens, uint32_t pos)
 {
-    struct MillieToken *token_array = tokens->token_array->buffer;
     return MStringCreateN(
-        MStringData(tokens->buffer) + token_array[pos].start,
-        token_array[pos].length
+        MStringData(tokens->buffer) + tokens->starts[pos],
+        tokens->lengths[pos]
     );
 }
 
 struct MillieToken GetToken(struct MillieTokens *tokens, uint32_t pos)
 {
-    struct MillieToken *token_array = tokens->token_array->buffer;
-    return token_array[pos];
+    struct MillieToken token;
+    token.type = (MILLIE_TOKEN)tokens->types[pos];
+    token.start = tokens->starts[pos];
+    token.length = tokens->lengths[pos];
+    token.hash = tokens->hashes[pos];
+    return token;
 }
 
 void PrintTokens(struct MillieTokens *tokens)
 {
-    for(unsigned int i = 0; i < tokens->token_array->item_count; i++) {
-        struct MillieToken token;
-        token = *(struct MillieToken *)(ArrayListIndex(tokens->token_array, i));
-
-        struct MString *substr = MStringCreateN(
-            MStringData(tokens->buffer) + token.start,
-            token.length
-        );
-        printf("%03d: %s\n", token.type, MStringData(substr));
+    for(unsigned int i = 0; i < tokens->count; i++) {
+        struct MString *substr = ExtractToken(tokens, i);
+        printf("%03d: %s\n", tokens->types[i], MStringData(substr));
         MStringFree(&substr);
     }
 }
@@ -12,17 +12,38 @@
 #include "parser.c"
 #include "typecheck.c"
 #include "compiler.c"
+#include "gc.c"
+#include "rt.c"
 #include "runtime.c"
+#include "optimize.c"
+#include "cache.c"
+#include "jit.c"
+#include "emitc.c"
 
 
 
 // ----------------------------------------------------------------------------
 // Driver
 // ----------------------------------------------------------------------------
-static struct MString *FormatValue(uint64_t value, struct TypeExp *type) {
-    while(type->type == TYPEEXP_VARIABLE) {
-        type = type->var_instance;
+// _TupleMember reads member i of the tuple, which is of the given type, from
+// the given byte offset if the tuple is packed. (See TUPLE_PACKED.)
+static uint64_t _TupleMember(uint64_t *tuple, int i, struct TypeStore *store,
+                             TypeId type, size_t *offsets)
+{
+    if (!offsets) {
+        return tuple[i];
+    }
+
+    uint8_t *member = (uint8_t *)tuple + offsets[i];
+    if (PackedMemberSize(store, type) == 1) {
+        return *member;
     }
+    return *(uint64_t *)member;
+}
+
+static struct MString *FormatValue(uint64_t value, struct TypeStore *store,
+                                   TypeId type_id) {
+    struct TypeExp *type = ResolveType(store, type_id);
     struct MString *result;
     switch(type->type) {
     case TYPEEXP_BOOL:
@@ -40,11 +61,23 @@ static struct MString *FormatValue(uint64_t value, struct TypeExp *type) {
     case TYPEEXP_TUPLE:
         {
             uint64_t *tuple = (uint64_t *)value;
+            size_t *offsets = NULL;
+            if (TupleIsPacked(tuple)) {
+                offsets = malloc(
+                    TupleTypeLength(store, type_id) * sizeof(size_t)
+                );
+                PackedTupleLayout(store, type_id, offsets);
+            }
+
             struct MString *acc = MStringCreate("(");
             int i = 0;
             struct MString *tv = NULL;
             while(type->type == TYPEEXP_TUPLE) {
-                tv = FormatValue(tuple[i], type->tuple_first);
+                tv = FormatValue(
+                    _TupleMember(tuple, i, store, type->tuple_first, offsets),
+                    store,
+                    type->tuple_first
+                );
                 struct MString *nr = MStringPrintF(
                     "%s%s, ",
                     MStringData(acc),
@@ -54,15 +87,20 @@ static struct MString *FormatValue(uint64_t value, struct TypeExp *type) {
                 MStringFree(&acc);
                 acc = nr;
 
-                type = type->tuple_rest;
+                type = TypeAt(store, type->tuple_rest);
                 i += 1;
             }
 
             assert(type->type == TYPEEXP_TUPLE_FINAL);
-            tv = FormatValue(tuple[i], type->tuple_first);
+            tv = FormatValue(
+                _TupleMember(tuple, i, store, type->tuple_first, offsets),
+                store,
+                type->tuple_first
+            );
             result = MStringPrintF("%s%s)", MStringData(acc), MStringData(tv));
             MStringFree(&acc);
             MStringFree(&tv);
+            free(offsets);
         }
         break;
 
@@ -71,12 +109,52 @@ static struct MString *FormatValue(uint64_t value, struct TypeExp *type) {
     case TYPEEXP_GENERIC_VARIABLE:
     case TYPEEXP_INVALID:
     case TYPEEXP_ERROR:
+    default:
         result = MStringCreate("<<Invalid>>");
         break;
     }
     return result;
 }
 
+static size_t _CountInstructions(struct CompiledExpression *function)
+{
+    size_t count = 0;
+    size_t offset = 0;
+    while (offset < function->code_length) {
+        size_t length = _InstructionLength(function->code + offset);
+        if (length == 0) { break; }
+        offset += length;
+        count++;
+    }
+    return count;
+}
+
+static void PrintRegisterReport(struct Module *module)
+{
+    size_t total = 0;
+    size_t total_instructions = 0;
+    for (int i = 0; i < module->function_count; i++) {
+        struct CompiledExpression *function = &(module->functions[i]);
+        size_t instructions = _CountInstructions(function);
+        printf(
+            "function %d: %zu registers (%zu bytes of frame), "
+            "%zu instructions\n",
+            i,
+            function->register_count,
+            (function->register_count + function->stack_words) *
+                sizeof(uint64_t),
+            instructions
+        );
+        total += function->register_count;
+        total_instructions += instructions;
+    }
+    printf(
+        "total: %zu registers, %zu instructions\n",
+        total,
+        total_instructions
+    );
+}
+
 static void PrintErrors(const char *fname, struct MillieTokens *tokens,
                         struct Errors *errors)
 {
@@ -164,6 +242,43 @@ static struct MString *ReadFile(const char *filename)
     return buffer;
 }
 
+// LexOnly lexes the buffer and reports how fast, for `--lex`, and then any
+// errors.
+static int LexOnly(const char *fname, struct MString *buffer, int threads)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct Errors *errors;
+    struct MillieTokens *tokens = LexBuffer(buffer, threads, &errors);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (double)(end.tv_sec - start.tv_sec) +
+        (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    double megabytes = (double)MStringLength(buffer) / (1024.0 * 1024.0);
+    // (With a hash of the tokens, to tell whether two ways of lexing got the
+    // same thing.)
+    uint32_t count = tokens->count;
+    uint32_t hashes[4] = {
+        CityHash32((const char *)tokens->types, count * sizeof(uint8_t)),
+        CityHash32((const char *)tokens->starts, count * sizeof(uint32_t)),
+        CityHash32((const char *)tokens->lengths, count * sizeof(uint32_t)),
+        CityHash32((const char *)tokens->hashes, count * sizeof(uint32_t)),
+    };
+    printf(
+        "%u tokens (%08x)\n",
+        count,
+        CityHash32((const char *)hashes, sizeof(hashes))
+    );
+    printf("Lexed %.1f MB in %.3f ms (%.1f MB/s, %s)\n", megabytes,
+           seconds * 1000.0, megabytes / seconds, LexerScanName);
+    if (errors) {
+        PrintErrors(fname, tokens, errors);
+        return 1;
+    }
+    TokensFree(&tokens);
+    return 0;
+}
+
 static void _print_usage()
 {
     printf(
@@ -171,21 +286,139 @@ static void _print_usage()
         "  --print-type  -t  Print the type of the expression in the input\n"
         "                    file to stdout, instead of evaluating.\n"
         "  --verbose     -v  Print various other things to stdout.\n"
+        "  -O0, -O1, -O2     How hard the bytecode optimizer works: not at all,\n"
+        "                    cleaning up, or also using superinstructions.\n"
+        "                    (Defaults to -O2.)\n"
+        "  --stack-size <megabytes>\n"
+        "                    Limit the VM stack to the given size, which\n"
+        "                    bounds how deeply functions can recurse.\n"
+        "                    (Defaults to %d.)\n"
+        "  --heap-limit <megabytes>\n"
+        "                    Limit the garbage collected heap to the given\n"
+        "                    size. (Defaults to %zu.)\n"
+        "  --lex             Instead of evaluating, only lex the input, and\n"
+        "                    print how many tokens there are and how long\n"
+        "                    it took.\n"
+        "  --lex-threads <threads>\n"
+        "                    How many threads to lex a big input on.\n"
+        "                    (Defaults to one for each core.)\n"
+        "  --register-report\n"
+        "                    Instead of evaluating, print how many registers\n"
+        "                    each compiled function needs.\n"
+        "  --jit <never|hot|always>\n"
+        "                    Whether to compile functions to machine code:\n"
+        "                    never, once they are hot, or always. (Defaults\n"
+        "                    to hot; ignored where there is no JIT.)\n"
+        "  --emit-c <output file>\n"
+        "                    Instead of evaluating, translate the program to\n"
+        "                    C, to be built against rt.c and gc.c. The stack\n"
+        "                    size and heap limit are built into the program.\n"
+        "  --cache-dir <directory>\n"
+        "                    Keep the compiled bytecode of each input in the\n"
+        "                    directory, and use it instead of compiling again\n"
+        "                    when the same input is run with the same -O.\n"
+        "  --clear-cache     Remove everything from the --cache-dir before\n"
+        "                    starting. (With no input file, just do that.)\n",
+        DEFAULT_VM_STACK_SIZE / (1024 * 1024),
+        DEFAULT_HEAP_LIMIT / (1024 * 1024)
     );
 }
 
+// _ParseMegabytes parses the argument of a switch like `--stack-size 64`,
+// advancing *index past it.
+static bool _ParseMegabytes(int argc, const char *argv[], int *index,
+                            size_t *bytes)
+{
+    const char *name = argv[*index];
+    *index += 1;
+
+    char *end = NULL;
+    long megabytes = (*index < argc) ? strtol(argv[*index], &end, 10) : 0;
+    if (megabytes <= 0 || *end != '\0') {
+        fprintf(stderr, "%s needs a size in megabytes\n", name);
+        return false;
+    }
+    *bytes = (size_t)megabytes * 1024 * 1024;
+    return true;
+}
+
 int main(int argc, const char *argv[])
 {
     const char *fname = NULL;
     bool print_type = false;
     bool verbose = false;
+    size_t stack_size = DEFAULT_VM_STACK_SIZE;
+    size_t heap_limit = DEFAULT_HEAP_LIMIT;
+    const char *emit_c_path = NULL;
+    JIT_MODE jit_mode = JIT_HOT;
+    bool register_report = false;
+    bool lex_only = false;
+    int lex_threads = 0;
+    int optimize_level = 2;
+    const char *cache_dir = NULL;
+    bool clear_cache = false;
     for(int i = 1; i < argc; i++) {
         const char *arg = argv[i];
         if (arg[0] == '-') {
-            if (strcmp(arg, "--verbose") == 0) {
+            if (strcmp(arg, "-O0") == 0) {
+                optimize_level = 0;
+            } else if (strcmp(arg, "-O1") == 0) {
+                optimize_level = 1;
+            } else if (strcmp(arg, "-O2") == 0) {
+                optimize_level = 2;
+            } else if (strcmp(arg, "--verbose") == 0) {
                 verbose = true;
             } else if (strcmp(arg, "--print-type") == 0) {
                 print_type = true;
+            } else if (strcmp(arg, "--stack-size") == 0) {
+                if (!_ParseMegabytes(argc, argv, &i, &stack_size)) {
+                    return -1;
+                }
+            } else if (strcmp(arg, "--heap-limit") == 0) {
+                if (!_ParseMegabytes(argc, argv, &i, &heap_limit)) {
+                    return -1;
+                }
+            } else if (strcmp(arg, "--lex") == 0) {
+                lex_only = true;
+            } else if (strcmp(arg, "--lex-threads") == 0) {
+                i++;
+                char *end = NULL;
+                lex_threads = (i < argc) ? (int)strtol(argv[i], &end, 10) : 0;
+                if (lex_threads <= 0 || *end != '\0') {
+                    fprintf(stderr, "--lex-threads needs a number of threads\n");
+                    return -1;
+                }
+            } else if (strcmp(arg, "--register-report") == 0) {
+                register_report = true;
+            } else if (strcmp(arg, "--jit") == 0) {
+                i++;
+                const char *mode = (i < argc) ? argv[i] : "";
+                if (strcmp(mode, "never") == 0) {
+                    jit_mode = JIT_NEVER;
+                } else if (strcmp(mode, "hot") == 0) {
+                    jit_mode = JIT_HOT;
+                } else if (strcmp(mode, "always") == 0) {
+                    jit_mode = JIT_ALWAYS;
+                } else {
+                    fprintf(stderr, "--jit needs one of never, hot or always\n");
+                    return -1;
+                }
+            } else if (strcmp(arg, "--emit-c") == 0) {
+                i++;
+                if (i == argc) {
+                    fprintf(stderr, "--emit-c needs an output file\n");
+                    return -1;
+                }
+                emit_c_path = argv[i];
+            } else if (strcmp(arg, "--cache-dir") == 0) {
+                i++;
+                if (i == argc) {
+                    fprintf(stderr, "--cache-dir needs a directory\n");
+                    return -1;
+                }
+                cache_dir = argv[i];
+            } else if (strcmp(arg, "--clear-cache") == 0) {
+                clear_cache = true;
             } else if (strcmp(arg, "--help") == 0) {
                 _print_usage();
                 return 0;
@@ -219,6 +452,18 @@ int main(int argc, const char *argv[])
         }
     }
 
+    if (clear_cache) {
+        if (!cache_dir) {
+            fprintf(stderr, "--clear-cache needs a --cache-dir\n");
+            return -1;
+        }
+        if (!ClearCache(cache_dir)) {
+            fprintf(stderr, "Unable to clear the cache in %s\n", cache_dir);
+            return 1;
+        }
+        if (fname == NULL) { return 0; }
+    }
+
     if (fname == NULL) {
         fprintf(stderr, "No input file specified.\n");
         return -1;
@@ -227,57 +472,147 @@ int main(int argc, const char *argv[])
     struct MString *buffer = ReadFile(fname);
     if (!buffer) { return -1; }
 
-    struct Errors *errors;
-    struct MillieTokens *tokens = LexBuffer(buffer, &errors);
-    if (errors) {
-        PrintErrors(fname, tokens, errors);
-        return 1;
+    if (lex_only) {
+        return LexOnly(fname, buffer, lex_threads);
     }
 
-    struct Arena *arena = MakeFreshArena();
-    struct SymbolTable *symbol_table = SymbolTableCreate();
-    struct Expression *expression;
-    expression = ParseExpression(arena, tokens, symbol_table, &errors);
-    if (errors) {
-        PrintErrors(fname, tokens, errors);
-        return 1;
+    // With a cache hit, there's nothing to lex, parse, check or compile.
+    struct TypeStore *types = TypeStoreCreate();
+    struct Ast *ast = NULL;
+    struct Module module;
+    ModuleInit(&module);
+    int func_id = 0;
+    TypeId type = 0;
+    bool cache_hit = false;
+    if (cache_dir && !print_type) {
+        cache_hit = LoadCachedModule(cache_dir, buffer, optimize_level, types,
+                                     &module, &func_id, &type);
     }
 
-    struct TypeExp *type = GetExpressionType(arena, expression, tokens, &errors);
-    if (errors) {
-        PrintErrors(fname, tokens, errors);
-        return 1;
+    if (!cache_hit) {
+        struct Errors *errors;
+        struct MillieTokens *tokens = LexBuffer(buffer, lex_threads, &errors);
+        if (errors) {
+            PrintErrors(fname, tokens, errors);
+            return 1;
+        }
+
+        struct SymbolTable *symbol_table = SymbolTableCreate();
+        ast = AstCreate();
+        ExpressionId expression;
+        expression = ParseExpression(ast, tokens, symbol_table, &errors);
+        if (errors) {
+            PrintErrors(fname, tokens, errors);
+            return 1;
+        }
+
+        type = GetExpressionType(types, ast, expression, tokens, &errors);
+        if (errors) {
+            PrintErrors(fname, tokens, errors);
+            return 1;
+        }
+
+        if (!print_type) {
+            func_id = CompileExpression(ast, types, expression, tokens,
+                                        &errors, &module);
+            if (errors) {
+                PrintErrors(fname, tokens, errors);
+                return 1;
+            }
+
+            OptimizeModule(&module, optimize_level);
+            if (cache_dir &&
+                !WriteCachedModule(cache_dir, buffer, optimize_level, &module,
+                                   func_id, types, type) &&
+                verbose) {
+                fprintf(stderr, "Unable to write to the cache in %s\n",
+                        cache_dir);
+            }
+        }
     }
 
+    struct Heap *heap = NULL;
+    int jit_functions = 0;
+    size_t stack_allocations = 0;
     if (print_type) {
-        struct MString *typeexp = FormatTypeExpression(type);
+        struct MString *typeexp = FormatTypeExpression(types, type);
         printf("%s\n", MStringData(typeexp));
         MStringFree(&typeexp);
     } else {
-        struct Module module;
-        ModuleInit(&module);
-        int func_id = CompileExpression(expression, tokens, &errors, &module);
-        if (errors) {
-            PrintErrors(fname, tokens, errors);
+        if (register_report) {
+            PrintRegisterReport(&module);
+            return 0;
+        }
+
+        if (emit_c_path) {
+            FILE *output = fopen(emit_c_path, "w");
+            if (!output) {
+                fprintf(stderr, "Unable to open %s\n", emit_c_path);
+                return 1;
+            }
+            bool ok = EmitC(output, &module, func_id, types, type,
+                            stack_size, heap_limit);
+            fclose(output);
+            return ok ? 0 : 1;
+        }
+
+        heap = HeapCreate(heap_limit);
+        struct VM *vm = VMCreate(&module, heap, stack_size, jit_mode);
+        uint64_t result;
+        if (!EvaluateCode(vm, func_id, 0, 0, &result)) {
             return 1;
         }
+        for (int i = 0; i < module.function_count; i++) {
+            if (module.functions[i].jit) { jit_functions++; }
+        }
+        stack_allocations = VMStackAllocations(vm);
+        VMFree(&vm);
 
-        uint64_t result = EvaluateCode(&module, func_id, 0, 0);
-        struct MString *result_str = FormatValue(result, type);
+        struct MString *result_str = FormatValue(result, types, type);
         printf("%s\n", MStringData(result_str));
         MStringFree(&result_str);
     }
 
     if (verbose) {
-        fprintf(stderr, "Arena: %lu bytes used\n", ArenaAllocated(arena));
-        fprintf(stderr, "GC Heap:\n");
-        fprintf(stderr, "  Lifetime allocations: %zd bytes\n", LifetimeAllocations);
+        if (cache_dir) {
+            fprintf(stderr, "Bytecode cache: %s\n", cache_hit ? "hit" : "miss");
+        }
+        fprintf(stderr, "Closure loads: %d written, %d saved by reuse\n",
+                module.closure_loads, module.closure_loads_saved);
+        fprintf(stderr, "Lexer: %s\n", LexerScanName);
+        fprintf(stderr, "VM dispatch: %s\n", VMDispatchName);
+        VMPrintDispatchStats(stderr);
+        fprintf(stderr, "JIT: %s, %d functions compiled\n",
+                JitAvailable ? "available" : "unavailable", jit_functions);
+        fprintf(stderr, "Types: %u nodes, %zu bytes\n",
+                types->nodes->item_count, TypeStoreAllocated(types));
+        if (ast) {
+            fprintf(stderr, "AST: %u expressions, %zu bytes\n",
+                    ast->nodes->item_count, AstAllocated(ast));
+        }
+        if (heap) {
+            struct HeapStats stats = HeapGetStats(heap);
+            fprintf(stderr, "GC Heap:\n");
+            fprintf(stderr, "  Lifetime allocations: %zu bytes in %zu objects\n",
+                    stats.allocated_bytes, stats.allocated_objects);
+            fprintf(stderr, "  Collections: %zu minor, %zu major\n",
+                    stats.minor_collections, stats.major_collections);
+            fprintf(stderr, "  Promoted: %zu bytes\n", stats.promoted_bytes);
+            fprintf(stderr, "  Live after last collection: %zu bytes\n",
+                    stats.live_bytes);
+            fprintf(stderr, "  Heap size: %zu bytes (peak %zu bytes)\n",
+                    stats.heap_bytes, stats.peak_heap_bytes);
+            fprintf(stderr, "  Avoided: %zu objects allocated on the stack\n",
+                    stack_allocations);
+        }
 
         fprintf(stderr, "Size of expression is %lu bytes\n", sizeof(struct Expression));
         fprintf(stderr, "Size of type exp is %lu bytes\n", sizeof(struct TypeExp));
     }
 
-    FreeArena(&arena);
+    HeapFree(&heap);
+    AstFree(&ast);
+    TypeStoreFree(&types);
 
     return 0;
 }
@@ -0,0 +1,959 @@
+#ifndef PLATFORM_INCLUDED
+#include "platform.h"
+#endif
+
+/*
+ * The bytecode optimizer.
+ *
+ * The compiler writes the simplest code it can for each expression, one
+ * expression at a time. This pass goes back over each finished function and
+ * cleans up after it:
+ *
+ *   - Arithmetic and comparisons on constants are folded into a LOADI.
+ *   - A JZ on a constant becomes a JMP or goes away, and code that can no
+ *     longer be reached goes with it.
+ *   - Jumps to jumps go straight to the final target, a jump to a RET is
+ *     just a RET, and a jump to the next instruction is nothing at all.
+ *   - A MOV out of a register that was only just written is folded into the
+ *     instruction that wrote it, and a MOV of a register to itself goes away.
+ *   - Instructions that only compute a value nobody reads are removed.
+ *   - The frame shrinks to the registers that are still used.
+ *
+ * The function is decoded into an array of instructions, the passes run over
+ * that until they stop finding things to do, and then it is encoded again.
+ *
+ * At -O2 (the default), the last thing before encoding is to replace common
+ * sequences of instructions with the superinstructions at the bottom of
+ * opcodes.inc: `LOADI 1 => r3; SUB r1, r3 => r2` becomes `SUBI r1, 1 => r2`,
+ * and so on.
+ */
+
+// A set of registers fits in four words, so the passes only run on functions
+// with up to 256 registers; bigger ones (which need WIDE instructions anyway)
+// are only compacted.
+typedef struct { uint64_t bits[4]; } _RegisterSet;
+
+struct _OptInstruction {
+    MILLIE_OPCODE op;
+    uint64_t args[3];   // Decoded according to _op_info.
+    int target;         // For jumps, the index of the instruction jumped to.
+    bool leader;        // True if this starts a basic block.
+    bool removed;
+    bool wide;          // Chosen by the encoder.
+    _RegisterSet live_out;
+};
+
+struct _OptFunction {
+    struct CompiledExpression *code;
+    struct _OptInstruction *instructions;
+    int count;
+};
+
+static void _RegisterSetAdd(_RegisterSet *set, uint8_t reg)
+{
+    set->bits[reg / 64] |= ((uint64_t)1) << (reg % 64);
+}
+
+static void _RegisterSetRemove(_RegisterSet *set, uint8_t reg)
+{
+    set->bits[reg / 64] &= ~(((uint64_t)1) << (reg % 64));
+}
+
+static bool _RegisterSetHas(_RegisterSet *set, uint8_t reg)
+{
+    return (set->bits[reg / 64] >> (reg % 64)) & 1;
+}
+
+static bool _IsJump(MILLIE_OPCODE op)
+{
+    return op == OP_JMP || op == OP_JZ || op == OP_JNE || op == OP_JNEI;
+}
+
+static bool _IsLoadI(MILLIE_OPCODE op)
+{
+    return
+        op == OP_LOADI_8 || op == OP_LOADI_16 ||
+        op == OP_LOADI_32 || op == OP_LOADI_64;
+}
+
+// _JumpArg returns which argument of a jump is its offset.
+static int _JumpArg(MILLIE_OPCODE op)
+{
+    return (op == OP_JMP) ? 0 : (op == OP_JZ) ? 1 : 2;
+}
+
+// _DestArg returns which argument is the destination register, or -1.
+static int _DestArg(MILLIE_OPCODE op)
+{
+    for (int i = 0; i < 3; i++) {
+        if (_op_info[op].args[i] == OPARG_DREG) { return i; }
+    }
+    return -1;
+}
+
+// _IsPure is true of instructions that do nothing but compute a value into
+// their destination register, and so can go if nobody wants the value.
+static bool _IsPure(MILLIE_OPCODE op)
+{
+    switch(op) {
+    case OP_LOADI_8:
+    case OP_LOADI_16:
+    case OP_LOADI_32:
+    case OP_LOADI_64:
+    case OP_LOADA_8:
+    case OP_LOADA_16:
+    case OP_LOADA_32:
+    case OP_LOADA_64:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_NEG:
+    case OP_EQ:
+    case OP_MOV:
+    case OP_ADDI:
+    case OP_SUBI:
+    case OP_EQI:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// _GetArgumentRow finds the registers that a call which takes its arguments
+// in a row (like CALLN) reads, which aren't all named; it returns false for
+// every other instruction.
+static bool _GetArgumentRow(struct _OptInstruction *instruction,
+                            uint8_t *first_reg,
+                            int *count)
+{
+    switch (instruction->op) {
+    case OP_CALLN:
+    case OP_TAILCALLN:
+    case OP_CALL_DIRECT:
+    case OP_TAILCALL_DIRECT:
+        *first_reg = instruction->args[1];
+        *count = instruction->args[2];
+        return true;
+    case OP_CALL_SELF:
+        *first_reg = instruction->args[0];
+        *count = instruction->args[1];
+        return true;
+    default:
+        return false;
+    }
+}
+
+// _AddReads adds the registers that the instruction reads to the set.
+static void _AddReads(struct _OptFunction *function,
+                      struct _OptInstruction *instruction,
+                      _RegisterSet *set)
+{
+    if (instruction->op == OP_RET) {
+        _RegisterSetAdd(set, function->code->result_register);
+    }
+    uint8_t first_reg;
+    int count;
+    if (_GetArgumentRow(instruction, &first_reg, &count)) {
+        for (int i = 0; i < count; i++) {
+            _RegisterSetAdd(set, first_reg + i);
+        }
+    }
+    for (int i = 0; i < 3; i++) {
+        if (_op_info[instruction->op].args[i] == OPARG_REG) {
+            _RegisterSetAdd(set, instruction->args[i]);
+        }
+    }
+}
+
+static bool _Reads(struct _OptFunction *function,
+                   struct _OptInstruction *instruction,
+                   uint8_t reg)
+{
+    _RegisterSet reads;
+    memset(&reads, 0, sizeof(reads));
+    _AddReads(function, instruction, &reads);
+    return _RegisterSetHas(&reads, reg);
+}
+
+static bool _Writes(struct _OptInstruction *instruction, uint8_t reg)
+{
+    int dest = _DestArg(instruction->op);
+    return dest >= 0 && instruction->args[dest] == reg;
+}
+
+static void _MakeLoadI(struct _OptInstruction *instruction, uint8_t dest,
+                       uint64_t value)
+{
+    instruction->op = OP_LOADI_64; // (The encoder picks the right size.)
+    instruction->args[0] = value;
+    instruction->args[1] = dest;
+    instruction->args[2] = 0;
+}
+
+// ----------------------------------------------------------------------------
+// Decoding and Encoding
+// ----------------------------------------------------------------------------
+
+static bool _DecodeFunction(struct CompiledExpression *code,
+                            struct _OptFunction *function)
+{
+    function->code = code;
+    function->instructions = calloc(
+        code->code_length + 1,
+        sizeof(struct _OptInstruction)
+    );
+    function->count = 0;
+
+    // Where each instruction starts, by offset, so that jumps can be turned
+    // into instruction indices.
+    int *index_at = malloc((code->code_length + 1) * sizeof(int));
+    for (size_t i = 0; i <= code->code_length; i++) { index_at[i] = -1; }
+
+    const uint8_t *ip = code->code;
+    const uint8_t *end = code->code + code->code_length;
+    bool ok = true;
+    while (ok && ip < end) {
+        if (_InstructionLength(ip) == 0) {
+            ok = false;
+            break;
+        }
+
+        index_at[ip - code->code] = function->count;
+        struct _OptInstruction *instruction =
+            &(function->instructions[function->count++]);
+        bool wide = (*ip == OP_WIDE);
+        if (wide) { ip++; }
+        instruction->op = *(ip++);
+        for (int i = 0; i < 3; i++) {
+            switch(_op_info[instruction->op].args[i]) {
+            case OPARG_REG:
+            case OPARG_DREG:
+                instruction->args[i] = _ReadReg(&ip, wide);
+                break;
+
+            case OPARG_U8:
+                instruction->args[i] = _ReadU8(&ip);
+                break;
+
+            case OPARG_I8:
+                instruction->args[i] = (uint64_t)(int64_t)(int8_t)_ReadU8(&ip);
+                break;
+
+            case OPARG_U16:
+                instruction->args[i] = _ReadU16(&ip);
+                break;
+
+            case OPARG_OFF:
+                instruction->args[i] = (uint64_t)(int64_t)_ReadOff(&ip, wide);
+                break;
+
+            case OPARG_IDX:
+                instruction->args[i] = (uint64_t)(int64_t)(int16_t)_ReadU16(&ip);
+                break;
+
+            case OPARG_U32:
+                instruction->args[i] = _ReadU32(&ip);
+                break;
+
+            case OPARG_U64:
+                instruction->args[i] = _ReadU64(&ip);
+                break;
+
+            case OPARG_0:
+                break;
+            }
+        }
+
+        if (_IsJump(instruction->op)) {
+            // For now, keep the target offset; it becomes an index below.
+            int64_t offset = (int64_t)instruction->args[_JumpArg(instruction->op)];
+            instruction->target = (int)((ip - code->code) + offset);
+        }
+    }
+    index_at[code->code_length] = function->count;
+
+    for (int i = 0; ok && i < function->count; i++) {
+        struct _OptInstruction *instruction = &(function->instructions[i]);
+        if (_IsJump(instruction->op)) {
+            int offset = instruction->target;
+            if (offset < 0 || (size_t)offset > code->code_length ||
+                index_at[offset] < 0) {
+                ok = false;
+            } else {
+                instruction->target = index_at[offset];
+            }
+        }
+    }
+
+    free(index_at);
+    if (!ok) {
+        free(function->instructions);
+    }
+    return ok;
+}
+
+// _EncodedOp is the opcode the instruction is written with, which for a LOADI
+// is the smallest one that holds the value.
+static MILLIE_OPCODE _EncodedOp(struct _OptInstruction *instruction)
+{
+    if (_IsLoadI(instruction->op)) {
+        uint64_t value = instruction->args[0];
+        if (value <= UINT8_MAX) { return OP_LOADI_8; }
+        if (value <= UINT16_MAX) { return OP_LOADI_16; }
+        if (value <= UINT32_MAX) { return OP_LOADI_32; }
+        return OP_LOADI_64;
+    }
+    return instruction->op;
+}
+
+static size_t _EncodedLength(struct _OptInstruction *instruction)
+{
+    MILLIE_OPCODE op = _EncodedOp(instruction);
+    if (instruction->wide) { return 1 + _wide_instruction_length[op]; }
+    return _instruction_length[op];
+}
+
+// _NeedsWide is true if one of the instruction's registers doesn't fit in a
+// byte. (Whether its jump fits depends on where everything ends up.)
+static bool _NeedsWide(struct _OptInstruction *instruction)
+{
+    for (int i = 0; i < 3; i++) {
+        OP_ARG_TYPE type = _op_info[instruction->op].args[i];
+        if ((type == OPARG_REG || type == OPARG_DREG) &&
+            instruction->args[i] > UINT8_MAX) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void _WriteU(uint8_t **write, uint64_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++) {
+        *((*write)++) = (uint8_t)(value >> (8 * i));
+    }
+}
+
+// _EncodeFunction writes the instructions back into the function's code.
+// Every instruction starts out short unless it has a big register; then any
+// jump that can't reach its target becomes WIDE, which moves everything after
+// it, so we go around again until nothing else has to grow. Returns false
+// (and leaves the function alone) if a jump doesn't fit even then.
+static bool _EncodeFunction(struct _OptFunction *function)
+{
+    for (int i = 0; i < function->count; i++) {
+        struct _OptInstruction *instruction = &(function->instructions[i]);
+        instruction->wide = _NeedsWide(instruction);
+    }
+
+    size_t *offsets = malloc((function->count + 1) * sizeof(size_t));
+    size_t length;
+    bool grew;
+    do {
+        length = 0;
+        for (int i = 0; i < function->count; i++) {
+            offsets[i] = length;
+            length += _EncodedLength(&(function->instructions[i]));
+        }
+        offsets[function->count] = length;
+
+        grew = false;
+        for (int i = 0; i < function->count; i++) {
+            struct _OptInstruction *instruction = &(function->instructions[i]);
+            if (!_IsJump(instruction->op) || instruction->wide) { continue; }
+            int64_t offset =
+                (int64_t)offsets[instruction->target] -
+                (int64_t)offsets[i + 1];
+            if (offset < INT16_MIN || offset > INT16_MAX) {
+                instruction->wide = true;
+                grew = true;
+            }
+        }
+    } while (grew);
+
+    uint8_t *code = malloc(length);
+    uint8_t *write = code;
+    bool ok = true;
+    for (int i = 0; ok && i < function->count; i++) {
+        struct _OptInstruction *instruction = &(function->instructions[i]);
+
+        MILLIE_OPCODE op = _EncodedOp(instruction);
+        bool wide = instruction->wide;
+        if (wide) { *(write++) = OP_WIDE; }
+        *(write++) = op;
+
+        for (int arg = 0; arg < 3; arg++) {
+            uint64_t value = instruction->args[arg];
+            switch(_op_info[op].args[arg]) {
+            case OPARG_REG:
+            case OPARG_DREG:
+                _WriteU(&write, value, wide ? 2 : 1);
+                break;
+
+            case OPARG_U8:
+            case OPARG_I8:
+                _WriteU(&write, value, 1);
+                break;
+
+            case OPARG_U16:
+            case OPARG_IDX:
+                _WriteU(&write, value, 2);
+                break;
+
+            case OPARG_OFF:
+                {
+                    int64_t offset =
+                        (int64_t)offsets[instruction->target] -
+                        (int64_t)offsets[i + 1];
+                    if (offset < INT32_MIN || offset > INT32_MAX) {
+                        ok = false;
+                    }
+                    _WriteU(&write, (uint64_t)offset, wide ? 4 : 2);
+                }
+                break;
+
+            case OPARG_U32:
+                _WriteU(&write, value, 4);
+                break;
+
+            case OPARG_U64:
+                _WriteU(&write, value, 8);
+                break;
+
+            case OPARG_0:
+                break;
+            }
+        }
+    }
+    free(offsets);
+
+    if (!ok) {
+        free(code);
+        return false;
+    }
+
+    free(function->code->code);
+    function->code->code = code;
+    function->code->code_length = length;
+    return true;
+}
+
+// _ShrinkFrame sets the function's register count to what its code uses now,
+// which after coalescing can be fewer than the compiler handed out. (The
+// arguments always get a register each, whether or not they're used.)
+static void _ShrinkFrame(struct _OptFunction *function)
+{
+    _RegisterSet used;
+    memset(&used, 0, sizeof(used));
+    for (int i = 0; i < function->count; i++) {
+        struct _OptInstruction *instruction = &(function->instructions[i]);
+        _AddReads(function, instruction, &used);
+        int dest = _DestArg(instruction->op);
+        if (dest >= 0) { _RegisterSetAdd(&used, instruction->args[dest]); }
+    }
+
+    size_t count = function->code->arity + 1;
+    for (size_t reg = count; reg <= UINT8_MAX; reg++) {
+        if (_RegisterSetHas(&used, reg)) { count = reg + 1; }
+    }
+    function->code->register_count = count;
+}
+
+// _Compact drops removed instructions, moving jumps to removed instructions
+// onto whatever comes after them, and works out where the basic blocks are.
+static void _Compact(struct _OptFunction *function)
+{
+    int *new_index = malloc((function->count + 1) * sizeof(int));
+    int count = 0;
+    for (int i = 0; i < function->count; i++) {
+        new_index[i] = count;
+        if (!function->instructions[i].removed) { count++; }
+    }
+    new_index[function->count] = count;
+
+    for (int i = 0; i < function->count; i++) {
+        struct _OptInstruction *instruction = &(function->instructions[i]);
+        if (instruction->removed) { continue; }
+
+        if (_IsJump(instruction->op)) {
+            instruction->target = new_index[instruction->target];
+        }
+        function->instructions[new_index[i]] = *instruction;
+    }
+    function->count = count;
+    free(new_index);
+
+    for (int i = 0; i < count; i++) {
+        function->instructions[i].leader = (i == 0);
+    }
+    for (int i = 0; i < count; i++) {
+        struct _OptInstruction *instruction = &(function->instructions[i]);
+        if (_IsJump(instruction->op)) {
+            if (instruction->target < count) {
+                function->instructions[instruction->target].leader = true;
+            }
+            if (i + 1 < count) {
+                function->instructions[i + 1].leader = true;
+            }
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Passes
+// ----------------------------------------------------------------------------
+
+// _FoldConstants tracks which registers hold known constants through each
+// basic block, and folds whatever it can.
+static bool _FoldConstants(struct _OptFunction *function)
+{
+    bool changed = false;
+    bool known[256];
+    uint64_t value[256];
+
+    for (int i = 0; i < function->count; i++) {
+        struct _OptInstruction *instruction = &(function->instructions[i]);
+        if (instruction->leader) {
+            memset(known, 0, sizeof(known));
+        }
+
+        uint64_t *args = instruction->args;
+        switch(instruction->op) {
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_EQ:
+            if (known[args[0]] && known[args[1]]) {
+                uint64_t left = value[args[0]];
+                uint64_t right = value[args[1]];
+                uint64_t result =
+                    (instruction->op == OP_ADD) ? left + right :
+                    (instruction->op == OP_SUB) ? left - right :
+                    (instruction->op == OP_MUL) ? left * right :
+                    (left == right);
+                _MakeLoadI(instruction, args[2], result);
+                changed = true;
+            }
+            break;
+
+        case OP_NEG:
+            if (known[args[0]]) {
+                _MakeLoadI(instruction, args[1], -value[args[0]]);
+                changed = true;
+            }
+            break;
+
+        case OP_MOV:
+            if (known[args[0]]) {
+                _MakeLoadI(instruction, args[1], value[args[0]]);
+                changed = true;
+            }
+            break;
+
+        case OP_JZ:
+            if (known[args[0]]) {
+                if (value[args[0]] == 0) {
+                    instruction->op = OP_JMP;
+                } else {
+                    instruction->removed = true;
+                }
+                changed = true;
+            }
+            break;
+
+        default:
+            break;
+        }
+
+        if (_IsLoadI(instruction->op)) {
+            known[args[1]] = true;
+            value[args[1]] = args[0];
+        } else {
+            int dest = _DestArg(instruction->op);
+            if (dest >= 0) { known[args[dest]] = false; }
+        }
+    }
+    return changed;
+}
+
+// _ThreadJumps sends jumps straight to where they end up going.
+static bool _ThreadJumps(struct _OptFunction *function)
+{
+    bool changed = false;
+    for (int i = 0; i < function->count; i++) {
+        struct _OptInstruction *instruction = &(function->instructions[i]);
+        if (instruction->removed || !_IsJump(instruction->op)) { continue; }
+
+        // (Bounded, in case of a loop made of nothing but jumps.)
+        for (int hops = 0; hops < function->count; hops++) {
+            int target = instruction->target;
+            if (target >= function->count) { break; }
+
+            struct _OptInstruction *next = &(function->instructions[target]);
+            if (next->op != OP_JMP || next->target == target) { break; }
+            instruction->target = next->target;
+            changed = true;
+        }
+
+        int target = instruction->target;
+        if (target == i + 1) {
+            // Jumping to the next instruction is the same as not jumping.
+            instruction->removed = true;
+            changed = true;
+        } else if (instruction->op == OP_JMP &&
+                   target < function->count &&
+                   function->instructions[target].op == OP_RET) {
+            instruction->op = OP_RET;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+// _RemoveUnreachable removes every instruction that can't be reached from
+// the start of the function.
+static bool _RemoveUnreachable(struct _OptFunction *function)
+{
+    bool *reached = calloc(function->count + 1, sizeof(bool));
+    int *work = malloc((function->count + 1) * sizeof(int));
+    int work_top = 0;
+
+    work[work_top++] = 0;
+    reached[0] = true;
+    while (work_top > 0) {
+        int i = work[--work_top];
+        if (i >= function->count) { continue; }
+
+        struct _OptInstruction *instruction = &(function->instructions[i]);
+        int successors[2];
+        int successor_count = 0;
+        if (_IsJump(instruction->op)) {
+            successors[successor_count++] = instruction->target;
+        }
+        if (instruction->op != OP_JMP &&
+            instruction->op != OP_RET &&
+            instruction->op != OP_TAILCALL) {
+            successors[successor_count++] = i + 1;
+        }
+
+        for (int s = 0; s < successor_count; s++) {
+            if (!reached[successors[s]]) {
+                reached[successors[s]] = true;
+                work[work_top++] = successors[s];
+            }
+        }
+    }
+
+    bool changed = false;
+    for (int i = 0; i < function->count; i++) {
+        if (!reached[i] && !function->instructions[i].removed) {
+            function->instructions[i].removed = true;
+            changed = true;
+        }
+    }
+    free(reached);
+    free(work);
+    return changed;
+}
+
+// _ComputeLiveness works out which registers are live after each
+// instruction, which is to say which ones might be read before they're
+// written again.
+static void _ComputeLiveness(struct _OptFunction *function)
+{
+    for (int i = 0; i < function->count; i++) {
+        memset(&(function->instructions[i].live_out), 0, sizeof(_RegisterSet));
+    }
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i = function->count - 1; i >= 0; i--) {
+            struct _OptInstruction *instruction = &(function->instructions[i]);
+
+            _RegisterSet live;
+            memset(&live, 0, sizeof(live));
+
+            int successors[2];
+            int successor_count = 0;
+            if (_IsJump(instruction->op)) {
+                successors[successor_count++] = instruction->target;
+            }
+            if (instruction->op != OP_JMP &&
+                instruction->op != OP_RET &&
+                instruction->op != OP_TAILCALL) {
+                successors[successor_count++] = i + 1;
+            }
+
+            for (int s = 0; s < successor_count; s++) {
+                if (successors[s] >= function->count) { continue; }
+
+                // live_in(next) = reads(next) + (live_out(next) - writes(next))
+                struct _OptInstruction *next =
+                    &(function->instructions[successors[s]]);
+                _RegisterSet in = next->live_out;
+                int dest = _DestArg(next->op);
+                if (dest >= 0) { _RegisterSetRemove(&in, next->args[dest]); }
+                _AddReads(function, next, &in);
+                for (int w = 0; w < 4; w++) { live.bits[w] |= in.bits[w]; }
+            }
+
+            if (memcmp(&live, &(instruction->live_out), sizeof(live)) != 0) {
+                instruction->live_out = live;
+                changed = true;
+            }
+        }
+    }
+}
+
+// _RetargetWriter looks back from instruction `before` through its block for
+// whatever wrote src, and makes it write dst instead, as long as nothing in
+// between touches either register. Returns false if it can't.
+static bool _RetargetWriter(struct _OptFunction *function, int before,
+                            uint8_t src, uint8_t dst)
+{
+    for (int k = before - 1; k >= 0; k--) {
+        struct _OptInstruction *writer = &(function->instructions[k]);
+        if (writer->removed) { continue; }
+
+        uint8_t first_reg;
+        int count;
+        if (_Writes(writer, src)) {
+            if (_GetArgumentRow(writer, &first_reg, &count)) { return false; }
+            writer->args[_DestArg(writer->op)] = dst;
+            return true;
+        }
+        if (_Reads(function, writer, src) || _Reads(function, writer, dst) ||
+            _Writes(writer, dst) || writer->leader) {
+            return false;
+        }
+    }
+    return false;
+}
+
+// _CoalesceMoves folds `MOV a => b` into the instruction that computed a,
+// when nothing else wants a, so that the value goes straight into b. (Every
+// instruction reads its sources before it writes its destination, so this is
+// fine even if that instruction reads b.)
+static bool _CoalesceMoves(struct _OptFunction *function)
+{
+    bool changed = false;
+    _ComputeLiveness(function);
+    for (int i = 0; i < function->count; i++) {
+        struct _OptInstruction *move = &(function->instructions[i]);
+        if (move->removed || move->op != OP_MOV) { continue; }
+
+        uint8_t src = move->args[0];
+        uint8_t dst = move->args[1];
+        if (src == dst) {
+            move->removed = true;
+            changed = true;
+            continue;
+        }
+        if (move->leader || _RegisterSetHas(&(move->live_out), src)) {
+            continue;
+        }
+
+        // Look back through the block for whatever wrote src, making sure
+        // nothing in between touches either register.
+        for (int j = i - 1; j >= 0; j--) {
+            struct _OptInstruction *prev = &(function->instructions[j]);
+            if (prev->removed) { continue; }
+
+            if (_Writes(prev, src)) {
+                // A call's result has to go where its arguments were, so
+                // they have to move too, which is only simple for a row of
+                // one.
+                uint8_t first_reg;
+                int count;
+                if (_GetArgumentRow(prev, &first_reg, &count)) {
+                    if (count != 1 || prev->leader ||
+                        _Reads(function, prev, dst) ||
+                        !_RetargetWriter(function, j, src, dst)) {
+                        break;
+                    }
+                }
+
+                prev->args[_DestArg(prev->op)] = dst;
+                move->removed = true;
+                changed = true;
+
+                // That moved a value from one register to another, so
+                // what's live where has changed.
+                _Compact(function);
+                _ComputeLiveness(function);
+                i = -1;
+                break;
+            }
+            if (_Reads(function, prev, src) || _Reads(function, prev, dst) ||
+                _Writes(prev, dst) || prev->leader) {
+                break;
+            }
+        }
+    }
+    return changed;
+}
+
+// _RemoveDeadCode removes pure instructions whose results are never read.
+static bool _RemoveDeadCode(struct _OptFunction *function)
+{
+    bool changed = false;
+    _ComputeLiveness(function);
+    for (int i = 0; i < function->count; i++) {
+        struct _OptInstruction *instruction = &(function->instructions[i]);
+        if (instruction->removed || !_IsPure(instruction->op)) { continue; }
+
+        uint8_t dest = instruction->args[_DestArg(instruction->op)];
+        if (!_RegisterSetHas(&(instruction->live_out), dest)) {
+            instruction->removed = true;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+// ----------------------------------------------------------------------------
+// Superinstructions
+// ----------------------------------------------------------------------------
+
+static bool _FitsI8(uint64_t value)
+{
+    return (int64_t)value >= INT8_MIN && (int64_t)value <= INT8_MAX;
+}
+
+// _IsDeadAfter is true if nothing reads the value in reg once instruction is
+// done, either because nobody wants it or because instruction replaces it.
+static bool _IsDeadAfter(struct _OptInstruction *instruction, uint8_t reg)
+{
+    return _Writes(instruction, reg) ||
+        !_RegisterSetHas(&(instruction->live_out), reg);
+}
+
+// _FuseImmediate folds a LOADI into the instruction right after it, when
+// that's the only thing that wants the constant.
+static void _FuseImmediate(struct _OptInstruction *load,
+                           struct _OptInstruction *next)
+{
+    uint64_t value = load->args[0];
+    uint8_t reg = load->args[1];
+    if (!_IsDeadAfter(next, reg)) { return; }
+
+    uint64_t *args = next->args;
+    switch(next->op) {
+    case OP_ADD:
+    case OP_EQ:
+        // (Either side will do, so put the constant on the right.)
+        if (args[0] == reg) {
+            args[0] = args[1];
+            args[1] = reg;
+        }
+        // Fall through.
+    case OP_SUB:
+        if (args[1] != reg || args[0] == reg || !_FitsI8(value)) { return; }
+        next->op =
+            (next->op == OP_ADD) ? OP_ADDI :
+            (next->op == OP_SUB) ? OP_SUBI : OP_EQI;
+        args[1] = value;
+        break;
+
+    case OP_NEW_CLOSURE:
+        if (args[0] != reg || value > UINT16_MAX) { return; }
+        next->op = OP_NEW_CLOSURE_I;
+        args[0] = value;
+        break;
+
+    default:
+        return;
+    }
+    load->removed = true;
+}
+
+// _FuseBranch folds a comparison into the JZ right after it, when the JZ is
+// the only thing that wants the result.
+static void _FuseBranch(struct _OptInstruction *compare,
+                        struct _OptInstruction *branch)
+{
+    if (compare->removed || branch->op != OP_JZ) { return; }
+    if (compare->op != OP_EQ && compare->op != OP_EQI) { return; }
+
+    uint8_t reg = compare->args[2];
+    if (branch->args[0] != reg || !_IsDeadAfter(branch, reg)) { return; }
+
+    branch->op = (compare->op == OP_EQ) ? OP_JNE : OP_JNEI;
+    branch->args[0] = compare->args[0];
+    branch->args[1] = compare->args[1];
+    compare->removed = true;
+}
+
+static void _SelectSuperinstructions(struct _OptFunction *function)
+{
+    _ComputeLiveness(function);
+    for (int i = 0; i + 1 < function->count; i++) {
+        struct _OptInstruction *instruction = &(function->instructions[i]);
+        struct _OptInstruction *next = &(function->instructions[i + 1]);
+        if (_IsLoadI(instruction->op) && !next->leader) {
+            _FuseImmediate(instruction, next);
+        }
+    }
+
+    // Now that the constants are in place, JNEI can swallow EQIs.
+    for (int i = 0; i + 1 < function->count; i++) {
+        struct _OptInstruction *instruction = &(function->instructions[i]);
+        struct _OptInstruction *next = &(function->instructions[i + 1]);
+        if (!next->leader) {
+            _FuseBranch(instruction, next);
+        }
+    }
+    _Compact(function);
+}
+
+void OptimizeFunction(struct CompiledExpression *code, int level)
+{
+    if (level <= 0) { return; }
+    if (code->register_count > 256) { return; } // See _RegisterSet.
+
+    struct _OptFunction function;
+    if (!_DecodeFunction(code, &function)) { return; }
+
+    _Compact(&function);
+    for (int round = 0; round < 16; round++) {
+        bool changed = false;
+
+        changed |= _FoldConstants(&function);
+        _Compact(&function);
+        changed |= _ThreadJumps(&function);
+        _Compact(&function);
+        changed |= _RemoveUnreachable(&function);
+        _Compact(&function);
+        changed |= _CoalesceMoves(&function);
+        _Compact(&function);
+        changed |= _RemoveDeadCode(&function);
+        _Compact(&function);
+
+        if (!changed) { break; }
+    }
+    if (level >= 2) {
+        _SelectSuperinstructions(&function);
+    }
+
+    if (_EncodeFunction(&function)) {
+        _ShrinkFrame(&function);
+    }
+    free(function.instructions);
+}
+
+bool CompactFunction(struct CompiledExpression *code)
+{
+    struct _OptFunction function;
+    if (!_DecodeFunction(code, &function)) { return false; }
+    bool ok = _EncodeFunction(&function);
+    free(function.instructions);
+    return ok;
+}
+
+void OptimizeModule(struct Module *module, int level)
+{
+    for (int i = 0; i < module->function_count; i++) {
+        OptimizeFunction(&(module->functions[i]), level);
+    }
+}
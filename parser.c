@@ -5,11 +5,17 @@
 // struct ParseContext is the record of things we're tracking while parsing, so
 // we don't have to pass quite so many arguments.
 struct ParseContext {
-    struct Arena *arena;
+    struct Ast *ast;
     struct MString *buffer;
-    struct MillieToken *tokens;
+    const uint8_t *types;
+    struct MillieTokens *tokens;
     struct SymbolTable *table;
     struct Errors **errors;
+
+    // The members of the tuples being parsed, innermost last; a tuple's
+    // members are added to the AST together once they've all been parsed.
+    struct ArrayList *tuple_stack;  // of ExpressionId
+
     uint32_t pos;
     uint32_t lost_count;
 };
@@ -20,17 +26,17 @@ struct ParseContext {
 
 static MILLIE_TOKEN _PeekToken(struct ParseContext *context)
 {
-    return context->tokens[context->pos].type;
+    return (MILLIE_TOKEN)context->types[context->pos];
 }
 
 static struct MillieToken _PrevTokenStruct(struct ParseContext *context)
 {
-    return context->tokens[context->pos-1];
+    return GetToken(context->tokens, context->pos-1);
 }
 
 static MILLIE_TOKEN _PrevToken(struct ParseContext *context)
 {
-    return context->tokens[context->pos-1].type;
+    return (MILLIE_TOKEN)context->types[context->pos-1];
 }
 
 static uint32_t _PrevPos(struct ParseContext *context)
@@ -73,7 +79,7 @@ static void _SyntaxErrorToken(struct ParseContext *context,
 
 static void _SyntaxError(struct ParseContext *context, const char *message)
 {
-    struct MillieToken token = context->tokens[context->pos];
+    struct MillieToken token = GetToken(context->tokens, context->pos);
     _SyntaxErrorToken(context, token, message);
 }
 
@@ -122,16 +128,15 @@ static Symbol _ParseSymbol(struct ParseContext *context)
 {
     Symbol symbol = INVALID_SYMBOL;
     if (_Match(context, TOK_ID)) {
-        // TODO: Work out how to avoid the allocation here without screwing up
-        //       and writing to the source buffer. (The catch is null
-        //       termination.)
+        // The lexer already hashed the identifier, and the symbol table
+        // only copies it out of the buffer the first time it sees it.
         struct MillieToken id_token = _PrevTokenStruct(context);
-        struct MString *token_value = MStringCreateN(
+        symbol = FindOrCreateSymbolN(
+            context->table,
             MStringData(context->buffer) + id_token.start,
-            id_token.length
+            id_token.length,
+            id_token.hash
         );
-        symbol = FindOrCreateSymbol(context->table, token_value);
-        MStringFree(&token_value);
     } else {
         _SyntaxError(context, "Expected an identifier");
     }
@@ -142,40 +147,36 @@ static Symbol _ParseSymbol(struct ParseContext *context)
 // Productions
 // ----------------------------------------------------------------------------
 
-static struct Expression *_ParseExpr(struct ParseContext *context);
+static ExpressionId _ParseExpr(struct ParseContext *context);
 
-static struct Expression *_ParseTuple(struct ParseContext *context);
-
-static struct Expression *_ParseTupleNext(struct ParseContext *context,
-                                          struct Expression *first)
+// _ParseTupleNext parses the rest of a tuple, after the first member and its
+// comma.
+static ExpressionId _ParseTupleNext(struct ParseContext *context,
+                                    ExpressionId first)
 {
-    struct Expression *rest = _ParseTuple(context);
-
-    int length = 2; // Assume that we just parsed the end.
-    if (rest->type == EXP_TUPLE) {
-        length = rest->tuple_length + 1;
-    }
-
-    return MakeTuple(context->arena, first, rest, length);
+    struct ArrayList *stack = context->tuple_stack;
+    unsigned int base = ArrayListAdd(stack, &first);
+    do {
+        ExpressionId member = _ParseExpr(context);
+        ArrayListAdd(stack, &member);
+    } while (_Match(context, TOK_COMMA));
+
+    ExpressionId result = MakeTuple(
+        context->ast,
+        (ExpressionId *)stack->buffer + base,
+        (int)(stack->item_count - base)
+    );
+    stack->item_count = base;
+    return result;
 }
 
-static struct Expression *_ParseTuple(struct ParseContext *context)
-{
-    struct Expression *car = _ParseExpr(context);
-    if (_Match(context, TOK_COMMA)) {
-        return _ParseTupleNext(context, car);
-    } else {
-        return MakeTupleFinal(context->arena, car);
-    }
-}
-
-static struct Expression *_ParsePrimary(struct ParseContext *context)
+static ExpressionId _ParsePrimary(struct ParseContext *context)
 {
     if (_Match(context, TOK_FALSE)) {
-        return MakeBooleanLiteral(context->arena, _PrevPos(context), false);
+        return MakeBooleanLiteral(context->ast, _PrevPos(context), false);
     }
     if (_Match(context, TOK_TRUE)) {
-        return MakeBooleanLiteral(context->arena, _PrevPos(context), true);
+        return MakeBooleanLiteral(context->ast, _PrevPos(context), true);
     }
     if (_Match(context, TOK_INT_LITERAL)) {
         uint64_t value = 0;
@@ -189,14 +190,14 @@ static struct Expression *_ParsePrimary(struct ParseContext *context)
             }
             value = new_value;
         }
-        return MakeIntegerLiteral(context->arena,  _PrevPos(context), value);
+        return MakeIntegerLiteral(context->ast,  _PrevPos(context), value);
     }
     if (_Check(context, TOK_ID)) {
         Symbol sym = _ParseSymbol(context);
-        return MakeIdentifier(context->arena, _PrevPos(context), sym);
+        return MakeIdentifier(context->ast, _PrevPos(context), sym);
     }
     if (_Match(context, TOK_LPAREN)) {
-        struct Expression *expr = _ParseExpr(context);
+        ExpressionId expr = _ParseExpr(context);
         if (_Match(context, TOK_COMMA)) {
             expr = _ParseTupleNext(context, expr);
         }
@@ -205,75 +206,90 @@ static struct Expression *_ParsePrimary(struct ParseContext *context)
     }
 
     _SyntaxError(context, "Expected an expression.");
-    return MakeSyntaxError(context->arena, context->pos);
+    return MakeSyntaxError(context->ast, context->pos);
 }
 
-static struct Expression *_ParseApplication(struct ParseContext *context)
+static ExpressionId _ParseApplication(struct ParseContext *context)
 {
-    struct Expression *expr = _ParsePrimary(context);
+    if (_Match(context, TOK_TAIL)) {
+        struct MillieToken tail_token = _PrevTokenStruct(context);
+        uint32_t token_pos = _PrevPos(context);
+        ExpressionId call = _ParseApplication(context);
+        if (AstNode(context->ast, call)->type != EXP_APPLY) {
+            _SyntaxErrorToken(
+                context,
+                tail_token,
+                "Expected a function call after 'tail'."
+            );
+            return call;
+        }
+        return MakeTailCall(context->ast, token_pos, call);
+    }
+
+    ExpressionId expr = _ParsePrimary(context);
 
     while (_PeekToken(context) >= TOK_FIRST_PRIMARY &&
            _PeekToken(context) <= TOK_LAST_PRIMARY) {
 
-        struct Expression *arg = _ParsePrimary(context);
-        expr = MakeApply(context->arena, expr, arg);
+        ExpressionId arg = _ParsePrimary(context);
+        expr = MakeApply(context->ast, expr, arg);
     }
 
     return expr;
 }
 
-static struct Expression *_ParseUnary(struct ParseContext *context)
+static ExpressionId _ParseUnary(struct ParseContext *context)
 {
     if (_MatchV(context, 2, TOK_PLUS, TOK_MINUS)) {
         MILLIE_TOKEN operator = _PrevToken(context);
         uint32_t token_pos = _PrevPos(context);
-        struct Expression *right = _ParseUnary(context);
-        return MakeUnary(context->arena, token_pos, operator, right);
+        ExpressionId right = _ParseUnary(context);
+        return MakeUnary(context->ast, token_pos, operator, right);
     }
 
     return _ParseApplication(context);
 }
 
-static struct Expression *_ParseFactor(struct ParseContext *context)
+static ExpressionId _ParseFactor(struct ParseContext *context)
 {
-    struct Expression *expr = _ParseUnary(context);
+    ExpressionId expr = _ParseUnary(context);
 
     while(_MatchV(context, 2, TOK_STAR, TOK_SLASH)) {
         MILLIE_TOKEN operator = _PrevToken(context);
-        struct Expression *right = _ParseUnary(context);
-        expr = MakeBinary(context->arena, operator, expr, right);
+        ExpressionId right = _ParseUnary(context);
+        expr = MakeBinary(context->ast, operator, expr, right);
     }
 
     return expr;
 }
 
-static struct Expression *_ParseTerm(struct ParseContext *context)
+static ExpressionId _ParseTerm(struct ParseContext *context)
 {
-    struct Expression *expr = _ParseFactor(context);
+    ExpressionId expr = _ParseFactor(context);
 
     while(_MatchV(context, 2, TOK_PLUS, TOK_MINUS)) {
         MILLIE_TOKEN operator = _PrevToken(context);
-        struct Expression *right = _ParseFactor(context);
-        expr = MakeBinary(context->arena, operator, expr, right);
+        ExpressionId right = _ParseFactor(context);
+        expr = MakeBinary(context->ast, operator, expr, right);
     }
 
     return expr;
 }
 
-static struct Expression *_ParseComparison(struct ParseContext *context)
+static ExpressionId _ParseComparison(struct ParseContext *context)
 {
-    struct Expression *expr = _ParseTerm(context);
+    ExpressionId expr = _ParseTerm(context);
 
     while(_Match(context, TOK_EQUALS)) {
         MILLIE_TOKEN operator = _PrevToken(context);
-        struct Expression *right = _ParseTerm(context);
-        expr = MakeBinary(context->arena, operator, expr, right);
+        ExpressionId right = _ParseTerm(context);
+        expr = MakeBinary(context->ast, operator, expr, right);
     }
 
     return expr;
 }
 
-static struct Expression *_ParseFn(struct ParseContext *context)
+static ExpressionId _ParseFn(struct ParseContext *context)
 {
     if (_Match(context, TOK_FN)) {
         uint32_t token_pos = _PrevPos(context);
@@ -283,31 +299,31 @@ static struct Expression *_ParseFn(struct ParseContext *context)
             TOK_ARROW,
             "Expected an => between variable and function body."
         );
-        struct Expression *body = _ParseExpr(context);
+        ExpressionId body = _ParseExpr(context);
 
-        return MakeLambda(context->arena, token_pos, variable, body);
+        return MakeLambda(context->ast, token_pos, variable, body);
     }
 
     return _ParseComparison(context);
 }
 
-static struct Expression *_ParseIf(struct ParseContext *context)
+static ExpressionId _ParseIf(struct ParseContext *context)
 {
     if (_Match(context, TOK_IF)) {
         uint32_t token_pos = _PrevPos(context);
-        struct Expression *test = _ParseExpr(context);
+        ExpressionId test = _ParseExpr(context);
         _Expect(context, TOK_THEN, "Expected 'then' after the condition.");
-        struct Expression *then_arm = _ParseExpr(context);
+        ExpressionId then_arm = _ParseExpr(context);
         _Expect(context, TOK_ELSE, "Expected 'else' after the 'then' arm.");
-        struct Expression *else_arm = _ParseExpr(context);
+        ExpressionId else_arm = _ParseExpr(context);
 
-        return MakeIf(context->arena, token_pos, test, then_arm, else_arm);
+        return MakeIf(context->ast, token_pos, test, then_arm, else_arm);
     }
 
     return _ParseFn(context);
 }
 
-static struct Expression *_ParseLet(struct ParseContext *context)
+static ExpressionId _ParseLet(struct ParseContext *context)
 {
     if (_Match(context, TOK_LET)) {
         uint32_t token_pos = _PrevPos(context);
@@ -323,42 +339,46 @@ static struct Expression *_ParseLet(struct ParseContext *context)
             TOK_EQUALS,
             "Expected an '=' after the variable in the let."
         );
-        struct Expression *value = _ParseExpr(context);
+        ExpressionId value = _ParseExpr(context);
         _Expect(
             context,
             TOK_IN,
             "Expected an 'in' after the variable value in the let."
         );
-        struct Expression *body = _ParseExpr(context);
+        ExpressionId body = _ParseExpr(context);
 
         if (is_let_rec) {
-            return MakeLetRec(context->arena, token_pos, variable, value, body);
+            return MakeLetRec(context->ast, token_pos, variable, value, body);
         } else {
-            return MakeLet(context->arena, token_pos, variable, value, body);
+            return MakeLet(context->ast, token_pos, variable, value, body);
         }
     }
 
     return _ParseIf(context);
 }
 
-static struct Expression *_ParseExpr(struct ParseContext *context)
+static ExpressionId _ParseExpr(struct ParseContext *context)
 {
     return _ParseLet(context);
 }
 
-struct Expression *ParseExpression(struct Arena *arena,
-                                   struct MillieTokens *tokens,
-                                   struct SymbolTable *symbol_table,
-                                   struct Errors **errors)
+ExpressionId ParseExpression(struct Ast *ast,
+                             struct MillieTokens *tokens,
+                             struct SymbolTable *symbol_table,
+                             struct Errors **errors)
 {
     struct ParseContext context;
-    context.arena = arena;
+    context.ast = ast;
     context.buffer = tokens->buffer;
-    context.tokens = tokens->token_array->buffer;
+    context.types = tokens->types;
+    context.tokens = tokens;
     context.pos = 0;
     context.table = symbol_table;
     context.errors = errors;
     context.lost_count = 0;
+    context.tuple_stack = ArrayListCreate(sizeof(ExpressionId), 16);
 
-    return _ParseExpr(&context);
+    ExpressionId result = _ParseExpr(&context);
+    ArrayListFree(&context.tuple_stack);
+    return result;
 }
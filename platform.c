@@ -54,7 +54,8 @@ void *ArenaAllocate(struct Arena *arena, size_t size)
     struct ArenaBlock *current_block = arena->current;
     ptrdiff_t space_remaining = -1;
     if (current_block) {
-        space_remaining = current_block->start - current_block->arena;
+        space_remaining =
+            (current_block->arena + ARENA_SIZE) - current_block->start;
     }
     if ((space_remaining < 0) || (size > (size_t)space_remaining)) {
         struct ArenaBlock *new_block = calloc(1, sizeof(struct ArenaBlock));
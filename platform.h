@@ -3,16 +3,25 @@
 // Everything needed cross-module is in here.
 // ----------------------------------------------------------------------------
 #include <assert.h>
+#include <errno.h>
 #include <limits.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #define NORETURN  __attribute__((noreturn))
+#define ALWAYS_INLINE inline __attribute__((always_inline))
 
 // ----------------------------------------------------------------------------
 // Assertion and Failure
@@ -136,22 +145,33 @@ typedef enum {
     TOK_THEN,
     TOK_ELSE,
     TOK_COMMA,
+    TOK_TAIL,
 } MILLIE_TOKEN;
 
 struct MillieToken {
     MILLIE_TOKEN type;
     unsigned int start;
     unsigned int length;
+    uint32_t hash; // CityHash32 of the characters, for TOK_ID; 0 otherwise.
 };
 
+// The tokens are kept a column at a time, since the parser mostly only looks
+// at the types.
 struct MillieTokens {
-    struct ArrayList *token_array; // of MillieToken
-    struct ArrayList *line_array;  // of int
+    uint8_t *types;                // of MILLIE_TOKEN
+    uint32_t *starts;
+    uint32_t *lengths;
+    uint32_t *hashes;              // See MillieToken.
+    uint32_t count;
+    struct ArrayList *line_array;  // of int; built the first time it's needed
     struct MString *buffer;
 };
 
 void TokensFree(struct MillieTokens **tokens_ptr);
-struct MillieTokens *LexBuffer(struct MString *buffer, struct Errors **errors);
+// LexBuffer lexes a big buffer in pieces on `threads` threads, or one for each
+// core if it's 0; the result is the same either way.
+struct MillieTokens *LexBuffer(struct MString *buffer, int threads,
+                               struct Errors **errors);
 void GetLineColumnForPosition(struct MillieTokens *tokens, unsigned int position,
                               unsigned int *line, unsigned int *col);
 struct MString *ExtractLine(struct MillieTokens *tokens, unsigned int line);
@@ -171,6 +191,10 @@ struct SymbolTable;
 struct SymbolTable *SymbolTableCreate(void);
 void SymbolTableFree(struct SymbolTable **table_ptr);
 Symbol FindOrCreateSymbol(struct SymbolTable *table, struct MString *key);
+// FindOrCreateSymbolN looks up the `length` characters at `str`, which hash to
+// `hash` with CityHash32, and only copies them if the symbol is new.
+Symbol FindOrCreateSymbolN(struct SymbolTable *table, const char *str,
+                           unsigned int length, uint32_t hash);
 struct MString *FindSymbolKey(struct SymbolTable *table, Symbol symbol);
 
 
@@ -193,16 +217,21 @@ typedef enum {
     EXP_BINARY,
     EXP_UNARY,
     EXP_TUPLE,
-    EXP_TUPLE_FINAL,
+    EXP_TAILCALL,
 } ExpressionType;
 
+// The AST is one array of expressions, which refer to each other by index.
+// Every expression comes after the ones it's made of (the parser makes them
+// bottom up), so the root is the last one.
+typedef uint32_t ExpressionId;
+
 struct Expression {
     ExpressionType type;
     union
     {
         struct
         {
-            struct Expression *lambda_body;
+            ExpressionId lambda_body;
             Symbol lambda_id;
         };
         struct
@@ -211,86 +240,109 @@ struct Expression {
         };
         struct
         {
-            struct Expression *apply_function;
-            struct Expression *apply_argument;
+            // (Shared by EXP_APPLY and EXP_TAILCALL.)
+            ExpressionId apply_function;
+            ExpressionId apply_argument;
         };
         struct
         {
             Symbol let_id;
-            struct Expression *let_value;
-            struct Expression *let_body;
+            ExpressionId let_value;
+            ExpressionId let_body;
         };
         struct
         {
-            uint64_t literal_value;
+            // (In halves, so that the union doesn't need 8-byte alignment;
+            // see ExpressionLiteral.)
+            uint32_t literal_low;
+            uint32_t literal_high;
         };
         struct
         {
-            struct Expression *if_test;
-            struct Expression *if_then;
-            struct Expression *if_else;
+            ExpressionId if_test;
+            ExpressionId if_then;
+            ExpressionId if_else;
         };
         struct
         {
             MILLIE_TOKEN binary_operator;
-            struct Expression *binary_left;
-            struct Expression *binary_right;
+            ExpressionId binary_left;
+            ExpressionId binary_right;
         };
         struct
         {
             MILLIE_TOKEN unary_operator;
-            struct Expression *unary_arg;
+            ExpressionId unary_arg;
         };
         struct
         {
-            struct Expression *tuple_first;
-            struct Expression *tuple_rest;
-            int tuple_length;
+            // The members are tuple_length entries of the AST's
+            // tuple_members, from tuple_first; tuple_index is the tuple's
+            // entry in tuple_types. (See AstTupleMember and AstTupleType.)
+            uint32_t tuple_first;
+            uint32_t tuple_length;
+            uint32_t tuple_index;
         };
     };
     uint32_t start_token;
     uint32_t end_token;
 };
 
-struct Expression *MakeSyntaxError(struct Arena *arena, uint32_t position);
-struct Expression *MakeLambda(struct Arena *arena, uint32_t start_token,
-                              Symbol variable, struct Expression *body);
-struct Expression *MakeIdentifier(struct Arena *arena, uint32_t token_pos,
-                                  Symbol id);
-struct Expression *MakeApply(struct Arena *arena, struct Expression *func_expr,
-                             struct Expression *arg_expr);
-struct Expression *MakeLet(struct Arena *arena, uint32_t let_pos,
-                           Symbol variable, struct Expression *value,
-                           struct Expression *body);
-struct Expression *MakeLetRec(struct Arena *arena, uint32_t let_pos,
-                              Symbol variable, struct Expression *value,
-                              struct Expression *body);
-struct Expression *MakeIf(struct Arena *arena, uint32_t if_pos,
-                          struct Expression *test,
-                          struct Expression *then_branch,
-                          struct Expression *else_branch);
-struct Expression *MakeBinary(struct Arena *arena, MILLIE_TOKEN op,
-                              struct Expression *left,
-                              struct Expression *right);
-struct Expression *MakeUnary(struct Arena *arena, uint32_t operator_pos,
-                             MILLIE_TOKEN op, struct Expression *arg);
-struct Expression *MakeBooleanLiteral(struct Arena *arena, uint32_t pos,
-                                      bool value);
-struct Expression *MakeIntegerLiteral(struct Arena *arena, uint32_t pos,
-                                      uint64_t value);
-struct Expression *MakeTuple(struct Arena *arena, struct Expression *first,
-                             struct Expression *rest, int length);
-struct Expression *MakeTupleFinal(struct Arena *arena, struct Expression *expr);
+// A type is an index into a TypeStore; 0 is no type. (See the Type Checker.)
+typedef uint32_t TypeId;
+
+struct Ast {
+    struct ArrayList *nodes;          // of Expression
+    struct ArrayList *tuple_members;  // of ExpressionId
+
+    // The type of each tuple, which the type checker fills in, for the
+    // compiler to lay it out by.
+    struct ArrayList *tuple_types;    // of TypeId
+};
+
+struct Ast *AstCreate(void);
+void AstFree(struct Ast **ast_ptr);
+size_t AstAllocated(struct Ast *ast);
+struct Expression *AstNode(struct Ast *ast, ExpressionId id);
+ExpressionId AstTupleMember(struct Ast *ast, struct Expression *tuple, int i);
+TypeId AstTupleType(struct Ast *ast, struct Expression *tuple);
+void AstSetTupleType(struct Ast *ast, struct Expression *tuple, TypeId type);
+uint64_t ExpressionLiteral(struct Expression *expression);
+
+ExpressionId MakeSyntaxError(struct Ast *ast, uint32_t position);
+ExpressionId MakeLambda(struct Ast *ast, uint32_t start_token,
+                        Symbol variable, ExpressionId body);
+ExpressionId MakeIdentifier(struct Ast *ast, uint32_t token_pos, Symbol id);
+ExpressionId MakeApply(struct Ast *ast, ExpressionId func_expr,
+                       ExpressionId arg_expr);
+ExpressionId MakeTailCall(struct Ast *ast, uint32_t tail_pos,
+                          ExpressionId apply_expr);
+ExpressionId MakeLet(struct Ast *ast, uint32_t let_pos, Symbol variable,
+                     ExpressionId value, ExpressionId body);
+ExpressionId MakeLetRec(struct Ast *ast, uint32_t let_pos, Symbol variable,
+                        ExpressionId value, ExpressionId body);
+ExpressionId MakeIf(struct Ast *ast, uint32_t if_pos, ExpressionId test,
+                    ExpressionId then_branch, ExpressionId else_branch);
+ExpressionId MakeBinary(struct Ast *ast, MILLIE_TOKEN op, ExpressionId left,
+                        ExpressionId right);
+ExpressionId MakeUnary(struct Ast *ast, uint32_t operator_pos,
+                       MILLIE_TOKEN op, ExpressionId arg);
+ExpressionId MakeBooleanLiteral(struct Ast *ast, uint32_t pos, bool value);
+ExpressionId MakeIntegerLiteral(struct Ast *ast, uint32_t pos,
+                                uint64_t value);
+// MakeTuple makes a tuple of the `length` members at `members`.
+ExpressionId MakeTuple(struct Ast *ast, ExpressionId *members, int length);
 void DumpExpression(struct SymbolTable *table, struct MillieTokens *tokens,
-                    struct Expression *expression);
+                    struct Ast *ast, ExpressionId expression);
 
 
 // ----------------------------------------------------------------------------
 // Parser
 // ----------------------------------------------------------------------------
 
-struct Expression *ParseExpression(struct Arena *arena,
-                                   struct MillieTokens *tokens,
+// ParseExpression adds the expression to the AST, and returns its root.
+ExpressionId ParseExpression(struct Ast *ast,
+                             struct MillieTokens *tokens,
                                    struct SymbolTable *symbol_table,
                                    struct Errors **errors);
 
@@ -312,28 +364,77 @@ typedef enum {
     TYPEEXP_TUPLE_FINAL,
 } TypeExpType;
 
+// Types are nodes in one array, a TypeStore, and refer to each other by
+// their index in it, so a node is 20 bytes, and the nodes made together are
+// next to each other.
 struct TypeExp {
-    TypeExpType type;
+    TypeExpType type : 8;
+
+    // For a variable that hasn't been bound, a bound on how long the chains of
+    // variables bound to it are. (See _UnifyTypeVariables.)
+    unsigned rank : 8;
+
+    // For a variable, how many lets deep it was made, which only goes down as
+    // it's unified with variables from further out; for anything else, at
+    // least the level of every variable in it. (See typecheck.c.)
+    int level;
+
     union
     {
-        struct TypeExp *arg_first;
-        struct TypeExp *func_from;
-        struct TypeExp *tuple_first;
-        struct TypeExp *var_instance;
+        TypeId arg_first;
+        TypeId func_from;
+        TypeId tuple_first;
+        TypeId var_instance;
     };
     union
     {
-        struct TypeExp *arg_second;
-        struct TypeExp *func_to;
-        struct TypeExp *tuple_rest;
-        struct TypeExp *var_temp_other;
+        TypeId arg_second;
+        TypeId func_to;
+        TypeId tuple_rest;
     };
+
+    // Scratch space for the traversals in typecheck.c, which is 0 except
+    // while one of them is going on.
+    uint32_t temp;
 };
 
-struct MString *FormatTypeExpression(struct TypeExp *type);
-struct TypeExp *GetExpressionType(
-    struct Arena *arena,
-    struct Expression *node,
+struct TypeStore {
+    struct ArrayList *nodes;    // of TypeExp
+};
+
+struct TypeStore *TypeStoreCreate(void);
+void TypeStoreFree(struct TypeStore **store);
+size_t TypeStoreAllocated(struct TypeStore *store);
+TypeId TypeStoreAdd(struct TypeStore *store, TypeExpType type,
+                    TypeId first, TypeId second);
+
+// TypeAt is the node for the type, which only stays put until the next one is
+// added. ResolveType is the node for what the type is, following the
+// variables bound to something else.
+struct TypeExp *TypeAt(struct TypeStore *store, TypeId type);
+struct TypeExp *ResolveType(struct TypeStore *store, TypeId type);
+
+struct MString *FormatTypeExpression(struct TypeStore *store, TypeId type);
+
+// A packed tuple (see TUPLE_PACKED) has the members that take a word first,
+// in order, and then the bools, a byte each, so that nothing needs padding.
+// PackedMemberSize returns how many bytes a member of this type takes: one for
+// a bool, and a word for anything else, or 0 for a type variable, which could
+// be either.
+//
+// PackedTupleLayout fills in the byte offset of each member of a packed tuple
+// of this type, in the order the type has them, and returns how many bytes it
+// takes up; or 0, without filling anything in, if some member's size is 0.
+// TupleTypeLength is how many members there are.
+int PackedMemberSize(struct TypeStore *store, TypeId type);
+size_t PackedTupleLayout(struct TypeStore *store, TypeId type,
+                         size_t *offsets);
+int TupleTypeLength(struct TypeStore *store, TypeId type);
+
+TypeId GetExpressionType(
+    struct TypeStore *store,
+    struct Ast *ast,
+    ExpressionId node,
     struct MillieTokens *tokens,
     struct Errors **errors);
 
@@ -385,19 +486,192 @@ struct CompiledExpression {
         struct RuntimeClosure static_closure;
     };
 
-    uint8_t result_register;
+    uint16_t result_register;
+
+    // How many 64-bit words the frame sets aside, above its registers, for
+    // the objects that NEW_CLOSURE_S and NEW_TUPLE_S put on the stack.
+    size_t stack_words;
+
+    // How many arguments the function takes, in r1 and up. Every function
+    // takes one, except for the uncurried entries below.
+    uint8_t arity;
+
+    // For `fn x => fn y => ...`, the compiler also writes an uncurried entry
+    // that takes all of the arguments at once (see CALLN), and this is its
+    // function ID; otherwise it's 0. The entry expects this function's
+    // closure in r0.
+    int uncurried_id;
+
+    // How many times this has been entered, by a call or a loop, while
+    // interpreted; once it is hot enough the VM hands it to JitCompile.
+    uint32_t hotness;
+    struct JitCode *jit;
 };
 
 struct Module {
     struct CompiledExpression *functions;
     int function_count;
     int function_capacity;
+
+    // How many loads of captured values out of closures the compiler wrote,
+    // and how many more it would have if it didn't keep them in registers.
+    int closure_loads;
+    int closure_loads_saved;
 };
 
 void ModuleInit(struct Module *module);
-int CompileExpression(struct Expression *expression,
+int CompileExpression(struct Ast *ast,
+                      struct TypeStore *store,
+                      ExpressionId expression,
                       struct MillieTokens *tokens,
                       struct Errors **errors,
                       struct Module *result);
 
+
+// ----------------------------------------------------------------------------
+// Optimizer
+// ----------------------------------------------------------------------------
+
+// The level is as for the -O switch: 0 does nothing, 1 cleans up, and 2 also
+// picks out superinstructions.
+void OptimizeFunction(struct CompiledExpression *code, int level);
+void OptimizeModule(struct Module *module, int level);
+
+// CompactFunction re-encodes the code the compiler wrote, which is all WIDE,
+// using the short forms wherever they fit. It returns false if the code
+// doesn't make sense.
+bool CompactFunction(struct CompiledExpression *code);
+
+
+// ----------------------------------------------------------------------------
+// Bytecode Cache
+// ----------------------------------------------------------------------------
+
+// LoadCachedModule fills in the module, the id of the function to run, and
+// the type of its result from the cache entry for the source, if there is a
+// good one; the code stays in a read-only mapping of the file. The type is
+// added to the store. WriteCachedModule writes the entry, after the module
+// has been optimized at the given level.
+bool LoadCachedModule(const char *cache_dir, struct MString *source,
+                      int optimize_level, struct TypeStore *store,
+                      struct Module *module, int *func_id, TypeId *type);
+bool WriteCachedModule(const char *cache_dir, struct MString *source,
+                       int optimize_level, struct Module *module,
+                       int func_id, struct TypeStore *store, TypeId type);
+bool ClearCache(const char *cache_dir);
+
+
+// ----------------------------------------------------------------------------
+// Garbage Collected Heap
+// ----------------------------------------------------------------------------
+
+#define DEFAULT_HEAP_LIMIT ((size_t)4 * 1024 * 1024 * 1024)
+
+struct Heap;
+
+struct HeapStats {
+    size_t allocated_bytes;   // Over the lifetime of the heap.
+    size_t allocated_objects; // Over the lifetime of the heap.
+    size_t promoted_bytes;    // Survived a minor collection.
+    size_t minor_collections;
+    size_t major_collections;
+    size_t live_bytes;        // As of the last collection.
+    size_t heap_bytes;
+    size_t peak_heap_bytes;
+};
+
+// A HeapRootScanner calls HeapMarkRange on everything that might refer to an
+// object in the heap.
+typedef void (*HeapRootScanner)(struct Heap *heap, void *context);
+
+struct Heap *HeapCreate(size_t heap_limit);
+void HeapFree(struct Heap **heap_ptr);
+void HeapSetRootScanner(struct Heap *heap, HeapRootScanner scanner,
+                        void *context);
+uint64_t *HeapAllocate(struct Heap *heap, size_t slot_count);
+void HeapMarkRange(struct Heap *heap, uint64_t *start, uint64_t *end);
+void HeapCollect(struct Heap *heap, bool major);
+struct HeapStats HeapGetStats(struct Heap *heap);
+
+
+// ----------------------------------------------------------------------------
+// Runtime Objects
+// ----------------------------------------------------------------------------
+
+// A tuple's members take a word each, unless the length it was allocated with
+// has TUPLE_PACKED set: then they're packed as their types allow (see
+// PackedMemberSize), and the length is the number of words they take up that
+// way. Whoever reads a tuple has to ask which it is, since the same code can
+// make tuples of different types when it's polymorphic, and only the code that
+// knows the types can pack them.
+#define TUPLE_PACKED ((uint64_t)1 << 32)
+
+struct RuntimeClosure *AllocateClosure(struct Heap *heap, int func_id,
+                                       size_t slot_count);
+uint64_t *AllocateTuple(struct Heap *heap, uint64_t size);
+bool TupleIsPacked(const uint64_t *tuple);
+
+
+// ----------------------------------------------------------------------------
+// Compiled Programs
+// ----------------------------------------------------------------------------
+//
+// The runtime support for programs written out by EmitC; see rt.c.
+//
+typedef uint64_t (*CompiledFunction)(uint64_t closure, uint64_t arg0);
+
+extern char *CompiledStackLimit;
+
+NORETURN void CompiledStackOverflow(void);
+uint64_t CompiledNewClosure(int func_id, size_t slot_count);
+uint64_t CompiledNewTuple(uint64_t size);
+bool RunCompiledProgram(CompiledFunction entry, size_t stack_size,
+                        size_t heap_limit, void (*print_result)(uint64_t));
+
+
+// ----------------------------------------------------------------------------
+// JIT
+// ----------------------------------------------------------------------------
+
+struct JitCode;
+
+extern const bool JitAvailable;
+
+bool JitCompile(struct CompiledExpression *code);
+const uint8_t *JitRun(struct CompiledExpression *code, const uint8_t *ip,
+                      uint64_t *registers);
+void JitFree(struct CompiledExpression *code);
+
+
+// ----------------------------------------------------------------------------
+// Runtime
+// ----------------------------------------------------------------------------
+
+#define DEFAULT_VM_STACK_SIZE (64 * 1024 * 1024)
+
+typedef enum {
+    JIT_NEVER,  // Interpret everything.
+    JIT_HOT,    // Compile functions once they are hot.
+    JIT_ALWAYS, // Compile every function the first time it runs.
+} JIT_MODE;
+
+struct VM;
+
+struct VM *VMCreate(struct Module *module, struct Heap *heap,
+                    size_t stack_size, JIT_MODE jit_mode);
+void VMFree(struct VM **vm_ptr);
+size_t VMStackAllocations(struct VM *vm);
+bool EvaluateCode(struct VM *vm, int func_id, uint64_t closure, uint64_t arg0,
+                  uint64_t *result);
+void VMPrintDispatchStats(FILE *output);
+
+
+// ----------------------------------------------------------------------------
+// C Backend
+// ----------------------------------------------------------------------------
+
+bool EmitC(FILE *output, struct Module *module, int func_id,
+           struct TypeStore *store, TypeId type, size_t stack_size,
+           size_t heap_limit);
+
 #define PLATFORM_INCLUDED
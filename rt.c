@@ -0,0 +1,162 @@
+#ifndef PLATFORM_INCLUDED
+#include "platform.h"
+#endif
+
+/*
+ * The parts of the runtime that don't depend on the bytecode VM.
+ *
+ * This file is built into millie itself, and it is also the whole runtime
+ * for programs written out by --emit-c (see emitc.c), which are linked
+ * against just this and gc.c:
+ *
+ *    cc -O2 -I path/to/millie program.c path/to/millie/rt.c \
+ *        path/to/millie/gc.c -o program
+ */
+
+// ----------------------------------------------------------------------------
+// Objects
+// ----------------------------------------------------------------------------
+//
+// A closure is the function ID followed by one slot per captured value; a
+// tuple is just its members, end to end. (See RuntimeClosure, and
+// TUPLE_PACKED, which is kept in the upper half of the tuple's header.)
+//
+struct RuntimeClosure *AllocateClosure(struct Heap *heap, int func_id,
+                                       size_t slot_count)
+{
+    uint64_t *object = HeapAllocate(heap, slot_count + 1);
+    if (!object) { return NULL; }
+
+    struct RuntimeClosure *closure = (struct RuntimeClosure *)object;
+    closure->function_id = func_id;
+    return closure;
+}
+
+uint64_t *AllocateTuple(struct Heap *heap, uint64_t size)
+{
+    uint64_t *tuple = HeapAllocate(heap, size & UINT32_MAX);
+    if (!tuple) { return NULL; }
+
+    tuple[-1] |= size & TUPLE_PACKED;
+    return tuple;
+}
+
+bool TupleIsPacked(const uint64_t *tuple)
+{
+    return (tuple[-1] & TUPLE_PACKED) != 0;
+}
+
+// ----------------------------------------------------------------------------
+// Compiled Programs
+// ----------------------------------------------------------------------------
+//
+// A compiled program keeps its registers in C locals, so there's no register
+// stack for the collector to look at. Instead the whole C stack of the thread
+// running the program is scanned, conservatively, the same way the VM stack
+// is. The program runs on its own thread so that it gets a stack of the size
+// it was compiled for, and so that we know where that stack ends.
+//
+// Every compiled function checks CompiledStackLimit on entry, so that running
+// out of stack is an error instead of a crash.
+//
+
+char *CompiledStackLimit;
+
+static struct Heap *_compiled_heap;
+static uint64_t *_compiled_stack_top;
+
+// How much of the thread's stack we keep back for the runtime itself, below
+// CompiledStackLimit.
+#define COMPILED_STACK_RESERVE (256 * 1024)
+
+struct _CompiledRun {
+    CompiledFunction entry;
+    size_t stack_size;
+    uint64_t result;
+};
+
+NORETURN void CompiledStackOverflow(void)
+{
+    fprintf(stderr, "ERROR: stack overflow\n");
+    exit(1);
+}
+
+uint64_t CompiledNewClosure(int func_id, size_t slot_count)
+{
+    struct RuntimeClosure *closure = AllocateClosure(
+        _compiled_heap,
+        func_id,
+        slot_count
+    );
+    if (!closure) { exit(1); } // (HeapAllocate has already said why.)
+    return (uint64_t)closure;
+}
+
+uint64_t CompiledNewTuple(uint64_t size)
+{
+    uint64_t *tuple = AllocateTuple(_compiled_heap, size);
+    if (!tuple) { exit(1); }
+    return (uint64_t)tuple;
+}
+
+// _ScanFrom marks everything from its own frame to the top of the stack.
+// It's a separate function so that its frame is below the callee-saved
+// registers that _ScanCompiledRoots spilled.
+static __attribute__((noinline)) void _ScanFrom(struct Heap *heap)
+{
+    volatile uint64_t marker = 0;
+    HeapMarkRange(heap, (uint64_t *)&marker, _compiled_stack_top);
+}
+
+static void _ScanCompiledRoots(struct Heap *heap, void *context)
+{
+    (void)context;
+
+    // A live value might only be in a callee-saved register right now, so
+    // get them all onto the stack where the scan will see them.
+    __builtin_unwind_init();
+    _ScanFrom(heap);
+}
+
+static void *_CompiledThread(void *context)
+{
+    struct _CompiledRun *run = (struct _CompiledRun *)context;
+
+    // This is the first frame on the thread's stack, so everything the
+    // program does happens below here.
+    uint64_t top = 0;
+    _compiled_stack_top = &top + 1;
+    CompiledStackLimit = (char *)&top - run->stack_size;
+    run->result = run->entry(0, 0);
+    return NULL;
+}
+
+bool RunCompiledProgram(CompiledFunction entry, size_t stack_size,
+                        size_t heap_limit, void (*print_result)(uint64_t))
+{
+    _compiled_heap = HeapCreate(heap_limit);
+    HeapSetRootScanner(_compiled_heap, _ScanCompiledRoots, NULL);
+
+    struct _CompiledRun run = {
+        .entry = entry,
+        .stack_size = stack_size,
+        .result = 0
+    };
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, stack_size + 2 * COMPILED_STACK_RESERVE);
+
+    pthread_t thread;
+    bool ok = (pthread_create(&thread, &attr, _CompiledThread, &run) == 0);
+    pthread_attr_destroy(&attr);
+    if (!ok) {
+        fprintf(stderr, "ERROR: unable to start the program thread\n");
+        HeapFree(&_compiled_heap);
+        return false;
+    }
+    pthread_join(thread, NULL);
+
+    print_result(run.result);
+    HeapFree(&_compiled_heap);
+    return true;
+}
@@ -2,19 +2,10 @@
 #include "platform.h"
 #endif
 
-struct Frame {
-    uint64_t *registers;
-};
-
-static uint8_t _ReadU8(const uint8_t **buffer_ptr);
-static uint16_t _ReadU16(const uint8_t **buffer_ptr);
-static uint32_t _ReadU32(const uint8_t **buffer_ptr);
-static uint64_t _ReadU64(const uint8_t **buffer_ptr);
-
-// For watching the execution of the VM, obvs.
-// #define VM_TRACE
-
-#ifdef VM_TRACE
+static ALWAYS_INLINE uint8_t _ReadU8(const uint8_t **buffer_ptr);
+static ALWAYS_INLINE uint16_t _ReadU16(const uint8_t **buffer_ptr);
+static ALWAYS_INLINE uint32_t _ReadU32(const uint8_t **buffer_ptr);
+static ALWAYS_INLINE uint64_t _ReadU64(const uint8_t **buffer_ptr);
 
 typedef enum OP_ARG_TYPE {
     OPARG_0 = 0,
@@ -26,8 +17,11 @@ typedef enum OP_ARG_TYPE {
     OPARG_U32,
     OPARG_U64,
     OPARG_IDX,
+    OPARG_I8,
 } OP_ARG_TYPE;
 
+// The name and arguments of each instruction, for anything that needs to
+// pick bytecode apart, like the disassembler and the optimizer.
 static const struct OpInfo {
     const char *name;
     OP_ARG_TYPE args[3];
@@ -46,26 +40,40 @@ static const struct OpInfo {
 #undef Q
 };
 
+// For watching the execution of the VM, obvs.
+// #define VM_TRACE
+
+#ifdef VM_TRACE
+
 // TraceInstruction disassembles an instruction and prints the details.
 static const uint8_t *_TraceInstruction(const uint8_t *ip,
                                         struct CompiledExpression *def)
 {
-    const struct OpInfo *info = &(_op_info[*ip]);
     ptrdiff_t offset = ip - def->code;
-    fprintf(stderr, "%05td %s", offset, info->name);
+    bool wide = (*ip == OP_WIDE);
+    if (wide) { ip++; }
+    const struct OpInfo *info = &(_op_info[*ip]);
+    fprintf(stderr, "%05td %s%s", offset, wide ? "WIDE " : "", info->name);
     ip++;
     for(int i = 0; i < 3; i++) {
         switch(info->args[i]) {
-        case OPARG_REG: fprintf(stderr, " r%d",     _ReadU8(&ip)); break;
-        case OPARG_DREG: fprintf(stderr, " => r%d", _ReadU8(&ip)); break;
+        case OPARG_REG:
+            fprintf(stderr, " r%d", wide ? _ReadU16(&ip) : _ReadU8(&ip));
+            break;
+        case OPARG_DREG:
+            fprintf(stderr, " => r%d", wide ? _ReadU16(&ip) : _ReadU8(&ip));
+            break;
         case OPARG_U8:  fprintf(stderr, " %02x",    _ReadU8(&ip)); break;
+        case OPARG_I8:  fprintf(stderr, " %d",  (int8_t)_ReadU8(&ip)); break;
         case OPARG_U16: fprintf(stderr, " %04x",    _ReadU16(&ip)); break;
         case OPARG_U32: fprintf(stderr, " %08x",    _ReadU32(&ip)); break;
         case OPARG_U64: fprintf(stderr, " %llx",    _ReadU64(&ip)); break;
         case OPARG_IDX: fprintf(stderr, "[%d]",  (int16_t)_ReadU16(&ip)); break;
         case OPARG_OFF:
             {
-                int16_t offset = (int16_t)_ReadU16(&ip);
+                int32_t offset = wide
+                    ? (int32_t)_ReadU32(&ip)
+                    : (int16_t)_ReadU16(&ip);
                 ptrdiff_t target_offset = (ip + offset) - def->code;
                 fprintf(stderr, " %d (%05td)", offset, target_offset);
             }
@@ -77,28 +85,26 @@ static const uint8_t *_TraceInstruction(const uint8_t *ip,
 }
 
 static void _TraceStep(const uint8_t *code,
-                     struct CompiledExpression *def,
-                     struct Frame *frame)
+                       struct CompiledExpression *def,
+                       uint64_t *registers)
 {
-    fprintf(stderr, "  Frame: %p\n", frame);
+    fprintf(stderr, "  Frame: %p\n", registers);
     for(size_t i = 0; i < def->register_count; i++) {
-        fprintf(stderr, "    r%zu: 0x%llx\n", i, frame->registers[i]);
+        fprintf(stderr, "    r%zu: 0x%llx\n", i, registers[i]);
     }
     _TraceInstruction(code, def);
     fprintf(stderr, "\n\n");
 }
 
 static void _TraceFunctionBody(struct Module *module,
-                               int func_id,
+                               struct CompiledExpression *def,
                                const uint8_t *curr_ip,
-                               uint64_t closure,
-                               uint64_t arg0)
+                               uint64_t *registers)
 {
     const char *what = (curr_ip == NULL) ? "Called" : "Returned to";
-    fprintf(stderr, "%s %p: %d\n", what, module, func_id);
-    fprintf(stderr, "  Closure: %llx  Arg0: %llx\n", closure, arg0);
+    fprintf(stderr, "%s %p: %td\n", what, module, def - module->functions);
+    fprintf(stderr, "  Closure: %llx  Arg0: %llx\n", registers[0], registers[1]);
 
-    struct CompiledExpression *def = &(module->functions[func_id]);
     const uint8_t *ip = def->code;
 
     if (curr_ip == NULL) { curr_ip = ip; }
@@ -117,29 +123,56 @@ static void _TraceFunctionBody(struct Module *module,
     fprintf(stderr, "\n");
 }
 
-#define TRACE_STEP(ip, def, frame) _TraceStep(ip, def, frame)
-#define TRACE_ENTER(module, func_id, closure, arg0) \
-    _TraceFunctionBody(module, func_id, NULL, closure, arg0)
-#define TRACE_RETURN(module, func_id, ip, closure, arg0) \
-    _TraceFunctionBody(module, func_id, ip, closure, arg0)
+#define TRACE_STEP(ip, def, registers) _TraceStep(ip, def, registers)
+#define TRACE_ENTER(module, def, registers) \
+    _TraceFunctionBody(module, def, NULL, registers)
+#define TRACE_RETURN(module, def, ip, registers) \
+    _TraceFunctionBody(module, def, ip, registers)
+
+#else
+
+#define TRACE_STEP(ip, def, registers)
+#define TRACE_ENTER(module, def, registers)
+#define TRACE_RETURN(module, def, ip, registers)
+
+#endif
+
+// For counting what the VM spends its time dispatching, build with
+// -DVM_STATS; --verbose then prints how often each instruction, and each pair
+// of instructions, was dispatched. (Instructions run by the JIT don't count,
+// so use --jit never.)
+#ifdef VM_STATS
+
+static uint64_t _dispatch_counts[256];
+static uint64_t _pair_counts[256][256];
+static uint8_t _last_dispatched;
+
+static void _CountDispatch(const uint8_t *ip)
+{
+    _dispatch_counts[*ip]++;
+    _pair_counts[_last_dispatched][*ip]++;
+    _last_dispatched = *ip;
+}
+
+#define STATS_STEP(ip) _CountDispatch(ip)
 
 #else
 
-#define TRACE_STEP(ip, def, frame)
-#define TRACE_ENTER(module, func_id, closure, arg0)
-#define TRACE_RETURN(module, func_id, ip, closure, arg0)
+#define STATS_STEP(ip)
 
 #endif
 
 
 
-static uint8_t _ReadU8(const uint8_t **buffer_ptr) {
+// These take the address of the handler's ip, so they have to be inlined for
+// the tail calls in VM_DISPATCH_TAILCALL to stay tail calls.
+static ALWAYS_INLINE uint8_t _ReadU8(const uint8_t **buffer_ptr) {
     const uint8_t *buffer = *buffer_ptr;
     *buffer_ptr += 1;
     return buffer[0];
 }
 
-static uint16_t _ReadU16(const uint8_t **buffer_ptr) {
+static ALWAYS_INLINE uint16_t _ReadU16(const uint8_t **buffer_ptr) {
     const uint8_t *buffer = *buffer_ptr;
     *buffer_ptr += 2;
     return
@@ -147,7 +180,7 @@ static uint16_t _ReadU16(const uint8_t **buffer_ptr) {
         (((uint16_t)buffer[1]) << 8);
 }
 
-static uint32_t _ReadU32(const uint8_t **buffer_ptr) {
+static ALWAYS_INLINE uint32_t _ReadU32(const uint8_t **buffer_ptr) {
     const uint8_t *buffer = *buffer_ptr;
     *buffer_ptr += 4;
     return
@@ -157,7 +190,7 @@ static uint32_t _ReadU32(const uint8_t **buffer_ptr) {
         (((uint32_t)buffer[3]) << 24);
 }
 
-static uint64_t _ReadU64(const uint8_t **buffer_ptr) {
+static ALWAYS_INLINE uint64_t _ReadU64(const uint8_t **buffer_ptr) {
     const uint8_t *buffer = *buffer_ptr;
     *buffer_ptr += 8;
     return
@@ -171,249 +204,690 @@ static uint64_t _ReadU64(const uint8_t **buffer_ptr) {
         (((uint64_t)buffer[7]) << 56);
 }
 
-size_t LifetimeAllocations = 0;
+// In an instruction after a WIDE prefix, registers and jump offsets are
+// twice as big (see opcodes.inc). These are for whatever picks the bytecode
+// apart; the handlers in handlers.inc are built once each way instead.
+static ALWAYS_INLINE uint16_t _ReadReg(const uint8_t **buffer_ptr, bool wide)
+{
+    return wide ? _ReadU16(buffer_ptr) : _ReadU8(buffer_ptr);
+}
 
-static struct RuntimeClosure *_AllocateClosure(int func_id, int slot_count)
+static ALWAYS_INLINE int32_t _ReadOff(const uint8_t **buffer_ptr, bool wide)
 {
-    size_t alloc_size =
-        sizeof(struct RuntimeClosure) + (slot_count * sizeof(uint64_t));
+    return wide ? (int32_t)_ReadU32(buffer_ptr) : (int16_t)_ReadU16(buffer_ptr);
+}
+
+#define _ARGSIZE_0    0
+#define _ARGSIZE_REG  1
+#define _ARGSIZE_DREG 1
+#define _ARGSIZE_U8   1
+#define _ARGSIZE_U16  2
+#define _ARGSIZE_U32  4
+#define _ARGSIZE_U64  8
+#define _ARGSIZE_OFF  2
+#define _ARGSIZE_IDX  2
+#define _ARGSIZE_I8   1
+
+// The length of each instruction, in bytes, including the opcode.
+static const uint8_t _instruction_length[] = {
+#define OPCODE(name, arg0, arg1, arg2) \
+    1 + _ARGSIZE_##arg0 + _ARGSIZE_##arg1 + _ARGSIZE_##arg2,
+#include "opcodes.inc"
+#undef OPCODE
+};
 
-    LifetimeAllocations += alloc_size;
-    struct RuntimeClosure *closure = malloc(alloc_size);
-    closure->function_id = func_id;
+// The same, for after a WIDE prefix (not counting the prefix).
+#define _WIDESIZE_REG  2
+#define _WIDESIZE_DREG 2
+#define _WIDESIZE_OFF  4
+#define _WIDESIZE_0    _ARGSIZE_0
+#define _WIDESIZE_U8   _ARGSIZE_U8
+#define _WIDESIZE_U16  _ARGSIZE_U16
+#define _WIDESIZE_U32  _ARGSIZE_U32
+#define _WIDESIZE_U64  _ARGSIZE_U64
+#define _WIDESIZE_IDX  _ARGSIZE_IDX
+#define _WIDESIZE_I8   _ARGSIZE_I8
+
+static const uint8_t _wide_instruction_length[] = {
+#define OPCODE(name, arg0, arg1, arg2) \
+    1 + _WIDESIZE_##arg0 + _WIDESIZE_##arg1 + _WIDESIZE_##arg2,
+#include "opcodes.inc"
+#undef OPCODE
+};
 
-    return closure;
+// _InstructionLength is the length of the instruction at ip, prefix and all,
+// or 0 if it isn't one.
+static size_t _InstructionLength(const uint8_t *ip)
+{
+    if (ip[0] >= sizeof(_instruction_length)) { return 0; }
+    if (ip[0] != OP_WIDE) { return _instruction_length[ip[0]]; }
+    if (ip[1] >= sizeof(_instruction_length) || ip[1] == OP_WIDE) {
+        return 0;
+    }
+    return 1 + _wide_instruction_length[ip[1]];
 }
 
-static uint64_t *_AllocateTuple(uint64_t size)
+static void _UnknownInstruction(const uint8_t *ip)
 {
-    size_t alloc_size = size * sizeof(uint64_t);
+    fprintf(stderr, "ERROR: UNKNOWN INSTRUCTION: %d\n", ip[-1]);
+}
 
-    LifetimeAllocations += alloc_size;
-    uint64_t *tuple = malloc(alloc_size);
+// ----------------------------------------------------------------------------
+// The VM Stack
+// ----------------------------------------------------------------------------
+//
+// Calls between millie functions do not recurse in C. Instead, the VM keeps
+// one contiguous stack of registers: each function's frame sits directly
+// above its caller's, and a call just bumps the window up by the size of the
+// caller's frame. A frame is the function's registers, followed by room for
+// any objects that the function allocates on the stack instead of in the heap
+// (see NEW_CLOSURE_S).
+//
+// Because registers can hold pointers to those objects, the stack never
+// moves: all of the configured stack size is reserved up front, and the
+// system only hands us pages as the stack grows into them.
+//
+// Alongside the registers is a stack of VMFrames that records where to go
+// back to when a function returns. A frame with a NULL return_ip was entered
+// from C, by EvaluateCode, and returning from it leaves the interpreter.
+//
+struct VMFrame {
+    struct CompiledExpression *code;
+    const uint8_t *return_ip;
+    size_t base;
+    uint16_t ret_reg;
+};
 
-    return tuple;
+struct VM {
+    struct Module *module;
+    struct Heap *heap;
+
+    uint64_t *stack;
+    size_t stack_limit;    // In registers.
+    size_t stack_top;      // Top of the stack when we last left the loop.
+
+    struct VMFrame *frames;
+    size_t frame_count;
+    size_t frame_capacity;
+
+    // How hot a function has to get before it is JIT compiled; 0 for never.
+    uint32_t jit_threshold;
+
+    // How many objects went on the stack instead of in the heap.
+    size_t stack_allocations;
+};
+
+#define JIT_HOT_THRESHOLD (1000)
+#define INITIAL_FRAME_CAPACITY (256)
+
+// The registers of every active frame are the roots of the heap. (The stack
+// objects are in there too, and so whatever they point to stays alive.)
+static void _ScanVMRoots(struct Heap *heap, void *context)
+{
+    struct VM *vm = (struct VM *)context;
+    HeapMarkRange(heap, vm->stack, vm->stack + vm->stack_top);
 }
 
-uint64_t EvaluateCode(struct Module *module,
-                      int func_id,
-                      uint64_t closure,
-                      uint64_t arg0)
+struct VM *VMCreate(struct Module *module, struct Heap *heap,
+                    size_t stack_size, JIT_MODE jit_mode)
 {
-    TRACE_ENTER(module, func_id, closure, arg0);
-
-    struct CompiledExpression *code = &(module->functions[func_id]);
-    struct Frame frame;
-    frame.registers = calloc(code->register_count, sizeof(uint64_t));
-    frame.registers[0] = closure;
-    frame.registers[1] = arg0;
-
-    const uint8_t *ip = code->code;
-    bool halt = false;
-    while(!halt) {
-        TRACE_STEP(ip, code, &frame);
-        MILLIE_OPCODE op = *(ip++);
-        switch(op) {
+    struct VM *vm = calloc(1, sizeof(struct VM));
+    vm->module = module;
+    vm->heap = heap;
+    HeapSetRootScanner(heap, _ScanVMRoots, vm);
+
+    vm->stack_limit = stack_size / sizeof(uint64_t);
+    vm->stack = mmap(
+        NULL,
+        vm->stack_limit * sizeof(uint64_t),
+        PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+        -1,
+        0
+    );
+    if (vm->stack == MAP_FAILED) {
+        fprintf(stderr, "ERROR: unable to reserve the VM stack\n");
+        exit(1);
+    }
 
-        case OP_LOADI_8:
-            {
-                uint8_t val = _ReadU8(&ip);
-                uint8_t reg = _ReadU8(&ip);
-                frame.registers[reg] = val;
-            }
-            break;
-        case OP_LOADI_16:
-            {
-                uint16_t val = _ReadU16(&ip);
-                uint8_t reg = _ReadU8(&ip);
-                frame.registers[reg] = val;
-            }
-            break;
-        case OP_LOADI_32:
-            {
-                uint32_t val = _ReadU32(&ip);
-                uint8_t reg = _ReadU8(&ip);
-                frame.registers[reg] = val;
-            }
-            break;
-        case OP_LOADI_64:
-            {
-                uint64_t val = _ReadU64(&ip);
-                uint8_t reg = _ReadU8(&ip);
-                frame.registers[reg] = val;
-            }
-            break;
+    vm->frame_capacity = INITIAL_FRAME_CAPACITY;
+    vm->frames = malloc(vm->frame_capacity * sizeof(struct VMFrame));
 
-        case OP_RET:
-            halt = true;
-            break;
+    switch(jit_mode) {
+    case JIT_NEVER:  vm->jit_threshold = 0; break;
+    case JIT_HOT:    vm->jit_threshold = JIT_HOT_THRESHOLD; break;
+    case JIT_ALWAYS: vm->jit_threshold = 1; break;
+    }
+    return vm;
+}
 
-        case OP_CALL:
-            {
-                uint8_t func_reg = _ReadU8(&ip);
-                uint8_t arg_reg = _ReadU8(&ip);
-                uint8_t ret_reg = _ReadU8(&ip);
-
-                uint64_t closure = frame.registers[func_reg];
-                int function_id = (int)((uint64_t *)closure)[0];
-
-                uint64_t arg_val = frame.registers[arg_reg];
-                uint64_t retval = EvaluateCode(
-                    module,
-                    function_id,
-                    closure,
-                    arg_val
-                );
-                frame.registers[ret_reg] = retval;
-
-                TRACE_RETURN(module, func_id, ip, closure, arg0);
-            }
-            break;
+void VMFree(struct VM **vm_ptr)
+{
+    struct VM *vm = *vm_ptr;
+    *vm_ptr = NULL;
 
-        case OP_ADD:
-            {
-                uint8_t left_reg = _ReadU8(&ip);
-                uint8_t right_reg = _ReadU8(&ip);
-                uint8_t ret_reg = _ReadU8(&ip);
+    if (!vm) { return; }
+    HeapSetRootScanner(vm->heap, NULL, NULL);
+    for (int i = 0; i < vm->module->function_count; i++) {
+        JitFree(&(vm->module->functions[i]));
+    }
+    munmap(vm->stack, vm->stack_limit * sizeof(uint64_t));
+    free(vm->frames);
+    free(vm);
+}
 
-                frame.registers[ret_reg] =
-                    frame.registers[left_reg] + frame.registers[right_reg];
-            }
-            break;
+size_t VMStackAllocations(struct VM *vm)
+{
+    return vm->stack_allocations;
+}
 
-        case OP_SUB:
-            {
-                uint8_t left_reg = _ReadU8(&ip);
-                uint8_t right_reg = _ReadU8(&ip);
-                uint8_t ret_reg = _ReadU8(&ip);
+// _FrameSize is how much of the VM stack a frame of `code` takes up.
+static inline size_t _FrameSize(struct CompiledExpression *code)
+{
+    return code->register_count + code->stack_words;
+}
 
-                frame.registers[ret_reg] =
-                    frame.registers[left_reg] - frame.registers[right_reg];
-            }
-            break;
+// _EnsureStack makes sure that the VM stack has room for `top` registers.
+// Returns false if that would overflow the stack.
+static bool _EnsureStack(struct VM *vm, size_t top)
+{
+    if (top > vm->stack_limit) {
+        fprintf(stderr, "ERROR: stack overflow\n");
+        return false;
+    }
+    return true;
+}
 
-        case OP_MUL:
-            {
-                uint8_t left_reg = _ReadU8(&ip);
-                uint8_t right_reg = _ReadU8(&ip);
-                uint8_t ret_reg = _ReadU8(&ip);
+// _PushFrame records the caller's state in a new VMFrame and returns the
+// register window for the callee, which begins `window` registers above the
+// caller's registers. Returns NULL if the VM stack is exhausted.
+static uint64_t *_PushFrame(struct VM *vm,
+                            struct CompiledExpression *code,
+                            const uint8_t *return_ip,
+                            size_t base,
+                            uint16_t ret_reg,
+                            size_t window,
+                            struct CompiledExpression *callee)
+{
+    size_t new_base = base + window;
+    if (!_EnsureStack(vm, new_base + _FrameSize(callee))) {
+        return NULL;
+    }
 
-                frame.registers[ret_reg] =
-                    frame.registers[left_reg] * frame.registers[right_reg];
-            }
-            break;
+    if (vm->frame_count == vm->frame_capacity) {
+        vm->frame_capacity *= 2;
+        vm->frames = realloc(
+            vm->frames,
+            vm->frame_capacity * sizeof(struct VMFrame)
+        );
+    }
 
-        case OP_NEG:
-            {
-                uint8_t arg_reg = _ReadU8(&ip);
-                uint8_t ret_reg = _ReadU8(&ip);
+    struct VMFrame *frame = &(vm->frames[vm->frame_count]);
+    frame->code = code;
+    frame->return_ip = return_ip;
+    frame->base = base;
+    frame->ret_reg = ret_reg;
+    vm->frame_count++;
 
-                frame.registers[ret_reg] = -frame.registers[arg_reg];
-            }
-            break;
+    return vm->stack + new_base;
+}
 
-        case OP_EQ:
-            {
-                uint8_t left_reg = _ReadU8(&ip);
-                uint8_t right_reg = _ReadU8(&ip);
-                uint8_t ret_reg = _ReadU8(&ip);
-
-                if (frame.registers[left_reg] == frame.registers[right_reg]) {
-                    frame.registers[ret_reg] = 1;
-                } else {
-                    frame.registers[ret_reg] = 0;
-                }
-            }
-            break;
+// _ReuseFrame returns the register window at `base`, which has been given
+// over to `callee` by a tail call, and so no new VMFrame is needed. Returns
+// NULL if the callee doesn't fit on the VM stack.
+static uint64_t *_ReuseFrame(struct VM *vm,
+                             size_t base,
+                             struct CompiledExpression *callee)
+{
+    if (!_EnsureStack(vm, base + _FrameSize(callee))) {
+        return NULL;
+    }
+    return vm->stack + base;
+}
 
-        case OP_JZ:
-            {
-                uint8_t test_reg = _ReadU8(&ip);
-                int16_t offset = (int16_t)_ReadU16(&ip);
+// _PushCall is _PushFrame for the calls that take their arguments from a row
+// of registers (CALLN, CALL_DIRECT, CALL_SELF): it also puts the closure in
+// the callee's r0, and the `count` arguments starting at the caller's
+// first_reg in r1 and up. The result comes back to first_reg.
+static inline uint64_t *_PushCall(struct VM *vm,
+                                  struct CompiledExpression *code,
+                                  const uint8_t *return_ip,
+                                  uint64_t *registers,
+                                  struct CompiledExpression *callee,
+                                  uint64_t closure,
+                                  uint16_t first_reg,
+                                  uint8_t count)
+{
+    uint64_t *callee_registers = _PushFrame(
+        vm,
+        code,
+        return_ip,
+        registers - vm->stack,
+        first_reg,
+        _FrameSize(code),
+        callee
+    );
+    if (!callee_registers) {
+        return NULL;
+    }
 
-                if (frame.registers[test_reg] == 0) {
-                    ip += offset;
-                }
-            }
-            break;
+    uint64_t *args = registers + first_reg;
+    callee_registers[0] = closure;
+    for (int i = 0; i < count; i++) {
+        callee_registers[i + 1] = args[i];
+    }
+    return callee_registers;
+}
 
-        case OP_JMP:
-            {
-                int16_t offset = (int16_t)_ReadU16(&ip);
-                ip += offset;
-            }
-            break;
+// _ReuseCall is _PushCall for the tail calls, by way of _ReuseFrame.
+static uint64_t *_ReuseCall(struct VM *vm,
+                            uint64_t *registers,
+                            struct CompiledExpression *callee,
+                            uint64_t closure,
+                            uint16_t first_reg,
+                            uint8_t count)
+{
+    // The arguments are about to be overwritten by the new frame.
+    uint64_t args[256];
+    for (int i = 0; i < count; i++) {
+        args[i] = registers[first_reg + i];
+    }
 
-        case OP_MOV:
-            {
-                uint8_t src_reg = _ReadU8(&ip);
-                uint8_t dst_reg = _ReadU8(&ip);
+    registers = _ReuseFrame(vm, registers - vm->stack, callee);
+    if (!registers) {
+        return NULL;
+    }
+    registers[0] = closure;
+    for (int i = 0; i < count; i++) {
+        registers[i + 1] = args[i];
+    }
+    return registers;
+}
 
-                frame.registers[dst_reg] = frame.registers[src_reg];
-            }
-            break;
+static struct VMFrame *_PopFrame(struct VM *vm)
+{
+    vm->frame_count--;
+    return &(vm->frames[vm->frame_count]);
+}
 
-        case OP_NEW_CLOSURE:
-            {
-                uint8_t funcid_reg = _ReadU8(&ip);
-                uint8_t dst_reg = _ReadU8(&ip);
-
-                int func_id = (int)frame.registers[funcid_reg];
-                struct CompiledExpression *target;
-                target = &(module->functions[func_id]);
-
-                struct RuntimeClosure *closure;
-                if (target->closure_length > 0) {
-                    closure = _AllocateClosure(func_id, target->closure_length);
-                } else {
-                    closure = &(target->static_closure);
-                }
+// ----------------------------------------------------------------------------
+// JIT
+// ----------------------------------------------------------------------------
+//
+// The interpreter counts how often each function is entered, by a call or by
+// a backward jump, and compiles it once it's hot. JIT code runs until it
+// reaches an instruction it leaves to the interpreter (see jit.c); after
+// running such an instruction the interpreter goes back into the machine code
+// of whatever function it's now in.
+//
+
+// _EnterJit is for when a function has just been entered at ip; it returns
+// where the interpreter should carry on.
+static const uint8_t *_EnterJit(struct VM *vm,
+                                struct CompiledExpression *code,
+                                const uint8_t *ip,
+                                uint64_t *registers)
+{
+    if (!code->jit) {
+        if (vm->jit_threshold == 0) { return ip; }
 
-                frame.registers[dst_reg] = (uint64_t)closure;
-            }
-            break;
+        code->hotness += 1;
+        if (code->hotness < vm->jit_threshold) { return ip; }
 
-        case OP_LOADA_64:
-            {
-                uint8_t src_reg = _ReadU8(&ip);
-                int16_t offset = (int16_t)_ReadU16(&ip);
-                uint8_t dst_reg = _ReadU8(&ip);
+        code->hotness = 0;
+        if (!JitCompile(code)) { return ip; }
+    }
+    return JitRun(code, ip, registers);
+}
 
-                uint64_t *arr = (uint64_t *)(frame.registers[src_reg]);
-                uint64_t result = arr[offset];
-                frame.registers[dst_reg] = result;
-            }
-            break;
+// _ResumeJit is for when the interpreter has finished with an instruction
+// and would like to get back into machine code, if there is any.
+static const uint8_t *_ResumeJit(struct CompiledExpression *code,
+                                 const uint8_t *ip,
+                                 uint64_t *registers)
+{
+    if (!code->jit) { return ip; }
+    return JitRun(code, ip, registers);
+}
 
-        case OP_STOREA_64:
-            {
-                uint8_t src_reg = _ReadU8(&ip);
-                int16_t offset = (int16_t)_ReadU16(&ip);
-                uint8_t val_reg = _ReadU8(&ip);
+// ----------------------------------------------------------------------------
+// Allocation
+// ----------------------------------------------------------------------------
+//
+// Allocating can collect, and the collector needs to know how much of the VM
+// stack is live, so these take the end of the current frame.
+//
+static struct RuntimeClosure *_AllocateClosure(struct VM *vm,
+                                               uint64_t *registers_end,
+                                               int func_id,
+                                               int slot_count)
+{
+    vm->stack_top = registers_end - vm->stack;
+    return AllocateClosure(vm->heap, func_id, slot_count);
+}
 
-                uint64_t *arr = (uint64_t *)(frame.registers[src_reg]);
-                arr[offset] = frame.registers[val_reg];
-            }
-            break;
+static uint64_t *_AllocateTuple(struct VM *vm,
+                                uint64_t *registers_end,
+                                uint64_t size)
+{
+    vm->stack_top = registers_end - vm->stack;
+    return AllocateTuple(vm->heap, size);
+}
 
-        case OP_NEW_TUPLE:
-            {
-                uint8_t len_reg = _ReadU8(&ip);
-                uint8_t dst_reg = _ReadU8(&ip);
+// ----------------------------------------------------------------------------
+// Dispatch
+// ----------------------------------------------------------------------------
+//
+// The interpreter loop can be built three different ways, selected by
+// defining one of these when building:
+//
+//   VM_DISPATCH_SWITCH:   A single `switch` in a loop. Portable, but every
+//                         instruction goes through the same indirect branch.
+//
+//   VM_DISPATCH_GOTO:     Direct threading with computed goto; each handler
+//                         ends in its own indirect branch. See
+//                         http://eli.thegreenplace.net/2012/07/12/computed-goto-for-efficient-dispatch-tables
+//
+//   VM_DISPATCH_TAILCALL: Each handler is its own function, and ends by
+//                         tail-calling the handler for the next instruction.
+//                         This needs either clang's `musttail` or an
+//                         optimizing build, or the C stack will overflow.
+//
+// The handlers themselves live in handlers.inc, and are the same for all
+// three. Each strategy builds them twice, the second time for instructions
+// after a WIDE prefix.
+//
+#if !defined(VM_DISPATCH_SWITCH) && \
+    !defined(VM_DISPATCH_GOTO) && \
+    !defined(VM_DISPATCH_TAILCALL)
+#if defined(__GNUC__)
+#define VM_DISPATCH_GOTO
+#else
+#define VM_DISPATCH_SWITCH
+#endif
+#endif
 
-                uint64_t *tuple = _AllocateTuple(frame.registers[len_reg]);
-                frame.registers[dst_reg] = (uint64_t)tuple;
-            }
-            break;
+#if defined(VM_DISPATCH_SWITCH)
+
+const char *VMDispatchName = "switch";
+
+// The wide handlers are the cases past 256.
+#define VM_NEXT() break
+#define VM_NEXT_WIDE() do { op = 256 + *(ip++); goto dispatch; } while(0)
+#define VM_RETURN(value) do { result = (value); goto done; } while(0)
+
+static uint64_t _Run(struct VM *vm,
+                     struct CompiledExpression *code,
+                     const uint8_t *ip,
+                     uint64_t *registers)
+{
+    uint64_t result;
+    for(;;) {
+        TRACE_STEP(ip, code, registers);
+        STATS_STEP(ip);
+        int op = *(ip++);
+    dispatch:
+        switch(op) {
+#define VM_WIDE 0
+#define VM_OP(name) case OP_##name:
+#include "handlers.inc"
+#undef VM_OP
+#undef VM_WIDE
+
+#define VM_WIDE 1
+#define VM_OP(name) case 256 + OP_##name:
+#include "handlers.inc"
+#undef VM_OP
+#undef VM_WIDE
 
         default:
-            fprintf(stderr, "ERROR: UNKNOWN INSTRUCTION: %d\n", op);
-            halt = true;
-            break;
+            _UnknownInstruction(ip);
+            VM_RETURN(registers[code->result_register]);
         }
     }
 
-    uint64_t result = frame.registers[code->result_register];
-    free(frame.registers);
+done:
     return result;
 }
+
+#elif defined(VM_DISPATCH_GOTO)
+
+const char *VMDispatchName = "goto";
+
+#define VM_NEXT() do {                          \
+        TRACE_STEP(ip, code, registers);        \
+        STATS_STEP(ip);                         \
+        goto *dispatch_table[*(ip++)];          \
+    } while(0)
+#define VM_NEXT_WIDE() goto *wide_dispatch_table[*(ip++)]
+#define VM_RETURN(value) return (value)
+
+static uint64_t _Run(struct VM *vm,
+                     struct CompiledExpression *code,
+                     const uint8_t *ip,
+                     uint64_t *registers)
+{
+#pragma GCC diagnostic push
+#ifdef __clang__
+#pragma GCC diagnostic ignored "-Winitializer-overrides"
+#else
+#pragma GCC diagnostic ignored "-Woverride-init"
+#endif
+    static const void *dispatch_table[256] = {
+        [0 ... 255] = &&op_INVALID,
+#define OPCODE(name, _x, _y, _z) [OP_##name] = &&op_##name,
+#include "opcodes.inc"
+#undef OPCODE
+    };
+    static const void *wide_dispatch_table[256] = {
+        [0 ... 255] = &&op_INVALID,
+#define OPCODE(name, _x, _y, _z) [OP_##name] = &&op_W_##name,
+#include "opcodes.inc"
+#undef OPCODE
+    };
+#pragma GCC diagnostic pop
+
+    VM_NEXT();
+
+#define VM_WIDE 0
+#define VM_OP(name) op_##name:
+#include "handlers.inc"
+#undef VM_OP
+#undef VM_WIDE
+
+#define VM_WIDE 1
+#define VM_OP(name) op_W_##name:
+#include "handlers.inc"
+#undef VM_OP
+#undef VM_WIDE
+
+op_INVALID:
+    _UnknownInstruction(ip);
+    VM_RETURN(registers[code->result_register]);
+}
+
+#elif defined(VM_DISPATCH_TAILCALL)
+
+const char *VMDispatchName = "tailcall";
+
+#if defined(__has_attribute)
+#if __has_attribute(musttail)
+#define MUSTTAIL __attribute__((musttail))
+#endif
+#endif
+
+#ifndef MUSTTAIL
+#ifndef __OPTIMIZE__
+#error "VM_DISPATCH_TAILCALL needs musttail or an optimizing build"
+#endif
+#define MUSTTAIL
+#endif
+
+#define VM_PARAMS                                       \
+    __attribute__((unused)) struct VM *vm,              \
+    __attribute__((unused)) struct CompiledExpression *code, \
+    __attribute__((unused)) const uint8_t *ip,          \
+    __attribute__((unused)) uint64_t *registers
+
+typedef uint64_t (*VMHandler)(VM_PARAMS);
+
+#define OPCODE(name, _x, _y, _z)                        \
+    static uint64_t _VMOp_##name(VM_PARAMS);            \
+    static uint64_t _VMOpW_##name(VM_PARAMS);
+#include "opcodes.inc"
+#undef OPCODE
+
+static const VMHandler _vm_handlers[256];
+static const VMHandler _vm_wide_handlers[256];
+
+#define VM_NEXT() do {                                                  \
+        TRACE_STEP(ip, code, registers);                                \
+        STATS_STEP(ip);                                                 \
+        MUSTTAIL return _vm_handlers[*ip](vm, code, ip + 1, registers); \
+    } while(0)
+#define VM_NEXT_WIDE()                                                  \
+    MUSTTAIL return _vm_wide_handlers[*ip](vm, code, ip + 1, registers)
+#define VM_RETURN(value) return (value)
+
+#define VM_WIDE 0
+#define VM_OP(name) static uint64_t _VMOp_##name(VM_PARAMS)
+#include "handlers.inc"
+#undef VM_OP
+#undef VM_WIDE
+
+#define VM_WIDE 1
+#define VM_OP(name) static uint64_t _VMOpW_##name(VM_PARAMS)
+#include "handlers.inc"
+#undef VM_OP
+#undef VM_WIDE
+
+static uint64_t _VMOp_INVALID(VM_PARAMS)
+{
+    _UnknownInstruction(ip);
+    VM_RETURN(registers[code->result_register]);
+}
+
+#pragma GCC diagnostic push
+#ifdef __clang__
+#pragma GCC diagnostic ignored "-Winitializer-overrides"
+#else
+#pragma GCC diagnostic ignored "-Woverride-init"
+#endif
+static const VMHandler _vm_handlers[256] = {
+    [0 ... 255] = _VMOp_INVALID,
+#define OPCODE(name, _x, _y, _z) [OP_##name] = _VMOp_##name,
+#include "opcodes.inc"
+#undef OPCODE
+};
+static const VMHandler _vm_wide_handlers[256] = {
+    [0 ... 255] = _VMOp_INVALID,
+#define OPCODE(name, _x, _y, _z) [OP_##name] = _VMOpW_##name,
+#include "opcodes.inc"
+#undef OPCODE
+};
+#pragma GCC diagnostic pop
+
+static uint64_t _Run(struct VM *vm,
+                     struct CompiledExpression *code,
+                     const uint8_t *ip,
+                     uint64_t *registers)
+{
+    VM_NEXT();
+}
+
+#else
+#error "Unknown VM dispatch strategy"
+#endif
+
+#undef VM_NEXT
+#undef VM_NEXT_WIDE
+#undef VM_RETURN
+
+bool EvaluateCode(struct VM *vm,
+                  int func_id,
+                  uint64_t closure,
+                  uint64_t arg0,
+                  uint64_t *result)
+{
+    struct CompiledExpression *code = &(vm->module->functions[func_id]);
+    size_t base = vm->stack_top;
+    size_t frame_count = vm->frame_count;
+
+    uint64_t *registers = _PushFrame(vm, NULL, NULL, base, 0, 0, code);
+    if (!registers) { return false; }
+    registers[0] = closure;
+    registers[1] = arg0;
+
+    TRACE_ENTER(vm->module, code, registers);
+
+    vm->stack_top = base + _FrameSize(code);
+    const uint8_t *ip = _EnterJit(vm, code, code->code, registers);
+    *result = _Run(vm, code, ip, registers);
+    vm->stack_top = base;
+
+    if (vm->frame_count != frame_count) {
+        // We bailed out of the middle of the program; throw away everything
+        // it was doing.
+        vm->frame_count = frame_count;
+        return false;
+    }
+    return true;
+}
+
+void VMPrintDispatchStats(FILE *output)
+{
+#ifdef VM_STATS
+    uint64_t total = 0;
+    for (int i = 0; i < 256; i++) { total += _dispatch_counts[i]; }
+    fprintf(output, "Dispatches: %llu\n", total);
+    if (total == 0) { return; }
+
+    for (int i = 0; i < 256; i++) {
+        if (_dispatch_counts[i] == 0) { continue; }
+        fprintf(
+            output,
+            "  %-16s %12llu (%4.1f%%)\n",
+            _op_info[i].name,
+            _dispatch_counts[i],
+            100.0 * _dispatch_counts[i] / total
+        );
+    }
+
+    // The busiest pairs, biggest first; there are few enough opcodes that
+    // picking them out one at a time is fine.
+    fprintf(output, "Most common pairs:\n");
+    static bool printed[256][256];
+    memset(printed, 0, sizeof(printed));
+    for (int rank = 0; rank < 10; rank++) {
+        int best_first = -1, best_second = -1;
+        for (int first = 0; first < 256; first++) {
+            for (int second = 0; second < 256; second++) {
+                if (printed[first][second] ||
+                    _pair_counts[first][second] == 0) {
+                    continue;
+                }
+                if (best_first < 0 ||
+                    _pair_counts[first][second] >
+                    _pair_counts[best_first][best_second]) {
+                    best_first = first;
+                    best_second = second;
+                }
+            }
+        }
+        if (best_first < 0) { break; }
+
+        printed[best_first][best_second] = true;
+        uint64_t count = _pair_counts[best_first][best_second];
+        fprintf(
+            output,
+            "  %-16s %-16s %12llu (%4.1f%%)\n",
+            _op_info[best_first].name,
+            _op_info[best_second].name,
+            count,
+            100.0 * count / total
+        );
+    }
+#else
+    (void)output;
+#endif
+}
@@ -15,15 +15,15 @@ struct SymbolEntry {
 struct SymbolTable {
     uint32_t *hashes;
     struct SymbolEntry *entries;
+    struct Arena *strings; // The keys, and their characters.
     uint32_t capacity;
     uint32_t item_count;
     uint32_t resize_threshold;
     uint32_t mask;
 };
 
-static uint32_t _HashString(struct MString *string)
+static uint32_t _NormalizeHash(uint32_t hash)
 {
-    uint32_t hash = MStringHash32(string);
     hash &= 0x7FFFFFFF; // Clear tombstone bit.
     if (hash == 0) { hash = 1; } // Never return empty.
     return hash;
@@ -121,9 +121,9 @@ static void _Grow(struct SymbolTable *table)
     free(old_hashes);
 }
 
-static Symbol _Find(struct SymbolTable *table, struct MString *key)
+static Symbol _Find(struct SymbolTable *table, const char *str,
+                    unsigned int length, uint32_t hash)
 {
-    uint32_t hash = _HashString(key);
     uint32_t pos = _DesiredPosition(table, hash);
     uint32_t dist = 0;
     for (;;) {
@@ -134,8 +134,9 @@ static Symbol _Find(struct SymbolTable *table, struct MString *key)
         if (dist > _ProbeDistance(table, existing_hash, pos)) {
             return INVALID_SYMBOL;
         }
-        if (hash == existing_hash &&
-            MStringEquals(key, table->entries[pos].key)) {
+        struct MString *key = table->entries[pos].key;
+        if (hash == existing_hash && MStringLength(key) == length &&
+            memcmp(MStringData(key), str, length) == 0) {
             return table->entries[pos].value;
         }
         pos = (pos + 1) & table->mask;
@@ -147,6 +148,7 @@ struct SymbolTable *SymbolTableCreate()
 {
     struct SymbolTable *result = calloc(1, sizeof(struct SymbolTable));
     result->capacity = 256;
+    result->strings = MakeFreshArena();
     _Allocate(result);
     return result;
 }
@@ -162,13 +164,41 @@ void SymbolTableFree(struct SymbolTable **table_ptr)
     }
     free(table->entries);
     free(table->hashes);
+    FreeArena(&table->strings);
     free(table);
 }
 
+// _InternKey copies a new key into the table's arena, as a static MString
+// that MStringFree leaves alone. (Keys too big for the arena go on the heap.)
+static struct MString *_InternKey(struct SymbolTable *table, const char *str,
+                                  unsigned int length)
+{
+    size_t size = sizeof(struct MStringStatic) + length + 1;
+    if (size > ARENA_SIZE) { return MStringCreateN(str, length); }
+
+    struct MStringStatic *block = ArenaAllocate(table->strings, size);
+    char *chars = (char *)(block + 1);
+    memcpy(chars, str, length);
+    chars[length] = '\0';
+    return MStringCreateStatic(chars, block);
+}
+
 Symbol FindOrCreateSymbol(struct SymbolTable *table, struct MString *key)
+{
+    return FindOrCreateSymbolN(
+        table,
+        MStringData(key),
+        MStringLength(key),
+        MStringHash32(key)
+    );
+}
+
+Symbol FindOrCreateSymbolN(struct SymbolTable *table, const char *str,
+                           unsigned int length, uint32_t hash)
 {
     // See if we can find the symbol in the table first...
-    Symbol symbol = _Find(table, key);
+    hash = _NormalizeHash(hash);
+    Symbol symbol = _Find(table, str, length, hash);
     if (symbol != INVALID_SYMBOL) { return symbol; }
 
     table->item_count += 1;
@@ -177,9 +207,7 @@ Symbol FindOrCreateSymbol(struct SymbolTable *table, struct MString *key)
         _Grow(table);
     }
 
-    key = MStringCopy(key);
-    uint32_t hash = _HashString(key);
-    _InsertHelper(table, hash, key, symbol);
+    _InsertHelper(table, hash, _InternKey(table, str, length), symbol);
 
     return symbol;
 }
@@ -1,9 +1,11 @@
 #!/usr/local/bin/python3
 import locale
+import os
 
 from collections import namedtuple
 from pathlib import Path
 from subprocess import run, PIPE
+from tempfile import TemporaryDirectory
 from time import perf_counter
 
 
@@ -13,7 +15,7 @@ def read_test_spec(path):
         for line in file:
             if (not line) or line[0] != '#':
                 break
-            spec_part = line[1:].strip().split(':')
+            spec_part = line[1:].strip().split(':', 1)
             if len(spec_part) > 1:
                 spec[spec_part[0].strip()] = spec_part[1].strip()
     return spec
@@ -21,7 +23,8 @@ def read_test_spec(path):
 
 test_result = namedtuple(
     'test_result',
-    ['result', 'path', 'elapsed', 'details', 'stderr', 'stdout'],
+    ['result', 'path', 'elapsed', 'details', 'stderr', 'stdout', 'returncode'],
+    defaults=[0],
 )
 
 
@@ -30,13 +33,17 @@ def parse_bool(val):
     return val in ('true', 1, 'yes', 'y')
 
 
-def run_test(path):
-    spec = read_test_spec(path)
-
-    if (
+def is_disabled(spec):
+    return (
         ('Disabled' in spec and parse_bool(spec['Disabled'])) or
         ('Enabled' in spec and not parse_bool(spec['Enabled']))
-    ):
+    )
+
+
+def run_test(path, extra_args=()):
+    spec = read_test_spec(path)
+
+    if is_disabled(spec):
         return test_result(
             result='skip',
             path=path,
@@ -47,16 +54,14 @@ def run_test(path):
         )
 
     args = ['./millie', path]
+    if 'Args' in spec:
+        args.extend(spec['Args'].split())
+    args.extend(extra_args)
     if 'ExpectedType' in spec:
         args.append('--print-type')
 
     start = perf_counter()
-    cp = run(
-        args,
-        stdout=PIPE,
-        stderr=PIPE,
-        encoding=locale.getpreferredencoding()
-    )
+    cp = run_millie(args)
     elapsed = perf_counter() - start
 
     result = 'ok'
@@ -69,7 +74,9 @@ def run_test(path):
     else:
         actual = cp.stdout.strip()
         if 'Expected' in spec:
-            if actual != spec['Expected']:
+            # (Expected output with more than one line uses \n.)
+            expected = spec['Expected'].replace('\\n', '\n')
+            if actual != expected:
                 result = 'fail'
                 details = 'Expected "{}" got "{}"'.format(
                     spec['Expected'],
@@ -89,16 +96,216 @@ def run_test(path):
                     spec['ExpectedError'],
                 )
 
+    return test_result(
+        result, path, elapsed, details, cp.stderr, cp.stdout, cp.returncode
+    )
+
+
+def run_millie(args):
+    return run(
+        args,
+        stdout=PIPE,
+        stderr=PIPE,
+        encoding=locale.getpreferredencoding()
+    )
+
+
+def run_emit_c_test(path, out_dir, interpreted):
+    """Run an eval test through --emit-c and the C compiler, and check that
+    the program does what the interpreter did."""
+    spec = read_test_spec(path)
+    if is_disabled(spec):
+        return None
+
+    source = Path(out_dir) / 'program.c'
+    program = Path(out_dir) / 'program'
+    args = ['./millie', path, '--emit-c', str(source)]
+    if 'Args' in spec:
+        args.extend(spec['Args'].split())
+
+    start = perf_counter()
+    cp = run_millie(args)
+    if not cp.returncode:
+        cc = os.environ.get('CC', 'cc')
+        cp = run_millie([
+            cc, '-O2', '-I.', str(source), 'rt.c', 'gc.c', '-o', str(program)
+        ])
+        if cp.returncode:
+            return test_result(
+                'fail', path, perf_counter() - start,
+                'generated C failed to compile', cp.stderr, cp.stdout
+            )
+        cp = run_millie([str(program)])
+    elapsed = perf_counter() - start
+
+    result = 'ok'
+    details = None
+    if bool(cp.returncode) != bool(interpreted.returncode):
+        result = 'fail'
+        details = 'interpreter exit code {} but C exit code {}'.format(
+            interpreted.returncode,
+            cp.returncode
+        )
+    elif cp.stdout.strip() != interpreted.stdout.strip():
+        result = 'fail'
+        details = 'interpreter printed "{}" but C printed "{}"'.format(
+            interpreted.stdout.strip(),
+            cp.stdout.strip()
+        )
     return test_result(result, path, elapsed, details, cp.stderr, cp.stdout)
 
 
-locale.setlocale(locale.LC_ALL, '')
-for path in Path('./tests').glob('**/*.millie'):
-    result, path, elapsed, details, stderr, stdout = run_test(path)
-    print('[{0:<4}] {1} ({2:0.3}ms)'.format(result, path, elapsed * 1000))
+def run_parallel_lex_test(out_dir):
+    """Lex a source big enough to be cut into chunks, on one thread and on
+    several, and check that the tokens, lines and errors are the same."""
+    # Comments, some of them with nothing after them on the last line, and a
+    # few characters that aren't anything, so there are errors to report.
+    chunk = ''.join(
+        '# Step {0}\nlet value_{0} = fn x => if x = {0} then (x, 1){2}\n'
+        '    else value_{1} x * 17 - y / 3 # {0}\n'.format(
+            i, i - 1, ' @' if i % 100 == 0 else ''
+        )
+        for i in range(1000)
+    )
+    path = Path(out_dir) / 'parallel_lex.millie'
+    path.write_text(chunk * 60 + '# No newline at the end')
+
+    start = perf_counter()
+    one = run_millie(['./millie', '--lex', '--lex-threads', '1', str(path)])
+    many = run_millie(['./millie', '--lex', '--lex-threads', '7', str(path)])
+    elapsed = perf_counter() - start
+
+    # (Only the first line of output is the tokens; the second is timing.)
+    result, details = 'ok', None
+    if one.returncode != 1 or 'Unexpected characters' not in one.stderr:
+        result, details = 'fail', 'expected lexing errors'
+    elif (one.returncode != many.returncode or
+            one.stdout.split('\n')[0] != many.stdout.split('\n')[0] or
+            one.stderr != many.stderr):
+        result, details = 'fail', 'lexing on 7 threads did something else'
+    return test_result(
+        result, path, elapsed, details, many.stderr, many.stdout,
+        many.returncode
+    )
+
+
+def print_result(test, suffix=''):
+    result, path, elapsed, details, stderr, stdout, _ = test
+    print('[{0:<4}] {1}{2} ({3:0.3}ms)'.format(
+        result,
+        path,
+        suffix,
+        elapsed * 1000
+    ))
     if result == 'fail':
         print('  ' + details)
         print('  stdout:')
         print('    ' + '\n    '.join(stdout.split('\n')))
         print('  stderr:')
         print('    ' + '\n    '.join(stderr.split('\n')))
+
+
+def write_generated_tests(out_dir):
+    """Write the tests that are too big to check in, and return their
+    paths."""
+    tests = {}
+
+    # More values live at once than fit in a byte, inside a function.
+    count = 1000
+    tests['eval/many_lets.millie'] = (
+        '# Expected: {0}\n'.format(sum(range(1, count + 1))) +
+        'let f = fn x =>\n' +
+        ''.join('let a{0} = x + {0} in\n'.format(i) for i in range(count)) +
+        ' + '.join('a{0}'.format(i) for i in range(count)) + '\n' +
+        'in f 1\n'
+    )
+
+    # A branch with more code in it than a 16-bit offset can jump over.
+    terms = 10000
+    tests['eval/long_jump.millie'] = (
+        '# Expected: (0, {0})\n'.format(terms) +
+        'let f = fn x => if x = 1 then ' + ' + '.join(['x'] * terms) +
+        ' else 0\nin (f 0, f 1)\n'
+    )
+
+    # A type that's a tree of 2 ** 101 nodes, but only a few hundred when
+    # it's shared. This only finishes if inference and --print-type both
+    # keep it shared; the tuples are written three levels to an abbreviation.
+    depth = 100
+    abbreviations = (depth + 1) // 3
+    tests['types/exponential_type.millie'] = (
+        '# ExpectedType: ( \'A -> {0} ) where t1 = {1}'.format(
+            ' * '.join(['t{0}'.format(abbreviations)] *
+                       (2 ** ((depth + 1) % 3))),
+            ' * '.join(["'A"] * 8),
+        ) +
+        ''.join(
+            ' and t{0} = {1}'.format(i, ' * '.join(['t{0}'.format(i - 1)] * 8))
+            for i in range(2, abbreviations + 1)
+        ) + '\n' +
+        'let f0 = fn x => (x, x) in\n' +
+        ''.join(
+            'let f{0} = fn y => (f{1} y, f{1} y) in\n'.format(i, i - 1)
+            for i in range(1, depth + 1)
+        ) +
+        'f{0}\n'.format(depth)
+    )
+
+    # The same, but run, so that the bytecode cache has to write the type
+    # out (and read it back) shared too.
+    depth = 40
+    tests['eval/exponential_type.millie'] = (
+        '# Expected: A FUNCTION\n' +
+        'let f0 = fn x => (x, x) in\n' +
+        ''.join(
+            'let f{0} = fn y => (f{1} y, f{1} y) in\n'.format(i, i - 1)
+            for i in range(1, depth + 1)
+        ) +
+        'f{0}\n'.format(depth)
+    )
+
+    paths = []
+    for name, source in tests.items():
+        path = Path(out_dir) / name
+        path.parent.mkdir(exist_ok=True)
+        path.write_text(source)
+        paths.append(path)
+    return paths
+
+
+locale.setlocale(locale.LC_ALL, '')
+with TemporaryDirectory() as out_dir:
+    paths = list(Path('./tests').glob('**/*.millie'))
+    paths.extend(write_generated_tests(out_dir))
+    print_result(run_parallel_lex_test(out_dir), ' [lex threads]')
+    for path in paths:
+        test = run_test(path)
+        print_result(test)
+
+        if test.result == 'skip' or path.parent.name != 'eval':
+            continue
+
+        # Everything should do the same thing whether or not it's optimized...
+        print_result(run_test(path, ['-O0']), ' [-O0]')
+
+        # ...whether or not it's JIT compiled...
+        for mode in ('never', 'always'):
+            print_result(
+                run_test(path, ['--jit', mode]),
+                ' [jit {}]'.format(mode)
+            )
+
+        # ...whether it's compiled or loaded from the bytecode cache...
+        cache_args = ['--cache-dir', str(Path(out_dir) / 'cache'), '-v']
+        cold = run_test(path, cache_args)
+        print_result(cold, ' [cache cold]')
+        warm = run_test(path, cache_args)
+        if (warm.result == 'ok' and cold.returncode == 0 and
+                'Bytecode cache: hit' not in warm.stderr):
+            warm = warm._replace(result='fail', details='cache missed')
+        print_result(warm, ' [cache warm]')
+
+        # ...and when it's compiled to C.
+        c_test = run_emit_c_test(path, out_dir, test)
+        if c_test:
+            print_result(c_test, ' [emit-c]')
@@ -3,189 +3,298 @@
 #endif
 
 
-struct NonGenericTypeList {
-    struct NonGenericTypeList *next;
-    struct TypeExp *type;
+/*
+ * Generalization is by levels. The checker counts how many lets deep it is,
+ * and each type variable remembers the level it was made at. When the value
+ * of a let is done, anything in its type that was made inside the let (and so
+ * is above the let's own level) can't be mentioned by anything outside, and
+ * so it can be generic. A variable that gets unified with a variable or type
+ * from further out drops to that level, since it's now visible there too.
+ *
+ * Every other type has a level of at least that of every variable in it,
+ * so that whole subtrees can be skipped: a type at or below the let's level
+ * has nothing to generalize, and a type below a variable's level can't have
+ * that variable in it.
+ */
+
+// Generic variables are above every level, so that the types with generic
+// variables in them are the only types at GENERIC_LEVEL.
+#define GENERIC_LEVEL INT_MAX
+
+/*
+ * The Type Store
+ *
+ * Every type the checker makes is a node in the store's array, and a type is
+ * its node's index there. The types every store starts with have fixed ids;
+ * id 0 is a TYPEEXP_INVALID that stands for no type.
+ */
+enum {
+    _NO_TYPE = 0,
+    _INTEGER_TYPE,
+    _BOOLEAN_TYPE,
+    _ERROR_TYPE,
 };
 
-static struct NonGenericTypeList * _ExtendNonGenericTypeList(
-    struct Arena *arena,
-    struct TypeExp *type,
-    struct NonGenericTypeList *non_generics
-)
+struct TypeStore *TypeStoreCreate()
 {
-    struct NonGenericTypeList *new_list;
-    new_list = ArenaAllocate(arena, sizeof(struct NonGenericTypeList));
-    new_list->next = non_generics;
-    new_list->type = type;
-    return new_list;
+    struct TypeStore *store = calloc(1, sizeof(struct TypeStore));
+    store->nodes = ArrayListCreate(sizeof(struct TypeExp), 1024);
+    TypeStoreAdd(store, TYPEEXP_INVALID, _NO_TYPE, _NO_TYPE);
+    TypeStoreAdd(store, TYPEEXP_INT, _NO_TYPE, _NO_TYPE);
+    TypeStoreAdd(store, TYPEEXP_BOOL, _NO_TYPE, _NO_TYPE);
+    TypeStoreAdd(store, TYPEEXP_ERROR, _NO_TYPE, _NO_TYPE);
+    return store;
 }
 
-static bool _IsTypeContainedWithin(struct TypeExp *a, struct TypeExp *b)
+void TypeStoreFree(struct TypeStore **store_ptr)
 {
-    if (a == b) { return true; }
-    if (b == NULL) { return false; }
-    if (_IsTypeContainedWithin(a, b->arg_first)) { return true; }
-    if (_IsTypeContainedWithin(a, b->arg_second)) { return true; }
-    return false;
+    struct TypeStore *store = *store_ptr;
+    *store_ptr = NULL;
+
+    if (!store) { return; }
+    ArrayListFree(&store->nodes);
+    free(store);
 }
 
-static bool _IsTypeNonGeneric(struct TypeExp *a,
-                              struct NonGenericTypeList *non_generics)
+// TypeStoreAllocated is how many bytes the types are using, for --verbose.
+size_t TypeStoreAllocated(struct TypeStore *store)
 {
-    while(non_generics) {
-        if (_IsTypeContainedWithin(a, non_generics->type)) {
-            return true;
-        }
-        non_generics = non_generics->next;
+    return store->nodes->item_count * store->nodes->item_size;
+}
+
+TypeId TypeStoreAdd(struct TypeStore *store, TypeExpType type,
+                    TypeId first, TypeId second)
+{
+    struct TypeExp node = { .type = type };
+    node.arg_first = first;
+    node.arg_second = second;
+    return ArrayListAdd(store->nodes, &node);
+}
+
+// (TypeAt doesn't check the index, since it's in every step of every walk
+// of a type.)
+struct TypeExp *TypeAt(struct TypeStore *store, TypeId type)
+{
+    return ((struct TypeExp *)store->nodes->buffer) + type;
+}
+
+/*
+ * Variables that have been bound to something are a union-find forest: each
+ * one points at what it was bound to, and the type at the end of the chain is
+ * what they all are. _PruneTypeExp finds the end, and points everything on
+ * the way straight at it, so the next time is one step. Variables bound to
+ * variables are joined by rank (see _UnifyTypeVariables), so the chains don't
+ * get long in the first place.
+ */
+static TypeId _PruneTypeExp(struct TypeStore *store, TypeId type)
+{
+    TypeId root = type;
+    while(TypeAt(store, root)->type == TYPEEXP_VARIABLE &&
+          TypeAt(store, root)->var_instance) {
+        root = TypeAt(store, root)->var_instance;
     }
-    return false;
+    while(type != root) {
+        TypeId next = TypeAt(store, type)->var_instance;
+        TypeAt(store, type)->var_instance = root;
+        type = next;
+    }
+    return root;
+}
+
+struct TypeExp *ResolveType(struct TypeStore *store, TypeId type)
+{
+    return TypeAt(store, _PruneTypeExp(store, type));
+}
+
+/*
+ * Function and tuple types are hash-consed: there's only ever one with the
+ * same parts, so a type that mentions the same thing over and over (like the
+ * type of `(x, x)`, when x is itself a pair) is a DAG and not a tree. The
+ * traversals below remember what they did with each node they've been to, in
+ * its `temp`, so they take time in proportion to the DAG. (The tree can be
+ * exponentially bigger.) _ClearTypeTemps puts the temps back after.
+ */
+struct TypeTable {
+    struct TypeStore *store;
+    TypeId *slots;              // Open addressing; _NO_TYPE is empty.
+    uint32_t capacity;
+    uint32_t count;
+};
+
+static uint32_t _HashTypeParts(TypeExpType type, TypeId first, TypeId second)
+{
+    uint64_t hash = (uint64_t)type;
+    hash = (hash ^ first) * 0x9E3779B97F4A7C15ull;
+    hash = (hash ^ second) * 0x9E3779B97F4A7C15ull;
+    return (uint32_t)(hash >> 32);
 }
 
-static struct TypeExp *_PruneTypeExp(struct TypeExp *type)
+static void _GrowTypeTable(struct TypeTable *table)
 {
-    if (!type) { return NULL; }
-    while(type->type == TYPEEXP_VARIABLE && type->var_instance) {
-        type = type->var_instance;
+    TypeId *old_slots = table->slots;
+    uint32_t old_capacity = table->capacity;
+
+    table->capacity = old_capacity ? old_capacity * 2 : 1024;
+    table->slots = calloc(table->capacity, sizeof(TypeId));
+    uint32_t mask = table->capacity - 1;
+    for (uint32_t i = 0; i < old_capacity; i++) {
+        TypeId type = old_slots[i];
+        if (!type) { continue; }
+        struct TypeExp *node = TypeAt(table->store, type);
+        uint32_t pos = _HashTypeParts(
+            node->type,
+            node->arg_first,
+            node->arg_second
+        ) & mask;
+        while (table->slots[pos]) { pos = (pos + 1) & mask; }
+        table->slots[pos] = type;
     }
-    return type;
+    free(old_slots);
 }
 
-static struct TypeExp *_MakeFunctionType(struct Arena *arena,
-                                         struct TypeExp *from_type,
-                                         struct TypeExp *to_type)
+static TypeId _MakeCompoundType(struct TypeTable *table,
+                                TypeExpType type,
+                                TypeId first,
+                                TypeId second)
 {
-    struct TypeExp *result;
-    result = ArenaAllocate(arena, sizeof(struct TypeExp));
-    result->type = TYPEEXP_FUNC;
-    result->func_from = from_type;
-    result->func_to = to_type;
+    struct TypeStore *store = table->store;
+    first = _PruneTypeExp(store, first);
+    second = _PruneTypeExp(store, second);
+
+    if ((table->count + 1) * 4 > table->capacity * 3) {
+        _GrowTypeTable(table);
+    }
+    uint32_t mask = table->capacity - 1;
+    uint32_t pos = _HashTypeParts(type, first, second) & mask;
+    for (;;) {
+        TypeId existing = table->slots[pos];
+        if (!existing) { break; }
+        struct TypeExp *node = TypeAt(store, existing);
+        if (node->type == type &&
+            node->arg_first == first &&
+            node->arg_second == second) {
+            return existing;
+        }
+        pos = (pos + 1) & mask;
+    }
+
+    int first_level = TypeAt(store, first)->level;
+    int second_level = TypeAt(store, second)->level;
+    TypeId result = TypeStoreAdd(store, type, first, second);
+    TypeAt(store, result)->level =
+        (first_level > second_level) ? first_level : second_level;
+
+    table->slots[pos] = result;
+    table->count++;
     return result;
 }
 
-static struct TypeExp *_MakeTupleType(struct Arena *arena,
-                                      struct TypeExp *first_type,
-                                      struct TypeExp *rest_type)
+static TypeId _MakeFunctionType(struct TypeTable *table,
+                                TypeId from_type,
+                                TypeId to_type)
 {
-    struct TypeExp *result;
-    result = ArenaAllocate(arena, sizeof(struct TypeExp));
-    result->type = TYPEEXP_TUPLE;
-    result->tuple_first = first_type;
-    result->tuple_rest = rest_type;
-    return result;
+    return _MakeCompoundType(table, TYPEEXP_FUNC, from_type, to_type);
 }
 
-static struct TypeExp *_MakeTupleFinalType(struct Arena *arena,
-                                           struct TypeExp *first_type)
+static TypeId _MakeTupleType(struct TypeTable *table,
+                             TypeId first_type,
+                             TypeId rest_type)
 {
-    struct TypeExp *result;
-    result = ArenaAllocate(arena, sizeof(struct TypeExp));
-    result->type = TYPEEXP_TUPLE_FINAL;
-    result->tuple_first = first_type;
-    return result;
+    return _MakeCompoundType(table, TYPEEXP_TUPLE, first_type, rest_type);
 }
 
-static struct TypeExp *_MakeTypeVar(struct Arena *arena)
+static TypeId _MakeTupleFinalType(struct TypeTable *table, TypeId first_type)
 {
-    struct TypeExp *result = ArenaAllocate(arena, sizeof(struct TypeExp));
-    result->type = TYPEEXP_VARIABLE;
+    return _MakeCompoundType(table, TYPEEXP_TUPLE_FINAL, first_type, _NO_TYPE);
+}
+
+static TypeId _MakeTypeVar(struct TypeStore *store, int level)
+{
+    TypeId result = TypeStoreAdd(store, TYPEEXP_VARIABLE, _NO_TYPE, _NO_TYPE);
+    TypeAt(store, result)->level = level;
     return result;
 }
 
-static void _CleanupTypeVariables(struct TypeExp *type)
+// _ClearTypeTemps resets the temp of everything in the type that a traversal
+// has been to. (Each one only goes where it's been before, so this only goes
+// where they left a temp.)
+static void _ClearTypeTemps(struct TypeStore *store, TypeId type)
 {
-    type = _PruneTypeExp(type);
-    if (type == NULL) { return; }
-    if (type->type == TYPEEXP_VARIABLE ||
-        type->type == TYPEEXP_GENERIC_VARIABLE) {
-        type->var_temp_other = NULL;
-    } else {
-        _CleanupTypeVariables(type->arg_first);
-        _CleanupTypeVariables(type->arg_second);
+    type = _PruneTypeExp(store, type);
+    struct TypeExp *node = TypeAt(store, type);
+    if (node->temp == 0) { return; }
+    node->temp = 0;
+    if (node->type != TYPEEXP_VARIABLE &&
+        node->type != TYPEEXP_GENERIC_VARIABLE) {
+        _ClearTypeTemps(store, node->arg_first);
+        _ClearTypeTemps(store, node->arg_second);
     }
 }
 
 /*
  * _MakeTypeExpGenericImpl makes the given type expression generic by explicitly
- * replacing all free variables with generic variables. We can only do this for
- * variables that will no longer ever be unified, and those variables are *not*
- * contained within the type expressions in non_generics.
+ * replacing all free variables above the level with generic variables. Those
+ * were made while checking the value of a let at a deeper level, and nothing
+ * from further out has been unified with them, so they will never be unified
+ * again.
  *
  * The inverse of this function is `_MakeFreshTypeExp`.
+ *
+ * (Both of them add nodes to the store as they go, which moves the nodes, so
+ * they hold on to ids and not to nodes.)
  */
-static struct TypeExp *_MakeGenericTypeExpImpl(
-    struct Arena *arena,
-    struct TypeExp *type,
-    struct NonGenericTypeList *non_generics
+static TypeId _MakeGenericTypeExpImpl(
+    struct TypeTable *table,
+    TypeId type,
+    int level
 )
 {
-    type = _PruneTypeExp(type);
-    switch(type->type) {
-    case TYPEEXP_VARIABLE:
-        {
-            // If I've already visited this, don't check again.
-            if (type->var_temp_other) {
-                return type->var_temp_other;
-            }
+    struct TypeStore *store = table->store;
+    type = _PruneTypeExp(store, type);
+    struct TypeExp *node = TypeAt(store, type);
+    if (node->level <= level) {
+        // Nothing in here was made inside the let.
+        return type;
+    }
+    if (node->temp) {
+        // I've already been here.
+        return node->temp;
+    }
 
-            // If this type is non generic in this scope then we don't modify it.
-            if (_IsTypeNonGeneric(type, non_generics)) {
-                type->var_temp_other = type;
-                return type;
-            }
+    TypeId result = type;
+    TypeExpType tag = node->type;
+    TypeId first = node->arg_first;
+    TypeId second = node->arg_second;
+    switch(tag) {
+    case TYPEEXP_VARIABLE:
+        result = TypeStoreAdd(
+            store,
+            TYPEEXP_GENERIC_VARIABLE,
+            _NO_TYPE,
+            _NO_TYPE
+        );
+        TypeAt(store, result)->level = GENERIC_LEVEL;
+        break;
 
-            // This is a free type variable, it can be generic.
-            struct TypeExp *result;
-            result = ArenaAllocate(arena, sizeof(struct TypeExp));
-            result->type = TYPEEXP_GENERIC_VARIABLE;
-            type->var_temp_other = result;
-            return result;
-        }
     case TYPEEXP_FUNC:
     case TYPEEXP_TUPLE:
-        {
-            struct TypeExp *arg_first = _MakeGenericTypeExpImpl(
-                arena,
-                type->arg_first,
-                non_generics
-            );
-            struct TypeExp *arg_second = _MakeGenericTypeExpImpl(
-                arena,
-                type->arg_second,
-                non_generics
-            );
-            if ((arg_first == type->arg_first) &&
-                (arg_second == type->arg_second))
-            {
-                // Nothing in this was generic at all.
-                return type;
-            }
-
-            struct TypeExp *result = ArenaAllocate(arena, sizeof(struct TypeExp));
-            result->type = type->type;
-            result->arg_first = arg_first;
-            result->arg_second = arg_second;
-            return result;
-        }
-
     case TYPEEXP_TUPLE_FINAL:
         {
-            struct TypeExp *arg_first = _MakeGenericTypeExpImpl(
-                arena,
-                type->arg_first,
-                non_generics
-            );
-            if (arg_first == type->arg_first)
-            {
-                // Nothing in this was generic at all.
-                return type;
+            TypeId arg_first = _MakeGenericTypeExpImpl(table, first, level);
+            TypeId arg_second = _NO_TYPE;
+            if (second) {
+                arg_second = _MakeGenericTypeExpImpl(table, second, level);
+            }
+            if ((arg_first != first) || (arg_second != second)) {
+                result = _MakeCompoundType(
+                    table,
+                    tag,
+                    arg_first,
+                    arg_second
+                );
             }
-
-            struct TypeExp *result = ArenaAllocate(arena, sizeof(struct TypeExp));
-            result->type = type->type;
-            result->arg_first = arg_first;
-            return result;
         }
+        break;
 
     case TYPEEXP_INVALID:
     case TYPEEXP_INT:
@@ -195,17 +304,18 @@ static struct TypeExp *_MakeGenericTypeExpImpl(
         break;
     }
 
-    return type;
+    TypeAt(store, type)->temp = result;
+    return result;
 }
 
-static struct TypeExp *_MakeGenericTypeExp(
-    struct Arena *arena,
-    struct TypeExp *type,
-    struct NonGenericTypeList *non_generics
+static TypeId _MakeGenericTypeExp(
+    struct TypeTable *table,
+    TypeId type,
+    int level
 )
 {
-    struct TypeExp *result = _MakeGenericTypeExpImpl(arena, type, non_generics);
-    _CleanupTypeVariables(type);
+    TypeId result = _MakeGenericTypeExpImpl(table, type, level);
+    _ClearTypeTemps(table->store, type);
     return result;
 }
 
@@ -214,53 +324,50 @@ static struct TypeExp *_MakeGenericTypeExp(
  * into one that does not contain generic variables, that is,
  * `TYPEEXP_GENERIC_VARIABLE` becomes `TYPEEXP_VARIABLE`.
  */
-static struct TypeExp *_MakeFreshTypeExpCopy(struct Arena *arena,
-                                             struct TypeExp *type)
+static TypeId _MakeFreshTypeExpCopy(struct TypeTable *table,
+                                    TypeId type,
+                                    int level)
 {
-    type = _PruneTypeExp(type);
-    switch(type->type) {
+    struct TypeStore *store = table->store;
+    type = _PruneTypeExp(store, type);
+    struct TypeExp *node = TypeAt(store, type);
+    if (node->level != GENERIC_LEVEL) {
+        // Nothing generic in here.
+        return type;
+    }
+    if (node->temp) {
+        return node->temp;
+    }
+
+    TypeId result = type;
+    TypeExpType tag = node->type;
+    TypeId first = node->arg_first;
+    TypeId second = node->arg_second;
+    switch(tag) {
     case TYPEEXP_GENERIC_VARIABLE:
-        {
-            if (type->var_temp_other) {
-                return type->var_temp_other;
-            }
+        result = _MakeTypeVar(store, level);
+        break;
 
-            type->var_temp_other = _MakeTypeVar(arena);
-            return type->var_temp_other;
-        }
     case TYPEEXP_TUPLE:
     case TYPEEXP_FUNC:
-        {
-            struct TypeExp *arg_first, *arg_second;
-            arg_first = _MakeFreshTypeExpCopy(arena, type->arg_first);
-            arg_second = _MakeFreshTypeExpCopy(arena, type->arg_second);
-
-            if (arg_first == type->arg_first &&
-                arg_second == type->arg_second) {
-                return type;
-            }
-
-            struct TypeExp *result = ArenaAllocate(arena, sizeof(struct TypeExp));
-            result->type = type->type;
-            result->arg_first = arg_first;
-            result->arg_second = arg_second;
-            return result;
-        }
-
     case TYPEEXP_TUPLE_FINAL:
         {
-            struct TypeExp *arg_first;
-            arg_first = _MakeFreshTypeExpCopy(arena, type->arg_first);
-
-            if (arg_first == type->arg_first) {
-                return type;
+            TypeId arg_first, arg_second = _NO_TYPE;
+            arg_first = _MakeFreshTypeExpCopy(table, first, level);
+            if (second) {
+                arg_second = _MakeFreshTypeExpCopy(table, second, level);
             }
 
-            struct TypeExp *result = ArenaAllocate(arena, sizeof(struct TypeExp));
-            result->type = type->type;
-            result->arg_first = arg_first;
-            return result;
+            if (arg_first != first || arg_second != second) {
+                result = _MakeCompoundType(
+                    table,
+                    tag,
+                    arg_first,
+                    arg_second
+                );
+            }
         }
+        break;
 
     case TYPEEXP_VARIABLE:
     case TYPEEXP_BOOL:
@@ -269,91 +376,296 @@ static struct TypeExp *_MakeFreshTypeExpCopy(struct Arena *arena,
     case TYPEEXP_INVALID:
         break;
     }
-    return type;
+
+    TypeAt(store, type)->temp = result;
+    return result;
 }
 
-struct TypeExp *_MakeFreshTypeExp(struct Arena *arena, struct TypeExp *type)
+static TypeId _MakeFreshTypeExp(struct TypeTable *table,
+                                TypeId type,
+                                int level)
 {
-    struct TypeExp *fresh_type;
-    fresh_type = _MakeFreshTypeExpCopy(arena, type);
-    _CleanupTypeVariables(type);
+    type = _PruneTypeExp(table->store, type);
+    if (TypeAt(table->store, type)->level != GENERIC_LEVEL) {
+        // Most bindings aren't polymorphic, and there's nothing to copy.
+        return type;
+    }
+
+    TypeId fresh_type = _MakeFreshTypeExpCopy(table, type, level);
+    _ClearTypeTemps(table->store, type);
     return fresh_type;
 }
 
-static struct TypeExp _IntegerTypeExp = { TYPEEXP_INT,   {NULL}, {NULL}};
-static struct TypeExp _BooleanTypeExp = { TYPEEXP_BOOL,  {NULL}, {NULL}};
-static struct TypeExp _ErrorTypeExp   = { TYPEEXP_ERROR, {NULL}, {NULL}};
-
-bool _IsErrorType(struct TypeExp *type) {
-    return type == &_ErrorTypeExp || type->type == TYPEEXP_ERROR;
+static bool _IsErrorType(struct TypeStore *store, TypeId type) {
+    return type == _ERROR_TYPE || TypeAt(store, type)->type == TYPEEXP_ERROR;
 }
 
 /*
  * Type Environments
+ *
+ * There is just the one environment, indexed by symbol, with the type each
+ * symbol is bound to in the scope being checked. A binding that shadows
+ * another saves the old type on a stack, and _UnbindType puts it back when
+ * the scope ends, so binding, unbinding, and looking up are all O(1).
  */
 
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wpadded"
+struct ShadowedType {
+    Symbol id;
+    TypeId type;
+};
 
 struct TypeEnvironment {
-    struct TypeEnvironment *parent;
-    struct TypeExp *type;
-    Symbol id;
+    TypeId *types;              // By symbol; _NO_TYPE if it isn't bound.
+    size_t type_capacity;
+
+    struct ShadowedType *shadowed;
+    size_t shadowed_count;
+    size_t shadowed_capacity;
 };
 
-#pragma GCC diagnostic pop
+static void _BindType(struct TypeEnvironment *env, Symbol id, TypeId type)
+{
+    if (id >= env->type_capacity) {
+        size_t new_capacity = env->type_capacity ? env->type_capacity : 64;
+        while (new_capacity <= id) { new_capacity *= 2; }
+        env->types = realloc(env->types, new_capacity * sizeof(TypeId));
+        memset(
+            env->types + env->type_capacity,
+            0,
+            (new_capacity - env->type_capacity) * sizeof(TypeId)
+        );
+        env->type_capacity = new_capacity;
+    }
 
-static struct TypeEnvironment *_BindType(struct Arena *arena,
-                                         struct TypeEnvironment *parent,
-                                         Symbol id,
-                                         struct TypeExp *type)
+    if (env->shadowed_count == env->shadowed_capacity) {
+        env->shadowed_capacity =
+            env->shadowed_capacity ? env->shadowed_capacity * 2 : 64;
+        env->shadowed = realloc(
+            env->shadowed,
+            env->shadowed_capacity * sizeof(struct ShadowedType)
+        );
+    }
+    env->shadowed[env->shadowed_count].id = id;
+    env->shadowed[env->shadowed_count].type = env->types[id];
+    env->shadowed_count++;
+
+    env->types[id] = type;
+}
+
+// _UnbindType undoes the most recent _BindType.
+static void _UnbindType(struct TypeEnvironment *env)
 {
-    struct TypeEnvironment *result;
-    result = ArenaAllocate(arena, sizeof(struct TypeEnvironment));
-    result->parent = parent;
-    result->id = id;
-    result->type = type;
-    return result;
+    struct ShadowedType *shadowed = &(env->shadowed[--env->shadowed_count]);
+    env->types[shadowed->id] = shadowed->type;
 }
 
-static struct TypeExp *_LookupType(struct Arena *arena,
-                                   struct TypeEnvironment *env,
-                                   Symbol id)
+static TypeId _LookupType(struct TypeTable *table,
+                          struct TypeEnvironment *env,
+                          Symbol id,
+                          int level)
 {
-    while(env != NULL) {
-        if (env->id == id) {
-            return _MakeFreshTypeExp(arena, env->type);
-        }
-        env = env->parent;
+    if (id >= env->type_capacity || env->types[id] == _NO_TYPE) {
+        return _NO_TYPE;
     }
-    return NULL;
+    return _MakeFreshTypeExp(table, env->types[id], level);
 }
 
 /*
  * Formatting
  */
-static const char *type_names[] = {
-    "A", "B", "C", "D", "E", "F", "G", "H", "I", "J", "K", "L", "M",
-    "N", "O", "P", "Q", "R"
+int PackedMemberSize(struct TypeStore *store, TypeId type)
+{
+    switch(ResolveType(store, type)->type) {
+    case TYPEEXP_BOOL:
+        return 1;
+
+    case TYPEEXP_INT:
+    case TYPEEXP_FUNC:
+    case TYPEEXP_TUPLE:
+        return sizeof(uint64_t);
+
+    case TYPEEXP_TUPLE_FINAL:
+    case TYPEEXP_VARIABLE:
+    case TYPEEXP_GENERIC_VARIABLE:
+    case TYPEEXP_INVALID:
+    case TYPEEXP_ERROR:
+        break;
+    }
+    return 0;
+}
+
+size_t PackedTupleLayout(struct TypeStore *store, TypeId type,
+                         size_t *offsets)
+{
+    // (The last member's type is in a TYPEEXP_TUPLE_FINAL.)
+    type = _PruneTypeExp(store, type);
+    size_t words = 0;
+    for (TypeId t = type; ; t = TypeAt(store, t)->tuple_rest) {
+        int size = PackedMemberSize(store, TypeAt(store, t)->tuple_first);
+        if (size == 0) { return 0; }
+        if (size != 1) { words++; }
+        if (TypeAt(store, t)->type == TYPEEXP_TUPLE_FINAL) { break; }
+    }
+
+    size_t word_end = 0;
+    size_t byte_end = words * sizeof(uint64_t);
+    int i = 0;
+    for (TypeId t = type; ; t = TypeAt(store, t)->tuple_rest) {
+        if (PackedMemberSize(store, TypeAt(store, t)->tuple_first) == 1) {
+            offsets[i++] = byte_end++;
+        } else {
+            offsets[i++] = word_end;
+            word_end += sizeof(uint64_t);
+        }
+        if (TypeAt(store, t)->type == TYPEEXP_TUPLE_FINAL) { break; }
+    }
+    return byte_end;
+}
+
+int TupleTypeLength(struct TypeStore *store, TypeId type)
+{
+    int length = 1;
+    type = _PruneTypeExp(store, type);
+    while (TypeAt(store, type)->type == TYPEEXP_TUPLE) {
+        length++;
+        type = TypeAt(store, type)->tuple_rest;
+    }
+    return length;
+}
+
+// A type that's used in more than one place, and takes more than this many
+// nodes to write out, is written out just the once, as an abbreviation.
+#define FORMAT_ABBREVIATE_SIZE 16
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpadded"
+
+// What FormatTypeExpression knows about a node; its temp is 1 + the index of
+// this in the formatter's infos.
+struct TypeFormat {
+    int references;         // How many places the node is used.
+    int size;               // How many nodes it takes to write out, or 0.
+    int abbreviation;       // Which abbreviation it's written as, or 0.
+    int name;               // For a variable, 1 + the index of its name.
 };
 
-struct MString *_FormatTypeExpressionImpl(struct TypeExp *type, int *counter)
+struct TypeFormatter {
+    struct TypeStore *store;
+    struct ArrayList *infos;            // of struct TypeFormat
+    int variable_count;
+    int abbreviation_count;
+    struct ArrayList *abbreviations;    // of TypeId
+};
+
+#pragma GCC diagnostic pop
+
+static struct TypeFormat *_TypeFormatInfo(struct TypeFormatter *formatter,
+                                          TypeId type)
+{
+    return ArrayListIndex(
+        formatter->infos,
+        TypeAt(formatter->store, type)->temp - 1
+    );
+}
+
+// _CountTypeReferences gives every variable and compound type in the type a
+// TypeFormat, and counts how many places each is used.
+static void _CountTypeReferences(struct TypeFormatter *formatter,
+                                 TypeId type)
 {
-    type = _PruneTypeExp(type);
-    switch(type->type) {
+    type = _PruneTypeExp(formatter->store, type);
+    struct TypeExp *node = TypeAt(formatter->store, type);
+    switch(node->type) {
+    case TYPEEXP_VARIABLE:
+    case TYPEEXP_GENERIC_VARIABLE:
+    case TYPEEXP_FUNC:
+    case TYPEEXP_TUPLE:
+    case TYPEEXP_TUPLE_FINAL:
+        if (node->temp) {
+            _TypeFormatInfo(formatter, type)->references++;
+            return;
+        }
+        {
+            struct TypeFormat info = { .references = 1 };
+            node->temp = ArrayListAdd(formatter->infos, &info) + 1;
+        }
+        if (node->type != TYPEEXP_VARIABLE &&
+            node->type != TYPEEXP_GENERIC_VARIABLE) {
+            _CountTypeReferences(formatter, node->arg_first);
+            if (node->arg_second) {
+                _CountTypeReferences(formatter, node->arg_second);
+            }
+        }
+        break;
+
+    case TYPEEXP_INT:
+    case TYPEEXP_BOOL:
+    case TYPEEXP_ERROR:
+    case TYPEEXP_INVALID:
+        break;
+    }
+}
+
+// _PlanTypeAbbreviations decides which of the compound types get written as
+// abbreviations, inside out, so that each abbreviation only uses the ones
+// before it. It returns how many nodes it takes to write the type where it's
+// used.
+static int _PlanTypeAbbreviations(struct TypeFormatter *formatter,
+                                  TypeId type)
+{
+    type = _PruneTypeExp(formatter->store, type);
+    struct TypeExp *node = TypeAt(formatter->store, type);
+    if (node->type != TYPEEXP_FUNC &&
+        node->type != TYPEEXP_TUPLE &&
+        node->type != TYPEEXP_TUPLE_FINAL) {
+        return 1;
+    }
+
+    struct TypeFormat *info = _TypeFormatInfo(formatter, type);
+    if (!info->size) {
+        int size = 1 + _PlanTypeAbbreviations(formatter, node->arg_first);
+        if (node->arg_second) {
+            size += _PlanTypeAbbreviations(formatter, node->arg_second);
+        }
+        info->size = size;
+        if (info->references > 1 && size > FORMAT_ABBREVIATE_SIZE) {
+            info->abbreviation = ++formatter->abbreviation_count;
+            ArrayListAdd(formatter->abbreviations, &type);
+        }
+    }
+    return info->abbreviation ? 1 : info->size;
+}
+
+// Variables are named 'A to 'Z, and then 'A1 to 'Z1, and so on.
+static struct MString *_TypeVariableName(int index)
+{
+    char letter = (char)('A' + (index % 26));
+    if (index < 26) {
+        return MStringPrintF("'%c", letter);
+    }
+    return MStringPrintF("'%c%d", letter, index / 26);
+}
+
+static struct MString *_FormatTypeExpressionImpl(
+    struct TypeFormatter *formatter,
+    TypeId type,
+    bool expand
+)
+{
+    type = _PruneTypeExp(formatter->store, type);
+    struct TypeExp *node = TypeAt(formatter->store, type);
+    switch(node->type) {
     case TYPEEXP_ERROR:
         return MStringCreate("{{Error}}");
 
     case TYPEEXP_VARIABLE:
     case TYPEEXP_GENERIC_VARIABLE:
         {
-            struct MString *name = (struct MString *)type->var_temp_other;
-            if (!name) {
-                name = MStringPrintF("'%s", type_names[*counter]);
-                type->var_temp_other = (struct TypeExp *)name;
-                (*counter)++;
+            struct TypeFormat *info = _TypeFormatInfo(formatter, type);
+            if (!info->name) {
+                info->name = ++formatter->variable_count;
             }
-            return MStringCopy(name);
+            return _TypeVariableName(info->name - 1);
         }
         break;
 
@@ -364,44 +676,100 @@ struct MString *_FormatTypeExpressionImpl(struct TypeExp *type, int *counter)
         return MStringCreate("bool");
 
     case TYPEEXP_FUNC:
-        {
-            struct MString *from, *to, *result;
-            from = _FormatTypeExpressionImpl(type->func_from, counter);
-            to = _FormatTypeExpressionImpl(type->func_to, counter);
-            result = MStringPrintF("( %s -> %s )", MStringData(from), MStringData(to));
-            MStringFree(&from);
-            MStringFree(&to);
-            return result;
-        }
-
     case TYPEEXP_TUPLE:
-        {
-            struct MString *left, *right, *result;
-            left = _FormatTypeExpressionImpl(type->tuple_first, counter);
-            right = _FormatTypeExpressionImpl(type->tuple_rest, counter);
-            result = MStringPrintF("%s * %s", MStringData(left), MStringData(right));
-            MStringFree(&left);
-            MStringFree(&right);
-            return result;
-        }
-
     case TYPEEXP_TUPLE_FINAL:
-        {
-            return _FormatTypeExpressionImpl(type->tuple_first, counter);
+        if (!expand && _TypeFormatInfo(formatter, type)->abbreviation) {
+            return MStringPrintF(
+                "t%d",
+                _TypeFormatInfo(formatter, type)->abbreviation
+            );
         }
+        break;
 
     case TYPEEXP_INVALID:
-        break;
+        return MStringCreate("{{Invalid}}");
     }
 
-    return MStringCreate("{{Invalid}}");
+    if (node->type == TYPEEXP_TUPLE_FINAL) {
+        return _FormatTypeExpressionImpl(formatter, node->tuple_first, false);
+    }
+
+    struct MString *left, *right, *result;
+    left = _FormatTypeExpressionImpl(formatter, node->arg_first, false);
+    right = _FormatTypeExpressionImpl(formatter, node->arg_second, false);
+    if (node->type == TYPEEXP_FUNC) {
+        result = MStringPrintF(
+            "( %s -> %s )",
+            MStringData(left),
+            MStringData(right)
+        );
+    } else {
+        result = MStringPrintF("%s * %s", MStringData(left), MStringData(right));
+    }
+    MStringFree(&left);
+    MStringFree(&right);
+    return result;
 }
 
-struct MString *FormatTypeExpression(struct TypeExp *type)
+// FormatTypeExpression writes out a type that shares a big part in more than
+// one place with abbreviations, like
+//
+//    ( 'A -> t2 * t2 ) where t1 = ... and t2 = t1 * t1 ...
+//
+// so that the string isn't exponentially bigger than the type.
+struct MString *FormatTypeExpression(struct TypeStore *store, TypeId type)
 {
-    int counter = 0;
-    struct MString *str = _FormatTypeExpressionImpl(type, &counter);
-    _CleanupTypeVariables(type);
+    struct TypeFormatter formatter;
+    formatter.store = store;
+    formatter.infos = ArrayListCreate(sizeof(struct TypeFormat), 16);
+    formatter.variable_count = 0;
+    formatter.abbreviation_count = 0;
+    formatter.abbreviations = ArrayListCreate(sizeof(TypeId), 4);
+
+    _CountTypeReferences(&formatter, type);
+    _PlanTypeAbbreviations(&formatter, type);
+
+    // The definitions are put together all at once at the end, since there
+    // can be a lot of them.
+    int count = formatter.abbreviation_count;
+    struct MString **parts = calloc((size_t)count + 1, sizeof(struct MString *));
+    parts[0] = _FormatTypeExpressionImpl(&formatter, type, false);
+    size_t length = MStringLength(parts[0]);
+    for (int i = 0; i < count; i++) {
+        TypeId abbreviated;
+        abbreviated = *(TypeId *)ArrayListIndex(
+            formatter.abbreviations,
+            (unsigned int)i
+        );
+        struct MString *definition = _FormatTypeExpressionImpl(
+            &formatter,
+            abbreviated,
+            true
+        );
+        parts[i + 1] = MStringPrintF(
+            " %s t%d = %s",
+            (i == 0) ? "where" : "and",
+            i + 1,
+            MStringData(definition)
+        );
+        MStringFree(&definition);
+        length += MStringLength(parts[i + 1]);
+    }
+
+    char *buffer = malloc(length + 1);
+    char *end = buffer;
+    for (int i = 0; i <= count; i++) {
+        memcpy(end, MStringData(parts[i]), MStringLength(parts[i]));
+        end += MStringLength(parts[i]);
+        MStringFree(&parts[i]);
+    }
+    struct MString *str = MStringCreateN(buffer, (unsigned int)length);
+    free(buffer);
+    free(parts);
+
+    _ClearTypeTemps(store, type);
+    ArrayListFree(&formatter.abbreviations);
+    ArrayListFree(&formatter.infos);
     return str;
 }
 
@@ -409,9 +777,14 @@ struct MString *FormatTypeExpression(struct TypeExp *type)
  * Type checking/inference
  */
 struct CheckContext {
-    struct Arena *arena;
+    struct TypeStore *store;
+    struct Ast *ast;
+    struct TypeTable types;
     struct Errors **errors;
     struct MillieTokens *tokens;
+
+    // How many lets deep we are, for new type variables.
+    int level;
 };
 
 static void _ReportTypeError(struct CheckContext *context,
@@ -443,20 +816,21 @@ struct UnifyContext {
     struct CheckContext *context;
     struct Expression *expression;
     UnificationError error_code;
-    struct TypeExp *original_one;
-    struct TypeExp *original_two;
+    TypeId original_one;
+    TypeId original_two;
 };
 
 static void _ReportUnificationFailure(struct UnifyContext *unify_context)
 {
+    struct TypeStore *store = unify_context->context->store;
     struct MStringStatic st;
     struct MString *error_message = NULL;
     switch(unify_context->error_code) {
     case UNIFY_SELF_RECURSIVE:
         {
             struct MString *arg_one, *arg_two;
-            arg_one = FormatTypeExpression(unify_context->original_one);
-            arg_two = FormatTypeExpression(unify_context->original_two);
+            arg_one = FormatTypeExpression(store, unify_context->original_one);
+            arg_two = FormatTypeExpression(store, unify_context->original_two);
             error_message = MStringPrintF(
                 "unsupported recursive type: the type \"%s\" is contained "
                 "within the type \"%s\"",
@@ -468,8 +842,8 @@ static void _ReportUnificationFailure(struct UnifyContext *unify_context)
     case UNIFY_INVALID_FUNCTION_APPLY:
         {
             struct MString *arg_one, *arg_two;
-            arg_one = FormatTypeExpression(unify_context->original_one);
-            arg_two = FormatTypeExpression(unify_context->original_two);
+            arg_one = FormatTypeExpression(store, unify_context->original_one);
+            arg_two = FormatTypeExpression(store, unify_context->original_two);
             error_message = MStringPrintF(
                 "the function of type \"%s\" cannot be used as a function of "
                 "type \"%s\"; either the argument or return type is "
@@ -482,8 +856,8 @@ static void _ReportUnificationFailure(struct UnifyContext *unify_context)
     case UNIFY_INCONSITENT_RECURSION:
         {
             struct MString *arg_one, *arg_two;
-            arg_one = FormatTypeExpression(unify_context->original_one);
-            arg_two = FormatTypeExpression(unify_context->original_two);
+            arg_one = FormatTypeExpression(store, unify_context->original_one);
+            arg_two = FormatTypeExpression(store, unify_context->original_two);
             error_message = MStringPrintF(
                 "inconsistent recursive definition: unable to reconcile the "
                 "two necessary types \"%s\" and \"%s\"",
@@ -495,7 +869,7 @@ static void _ReportUnificationFailure(struct UnifyContext *unify_context)
     case UNIFY_IF_CONDITION_BOOLEAN:
         {
             struct MString *arg_one;
-            arg_one = FormatTypeExpression(unify_context->original_one);
+            arg_one = FormatTypeExpression(store, unify_context->original_one);
             error_message = MStringPrintF(
                 "condition of an if expression must be a boolean (not \"%s\")",
                 MStringData(arg_one)
@@ -505,8 +879,8 @@ static void _ReportUnificationFailure(struct UnifyContext *unify_context)
     case UNIFY_IF_BRANCHES_SAME:
         {
             struct MString *arg_one, *arg_two;
-            arg_one = FormatTypeExpression(unify_context->original_one);
-            arg_two = FormatTypeExpression(unify_context->original_two);
+            arg_one = FormatTypeExpression(store, unify_context->original_one);
+            arg_two = FormatTypeExpression(store, unify_context->original_two);
             error_message = MStringPrintF(
                 "then branch returns \"%s\" and else branch returns \"%s\"; "
                 "both branches of the condition must have the same type",
@@ -518,8 +892,8 @@ static void _ReportUnificationFailure(struct UnifyContext *unify_context)
     case UNIFY_NO_VALID_BINARY_OPERATOR:
         {
             struct MString *arg_one, *arg_two;
-            arg_one = FormatTypeExpression(unify_context->original_one);
-            arg_two = FormatTypeExpression(unify_context->original_two);
+            arg_one = FormatTypeExpression(store, unify_context->original_one);
+            arg_two = FormatTypeExpression(store, unify_context->original_two);
             error_message = MStringPrintF(
                 "no operator takes types \"%s\" and \"%s\"",
                 MStringData(arg_one),
@@ -539,59 +913,131 @@ static void _ReportUnificationFailure(struct UnifyContext *unify_context)
     );
 }
 
-static void _UnifyImpl(struct UnifyContext *context, struct TypeExp *type_one,
-                       struct TypeExp *type_two)
+// _OccursAndAdjustLevels is the occurs check for binding the variable to the
+// type: it returns true if the variable is somewhere in the type. Otherwise,
+// since the type is about to be visible wherever the variable is, it brings
+// everything in the type down to the variable's level on the way.
+static bool _OccursAndAdjustLevelsImpl(struct TypeStore *store,
+                                       TypeId variable,
+                                       TypeId type)
+{
+    type = _PruneTypeExp(store, type);
+    if (type == _NO_TYPE) { return false; }
+    if (type == variable) { return true; }
+    struct TypeExp *node = TypeAt(store, type);
+    int level = TypeAt(store, variable)->level;
+    if (node->level < level) {
+        // It's not in here, and everything in here is low enough already.
+        return false;
+    }
+
+    if (node->temp) {
+        // I've already been through here.
+        return false;
+    }
+    node->temp = type;
+
+    if (node->type != TYPEEXP_VARIABLE) {
+        if (_OccursAndAdjustLevelsImpl(store, variable, node->arg_first)) {
+            return true;
+        }
+        if (_OccursAndAdjustLevelsImpl(store, variable, node->arg_second)) {
+            return true;
+        }
+    }
+    node->level = level;
+    return false;
+}
+
+static bool _OccursAndAdjustLevels(struct TypeStore *store,
+                                   TypeId variable,
+                                   TypeId type)
+{
+    bool occurs = _OccursAndAdjustLevelsImpl(store, variable, type);
+    _ClearTypeTemps(store, type);
+    return occurs;
+}
+
+// _UnifyTypeVariables binds one of two unbound variables to the other. The one
+// with the lower rank goes under the other, so that a chain only gets longer
+// when two of the same rank are joined, and the rank is at most log2 of the
+// number of variables. Whichever is left unbound takes the lower level.
+static void _UnifyTypeVariables(struct TypeStore *store,
+                                TypeId variable_one,
+                                TypeId variable_two)
 {
-    type_one = _PruneTypeExp(type_one);
-    type_two = _PruneTypeExp(type_two);
+    struct TypeExp *one = TypeAt(store, variable_one);
+    struct TypeExp *two = TypeAt(store, variable_two);
+    if (one->rank > two->rank) {
+        struct TypeExp *tmp = one;
+        one = two;
+        two = tmp;
+        variable_two = variable_one;
+    }
+    if (one->rank == two->rank) {
+        two->rank++;
+    }
+    if (one->level < two->level) {
+        two->level = one->level;
+    }
+    one->var_instance = variable_two;
+}
+
+static void _UnifyImpl(struct UnifyContext *context, TypeId type_one,
+                       TypeId type_two)
+{
+    struct TypeStore *store = context->context->store;
+    type_one = _PruneTypeExp(store, type_one);
+    type_two = _PruneTypeExp(store, type_two);
 
     // Bail early if we've already detected some kind of type error here.
-    if (_IsErrorType(type_one) || _IsErrorType(type_two)) {
+    if (_IsErrorType(store, type_one) || _IsErrorType(store, type_two)) {
+        return;
+    }
+    if (type_one == type_two) {
+        // (Which, since types are hash-consed, includes a lot of the time
+        // that they're the same type.)
         return;
     }
 
     // If there's only one `TYPEEXP_VARIABLE` then put it in type_one.
     // (If there's two it doesn't matter.)
-    if (type_two->type == TYPEEXP_VARIABLE) {
-        struct TypeExp *tmp = type_two;
+    if (TypeAt(store, type_two)->type == TYPEEXP_VARIABLE) {
+        TypeId tmp = type_two;
         type_two = type_one;
         type_one = tmp;
     }
 
-    if (type_one->type == TYPEEXP_VARIABLE) {
-        if (type_one == type_two) { return; }
-        if (_IsTypeContainedWithin(type_one, type_two)) {
+    struct TypeExp *one = TypeAt(store, type_one);
+    struct TypeExp *two = TypeAt(store, type_two);
+    if (one->type == TYPEEXP_VARIABLE) {
+        if (two->type == TYPEEXP_VARIABLE) {
+            _UnifyTypeVariables(store, type_one, type_two);
+        } else if (_OccursAndAdjustLevels(store, type_one, type_two)) {
             context->error_code = UNIFY_SELF_RECURSIVE;
             _ReportUnificationFailure(context);
         } else {
-            type_one->var_instance = type_two;
+            one->var_instance = type_two;
         }
     } else {
-        if (type_one->type != type_two->type) {
+        if (one->type != two->type) {
             _ReportUnificationFailure(context);
             return;
         }
 
-        if (type_one->arg_first) {
-            _UnifyImpl(
-                context,
-                type_one->arg_first,
-                type_two->arg_first
-            );
+        // (Unifying doesn't add to the store, so the nodes stay put.)
+        if (one->arg_first) {
+            _UnifyImpl(context, one->arg_first, two->arg_first);
         }
-        if (type_one->arg_second) {
-            _UnifyImpl(
-                context,
-                type_one->arg_second,
-                type_two->arg_second
-            );
+        if (one->arg_second) {
+            _UnifyImpl(context, one->arg_second, two->arg_second);
         }
     }
 }
 
 static void _Unify(struct CheckContext *context, struct Expression *node,
-                   UnificationError error_code, struct TypeExp *type_one,
-                   struct TypeExp *type_two)
+                   UnificationError error_code, TypeId type_one,
+                   TypeId type_two)
 {
     struct UnifyContext unify_context;
     unify_context.context = context;
@@ -604,38 +1050,35 @@ static void _Unify(struct CheckContext *context, struct Expression *node,
 }
 
 
-static struct TypeExp *_Analyze(struct CheckContext *context,
-                                struct Expression *node,
-                                struct TypeEnvironment *env,
-                                struct NonGenericTypeList *non_generics);
+static TypeId _Analyze(struct CheckContext *context,
+                       ExpressionId id,
+                       struct TypeEnvironment *env);
 
-static struct TypeExp *_AnalyzeApply(struct CheckContext *context,
-                                struct Expression *node,
-                                struct TypeEnvironment *env,
-                                struct NonGenericTypeList *non_generics)
+static TypeId _AnalyzeApply(struct CheckContext *context,
+                            struct Expression *node,
+                            struct TypeEnvironment *env)
 {
-    struct TypeExp *function_type = _Analyze(
+    TypeId function_type = _Analyze(
         context,
         node->apply_function,
-        env,
-        non_generics
+        env
     );
-    struct TypeExp *arg_type = _Analyze(
+    TypeId arg_type = _Analyze(
         context,
         node->apply_argument,
-        env,
-        non_generics
+        env
     );
-    if (_IsErrorType(function_type) || _IsErrorType(arg_type)) {
-        return &_ErrorTypeExp;
+    if (_IsErrorType(context->store, function_type) ||
+        _IsErrorType(context->store, arg_type)) {
+        return _ERROR_TYPE;
     }
-    struct TypeExp *result_type = _MakeTypeVar(context->arena);
+    TypeId result_type = _MakeTypeVar(context->store, context->level);
     _Unify(
         context,
         node,
         UNIFY_INVALID_FUNCTION_APPLY,
         _MakeFunctionType(
-            context->arena,
+            &(context->types),
             arg_type,
             result_type
         ),
@@ -643,178 +1086,150 @@ static struct TypeExp *_AnalyzeApply(struct CheckContext *context,
     return result_type;
 }
 
-static struct TypeExp *_AnalyzeIdentifier(
+static TypeId _AnalyzeIdentifier(
     struct CheckContext *context,
     struct Expression *node,
     struct TypeEnvironment *env
 )
 {
-    struct TypeExp *type = _LookupType(
-        context->arena,
+    TypeId type = _LookupType(
+        &(context->types),
         env,
-        node->identifier_id
+        node->identifier_id,
+        context->level
     );
-    if (type == NULL) {
+    if (type == _NO_TYPE) {
         struct MStringStatic st;
         _ReportTypeError(
             context,
             node,
             MStringCreateStatic("Unbound identifier", &st)
         );
-        return &_ErrorTypeExp;
+        return _ERROR_TYPE;
     }
     return type;
 }
 
-static struct TypeExp *_AnalyzeLambda(
+static TypeId _AnalyzeLambda(
     struct CheckContext *context,
     struct Expression *node,
-    struct TypeEnvironment *env,
-    struct NonGenericTypeList *non_generics
+    struct TypeEnvironment *env
 )
 {
-    struct TypeExp *arg_type = _MakeTypeVar(context->arena);
-    struct TypeEnvironment *new_env = _BindType(
-        context->arena,
-        env,
-        node->lambda_id,
-        arg_type
-    );
-    struct NonGenericTypeList *new_non_generic;
-    new_non_generic = _ExtendNonGenericTypeList(
-        context->arena,
-        arg_type,
-        non_generics
-    );
-    struct TypeExp *result_type = _Analyze(
+    TypeId arg_type = _MakeTypeVar(context->store, context->level);
+    _BindType(env, node->lambda_id, arg_type);
+    TypeId result_type = _Analyze(
         context,
         node->lambda_body,
-        new_env,
-        new_non_generic
+        env
     );
-    return _MakeFunctionType(context->arena, arg_type, result_type);
+    _UnbindType(env);
+    return _MakeFunctionType(&(context->types), arg_type, result_type);
 }
 
-static struct TypeExp *_AnalyzeLet(
+static TypeId _AnalyzeLet(
     struct CheckContext *context,
     struct Expression *node,
-    struct TypeEnvironment *env,
-    struct NonGenericTypeList *non_generics
+    struct TypeEnvironment *env
 )
 {
-    struct TypeExp *defn_type = _Analyze(
-        context,
-        node->let_value,
-        env,
-        non_generics
-    );
+    context->level++;
+    TypeId defn_type = _Analyze(context, node->let_value, env);
+    context->level--;
     defn_type = _MakeGenericTypeExp(
-        context->arena,
+        &(context->types),
         defn_type,
-        non_generics
+        context->level
     );
 
-    struct TypeEnvironment *new_env = _BindType(
-        context->arena,
-        env,
-        node->let_id,
-        defn_type
-    );
-    return _Analyze(context, node->let_body, new_env, non_generics);
+    _BindType(env, node->let_id, defn_type);
+    TypeId result_type = _Analyze(context, node->let_body, env);
+    _UnbindType(env);
+    return result_type;
 }
 
-static struct TypeExp *_AnalyzeLetRec(
+static TypeId _AnalyzeLetRec(
     struct CheckContext *context,
     struct Expression *node,
-    struct TypeEnvironment *env,
-    struct NonGenericTypeList *non_generics
+    struct TypeEnvironment *env
 )
 {
-    struct TypeExp *new_type = _MakeTypeVar(context->arena);
+    context->level++;
+    TypeId new_type = _MakeTypeVar(context->store, context->level);
 
-    struct TypeEnvironment *new_env = _BindType(
-        context->arena,
-        env,
-        node->let_id,
-        new_type
-    );
-    struct NonGenericTypeList *new_non_generic;
-    new_non_generic = _ExtendNonGenericTypeList(
-        context->arena,
-        new_type,
-        non_generics
-    );
-    struct TypeExp *defn_type = _Analyze(
+    _BindType(env, node->let_id, new_type);
+    TypeId defn_type = _Analyze(
         context,
         node->let_value,
-        new_env,
-        new_non_generic
+        env
     );
     _Unify(context, node, UNIFY_INCONSITENT_RECURSION, new_type, defn_type);
+    context->level--;
 
     // Rebind the new type variable to the generic version of the type so I
-    // don't have to re-do new_env.
-    new_type->var_instance = _MakeGenericTypeExp(
-        context->arena,
+    // don't have to bind the name again.
+    TypeId generic_type = _MakeGenericTypeExp(
+        &(context->types),
         new_type,
-        non_generics
+        context->level
     );
+    TypeAt(context->store, new_type)->var_instance = generic_type;
 
-    return _Analyze(context, node->let_body, new_env, non_generics);
+    TypeId result_type = _Analyze(context, node->let_body, env);
+    _UnbindType(env);
+    return result_type;
 }
 
-static struct TypeExp *_AnalyzeIf(
+static TypeId _AnalyzeIf(
     struct CheckContext *context,
     struct Expression *node,
-    struct TypeEnvironment *env,
-    struct NonGenericTypeList *non_generics
+    struct TypeEnvironment *env
 )
 {
-    struct TypeExp *cond_type, *then_type, *else_type;
-    cond_type = _Analyze(context, node->if_test, env, non_generics);
+    TypeId cond_type, then_type, else_type;
+    cond_type = _Analyze(context, node->if_test, env);
     _Unify(
         context,
-        node->if_test,
+        AstNode(context->ast, node->if_test),
         UNIFY_IF_CONDITION_BOOLEAN,
         cond_type,
-        &_BooleanTypeExp
+        _BOOLEAN_TYPE
     );
 
-    then_type = _Analyze(context, node->if_then, env, non_generics);
-    else_type = _Analyze(context, node->if_else, env, non_generics);
+    then_type = _Analyze(context, node->if_then, env);
+    else_type = _Analyze(context, node->if_else, env);
     _Unify(context, node, UNIFY_IF_BRANCHES_SAME, then_type, else_type);
     return then_type;
 }
 
 struct OperatorEntry {
     MILLIE_TOKEN token;
-    struct TypeExp *left;
-    struct TypeExp *right;
-    struct TypeExp *result;
+    TypeId left;
+    TypeId right;
+    TypeId result;
 };
 
 struct OperatorEntry _operators[] = {
-    { TOK_PLUS,   &_IntegerTypeExp, &_IntegerTypeExp, &_IntegerTypeExp },
-    { TOK_MINUS,  &_IntegerTypeExp, &_IntegerTypeExp, &_IntegerTypeExp },
-    { TOK_STAR,   &_IntegerTypeExp, &_IntegerTypeExp, &_IntegerTypeExp },
-    { TOK_SLASH,  &_IntegerTypeExp, &_IntegerTypeExp, &_IntegerTypeExp },
+    { TOK_PLUS,   _INTEGER_TYPE, _INTEGER_TYPE, _INTEGER_TYPE },
+    { TOK_MINUS,  _INTEGER_TYPE, _INTEGER_TYPE, _INTEGER_TYPE },
+    { TOK_STAR,   _INTEGER_TYPE, _INTEGER_TYPE, _INTEGER_TYPE },
+    { TOK_SLASH,  _INTEGER_TYPE, _INTEGER_TYPE, _INTEGER_TYPE },
 
-    { TOK_EQUALS, NULL,             NULL,             &_BooleanTypeExp },
+    { TOK_EQUALS, _NO_TYPE,      _NO_TYPE,      _BOOLEAN_TYPE },
 
     { TOK_EOF, 0, 0, 0 },
 };
 
-static struct TypeExp *_AnalyzeBinary(
+static TypeId _AnalyzeBinary(
     struct CheckContext *context,
     struct Expression *node,
-    struct TypeEnvironment *env,
-    struct NonGenericTypeList *non_generics
+    struct TypeEnvironment *env
 )
 {
     // OK, dumb stuff, because this lets you add functions.
-    struct TypeExp *left, *right;
-    left = _Analyze(context, node->binary_left, env, non_generics);
-    right = _Analyze(context, node->binary_right, env, non_generics);
+    TypeId left, right;
+    left = _Analyze(context, node->binary_left, env);
+    right = _Analyze(context, node->binary_right, env);
 
     struct OperatorEntry *op = _operators;
     while(op->token != TOK_EOF) {
@@ -845,105 +1260,108 @@ static struct TypeExp *_AnalyzeBinary(
     }
 
     Fail("Binary operator not found in type table");
-    return &_ErrorTypeExp;
+    return _ERROR_TYPE;
 }
 
-static struct TypeExp *_AnalyzeUnary(
+static TypeId _AnalyzeUnary(
     struct CheckContext *context,
     struct Expression *node,
-    struct TypeEnvironment *env,
-    struct NonGenericTypeList *non_generics
+    struct TypeEnvironment *env
 )
 {
     // This lets you negate functions?
-    struct TypeExp *arg;
-    arg = _Analyze(context, node->unary_arg, env, non_generics);
+    TypeId arg;
+    arg = _Analyze(context, node->unary_arg, env);
     return arg;
 }
 
-static struct TypeExp *_AnalyzeTuple(
+static TypeId _AnalyzeTuple(
     struct CheckContext *context,
     struct Expression *node,
-    struct TypeEnvironment *env,
-    struct NonGenericTypeList *non_generics
+    struct TypeEnvironment *env
 )
 {
-    struct TypeExp *first, *rest;
-    first = _Analyze(context, node->tuple_first, env, non_generics);
-    rest = _Analyze(context, node->tuple_rest, env, non_generics);
-    return _MakeTupleType(context->arena, first, rest);
-}
+    // The members are checked in order, and then the type is put together
+    // from the last one back, the way it's linked.
+    int length = (int)node->tuple_length;
+    TypeId *members = malloc(length * sizeof(TypeId));
+    for (int i = 0; i < length; i++) {
+        members[i] = _Analyze(
+            context,
+            AstTupleMember(context->ast, node, i),
+            env
+        );
+    }
 
-static struct TypeExp *_AnalyzeTupleFinal(
-    struct CheckContext *context,
-    struct Expression *node,
-    struct TypeEnvironment *env,
-    struct NonGenericTypeList *non_generics
-)
-{
-    struct TypeExp *first;
-    first = _Analyze(context, node->tuple_first, env, non_generics);
-    return _MakeTupleFinalType(context->arena, first);
+    TypeId type = _MakeTupleFinalType(
+        &(context->types),
+        members[length - 1]
+    );
+    for (int i = length - 2; i >= 0; i--) {
+        type = _MakeTupleType(&(context->types), members[i], type);
+    }
+    free(members);
+
+    AstSetTupleType(context->ast, node, type);
+    return type;
 }
 
-static struct TypeExp *_Analyze(struct CheckContext *context,
-                                struct Expression *node,
-                                struct TypeEnvironment *env,
-                                struct NonGenericTypeList *non_generics)
+static TypeId _Analyze(struct CheckContext *context,
+                       ExpressionId id,
+                       struct TypeEnvironment *env)
 {
-    struct TypeExp *result;
+    struct Expression *node = AstNode(context->ast, id);
+    TypeId result;
     switch(node->type) {
     case EXP_IDENTIFIER:
         result = _AnalyzeIdentifier(context, node, env);
         break;
 
     case EXP_APPLY:
-        result = _AnalyzeApply(context, node, env, non_generics);
+    case EXP_TAILCALL:
+        result = _AnalyzeApply(context, node, env);
         break;
 
     case EXP_LAMBDA:
-        result = _AnalyzeLambda(context, node, env, non_generics);
+        result = _AnalyzeLambda(context, node, env);
         break;
 
     case EXP_LET:
-        result = _AnalyzeLet(context, node, env, non_generics);
+        result = _AnalyzeLet(context, node, env);
         break;
 
     case EXP_LETREC:
-        result = _AnalyzeLetRec(context, node, env, non_generics);
+        result = _AnalyzeLetRec(context, node, env);
         break;
 
     case EXP_IF:
-        result = _AnalyzeIf(context, node, env, non_generics);
+        result = _AnalyzeIf(context, node, env);
         break;
 
     case EXP_BINARY:
-        result = _AnalyzeBinary(context, node, env, non_generics);
+        result = _AnalyzeBinary(context, node, env);
         break;
 
     case EXP_UNARY:
-        result = _AnalyzeUnary(context, node, env, non_generics);
+        result = _AnalyzeUnary(context, node, env);
         break;
 
     case EXP_TUPLE:
-        result = _AnalyzeTuple(context, node, env, non_generics);
-        break;
-
-    case EXP_TUPLE_FINAL:
-        result = _AnalyzeTupleFinal(context, node, env, non_generics);
+        result = _AnalyzeTuple(context, node, env);
         break;
 
     case EXP_INTEGER_CONSTANT:
-        result = &_IntegerTypeExp;
+        result = _INTEGER_TYPE;
         break;
 
     case EXP_TRUE:
     case EXP_FALSE:
-        result = &_BooleanTypeExp;
+        result = _BOOLEAN_TYPE;
         break;
 
     case EXP_INVALID:
     case EXP_ERROR:
+    default:
         {
             struct MStringStatic st;
             _ReportTypeError(
@@ -952,23 +1370,34 @@ static struct TypeExp *_Analyze(struct CheckContext *context,
                 MStringCreateStatic("Invalid expression structure", &st)
             );
         }
-        result = &_ErrorTypeExp;
+        result = _ERROR_TYPE;
         break;
     }
 
     return result;
 }
 
-struct TypeExp *GetExpressionType(
-    struct Arena *arena,
-    struct Expression *node,
+TypeId GetExpressionType(
+    struct TypeStore *store,
+    struct Ast *ast,
+    ExpressionId node,
     struct MillieTokens *tokens,
     struct Errors **errors)
 {
     struct CheckContext context;
-    context.arena = arena;
+    context.store = store;
+    context.ast = ast;
     context.tokens = tokens;
     context.errors = errors;
-
-    return _Analyze(&context, node, NULL, NULL);
+    context.level = 0;
+    memset(&context.types, 0, sizeof(context.types));
+    context.types.store = store;
+
+    struct TypeEnvironment env;
+    memset(&env, 0, sizeof(env));
+    TypeId type = _Analyze(&context, node, &env);
+    free(env.types);
+    free(env.shadowed);
+    free(context.types.slots);
+    return type;
 }